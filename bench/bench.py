@@ -0,0 +1,528 @@
+#!/usr/bin/env python3
+
+# Benchmark suite for the emulators.
+#
+# Generates scalable IMPS workloads, runs every one of them several times
+# with every engine, checks the results and reports guest instructions per
+# second, wall time and its variance. The JIT also translates the loops of
+# every workload without running them (its --compile-bench), which is reported
+# as the engine jit-compile, in guest instructions translated per second and
+# bytes of code per instruction. The results are written as JSON and
+# compared to a stored baseline, flagging everything that got slower.
+#
+# usage: bench.py [--runs=N] [--quick] [--engines=NAME,...] [--output=FILE]
+#                 [--baseline=FILE] [--save-baseline] [--threshold=FRACTION]
+#
+# Run it through `make bench`, which builds the emulators it needs first.
+
+from __future__ import print_function
+
+import json
+import math
+import os
+import platform
+import re
+import struct
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+BUILD_DIR = os.path.join(BENCH_DIR, 'build')
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+# How each engine is run; engines whose binary does not exist are skipped
+ENGINES = [
+	('switch', [os.path.join(BUILD_DIR, 'imps-emulator'), '--engine=switch']),
+	('threaded', [os.path.join(BUILD_DIR, 'imps-emulator'), '--engine=threaded']),
+	('switch-guard', [os.path.join(BUILD_DIR, 'imps-emulator-guarded'), '--engine=switch']),
+	('threaded-guard', [os.path.join(BUILD_DIR, 'imps-emulator-guarded'), '--engine=threaded']),
+	('jit', [os.path.join(BUILD_DIR, 'imps-emulator-jit')]),
+]
+
+# How often jit-compile translates the loops of each workload
+COMPILE_ROUNDS = 1000
+COMPILE_ENGINE = ('jit-compile', [os.path.join(BUILD_DIR, 'imps-emulator-jit')])
+# The code the JIT generates does not vary between runs, so it is flagged as soon as it grows by this much
+CODE_SIZE_THRESHOLD = 0.01
+
+
+# ASSEMBLER
+#
+# Just enough of the IMPS assembler syntax (see programs/*.s) for the generated workloads:
+# labels, `.fill`, `.skip`, and `- comments`.
+
+OPCODES = ['halt', 'add', 'addi', 'sub', 'subi', 'mul', 'muli', 'lw', 'sw',
+	'beq', 'bne', 'blt', 'bgt', 'ble', 'bge', 'jmp', 'jr', 'jal', 'jit']
+BRANCHES = ['beq', 'bne', 'blt', 'bgt', 'ble', 'bge']
+
+def assemble(source):
+	lines = []
+	labels = {}
+	address = 0
+	for line in source.splitlines():
+		line = line.split(' - ')[0].strip()
+		match = re.match(r'(\w+):\s*(.*)', line)
+		if match:
+			labels[match.group(1)] = address
+			line = match.group(2)
+		if not line:
+			continue
+		tokens = line.split()
+		lines.append((address, tokens))
+		address += 4 * int(tokens[1]) if tokens[0] == '.skip' else 4
+
+	def value(token):
+		return labels[token] if token in labels else int(token, 0)
+
+	def register(token):
+		return int(token.lstrip('$'))
+
+	words = []
+	for address, tokens in lines:
+		op, args = tokens[0], tokens[1:]
+		if op == '.fill':
+			words.append(value(args[0]))
+		elif op == '.skip':
+			words.extend([0] * int(args[0]))
+		elif op in ('add', 'sub', 'mul'):
+			words.append(OPCODES.index(op) << 26 | register(args[0]) << 21 | register(args[1]) << 16 | register(args[2]) << 11)
+		elif op in ('jmp', 'jal'):
+			words.append(OPCODES.index(op) << 26 | value(args[0]))
+		elif op == 'jr':
+			words.append(OPCODES.index(op) << 26 | register(args[0]) << 21)
+		elif op == 'halt':
+			words.append(0)
+		else:
+			imm = value(args[2])
+			# Branches are relative to the branch, in instructions
+			if op in BRANCHES and args[2] in labels:
+				imm = (imm - address) // 4
+			words.append(OPCODES.index(op) << 26 | register(args[0]) << 21 | register(args[1]) << 16 | (imm & 0xffff))
+	return b''.join(struct.pack('<I', w & 0xffffffff) for w in words)
+
+
+# WORKLOADS
+#
+# Each generator returns the assembler source and the registers it expects
+# at HALT, as the emulators compute with 32-bit wraparound.
+
+def s32(x):
+	x &= 0xffffffff
+	return x - (1 << 32) if x & 0x80000000 else x
+
+def matmult(n, repetitions):
+	"""C = A * B for n x n matrices, repeated; $20 = sum of C."""
+	a = [[(i + 2 * j) % 7 - 3 for j in range(n)] for i in range(n)]
+	b = [[(3 * i + j) % 5 - 2 for j in range(n)] for i in range(n)]
+	checksum = sum(a[i][k] * b[k][j] for i in range(n) for j in range(n) for k in range(n))
+	a_data = '\n'.join('            .fill %d' % x for row in a for x in row)
+	b_data = '\n'.join('            .fill %d' % x for row in b for x in row)
+	# The matrices do not fit below 32K, where they could be addressed with immediates,
+	# so their addresses are loaded into $25, $26 and $27
+	source = '''
+start:      jmp main
+a_addr:     .fill a
+b_addr:     .fill b
+c_addr:     .fill c
+main:       lw $25 $0 a_addr
+            lw $26 $0 b_addr
+            lw $27 $0 c_addr
+            addi $1 $0 %(n)d             - $1 = n
+            addi $28 $0 %(repetitions)d  - $28 = repetitions
+rep_loop:   add $5 $0 $0                 - $5 = row = 0
+i_loop:     bge $5 $1 end_i_loop
+            add $6 $0 $0                 - $6 = col = 0
+j_loop:     bge $6 $1 end_j_loop
+            add $7 $0 $0                 - $7 = k = 0
+            add $8 $0 $0                 - $8 = sum = 0
+k_loop:     bge $7 $1 end_k_loop
+            mul $10 $5 $1                - $10 = row * n
+            add $10 $10 $7               - $10 = row * n + k
+            muli $10 $10 4
+            add $10 $10 $25
+            lw $12 $10 0                 - $12 = a[row][k]
+            mul $10 $7 $1                - $10 = k * n
+            add $10 $10 $6               - $10 = k * n + col
+            muli $10 $10 4
+            add $10 $10 $26
+            lw $13 $10 0                 - $13 = b[k][col]
+            mul $14 $12 $13
+            add $8 $8 $14                - sum += a[row][k] * b[k][col]
+            addi $7 $7 1
+            jmp k_loop
+end_k_loop: mul $10 $5 $1
+            add $10 $10 $6
+            muli $10 $10 4
+            add $10 $10 $27
+            sw $8 $10 0                  - c[row][col] = sum
+            addi $6 $6 1
+            jmp j_loop
+end_j_loop: addi $5 $5 1
+            jmp i_loop
+end_i_loop: subi $28 $28 1
+            bgt $28 $0 rep_loop
+            add $20 $0 $0                - $20 = sum of C
+            add $10 $27 $0
+            mul $11 $1 $1
+            muli $11 $11 4
+            add $11 $11 $27              - $11 = end of C
+sum_loop:   bge $10 $11 done
+            lw $12 $10 0
+            add $20 $20 $12
+            addi $10 $10 4
+            jmp sum_loop
+done:       halt
+a:
+%(a_data)s
+b:
+%(b_data)s
+c:          .skip %(c_size)d
+''' % {'n': n, 'repetitions': repetitions, 'a_data': a_data, 'b_data': b_data, 'c_size': n * n}
+	return source, {20: s32(checksum), 1: n}
+
+def fib(n):
+	"""Recursive Fibonacci with a stack in memory, i.e. JAL/JR and SW/LW of the stack frames."""
+	def reference(k):
+		x, y = 0, 1
+		for _ in range(k):
+			x, y = y, x + y
+		return x
+	source = '''
+start:      addi $29 $0 32764            - $29 = stack pointer
+            addi $4 $0 %(n)d             - argument
+            addi $30 $0 2                - constant 2
+            jal fib
+            add $20 $2 $0
+            halt
+fib:        add $2 $4 $0                 - fib(n) = n for n < 2
+            blt $4 $30 fib_return
+            subi $29 $29 12
+            sw $31 $29 0                 - save return address
+            sw $4 $29 4                  - save n
+            subi $4 $4 1
+            jal fib
+            sw $2 $29 8                  - save fib(n - 1)
+            lw $4 $29 4
+            subi $4 $4 2
+            jal fib
+            lw $5 $29 8
+            add $2 $2 $5                 - fib(n - 1) + fib(n - 2)
+            lw $31 $29 0
+            addi $29 $29 12
+fib_return: jr $31
+''' % {'n': n}
+	return source, {20: s32(reference(n)), 29: 32764}
+
+def stream(words, passes):
+	"""Reads and writes an array sequentially: a[i] += 1 and sums it up, several passes."""
+	array = [(3 * i + 1) % 1000 for i in range(words)]
+	total = 0
+	for p in range(passes):
+		total += sum(array)
+		array = [x + 1 for x in array]
+	source = '''
+start:      jmp main
+array_addr: .fill array
+main:       lw $1 $0 array_addr          - $1 = start of array
+            addi $2 $0 %(words)d
+            muli $2 $2 4
+            add $2 $2 $1                 - $2 = end of array
+            add $3 $1 $0                 - initialize a[i] = (3 * i + 1) %% 1000
+            add $4 $0 $0                 - $4 = 3 * i
+            addi $6 $0 1000
+init_loop:  bge $3 $2 init_done
+            addi $5 $4 1
+mod_loop:   blt $5 $6 mod_done
+            sub $5 $5 $6
+            jmp mod_loop
+mod_done:   sw $5 $3 0
+            addi $4 $4 3
+            addi $3 $3 4
+            jmp init_loop
+init_done:  addi $7 $0 %(passes)d         - $7 = passes left
+            add $20 $0 $0                - $20 = sum
+pass_loop:  add $3 $1 $0
+read_loop:  bge $3 $2 pass_done
+            lw $5 $3 0
+            add $20 $20 $5
+            addi $5 $5 1
+            sw $5 $3 0
+            addi $3 $3 4
+            jmp read_loop
+pass_done:  subi $7 $7 1
+            bgt $7 $0 pass_loop
+            halt
+array:      .skip %(words)d
+''' % {'words': words, 'passes': passes}
+	return source, {20: s32(total)}
+
+def branches(iterations):
+	"""A loop with data-dependent, hard to predict branches on a pseudo-random number."""
+	x = 1
+	counts = {10: 0, 12: 0, 13: 0, 15: 0, 16: 0}
+	for _ in range(iterations):
+		x = s32(x * 1103515245 + 12345)
+		if x < 0:
+			counts[10] -= 1
+			if x < -(1 << 30):
+				counts[16] += 2
+			else:
+				counts[15] += 1
+		else:
+			counts[10] += 1
+			if x > (1 << 30):
+				counts[13] += 3
+			else:
+				counts[12] += 1
+	source = '''
+start:      jmp main
+multiplier: .fill 1103515245
+quarter:    .fill 1073741824
+main:       lw $2 $0 multiplier
+            lw $11 $0 quarter            - $11 = 2^30
+            sub $14 $0 $11               - $14 = -2^30
+            addi $1 $0 1                 - $1 = x
+            lw $3 $0 count               - $3 = iterations left
+loop:       mul $1 $1 $2
+            addi $1 $1 12345             - x = x * 1103515245 + 12345
+            blt $1 $0 negative
+            addi $10 $10 1
+            bgt $1 $11 big
+            addi $12 $12 1
+            jmp next
+big:        addi $13 $13 3
+            jmp next
+negative:   subi $10 $10 1
+            blt $1 $14 very_small
+            addi $15 $15 1
+            jmp next
+very_small: addi $16 $16 2
+next:       subi $3 $3 1
+            bgt $3 $0 loop
+            halt
+count:      .fill %(iterations)d
+''' % {'iterations': iterations}
+	expected = dict((r, s32(v)) for r, v in counts.items())
+	expected[1] = x
+	return source, expected
+
+def workloads(quick):
+	"""The suite: name -> (source, expected registers). --quick makes everything about 10 times smaller."""
+	scale = 10 if quick else 1
+	return [
+		('matmult-60x60', matmult(60, 10 // scale)),
+		('matmult-20x20', matmult(20, 200 // scale)),
+		('fib-27', fib(27 - (5 if quick else 0))),
+		('stream-8192', stream(8192, 200 // scale)),
+		('branches', branches(2000000 // scale)),
+	]
+
+
+# RUNNING
+
+def parse_registers(output):
+	registers = {}
+	for match in re.finditer(r'^\$(\d+)\s*:\s*(-?\d+)', output, re.M):
+		registers[int(match.group(1))] = int(match.group(2))
+	return registers
+
+def count_instructions(oout):
+	"""Number of guest instructions executed, from the profile of the switch engine."""
+	profile = oout + '.prof'
+	subprocess.check_call([os.path.join(BUILD_DIR, 'imps-emulator'), '--profile=' + profile, oout],
+		stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	with open(profile) as f:
+		for line in f:
+			if line.startswith('total '):
+				return int(line.split()[1])
+
+def run(command, oout, expected):
+	"""Runs the program once; returns the wall time in seconds, or an error message."""
+	start = time.perf_counter()
+	result = subprocess.run(command + [oout], stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+	seconds = time.perf_counter() - start
+	registers = parse_registers(result.stdout)
+	for r, value in expected.items():
+		if registers.get(r) != value:
+			return 'expected $%d = %d, got %s (exit code %d)' % (r, value, registers.get(r), result.returncode)
+	return seconds
+
+def run_compile(command, oout, rounds):
+	"""Translates the loops of the program rounds times; returns the seconds, instructions
+	and bytes of code the JIT reports, or an error message."""
+	result = subprocess.run(command + ['--compile-bench=%d' % rounds, oout], stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+	match = re.search(r'(\d+) instructions, (\d+) bytes in ([0-9.]+) s', result.stdout)
+	if result.returncode != 0 or not match:
+		return 'no compile benchmark results (exit code %d): %s' % (result.returncode, result.stderr.strip())
+	return float(match.group(3)), int(match.group(1)), int(match.group(2))
+
+def statistics(times):
+	mean = sum(times) / len(times)
+	variance = sum((t - mean) ** 2 for t in times) / max(1, len(times) - 1)
+	times = sorted(times)
+	return {
+		'min_s': times[0],
+		'median_s': times[len(times) // 2],
+		'mean_s': mean,
+		'stdev_s': math.sqrt(variance),
+		'runs': len(times),
+	}
+
+def compare(results, baseline, threshold):
+	"""Flags results that are slower than in the baseline by more than threshold (and than their noise),
+	and generated code that got bigger per instruction by more than CODE_SIZE_THRESHOLD.
+	Results the baseline has no entry for are warned about, as nothing can be flagged for them.
+	Returns the number of regressions."""
+	old = dict(((r['workload'], r['engine']), r) for r in baseline['results'])
+	regressions = 0
+	print('\nCompared to the baseline (median times):')
+	for r in results:
+		b = old.get((r['workload'], r['engine']))
+		if b is None:
+			print('  %-16s %-14s WARNING: not in the baseline, record it with `make bench_baseline`' % (r['workload'], r['engine']))
+			continue
+		change = r['median_s'] / b['median_s'] - 1
+		noise = 2 * max(r['stdev_s'], b['stdev_s']) / b['median_s']
+		flag = ''
+		if change > threshold and change > noise:
+			flag = '  REGRESSION'
+			regressions += 1
+		elif -change > threshold and -change > noise:
+			flag = '  improvement'
+		print('  %-16s %-14s %9.2f ms -> %9.2f ms  %+6.1f%%%s' % (
+			r['workload'], r['engine'], b['median_s'] * 1e3, r['median_s'] * 1e3, 100 * change, flag))
+
+		if 'bytes_per_instruction' in r and 'bytes_per_instruction' in b:
+			change = r['bytes_per_instruction'] / b['bytes_per_instruction'] - 1
+			flag = ''
+			if change > CODE_SIZE_THRESHOLD:
+				flag = '  REGRESSION'
+				regressions += 1
+			elif -change > CODE_SIZE_THRESHOLD:
+				flag = '  improvement'
+			print('  %-16s %-14s %9.2f B  -> %9.2f B   %+6.1f%%%s  (bytes/instruction)' % (
+				r['workload'], r['engine'], b['bytes_per_instruction'], r['bytes_per_instruction'], 100 * change, flag))
+	return regressions
+
+def main(argv):
+	runs = 10
+	quick = False
+	engine_names = None
+	output = os.path.join(BUILD_DIR, 'results.json')
+	baseline_file = os.path.join(BENCH_DIR, 'baseline.json')
+	save_baseline = False
+	threshold = 0.10
+
+	for arg in argv:
+		if arg.startswith('--runs='):
+			runs = int(arg[7:])
+		elif arg == '--quick':
+			quick = True
+		elif arg.startswith('--engines='):
+			engine_names = arg[10:].split(',')
+		elif arg.startswith('--output='):
+			output = arg[9:]
+		elif arg.startswith('--baseline='):
+			baseline_file = arg[11:]
+		elif arg == '--save-baseline':
+			save_baseline = True
+		elif arg.startswith('--threshold='):
+			threshold = float(arg[12:])
+		else:
+			print('unknown option %s' % arg, file=sys.stderr)
+			return 2
+
+	engines = [(name, command) for name, command in ENGINES
+		if os.path.exists(command[0]) and (engine_names is None or name in engine_names)]
+	compile_engine = COMPILE_ENGINE if os.path.exists(COMPILE_ENGINE[1][0]) and (engine_names is None or COMPILE_ENGINE[0] in engine_names) else None
+	if not engines and not compile_engine:
+		print('no emulator found in %s, run `make bench`' % BUILD_DIR, file=sys.stderr)
+		return 2
+
+	results = []
+	failures = 0
+	print('%-16s %-14s %12s %11s %11s %9s' % ('workload', 'engine', 'instructions', 'median ms', 'stdev ms', 'MIPS'))
+	for name, (source, expected) in workloads(quick):
+		oout = os.path.join(BUILD_DIR, name + '.oout')
+		with open(os.path.join(BUILD_DIR, name + '.s'), 'w') as f:
+			f.write(source)
+		with open(oout, 'wb') as f:
+			f.write(assemble(source))
+		instructions = count_instructions(oout)
+
+		for engine, command in engines:
+			times = []
+			for i in range(runs):
+				t = run(command, oout, expected)
+				if not isinstance(t, float):
+					print('%-16s %-14s FAILED: %s' % (name, engine, t))
+					failures += 1
+					break
+				times.append(t)
+			if len(times) < runs:
+				continue
+			r = {'workload': name, 'engine': engine, 'instructions': instructions}
+			r.update(statistics(times))
+			r['instructions_per_s'] = instructions / r['median_s']
+			results.append(r)
+			print('%-16s %-14s %12d %11.2f %11.2f %9.1f' % (
+				name, engine, instructions, r['median_s'] * 1e3, r['stdev_s'] * 1e3, r['instructions_per_s'] / 1e6))
+
+		if compile_engine:
+			engine, command = compile_engine
+			rounds = COMPILE_ROUNDS // (10 if quick else 1)
+			times = []
+			for i in range(runs):
+				t = run_compile(command, oout, rounds)
+				if not isinstance(t, tuple):
+					print('%-16s %-14s FAILED: %s' % (name, engine, t))
+					failures += 1
+					break
+				seconds, translated, code_bytes = t
+				times.append(seconds)
+			if len(times) == runs and translated == 0:
+				print('%-16s %-14s no loops' % (name, engine))
+			elif len(times) == runs:
+				# instructions are the ones translated here, and MIPS the millions translated per second
+				r = {'workload': name, 'engine': engine, 'instructions': translated}
+				r.update(statistics(times))
+				r['instructions_per_s'] = translated / r['median_s']
+				r['bytes_per_instruction'] = code_bytes / translated
+				results.append(r)
+				print('%-16s %-14s %12d %11.2f %11.2f %9.1f  %.2f bytes/instruction' % (
+					name, engine, translated, r['median_s'] * 1e3, r['stdev_s'] * 1e3, r['instructions_per_s'] / 1e6,
+					r['bytes_per_instruction']))
+
+	report = {
+		'host': platform.node(),
+		'machine': platform.machine(),
+		'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+		'quick': quick,
+		'results': results,
+	}
+	with open(output, 'w') as f:
+		json.dump(report, f, indent=2)
+	print('\nwrote %s' % output)
+
+	if save_baseline:
+		with open(baseline_file, 'w') as f:
+			json.dump(report, f, indent=2)
+		print('saved as baseline %s' % baseline_file)
+		regressions = 0
+	elif os.path.exists(baseline_file):
+		with open(baseline_file) as f:
+			baseline = json.load(f)
+		if baseline.get('quick') != quick:
+			print('\nbaseline %s was made with%s --quick, not comparing' % (baseline_file, '' if baseline.get('quick') else 'out'))
+			regressions = 0
+		else:
+			regressions = compare(results, baseline, threshold)
+	else:
+		print('no baseline %s, create one with --save-baseline' % baseline_file)
+		regressions = 0
+
+	return 1 if failures or regressions else 0
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,356 @@
+/* Translates an IMPS program ahead of time into a C program, which gcc compiles
+ * into a standalone executable, for programs that are run over and over:
+ *
+ *     ./imps-aot programs/matmult.oout > matmult.c
+ *     gcc -O2 -I. matmult.c -o matmult
+ *     ./matmult
+ *
+ * usage: imps-aot program.oout
+ *
+ * The executable prints exactly what imps-emulator prints for the program,
+ * the register dump after HALT or the error message (with exit status 1).
+ *
+ * The control flow is rebuilt from the image: starting at address 0, every
+ * instruction that is reached by falling through, branching or jumping becomes
+ * C statements, and every branch or jump target a label, so that gcc sees
+ * the loops of the program. JR targets are only known at run time; the return
+ * addresses of the JALs are dispatched with a switch. Each instruction uses
+ * the semantics of imps-ops.h, as the engines do. The registers are a local
+ * array that is only indexed with constants, which gcc keeps in machine registers.
+ *
+ * What cannot be translated ahead of time is left to imps_interpret:
+ * jumps to addresses that were not translated, and everything after a store
+ * that changes a translated instruction (code cannot be compiled again at run time).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imps-vm.h"
+#include "imps-ops.h"
+
+// Size of memory, fixed by spec
+#define MEM_SIZE IMPS_MEM_SIZE
+
+// SEMANTIC PRINTFS
+
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+
+// Everything known about the program before it is translated
+typedef struct {
+	unsigned char memory[MEM_SIZE];
+	// Words from address 0 that come from the image, the only ones translated
+	unsigned int words;
+	// Whether the word at each aligned address is translated, i.e. reachable from address 0
+	unsigned char translated[MEM_SIZE / 4];
+	// Whether the translated word needs a label (a target, or not reached by falling through)
+	unsigned char labelled[MEM_SIZE / 4];
+	// Whether the translated word is the return address of a JAL, dispatched by JR
+	unsigned char returned_to[MEM_SIZE / 4];
+	int has_jr;
+} program;
+
+/* Whether control flow from an instruction to target stays in translated code.
+ * Only valid after find_reachable.
+ */
+int is_translated(const program *p, unsigned int target)
+{
+	return target % 4 == 0 && target / 4 < p->words && p->translated[target / 4];
+}
+
+/* Marks all words reachable from address 0 as translated, and the ones
+ * that are jumped to as labelled.
+ */
+void find_reachable(program *p)
+{
+	// Every word is pushed at most once
+	unsigned int *worklist = malloc(sizeof(unsigned int) * (p->words + 1));
+	unsigned int pending = 0;
+
+	/* Adds the word at target to the worklist. Targets outside of the image
+	 * or unaligned are left to the interpreter.
+	 */
+	void reach(unsigned int target, int jumped_to)
+	{
+		if (target % 4 != 0 || target / 4 >= p->words) {
+			return;
+		}
+		if (jumped_to) {
+			p->labelled[target / 4] = 1;
+		}
+		if (!p->translated[target / 4]) {
+			p->translated[target / 4] = 1;
+			worklist[pending++] = target;
+		}
+	}
+
+	if (p->words > 0) {
+		reach(0, 0);
+	}
+
+	while (pending > 0) {
+		unsigned int pc = worklist[--pending];
+		unsigned int instruction = W32(p->memory, pc);
+		int imm = SIGNEXT(SIGNED(IMPS_IMM(instruction)));
+
+		switch (IMPS_OPCODE(instruction)) {
+			case HALT:
+				break;
+			case BEQ: case BNE: case BLT: case BGT: case BLE: case BGE:
+				reach(pc + imm * 4, 1);
+				reach(pc + 4, 0);
+				break;
+			case JMP:
+				reach(IMPS_ADDR(instruction), 1);
+				break;
+			case JAL:
+				reach(IMPS_ADDR(instruction), 1);
+				// Returned to with JR, from the dispatch switch
+				reach(pc + 4, 1);
+				if (is_translated(p, pc + 4)) {
+					p->returned_to[(pc + 4) / 4] = 1;
+				}
+				break;
+			case JR:
+				p->has_jr = 1;
+				break;
+			default:
+				reach(pc + 4, 0);
+		}
+	}
+
+	free(worklist);
+}
+
+/* Writes the C statements that continue at target: a goto to its label
+ * if it is translated, otherwise the interpreter.
+ */
+void print_continue(const program *p, unsigned int target)
+{
+	if (is_translated(p, target)) {
+		printf("goto L%u;", target);
+	} else {
+		printf("{ pc = %u; goto interpret; }", target);
+	}
+}
+
+// Writes the translation of the instruction at pc
+void print_instruction(const program *p, unsigned int pc)
+{
+	unsigned int instruction = W32(p->memory, pc);
+	unsigned int opcode = IMPS_OPCODE(instruction);
+	unsigned int r1 = IMPS_R1(instruction);
+	unsigned int r2 = IMPS_R2(instruction);
+	unsigned int r3 = IMPS_R3(instruction);
+	int imm = SIGNEXT(SIGNED(IMPS_IMM(instruction)));
+	char disassembled[64];
+
+	imps_disassemble(instruction, pc, disassembled, sizeof(disassembled));
+
+	if (p->labelled[pc / 4]) {
+		printf("L%u:\n", pc);
+	}
+	printf("\t// %u: %s\n", pc, disassembled);
+
+	switch (opcode) {
+		case HALT:
+			printf("\tpc = %u;\n", pc + 4);
+			printf("\tgoto halt;\n");
+			// No fall through
+			return;
+
+		case ADD:  printf("\tIMPS_ADD(%u, %u, %u);\n", r1, r2, r3); break;
+		case ADDI: printf("\tIMPS_ADDI(%u, %u, %d);\n", r1, r2, imm); break;
+		case SUB:  printf("\tIMPS_SUB(%u, %u, %u);\n", r1, r2, r3); break;
+		case SUBI: printf("\tIMPS_SUBI(%u, %u, %d);\n", r1, r2, imm); break;
+		case MUL:  printf("\tIMPS_MUL(%u, %u, %u);\n", r1, r2, r3); break;
+		case MULI: printf("\tIMPS_MULI(%u, %u, %d);\n", r1, r2, imm); break;
+
+		case LW:
+			printf("\taddr = IMPS_ADDRESS(%u, %d);\n", r2, imm);
+			printf("\tif (!IMPS_IN_MEMORY(addr)) fail(IMPS_LOAD_ERROR, addr);\n");
+			printf("\tregisters[%u] = W32(memory, addr);\n", r1);
+			break;
+
+		case SW:
+			printf("\taddr = IMPS_ADDRESS(%u, %d);\n", r2, imm);
+			printf("\tif (!IMPS_IN_MEMORY(addr)) fail(IMPS_STORE_ERROR, addr);\n");
+			// The translation of a changed instruction would be wrong from now on
+			printf("\tif (CHANGES_CODE(addr, registers[%u])) { W32(memory, addr) = registers[%u]; pc = %u; goto interpret; }\n", r1, r1, pc + 4);
+			printf("\tW32(memory, addr) = registers[%u];\n", r1);
+			break;
+
+		case BEQ: case BNE: case BLT: case BGT: case BLE: case BGE:
+			printf("\tif (IMPS_%s(%u, %u)) ", imps_opcode_name(opcode), r1, r2);
+			print_continue(p, pc + imm * 4);
+			printf("\n");
+			break;
+
+		case JMP:
+			printf("\t");
+			print_continue(p, IMPS_ADDR(instruction));
+			printf("\n");
+			return;
+
+		case JR:
+			printf("\tpc = registers[%u];\n", r1);
+			printf("\tgoto dispatch;\n");
+			return;
+
+		case JAL:
+			printf("\tregisters[31] = %u;\n", pc + 4);
+			printf("\t");
+			print_continue(p, IMPS_ADDR(instruction));
+			printf("\n");
+			return;
+
+		default:
+			// Unknown instructions do nothing, as in imps-emulator
+			break;
+	}
+
+	// Falls through to the next instruction, which is only printed next if it is translated
+	if (!is_translated(p, pc + 4)) {
+		printf("\t");
+		print_continue(p, pc + 4);
+		printf("\n");
+	}
+}
+
+// Writes the whole C program
+void print_program(const program *p, const char *filename)
+{
+	unsigned int i, pc;
+
+	printf("/* %s, translated by imps-aot. Compile with gcc -O2 -I<directory of imps-ops.h> */\n\n", filename);
+	printf("#include <stdio.h>\n");
+	printf("#include <stdlib.h>\n\n");
+	printf("#include \"imps-ops.h\"\n\n");
+
+	// Declared as words, as it is accessed as words
+	printf("static unsigned int image[IMPS_MEM_SIZE / 4] = {");
+	for (i = 0; i < p->words; i++) {
+		printf("%s0x%08x,", i % 8 == 0 ? "\n\t" : " ", W32(p->memory, i * 4));
+	}
+	printf("\n};\n\n");
+	printf("#define memory ((unsigned char *) image)\n\n");
+
+	// With the word after the last, which an unaligned store can reach
+	printf("static const unsigned char translated[%u] = {", p->words + 1);
+	for (i = 0; i < p->words; i++) {
+		printf("%s%d,", i % 32 == 0 ? "\n\t" : " ", p->translated[i]);
+	}
+	printf("\n};\n\n");
+	printf("// Whether storing value to addr changes a translated instruction\n");
+	printf("#define CHANGES_CODE(addr, value) \\\n");
+	printf("\t((addr) < %u && (translated[(addr) / 4] || translated[((addr) + 3) / 4]) && W32(memory, addr) != (unsigned int) (value))\n\n", p->words * 4);
+
+	// Copying element by element keeps registers from being accessed by address
+	printf("static int state[32];\n\n");
+	printf("#define SAVE_REGISTERS() \\\n\t");
+	for (i = 0; i < 32; i++) {
+		printf("state[%u] = registers[%u]; %s", i, i, i == 31 ? "\n\n" : (i % 4 == 3 ? "\\\n\t" : ""));
+	}
+
+	printf("static void __attribute__((noreturn)) fail(const char *format, unsigned int addr)\n");
+	printf("{\n");
+	printf("\tfprintf(stderr, format, addr);\n");
+	printf("\tfprintf(stderr, \"\\n\");\n");
+	printf("\texit(IMPS_ERROR);\n");
+	printf("}\n\n");
+
+	printf("int main(void)\n");
+	printf("{\n");
+	printf("\tint registers[32] = {0};\n");
+	printf("\tunsigned int pc __attribute__((unused)) = 0;\n");
+	printf("\tunsigned int addr __attribute__((unused));\n");
+	printf("\tconst char *error;\n\n");
+
+	if (!is_translated(p, 0)) {
+		printf("\tgoto interpret;\n\n");
+	}
+
+	for (pc = 0; pc < p->words * 4; pc += 4) {
+		if (p->translated[pc / 4]) {
+			print_instruction(p, pc);
+		}
+	}
+
+	if (p->has_jr) {
+		printf("\ndispatch:\n");
+		printf("\tswitch (pc) {\n");
+		for (pc = 0; pc < p->words * 4; pc += 4) {
+			if (p->returned_to[pc / 4]) {
+				printf("\t\tcase %u: goto L%u;\n", pc, pc);
+			}
+		}
+		printf("\t}\n");
+		printf("\tgoto interpret;\n");
+	}
+
+	// Either may be unused, e.g. for a program that never halts
+	printf("\nhalt: __attribute__((unused));\n");
+	printf("\tSAVE_REGISTERS();\n");
+	printf("\timps_print_state(stdout, pc, state);\n");
+	printf("\treturn IMPS_HALTED;\n");
+
+	printf("\ninterpret: __attribute__((unused));\n");
+	printf("\tSAVE_REGISTERS();\n");
+	printf("\tif (!imps_interpret(state, memory, &pc, &error, &addr)) {\n");
+	printf("\t\tfail(error, addr);\n");
+	printf("\t}\n");
+	printf("\timps_print_state(stdout, pc, state);\n");
+	printf("\treturn IMPS_HALTED;\n");
+	printf("}\n");
+}
+
+int main (int argc, char *argv[])
+{
+	char *program_filename = NULL;
+	program *p;
+	size_t program_size;
+	FILE *file;
+	int arg;
+
+	for (arg = 1; arg < argc; arg++) {
+		if (argv[arg][0] == '-') {
+			LOG_ERROR("unknown option %s\n", argv[arg]);
+			return 1;
+		} else if (program_filename == NULL) {
+			program_filename = argv[arg];
+		} else {
+			LOG_ERROR("imps-aot takes exactly one program\n");
+			return 1;
+		}
+	}
+
+	if (program_filename == NULL) {
+		LOG_ERROR("usage: imps-aot program.oout\n");
+		return 1;
+	}
+
+	p = calloc(1, sizeof(program));
+	if (p == NULL) {
+		LOG_ERROR("out of memory\n");
+		return 1;
+	}
+
+	file = fopen(program_filename, "rb");
+	if (!file) {
+		LOG_ERROR("Error opening file %s\n", program_filename);
+		free(p);
+		return 1;
+	}
+	program_size = fread(p->memory, 1, MEM_SIZE, file);
+	fclose(file);
+
+	// A last partial word is padded with zeros, as in memory
+	p->words = (program_size + 3) / 4;
+
+	find_reachable(p);
+	print_program(p, program_filename);
+
+	free(p);
+	return 0;
+}
@@ -0,0 +1,324 @@
+/* Runs many IMPS programs in one process, in parallel on all cores,
+ * and compares their results to the expected ones.
+ *
+ * usage: imps-batch [--jobs=N] [--engine=switch|threaded] [--max-steps=N] (program.oout | directory)...
+ *
+ * For every program.oout, the register dump printed after HALT (see imps_vm_print_state)
+ * is compared to program.res next to it. Directories are searched for *.oout files.
+ * Every worker thread reuses one imps_vm context for all its programs,
+ * so there is no process to start and no file to diff per program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imps-vm.h"
+
+// SEMANTIC PRINTFS
+
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+
+// The outcomes of running one program
+enum {
+	// output equals the .res file
+	BATCH_OK,
+	// output differs from the .res file
+	BATCH_FAILED,
+	// there is no .res file to compare to
+	BATCH_NO_RES,
+	// the program could not be read
+	BATCH_UNREADABLE
+};
+
+char * OUTCOME_NAMES[] = {
+	"OK",
+	"FAILED",
+	"NO RES",
+	"UNREADABLE"
+};
+
+typedef struct {
+	char *filename;
+	int outcome;
+	// IMPS_HALTED, IMPS_ERROR or IMPS_RUNNING (ran out of --max-steps)
+	int result;
+	// load, run and compare, in seconds
+	double seconds;
+	// what went wrong, if anything
+	char message[160];
+} batch_program;
+
+// What the worker threads share
+typedef struct {
+	batch_program *programs;
+	int program_count;
+	// index of the next program to run, taken with __sync_fetch_and_add
+	int next;
+	int engine;
+	// 0 for no limit
+	unsigned long long max_steps;
+} batch;
+
+double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Reads the whole file into a malloc'd, 0-terminated buffer.
+ * Returns NULL if it cannot be read; the size is stored in size.
+ */
+char * read_file(const char *filename, size_t *size)
+{
+	FILE *file = fopen(filename, "rb");
+	char *buf;
+	long length;
+
+	if (!file) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	buf = malloc(length + 1);
+	*size = fread(buf, 1, length, file);
+	buf[*size] = '\0';
+	fclose(file);
+	return buf;
+}
+
+/* Returns the path of the .res file belonging to the .oout file (malloc'd). */
+char * res_filename(const char *filename)
+{
+	size_t length = strlen(filename);
+	char *res = malloc(length + 5);
+
+	strcpy(res, filename);
+	if (length > 5 && strcmp(filename + length - 5, ".oout") == 0) {
+		res[length - 5] = '\0';
+	}
+	strcat(res, ".res");
+	return res;
+}
+
+/* Describes the first line where output and expected differ in message. */
+void describe_difference(const char *output, const char *expected, char *message, size_t message_size)
+{
+	int line = 1;
+	const char *o = output, *e = expected;
+
+	while (*o && *o == *e) {
+		if (*o == '\n') {
+			line++;
+		}
+		o++;
+		e++;
+	}
+	snprintf(message, message_size, "line %d: expected \"%.*s\", got \"%.*s\"",
+		line, (int) strcspn(e, "\n"), e, (int) strcspn(o, "\n"), o);
+}
+
+void run_program(imps_vm *vm, batch *b, batch_program *p)
+{
+	double start = now();
+	size_t program_size, expected_size, output_size;
+	char *program = read_file(p->filename, &program_size);
+	char *res = res_filename(p->filename);
+	char *expected = read_file(res, &expected_size);
+	char *output = NULL;
+	FILE *out;
+
+	if (program == NULL || !imps_vm_load(vm, (unsigned char *) program, program_size)) {
+		p->outcome = BATCH_UNREADABLE;
+		snprintf(p->message, sizeof(p->message), "cannot load %s", p->filename);
+		goto done;
+	}
+
+	if (b->max_steps) {
+		p->result = imps_vm_step(vm, b->max_steps);
+	} else {
+		p->result = imps_vm_run(vm);
+	}
+
+	// Same output as the emulators print to stdout
+	out = open_memstream(&output, &output_size);
+	if (p->result == IMPS_HALTED) {
+		imps_vm_print_state(vm, out);
+	} else if (p->result == IMPS_ERROR) {
+		snprintf(p->message, sizeof(p->message), "%s", imps_vm_error(vm));
+	} else {
+		snprintf(p->message, sizeof(p->message), "did not halt within %llu instructions", b->max_steps);
+	}
+	fclose(out);
+
+	if (expected == NULL) {
+		p->outcome = BATCH_NO_RES;
+	} else if (strcmp(output, expected) == 0) {
+		p->outcome = BATCH_OK;
+	} else {
+		p->outcome = BATCH_FAILED;
+		if (p->message[0] == '\0') {
+			describe_difference(output, expected, p->message, sizeof(p->message));
+		}
+	}
+
+done:
+	free(program);
+	free(res);
+	free(expected);
+	free(output);
+	p->seconds = now() - start;
+}
+
+void * worker(void *arg)
+{
+	batch *b = arg;
+	imps_vm *vm = imps_vm_create();
+	int i;
+
+	if (vm == NULL) {
+		LOG_ERROR("out of memory\n");
+		exit(1);
+	}
+	imps_vm_set_engine(vm, b->engine);
+
+	while ((i = __sync_fetch_and_add(&b->next, 1)) < b->program_count) {
+		run_program(vm, b, &b->programs[i]);
+	}
+
+	imps_vm_destroy(vm);
+	return NULL;
+}
+
+void add_program(batch *b, const char *filename)
+{
+	b->programs = realloc(b->programs, sizeof(batch_program) * (b->program_count + 1));
+	memset(&b->programs[b->program_count], 0, sizeof(batch_program));
+	b->programs[b->program_count].filename = strdup(filename);
+	b->program_count++;
+}
+
+int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Adds all *.oout files in the directory, sorted by name. Returns 0 on error. */
+int add_directory(batch *b, const char *dirname)
+{
+	DIR *dir = opendir(dirname);
+	struct dirent *entry;
+	char **names = NULL;
+	int count = 0;
+	int i;
+
+	if (!dir) {
+		return 0;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		if (length > 5 && strcmp(entry->d_name + length - 5, ".oout") == 0) {
+			names = realloc(names, sizeof(char *) * (count + 1));
+			names[count] = malloc(strlen(dirname) + length + 2);
+			sprintf(names[count], "%s/%s", dirname, entry->d_name);
+			count++;
+		}
+	}
+	closedir(dir);
+
+	qsort(names, count, sizeof(char *), compare_strings);
+	for (i = 0; i < count; i++) {
+		add_program(b, names[i]);
+		free(names[i]);
+	}
+	free(names);
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	batch b = { NULL, 0, 0, IMPS_ENGINE_SWITCH, 0 };
+	// As many workers as there are cores by default
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int outcome_counts[4] = {0};
+	double cpu_seconds = 0, start;
+	int arg, i;
+
+	for (arg = 1; arg < argc; arg++) {
+		struct stat st;
+		if (strncmp(argv[arg], "--jobs=", 7) == 0) {
+			jobs = atoi(argv[arg] + 7);
+		} else if (strcmp(argv[arg], "--engine=switch") == 0) {
+			b.engine = IMPS_ENGINE_SWITCH;
+		} else if (strcmp(argv[arg], "--engine=threaded") == 0) {
+			b.engine = IMPS_ENGINE_THREADED;
+		} else if (strncmp(argv[arg], "--max-steps=", 12) == 0) {
+			b.max_steps = strtoull(argv[arg] + 12, NULL, 10);
+		} else if (argv[arg][0] == '-') {
+			LOG_ERROR("unknown option %s\n", argv[arg]);
+			return 1;
+		} else if (stat(argv[arg], &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (!add_directory(&b, argv[arg])) {
+				LOG_ERROR("Error opening directory %s\n", argv[arg]);
+				return 1;
+			}
+		} else {
+			add_program(&b, argv[arg]);
+		}
+	}
+
+	if (b.program_count == 0) {
+		LOG_ERROR("usage: imps-batch [--jobs=N] [--engine=switch|threaded] [--max-steps=N] (program.oout | directory)...\n");
+		return 1;
+	}
+	if (jobs < 1) {
+		jobs = 1;
+	}
+	if (jobs > b.program_count) {
+		jobs = b.program_count;
+	}
+
+	pthread_t threads[jobs];
+
+	start = now();
+	for (i = 0; i < jobs; i++) {
+		pthread_create(&threads[i], NULL, worker, &b);
+	}
+	for (i = 0; i < jobs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double wall_seconds = now() - start;
+
+	// Per program, in the order they were given
+	for (i = 0; i < b.program_count; i++) {
+		batch_program *p = &b.programs[i];
+		printf("%-40s %-10s %10.3f ms", p->filename, OUTCOME_NAMES[p->outcome], p->seconds * 1e3);
+		if (p->message[0]) {
+			printf("  %s", p->message);
+		}
+		printf("\n");
+		outcome_counts[p->outcome]++;
+		cpu_seconds += p->seconds;
+	}
+
+	printf("\n%d programs: %d OK, %d FAILED, %d NO RES, %d UNREADABLE\n",
+		b.program_count, outcome_counts[BATCH_OK], outcome_counts[BATCH_FAILED],
+		outcome_counts[BATCH_NO_RES], outcome_counts[BATCH_UNREADABLE]);
+	printf("%.3f ms wall time on %d threads, %.3f ms summed over programs\n",
+		wall_seconds * 1e3, jobs, cpu_seconds * 1e3);
+
+	for (i = 0; i < b.program_count; i++) {
+		free(b.programs[i].filename);
+	}
+	free(b.programs);
+
+	return outcome_counts[BATCH_FAILED] + outcome_counts[BATCH_UNREADABLE] > 0;
+}
@@ -1,7 +1,6 @@
 /* COMPILATION NOTE
- * This has to be compiled with `gcc -z execstack` to allow jumping
- * into the stack (which is where the JIT generated code is stored
- * in `jit_area`).
+ * It generates x86-64 code when compiled for x86-64 and i386 code otherwise (e.g. with `-m32`).
+ * The generated code lives in the code cache (see CODE CACHE), so no `-z execstack` is needed.
  */
 
 // TODO "i" is a bad variable name
@@ -9,9 +8,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define MEM_SIZE 65536
+#include "imps-vm.h"
+
+#define MEM_SIZE IMPS_MEM_SIZE
 
 #ifndef DEBUG_ENABLED
 	#define DEBUG_ENABLED 1
@@ -23,6 +32,14 @@
 #define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
 #define LOG_DEBUG(...) DEBUG( printf(__VA_ARGS__); )
 
+// Which code the JIT generates: x86-64 (1) or i386 (0), by default the one of the host
+#ifndef JIT_X86_64
+	#if defined(__x86_64__)
+		#define JIT_X86_64 1
+	#else
+		#define JIT_X86_64 0
+	#endif
+#endif
 
 // Instruction part access
 
@@ -59,28 +76,6 @@ enum {
 	LAST_OPCODE
 };
 
-char * INSTRUCTION_NAMES[] = {
-	"HALT",
-	"ADD",
-	"ADDI",
-	"SUB",
-	"SUBI",
-	"MUL",
-	"MULI",
-	"LW",
-	"SW",
-	"BEQ",
-	"BNE",
-	"BLT",
-	"BGT",
-	"BLE",
-	"BGE",
-	"JMP",
-	"JR",
-	"JAL",
-	"JIT"
-};
-
 // Allows to get 32-bit word from any byte address
 #define W32(arr, pos) (*((unsigned int *) &(arr)[pos]))
 
@@ -90,7 +85,6 @@ char * INSTRUCTION_NAMES[] = {
 // sign extension for immediate parts
 #define SIGNEXT(i) ( ((i) & 0b00000000000000001000000000000000 ) ? ((i) | 0b11111111111111110000000000000000) : (i) )
 
-
 void print_instruction_binary (unsigned int instruction)
 {
 	unsigned int mask = 1 << 30;
@@ -112,22 +106,6 @@ size_t read_binary_file_into_buffer(char *filename, unsigned char *buf, size_t l
 	return bytes_read;
 }
 
-int in_memory_bounds (unsigned int addr) {
-	return addr < MEM_SIZE;
-}
-
-
-void print_state(unsigned int PC, int *registers) {
-	int i;
-	
-	printf("\n");
-	printf("Registers:\n");
-	printf("PC : %10d (0x%.8x)\n", PC, PC);
-		for (i = 0; i < 32; i++) {
-			printf("$%-2d: %10d (0x%.8x)\n", i, registers[i], registers[i]);
-		}
-}
-
 int jit_check_translation_range(unsigned int start, unsigned int end, unsigned int program_size)
 {
 	if (start > end) {
@@ -165,7 +143,20 @@ int negate_condition_code(int condition_code)
 
 void nothing() {}
 
-typedef unsigned int (*pc_returning_fn_ptr)();
+// What running generated code results in: the PC the interpreter shall continue at,
+// and the exit it left through if that one can be linked to the code at the PC (see DIRECT CHAINING), else NULL
+typedef struct {
+	unsigned long pc;
+	unsigned char *exit;
+} jit_result;
+
+#if JIT_X86_64
+// returns the jit_result in rax and rdx
+typedef jit_result (*pc_returning_fn_ptr)(unsigned int pc_to_return_to, int *registers, unsigned char *memory);
+#else
+// The i386 code only uses pc_to_return_to and returns the PC only, as it is never linked
+typedef unsigned int (*pc_returning_fn_ptr)(unsigned int pc_to_return_to, int *registers, unsigned char *memory);
+#endif
 
 // from http://www.posix.nl/linuxassembly/nasmdochtml/nasmdoca.html
 /* EFFECTIVE ADDRESS:
@@ -191,1009 +182,4523 @@ typedef unsigned int (*pc_returning_fn_ptr)();
  *  use effective address with spare set to k
  */
 
-# define MODRM(mod, spare, rm) ((mod << 6) + (spare << 3) + rm)
+# define MODRM(mod, spare, rm) (((mod) << 6) + ((spare) << 3) + (rm))
+// SIB byte: index*(2^scale) + base, with index = 4 for none
+# define SIB(scale, index, base) (((scale) << 6) + ((index) << 3) + (base))
 # define EAX 0
+# define ECX 1
+# define EDX 2
 # define EBX 3
+# define ESP 4
 # define EBP 5
+# define ESI 6
+# define EDI 7
 // Entry for the spare field in ModR/M: does not matter
 # define SPARE 0
 
-/* NOTE: I think malloc'ing the generated code area and jumping into it
- * is not possible because of Data Execution Prevention (DEP).
- * Therefore, I allocate the generated code area outside of this
- * function call, in the stack.
+#if JIT_X86_64
+/* x86-64 has the same encodings, with 8 more registers (r8 to r15) and 64-bit operands
+ * selected by a REX prefix byte in front of the opcode:
+ *   0100 | W | R | X | B
+ * - W: 64-bit operand size (otherwise 32 bit, which also clears the upper half of the destination)
+ * - R, X, B: 4th bit of the ModR/M spare, the SIB index and the ModR/M r/m or SIB base
+ * So r12 is register no. 4 with REX.B when in r/m; R12 below is 12 and the 4th bit goes to the REX prefix.
+ * Absolute 32-bit addresses (memoffs32, mod = 0 with r/m = 5) no longer reach all of memory,
+ * which is why the generated code addresses the VM state relative to base registers.
  */
+# define REX_W 0x48
+# define REX_R 0x44
+# define REX_X 0x42
+# define REX_B 0x41
+# define R8 8
+# define R9 9
+# define R10 10
+# define R11 11
+# define R12 12
+# define R13 13
+# define R14 14
+# define R15 15
+// Second scratch register next to eax (ebx holds the registers, see jit_translate)
+# define SCRATCH ECX
+// The register holding the address of the IMPS registers (see the x86-64 BACKEND in jit_translate)
+# define STATE EBX
+#else
+# define SCRATCH EBX
+// The register holding the address of the IMPS registers (see the i386 BACKEND in jit_translate)
+# define STATE ESI
+#endif
 
-void jit_exit ()
-{
-	exit(0);
-}
+// X86 ENCODER
 
-// TODO start/end are bad names
-int jit_translate(int *registers, unsigned char *memory, unsigned int start, unsigned int end, unsigned char *jit_area, int *running_jit_start_instruction_no, int *running_jit_end_instruction_no) {
-	unsigned int start_instruction = W32(memory, start);
-	LOG_DEBUG("first instruction to be JITed is at %d: ", start);
-	DEBUG(print_instruction_binary(start_instruction));
-	LOG_DEBUG("\n");
-	unsigned int end_instruction = W32(memory, end);
-	LOG_DEBUG("last instruction to be JITed is at %d: ", end);
-	DEBUG(print_instruction_binary(end_instruction));
-	LOG_DEBUG("\n");
+/* The backends write their instructions with the jit_x86_* functions in jit_translate,
+ * which pick the shortest encoding for the operands at hand:
+ * - immediates from -128 to 127 as a sign-extended imm8 (83 /n ib, 6B /r ib, C1 /n ib), shifts by 1 without one (D1 /n)
+ * - eax with an imm32 in the forms without ModR/M byte (05 id, 3D id, A9 id, ...), other registers with B8+r id for mov
+ * - [base + displacement] without displacement if it is 0, and with a disp8 if it fits
+ * - jumps to code that is written already with a rel8 if it is close enough (EB cb, 70+cc cb)
+ * Jumps to code that comes later are rel32 (see FIXUPS), and so are relocated addresses (see RELOCATIONS).
+ * jit_x86_ops has the encodings of each operation; the SIMD instructions have their own (see jit_write_simd).
+ */
 
-	// TODO calculate needed jit area size. Should be simple as we know it from the first pass.
+enum {
+	X86_ADD,
+	X86_OR,
+	X86_AND,
+	X86_SUB,
+	X86_XOR,
+	X86_CMP,
+	X86_MOV,
+	X86_TEST,
+	X86_IMUL,
+	X86_LEA,
+	X86_MOVSXD,
+	X86_CMOVB,
+	X86_CMOVA,
+	X86_SHL,
+	X86_SHR,
+	X86_DEC,
+	X86_DIV,
+	X86_CALL,
+	X86_JMP
+};
 
-	// jit instruction pointer, used to assemble the instructions part by part
-	unsigned char *jip;
+typedef struct {
+	const char *mnemonic;
+	// op r/m, reg and op reg, r/m (two bytes for 0F xx), 0 for none
+	unsigned int rm_reg, reg_rm;
+	// op r/m, imm32 and op r/m, imm8 (sign-extended), and op r/m without other operand (by 1 for shifts), 0 for none
+	unsigned int rm_imm32, rm_imm8, rm;
+	// the ModR/M spare of those (/n)
+	int digit;
+} jit_x86_op;
+
+// The 8-bit forms of the operations with rm_reg and rm_imm32 are one opcode below (88, 80 ib, F6 ib, ...)
+static const jit_x86_op jit_x86_ops[] = {
+	[X86_ADD]    = { "add",    0x01, 0x03,   0x81, 0x83, 0,    0 },
+	[X86_OR]     = { "or",     0x09, 0x0b,   0x81, 0x83, 0,    1 },
+	[X86_AND]    = { "and",    0x21, 0x23,   0x81, 0x83, 0,    4 },
+	[X86_SUB]    = { "sub",    0x29, 0x2b,   0x81, 0x83, 0,    5 },
+	[X86_XOR]    = { "xor",    0x31, 0x33,   0x81, 0x83, 0,    6 },
+	[X86_CMP]    = { "cmp",    0x39, 0x3b,   0x81, 0x83, 0,    7 },
+	[X86_MOV]    = { "mov",    0x89, 0x8b,   0xc7, 0,    0,    0 },
+	[X86_TEST]   = { "test",   0x85, 0,      0xf7, 0,    0,    0 },
+	// with an immediate: imul reg, reg, imm
+	[X86_IMUL]   = { "imul",   0,    0x0faf, 0x69, 0x6b, 0,    0 },
+	[X86_LEA]    = { "lea",    0,    0x8d,   0,    0,    0,    0 },
+	[X86_MOVSXD] = { "movsxd", 0,    0x63,   0,    0,    0,    0 },
+	[X86_CMOVB]  = { "cmovb",  0,    0x0f42, 0,    0,    0,    0 },
+	[X86_CMOVA]  = { "cmova",  0,    0x0f47, 0,    0,    0,    0 },
+	[X86_SHL]    = { "shl",    0,    0,      0,    0xc1, 0xd1, 4 },
+	[X86_SHR]    = { "shr",    0,    0,      0,    0xc1, 0xd1, 5 },
+	[X86_DEC]    = { "dec",    0,    0,      0,    0,    0xff, 1 },
+	[X86_DIV]    = { "div",    0,    0,      0,    0,    0xf7, 6 },
+	[X86_CALL]   = { "call",   0,    0,      0,    0,    0xff, 2 },
+	[X86_JMP]    = { "jmp",    0,    0,      0,    0,    0xff, 4 }
+};
 
-	unsigned int instruction_count = ((end - start) / 4) + 1;
+// A memory operand [base + index * 2^scale + displacement] of host registers (-1 for none),
+// with the displacement an absolute address to relocate if relocation is not -1 (see RELOCATIONS)
+typedef struct {
+	int base, index, scale;
+	int displacement;
+	int relocation;
+} jit_x86_memory;
 
-	// IMPS instruction byte address to JIT address mapping
-	unsigned char * mapping[instruction_count];
+static inline jit_x86_memory jit_x86_at(int base, int displacement)
+{
+	jit_x86_memory m = { base, -1, 0, displacement, -1 };
+	return m;
+}
 
+static inline jit_x86_memory jit_x86_indexed(int base, int index, int scale, int displacement)
+{
+	jit_x86_memory m = { base, index, scale, displacement, -1 };
+	return m;
+}
 
-	/* Two passes: One counts instructions only and calculates the mapping,
-	 * the next one tranlates and adjusts jumps / memory references
-	 * according to the mapping.
-	 */
-	{
-		int count_only;
-		#define TRANSLATE(x) if (!count_only) {x}
-		#define COUNT(x) if (count_only) {x}
+static inline jit_x86_memory jit_x86_relocated(int base, int index, int displacement, int relocation)
+{
+	jit_x86_memory m = { base, index, 0, displacement, relocation };
+	return m;
+}
 
-		// Print out what instruction is generated at what offset (byte) from jit_area.
-		// This is to be prepended to every translation into an Intel instruction so that it can be debugged with gdb's x/i jit_area+(offset).
-		// THIS DESCRIBES WHAT HAPPENS.
-		// TODO do this for all instructions
-		#define JIT_ASM(mnemonic, instruction_type) TRANSLATE ( LOG_DEBUG("  +%d %s\n", (jip - jit_area), (mnemonic" | "instruction_type)); )
+void jit_exit ()
+{
+	exit(0);
+}
 
-		// Writes code that returns the control from the JIT back to the interpreter.
-		// It shall return (set eax to) the interpreter PC to continue execution at.
-		unsigned char * jit_write_leave (unsigned char * jip, int count_only)
-		{
-			TRANSLATE ( LOG_DEBUG("    writing a return-from-JIT instruction\n"); )
+// INTERMEDIATE REPRESENTATION
+
+/* jit_translate does not write code for the IMPS instructions right away, but turns them
+ * into a linear IR first, with one jit_ir per instruction (so that branch targets and the
+ * mapping stay instruction numbers) whose operands are IMPS registers or constants.
+ * jit_ir_optimize rewrites it with what it knows about the registers:
+ * - constant folding: instructions on known values become constants (addi $9 $0 8 -> $9 = 8)
+ * - copy propagation: registers that are copies of others are read from those
+ * - strength reduction: multiplications by powers of two become shifts
+ * - dead store elimination: register writes overwritten before anything reads them are dropped
+ * - address fusion: the additions and shifts computing an address right before a load or store
+ *   become part of it, as x86 computes base + index * 1, 2, 4 or 8 + offset in one instruction
+ * Lowering it to x86 is the last step. --dump-ir prints it for every translation.
+ */
 
-			// Put the return value (PC outside JIT, where to continue) into eax.
-			// If there is no jump out of JIT and we just want to continue where the JIT started, the we use the address pc_to_return_to provided by execute() as last parameter (which is ebp + 8).
-			// If there is such a jump, it will have overridden pc_to_return_to by calling jit_change_return_pc().
-			//          [... other execute parameters ...]
-			// ebp+8 -> pc_to_return_to
-			//          [return address to where execute() is called]
-			// ebp   -> [ebp from the scope where execute() is called]
-			//          [... our local variables ...]
-			// TODO check 64 bit: is the offset still 8?
-			JIT_ASM (
-				"mov eax, [ebp + 8]",
-				"MOV reg32,r/m32"
-			)  // o32 8B /r
-			TRANSLATE ( *jip = 0x8b; )
-			jip++;
-			TRANSLATE ( *jip = MODRM(2, EAX, EBP); )
-			jip++;
-			TRANSLATE ( W32(jip, 0) = (int) 8; )
-			jip += 4;
+enum {
+	IR_NOP,
+	// dest = a
+	IR_MOVE,
+	// dest = a op b
+	IR_ADD,
+	IR_SUB,
+	IR_MUL,
+	// dest = a << b, b a constant
+	IR_SHL,
+	// dest = memory[a + (index << scale) + offset]
+	IR_LOAD,
+	// memory[b + (index << scale) + offset] = a
+	IR_STORE,
+	// if a (opcode) b: continue at target
+	IR_BRANCH,
+	IR_JUMP,
+	// $31 = a, continue at target
+	IR_JAL,
+	// continue at a
+	IR_JR,
+	IR_HALT,
+	// the interpreter executes it (JIT and unknown instructions)
+	IR_LEAVE
+};
 
-			JIT_ASM (
-				"mov esp, ebp; pop ebp",
-				"LEAVE"
-			)  // C9
-			TRANSLATE ( *jip = 0xc9; )
-			jip++;
+typedef struct {
+	// IMPS register, or -1 for the constant value
+	int reg;
+	int value;
+} jit_operand;
+
+typedef struct {
+	int op;
+	// the IMPS opcode it was built from, which is the condition of IR_BRANCH
+	unsigned int opcode;
+	// the register written, -1 for none
+	int dest;
+	jit_operand a, b;
+	int offset;
+	// the register added to the address of loads and stores, -1 for none
+	int index;
+	int scale;
+	// the register written by the instructions fused into the address of a load or store, -1 for none
+	// (see jit_ir_fuse_address): it is set to the address - restore_offset when the access leaves
+	// the translation, or right away with restore_always
+	int restore;
+	int restore_offset;
+	int restore_always;
+	// address IR_BRANCH, IR_JUMP and IR_JAL continue at
+	unsigned int target;
+} jit_ir;
+
+// Whether main was given --dump-ir
+static int dump_ir = 0;
+
+static jit_operand jit_register_operand(int n)
+{
+	jit_operand o = { n, 0 };
+	return o;
+}
 
-			JIT_ASM ( "ret", "RET" )  // c3
-			*jip = 0xc3;
-			jip++;
+static jit_operand jit_constant_operand(int value)
+{
+	jit_operand o = { -1, value };
+	return o;
+}
 
-			return jip;
-		}
+/* Builds the IR of the count instructions from start in memory. */
+static void jit_ir_build(const unsigned char *memory, unsigned int start, unsigned int count, jit_ir *ir)
+{
+	unsigned int i;
 
-		// Called from inside JIT code, changes the pc_to_return_to argument to execute() that is later copied to eax by the code created by jit_write_leave() to form the return code of execute(). For a stack layout see jit_write_leave().
-		// If this function is not called, the original pc_to_return_to value set as execute parameter is left as is.
-		unsigned char * jit_write_change_return_pc(unsigned char * jip, unsigned int new_return_pc)
-		{
-			TRANSLATE ( LOG_DEBUG("    writing an instruction that would set the JIT return PC to %d\n", new_return_pc); )
+	for (i = 0; i < count; i++) {
+		unsigned int pc = start + i * 4;
+		unsigned int instruction = W32(memory, pc);
+		jit_ir *x = &ir[i];
 
-			// TODO check 64 bit: is the offset still 8?
-			JIT_ASM (
-				"mov [ebp + 8], new_return_pc",
-				"MOV r/m32,imm32"
-			)  // o32 C7 /0 id
-			TRANSLATE ( *jip = 0xc7; )
-			jip++;
-			TRANSLATE ( *jip = MODRM(2, 0, EBP); )
-			jip++;
-			TRANSLATE ( W32(jip, 0) = (int) 8; )
-			jip += 4;
-			TRANSLATE ( W32(jip, 0) = (int) new_return_pc; )
-			jip += 4;
+		memset(x, 0, sizeof(jit_ir));
+		x->opcode = OPCODE;
+		x->dest = -1;
+		// the operands an instruction does not have are constants, which read no register
+		x->a = x->b = jit_constant_operand(0);
+		x->index = -1;
+		x->restore = -1;
 
-			return jip;
+		switch (OPCODE) {
+			case ADD:
+			case SUB:
+			case MUL:
+				x->op = OPCODE == ADD ? IR_ADD : OPCODE == SUB ? IR_SUB : IR_MUL;
+				x->dest = R1;
+				x->a = jit_register_operand(R2);
+				x->b = jit_register_operand(R3);
+				break;
+			case ADDI:
+			case SUBI:
+			case MULI:
+				x->op = OPCODE == ADDI ? IR_ADD : OPCODE == SUBI ? IR_SUB : IR_MUL;
+				x->dest = R1;
+				x->a = jit_register_operand(R2);
+				x->b = jit_constant_operand(SIGNEXT(SIGNED(IMM)));
+				break;
+			case LW:
+				x->op = IR_LOAD;
+				x->dest = R1;
+				x->a = jit_register_operand(R2);
+				x->offset = SIGNEXT(SIGNED(IMM));
+				break;
+			case SW:
+				x->op = IR_STORE;
+				x->a = jit_register_operand(R1);
+				x->b = jit_register_operand(R2);
+				x->offset = SIGNEXT(SIGNED(IMM));
+				break;
+			case BEQ: case BNE: case BLT: case BGT: case BLE: case BGE:
+				x->op = IR_BRANCH;
+				x->a = jit_register_operand(R1);
+				x->b = jit_register_operand(R2);
+				// conditional branches are relative to the branch, in instructions
+				x->target = pc + 4 * SIGNEXT(SIGNED(IMM));
+				break;
+			case JMP:
+				x->op = IR_JUMP;
+				x->target = ADDR;
+				break;
+			case JAL:
+				x->op = IR_JAL;
+				x->dest = 31;
+				x->a = jit_constant_operand(pc + 4);
+				x->target = ADDR;
+				break;
+			case JR:
+				x->op = IR_JR;
+				x->a = jit_register_operand(R1);
+				break;
+			case HALT:
+				x->op = IR_HALT;
+				break;
+			default:
+				x->op = IR_LEAVE;
+				break;
 		}
+	}
+}
 
-		unsigned char * jit_write_jump(unsigned char * jip, int count_only, unsigned int i, unsigned int instruction)
-		{
-			// If PC + 4*C is in the JIT translation, jump around IN the translation
-			// otherwise, leave the JIT execution
-			// PC + 4*C can be evaluated AT THE TIME OF TRANSLATION
+// Whether a (opcode) b holds, for the opcode of a conditional branch
+static int jit_condition_holds(unsigned int opcode, int a, int b)
+{
+	switch (opcode) {
+		case BEQ: return a == b;
+		case BNE: return a != b;
+		case BLT: return a < b;
+		case BGT: return a > b;
+		case BLE: return a <= b;
+		default:  return a >= b;
+	}
+}
 
-			// Direct jump imm values contain the address to jump to, so address/4 gives us the instruction
-			// Note that target_instruction is the instruction number INSIDE JIT (the n-th jitted instruction)
-			int target_instruction = (SIGNEXT(SIGNED(IMM)) - start) / 4;  // (... - start) to get the address INSIDE JIT
+// The opcode of the branch with the operands swapped, e.g. BGT for BLT
+static unsigned int jit_mirror_condition(unsigned int opcode)
+{
+	switch (opcode) {
+		case BLT: return BGT;
+		case BGT: return BLT;
+		case BLE: return BGE;
+		case BGE: return BLE;
+		default:  return opcode;
+	}
+}
 
-			if (SIGNEXT(SIGNED(IMM)) % 4 != 0)
-			{
-				LOG_ERROR("JUMP ADDRESS %d IS NOT ALIGNED (multiple of 4)\n", SIGNEXT(SIGNED(IMM)));
-				return 0;
-			}
+static void jit_ir_move(jit_ir *x, jit_operand a)
+{
+	x->op = IR_MOVE;
+	x->a = a;
+	x->b = jit_constant_operand(0);
+}
 
-			// 0 <= target_instruction < instruction_count to be still in jitted code
-			int in_jit = 0 <= target_instruction && target_instruction < instruction_count;
+/* Fuses the additions and shifts computing the base register of the load or store at i right before it
+ * into its address (see INTERMEDIATE REPRESENTATION), e.g. for the array indexing
+ *     $10 = $10 << 2; $10 = $10 + $25; $12 = [$10 + 0]   ->   $12 = [$25 + ($10 << 2) + 0]
+ * Only writes to the base register are fused. The access sets it to what they would have written
+ * if it is read after the access (live), and otherwise only if it leaves the translation.
+ */
+static void jit_ir_fuse_address(jit_ir *ir, unsigned int i, const unsigned char *leader, unsigned int live)
+{
+	jit_ir *x = &ir[i];
+	jit_operand *base = x->op == IR_LOAD ? &x->a : &x->b;
+	int t = base->reg;
+	// The address is (term << shift) + other + offset, other being -1 for none
+	int term = t, shift = 0, other = -1;
+	unsigned int offset = x->offset;
+	// The first instruction fused and the one looked at
+	unsigned int first = i, m = i;
+
+	// A store of the base register would need it before the access
+	if (t < 0 || (x->op == IR_STORE && x->a.reg == t)) {
+		return;
+	}
 
-			if (target_instruction < 0)
-			{
-				LOG_ERROR("ATTEMPT TO JUMP TO NEGATIVE MEMORY ADDRESS\n");
-				return 0;
-			}
+	// Back through the writes to t, as long as the address is computed from t and nothing jumps in between
+	while (m > 0 && term == t && !leader[m]) {
+		jit_ir *y = &ir[--m];
 
-			if (in_jit)
-			{
-				// jump inside jit if the cmp condition is met
+		if (y->op == IR_NOP) {
+			continue;
+		}
+		if (y->dest != t) {
+			break;
+		}
 
-				TRANSLATE ( LOG_DEBUG("unconditional in-jit-jump\n"); )
+		if (y->op == IR_ADD && y->a.reg >= 0 && y->b.reg < 0) {
+			// ((a + value) << shift) + ...
+			offset += (unsigned int) y->b.value << shift;
+			term = y->a.reg;
+		} else if (y->op == IR_ADD && y->a.reg >= 0 && y->b.reg >= 0 && y->a.reg != y->b.reg && shift == 0 && other < 0) {
+			// a + b + ..., with t staying the term if it is one of them
+			term = y->b.reg == t ? y->b.reg : y->a.reg;
+			other = y->b.reg == t ? y->a.reg : y->b.reg;
+		} else if (y->op == IR_SHL && shift + y->b.value <= 3) {
+			shift += y->b.value;
+			term = y->a.reg;
+		} else if (y->op == IR_MOVE && y->a.reg >= 0) {
+			term = y->a.reg;
+		} else {
+			break;
+		}
+		first = m;
+	}
 
-				// note that in the second pass, mapping is already completely filled
-				unsigned char * in_jit_addr = mapping[target_instruction];
-				unsigned char * addr_after_instruction = jip + 5; // because this instruction has jip++, +=4
+	if (first == i) {
+		return;
+	}
 
-				JIT_ASM (
-					"jmp in_jit_addr",
-					"JMP imm"
-				)  // E9 rw/rd
-				TRANSLATE ( *jip = 0xe9; )
-				jip++;
-				TRANSLATE ( W32(jip, 0) = (int) ((int) in_jit_addr - (int) addr_after_instruction); )
-				jip += 4;
-			}
-			else
-			{
-				// jump out of jit if the cmp condition is met
+	for (m = first; m < i; m++) {
+		ir[m].op = IR_NOP;
+	}
+	x->restore = t;
+	x->restore_offset = x->offset;
+	x->restore_always = (live & (1u << t)) && !(x->op == IR_LOAD && x->dest == t);
+	x->offset = offset;
+	if (shift == 0) {
+		*base = jit_register_operand(term);
+		x->index = other;
+	} else {
+		// without another register, the base is 0
+		*base = other >= 0 ? jit_register_operand(other) : jit_constant_operand(0);
+		x->index = term;
+		x->scale = shift;
+	}
+}
+
+/* Rewrites the IR of the count instructions from start (see INTERMEDIATE REPRESENTATION).
+ * With zero_is_zero, $0 may be taken to be 0 everywhere (see jit_translate).
+ */
+static void jit_ir_optimize(jit_ir *ir, unsigned int start, unsigned int count, int zero_is_zero)
+{
+	// What is known about each register: nothing, that it holds a value or that it holds the same as another one
+	enum { UNKNOWN, CONSTANT, COPY } known[32];
+	int value[32];
+	unsigned char leader[count];
+	unsigned int i, n;
+	unsigned int live;
+
+	if (count == 0) {
+		return;
+	}
 
-				// where we have to jump outside the JIT if we have to jump
-				unsigned int next_pc = i + SIGNEXT(SIGNED(IMM));
+	/* Knowledge only holds within the straight code between instructions that are jumped to
+	 * (the leaders). JR can jump to any of them.
+	 */
+	memset(leader, 0, count);
+	leader[0] = 1;
+	for (i = 0; i < count; i++) {
+		unsigned int target = ir[i].target;
+
+		if (ir[i].op == IR_JR) {
+			memset(leader, 1, count);
+			break;
+		}
+		if ((ir[i].op == IR_BRANCH || ir[i].op == IR_JUMP || ir[i].op == IR_JAL) && target % 4 == 0 && start <= target && (target - start) / 4 < count) {
+			leader[(target - start) / 4] = 1;
+		}
+		if ((ir[i].op == IR_JUMP || ir[i].op == IR_JAL) && i + 1 < count) {
+			leader[i + 1] = 1;
+		}
+	}
 
-				TRANSLATE ( LOG_DEBUG("    This is an unconditional out-of-jit-jump, assembling a JMP to PC=%d\n", next_pc); )
+	// Forward: constant folding and copy propagation
+	for (i = 0; i < count; i++) {
+		jit_ir *x = &ir[i];
+		jit_operand *operands[2] = { &x->a, &x->b };
+		int k;
 
-				// set the right PC (next_pc) into [ebp + 8] (where to jump outside in bytecode)
-				jip = jit_write_change_return_pc (jip, next_pc);
+		if (leader[i]) {
+			for (n = 0; n < 32; n++) {
+				known[n] = UNKNOWN;
+			}
+			if (zero_is_zero) {
+				known[0] = CONSTANT;
+				value[0] = 0;
+			}
+		}
 
-				jip = jit_write_leave (jip, count_only);
+		// Read what the registers are known to hold
+		for (k = 0; k < 2; k++) {
+			jit_operand *o = operands[k];
 
+			if (o->reg >= 0 && known[o->reg] == CONSTANT) {
+				*o = jit_constant_operand(value[o->reg]);
+			} else if (o->reg >= 0 && known[o->reg] == COPY) {
+				*o = jit_register_operand(value[o->reg]);
 			}
-			return jip;
 		}
 
-		unsigned char * jit_write_conditional_jump(unsigned char * jip, int count_only, unsigned int i, unsigned int instruction, unsigned int condition_code)
-		{
-			// move R1 -> eax, R2 -> ebx
-			// If PC + 4*C is in the JIT translation, jump around IN the translation
-			// otherwise, leave the JIT execution
-			// PC + 4*C can be evaluated AT THE TIME OF TRANSLATION
+		// Fold, computing in unsigned so that overflows wrap around like in x86
+		switch (x->op) {
+			case IR_ADD:
+			case IR_MUL:
+				// the constant goes to b, where the x86 instructions take it
+				if (x->a.reg < 0 && x->b.reg >= 0) {
+					jit_operand a = x->a;
+					x->a = x->b;
+					x->b = a;
+				}
+				if (x->a.reg < 0) {
+					jit_ir_move(x, jit_constant_operand(x->op == IR_ADD ? (int) ((unsigned int) x->a.value + x->b.value) : (int) ((unsigned int) x->a.value * x->b.value)));
+				} else if (x->b.reg < 0 && x->b.value == (x->op == IR_ADD ? 0 : 1)) {
+					jit_ir_move(x, x->a);
+				} else if (x->op == IR_MUL && x->b.reg < 0 && x->b.value == 0) {
+					jit_ir_move(x, jit_constant_operand(0));
+				} else if (x->op == IR_MUL && x->b.reg < 0 && ((unsigned int) x->b.value & (x->b.value - 1)) == 0) {
+					// a power of two, 2^31 included
+					x->op = IR_SHL;
+					x->b.value = __builtin_ctz(x->b.value);
+				}
+				break;
+			case IR_SUB:
+				if (x->a.reg < 0 && x->b.reg < 0) {
+					jit_ir_move(x, jit_constant_operand((int) ((unsigned int) x->a.value - x->b.value)));
+				} else if (x->b.reg < 0 && x->b.value == 0) {
+					jit_ir_move(x, x->a);
+				} else if (x->a.reg >= 0 && x->a.reg == x->b.reg) {
+					jit_ir_move(x, jit_constant_operand(0));
+				} else if (x->b.reg < 0) {
+					// so that address fusion only has to know additions
+					x->op = IR_ADD;
+					x->b.value = (int) (0u - x->b.value);
+				}
+				break;
+			case IR_BRANCH:
+				if (x->a.reg < 0 && x->b.reg >= 0) {
+					jit_operand a = x->a;
+					x->a = x->b;
+					x->b = a;
+					x->opcode = jit_mirror_condition(x->opcode);
+				}
+				if ((x->a.reg < 0 && x->b.reg < 0) || (x->a.reg >= 0 && x->a.reg == x->b.reg)) {
+					x->op = jit_condition_holds(x->opcode, x->a.value, x->b.value) ? IR_JUMP : IR_NOP;
+					x->a = x->b = jit_constant_operand(0);
+				}
+				break;
+			case IR_JR:
+				if (x->a.reg < 0) {
+					x->op = IR_JUMP;
+					x->target = x->a.value;
+				}
+				break;
+		}
 
-			// Conditional branch imm values are relative to the instruction (i)
-			// Note that target_instruction is the instruction number INSIDE JIT (the n-th jitted instruction)
-			int target_instruction = i + SIGNEXT(SIGNED(IMM));
-			// 0 <= target_instruction < instruction_count to be still in jitted code
-			int in_jit = 0 <= target_instruction && target_instruction < instruction_count;
-//			LOG_DEBUG("instruction_count is %d\n", instruction_count);
-//			LOG_DEBUG("target_instruction is %d\n", target_instruction);
+		if (x->op == IR_MOVE && x->a.reg == x->dest) {
+			x->op = IR_NOP;
+		}
+		if (x->op == IR_NOP || x->dest < 0) {
+			continue;
+		}
 
-			if (target_instruction < 0)
-			{
-				LOG_ERROR("ATTEMPT TO JUMP TO NEGATIVE MEMORY ADDRESS\n");
-				return 0;
+		// The copies of what it overwrites are not anymore
+		for (n = 0; n < 32; n++) {
+			if (known[n] == COPY && value[n] == x->dest) {
+				known[n] = UNKNOWN;
 			}
+		}
+		if ((x->op == IR_MOVE || x->op == IR_JAL) && x->a.reg < 0) {
+			known[x->dest] = CONSTANT;
+			value[x->dest] = x->a.value;
+		} else if (x->op == IR_MOVE) {
+			known[x->dest] = COPY;
+			value[x->dest] = x->a.reg;
+		} else {
+			known[x->dest] = UNKNOWN;
+		}
+	}
 
-			/* IDEA:
-			 * if in_jit:
-			 *   if branch?:
-			 *     jmp in_jit_addr
-			 * else:
-			 *   if branch?:
-			 *     PC = start + i*4 + 4*C - 4    // -4 because PC += 4 after JIT done
-			 */
+	/* Backward: dead store elimination and address fusion. All registers are live at the end
+	 * of the straight code and where the translation may leave (loads and stores leave when they fail).
+	 */
+	live = ~0u;
+	for (i = count; i-- > 0; ) {
+		jit_ir *x = &ir[i];
 
-			/* We have to compare either way, so first write
-			 *   R1 -> eax
-			 *   R2 -> ebx
-			 *   cmp eax ebx
-			 * instructions.
-			 */
+		if (i + 1 == count || leader[i + 1]) {
+			live = ~0u;
+		}
 
-			JIT_ASM (
-				"MOV eax, r1",
-				"MOV EAX,memoffs32"
-			)  // o32 A1 ow/od
-			TRANSLATE ( *jip = 0xa1; )
-			jip++;
-			TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-			jip += 4;
+		switch (x->op) {
+			case IR_MOVE:
+			case IR_ADD:
+			case IR_SUB:
+			case IR_MUL:
+			case IR_SHL:
+				if (!(live & (1u << x->dest))) {
+					x->op = IR_NOP;
+					break;
+				}
+				live &= ~(1u << x->dest);
+				if (x->a.reg >= 0) {
+					live |= 1u << x->a.reg;
+				}
+				if (x->op != IR_MOVE && x->b.reg >= 0) {
+					live |= 1u << x->b.reg;
+				}
+				break;
+			case IR_NOP:
+				break;
+			case IR_LOAD:
+			case IR_STORE:
+				// live is what is read after it
+				jit_ir_fuse_address(ir, i, leader, live);
+				live = ~0u;
+				break;
+			default:
+				live = ~0u;
+				break;
+		}
+	}
+}
 
-			JIT_ASM (
-				"MOV ebx, r2",
-				"MOV reg32,r/m32"
-			)  // o32 8B /r
-			TRANSLATE ( *jip = 0x8b; )
-			jip++;
-			TRANSLATE ( *jip = MODRM(0, EBX, 5); )
-			jip++;
-			TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-			jip += 4;
+// Writes the operand as $n or its value into buf
+static void jit_operand_print(jit_operand o, char *buf, size_t size)
+{
+	if (o.reg >= 0) {
+		snprintf(buf, size, "$%d", o.reg);
+	} else {
+		snprintf(buf, size, "%d", o.value);
+	}
+}
 
-			JIT_ASM (
-				"CMP eax, ebx",
-				"CMP reg32,r/m32"
-			)  // o32 3B /r
-			TRANSLATE ( *jip = 0x3b; )
-			jip++;
-			TRANSLATE ( *jip = MODRM(3, EAX, EBX); )
-			jip++;
+// Writes the IR instruction in a readable form into buf, e.g. "$3 = $1 + 4"
+static void jit_ir_print(const jit_ir *x, char *buf, size_t size)
+{
+	static const char *conditions[] = { "==", "!=", "<", ">", "<=", ">=" };
+	char a[16], b[16];
 
-			/* Second, write one of
-			 *   jump inside JIT
-			 *   jump outside JIT.
-			 */
+	char address[64];
 
-			if (in_jit)
-			{
-				// jump inside jit if the cmp condition is met
+	jit_operand_print(x->a, a, sizeof(a));
+	jit_operand_print(x->b, b, sizeof(b));
+	if (x->index >= 0) {
+		snprintf(address, sizeof(address), "%s + ($%d << %d) + %d", x->op == IR_LOAD ? a : b, x->index, x->scale, x->offset);
+	} else {
+		snprintf(address, sizeof(address), "%s + %d", x->op == IR_LOAD ? a : b, x->offset);
+	}
 
-				TRANSLATE ( LOG_DEBUG("conditional in-jit-jump\n"); )
+	switch (x->op) {
+		case IR_NOP:    snprintf(buf, size, "nop"); break;
+		case IR_MOVE:   snprintf(buf, size, "$%d = %s", x->dest, a); break;
+		case IR_ADD:    snprintf(buf, size, "$%d = %s + %s", x->dest, a, b); break;
+		case IR_SUB:    snprintf(buf, size, "$%d = %s - %s", x->dest, a, b); break;
+		case IR_MUL:    snprintf(buf, size, "$%d = %s * %s", x->dest, a, b); break;
+		case IR_SHL:    snprintf(buf, size, "$%d = %s << %s", x->dest, a, b); break;
+		case IR_LOAD:   snprintf(buf, size, "$%d = [%s]", x->dest, address); break;
+		case IR_STORE:  snprintf(buf, size, "[%s] = %s", address, a); break;
+		case IR_BRANCH: snprintf(buf, size, "if %s %s %s goto %u", a, conditions[x->opcode - BEQ], b, x->target); break;
+		case IR_JUMP:   snprintf(buf, size, "goto %u", x->target); break;
+		case IR_JAL:    snprintf(buf, size, "$31 = %s; goto %u", a, x->target); break;
+		case IR_JR:     snprintf(buf, size, "goto %s", a); break;
+		case IR_HALT:   snprintf(buf, size, "halt"); break;
+		default:        snprintf(buf, size, "leave"); break;
+	}
+	if (x->restore >= 0 && x->restore_always) {
+		snprintf(buf + strlen(buf), size - strlen(buf), ", $%d = address - %d", x->restore, x->restore_offset);
+	}
+}
 
-				// note that in the second pass, mapping is already completely filled
-				unsigned char * in_jit_addr = mapping[target_instruction];
-				unsigned char * addr_after_instruction = jip + 6; // because this instruction has jip++, ++, +=4
+/* Prints the instructions from start with their IR as built and as optimized, e.g.
+ *     16  addi $9 $0 8             $9 = $0 + 8               $9 = 8
+ */
+static void jit_ir_dump(FILE *out, const unsigned char *memory, unsigned int start, unsigned int count, const jit_ir *built, const jit_ir *optimized)
+{
+	char instruction[64], before[96], after[96];
+	unsigned int i;
 
-				JIT_ASM (
-					"Jcc NEAR relative(in_jit_addr)",
-					"Jcc 80+cc imm"
-				)  // 0F 80+cc imm
-				// where cc is the condition code
-				// see http://www.posix.nl/linuxassembly/nasmdochtml/nasmdoca.html#section-A.2.2
-				TRANSLATE ( *jip = 0x0f; )
-				jip++;
-				TRANSLATE ( *jip = 0x80 + condition_code; )
-				jip++;
-				TRANSLATE ( W32(jip, 0) = (int) (in_jit_addr - addr_after_instruction); )
-				jip += 4;
-			}
-			else
-			{
-				// jump out of jit if the cmp condition is met
+	for (i = 0; i < count; i++) {
+		unsigned int pc = start + i * 4;
 
-				// where we have to jump outside the JIT if we have to jump
-				unsigned int next_pc = start + 4 * ( i + SIGNEXT(SIGNED(IMM)) );  // conditional branches are relative, so start + ..., and relative to the current instruction's PC (i)
+		imps_disassemble(W32(memory, pc), pc, instruction, sizeof(instruction));
+		jit_ir_print(&built[i], before, sizeof(before));
+		jit_ir_print(&optimized[i], after, sizeof(after));
+		fprintf(out, "%6u  %-24s %-25s %s\n", pc, instruction, before, after);
+	}
+}
 
-				TRANSLATE ( LOG_DEBUG("    This is a conditional out-of-jit-jump, assembling a conditional out-of-JIT-return to PC=%d\n", next_pc); )
+// VECTORIZATION
+
+/* Counted loops of the shape
+ *
+ *     header: bge $i n exit      (n a constant or a register the loop does not write)
+ *             ...                (no branches or jumps, and $i = $i + c with c > 0 once)
+ *             jmp header
+ *
+ * whose loads and stores access addresses growing by the same amount every iteration
+ * (e.g. a[i] or b[i * n + j]) run several iterations at once, in the lanes of SIMD registers:
+ * 4 with SSE2 and 8 with AVX2. jit_vector_analyze describes what one iteration does in every lane.
+ * The other registers the loop writes have to be temporaries, written before they are read
+ * in every iteration, or sums (sum = sum + x), which every lane adds up on its own.
+ * Before running the lanes, the translation checks that all the accesses of those iterations
+ * are in memory and that no store overlaps another access or the translated instructions
+ * (see jit_write_vector_loop). The iterations left, which are at least the last one,
+ * and loops failing the checks run as translated one at a time, which also leaves
+ * the temporaries as the interpreter would. Only the x86-64 backend vectorizes.
+ */
 
-				/* if the jump condition is NOT met (!condition_code), OMIT (jump over) the out-of-JIT jump written by jit_write_leave:
-				 *   jit_write_change_return_pc is jip += 10 bytes long and jit_write_leave is jip += 8 bytes long;
-				 *   therefore we have to jump over the next 18 bytes.
-				 */
-				// TODO modify JIT_ASM so that we can put in which cc it is
-				JIT_ASM (
-					"Jcc +18",
-					"Jcc 70+cc imm8"
-				)  // 70+cc imm8
-				TRANSLATE ( *jip = 0x70 + negate_condition_code(condition_code); )
-				jip++;
-				TRANSLATE ( W32(jip, 0) = (int) (10 + 8); )
-				jip++;
+// Which SIMD instructions vectorized loops use
+enum {
+	JIT_SIMD_NONE,
+	JIT_SIMD_SSE2,
+	JIT_SIMD_AVX2
+};
 
-				// set the right PC (next_pc) into [ebp + 8] (where to jump outside in bytecode)
-				jip = jit_write_change_return_pc (jip, next_pc);
+// Set by main (--simd), by default to the best one the CPU has
+static int simd = JIT_SIMD_NONE;
 
-				jip = jit_write_leave (jip, count_only);
+#define JIT_VECTOR_MAX_LOOPS 8
+#define JIT_VECTOR_MAX_NODES 128
+#define JIT_VECTOR_MAX_STREAMS 8
+#define JIT_VECTOR_MAX_OPS 32
+// xmm0 to xmm12 hold the values of vectorized loops, xmm13 to xmm15 are scratch registers
+#define JIT_VECTOR_REGISTERS 13
 
-			}
-			return jip;
-		}
+/* An expression on the registers at the start of an iteration: the operand itself (op IR_MOVE),
+ * or left op right (IR_ADD, IR_SUB, IR_MUL, or IR_SHL by a constant), left and right being other nodes
+ */
+typedef struct {
+	int op;
+	jit_operand operand;
+	int left, right;
+} jit_vector_node;
+
+// A load or store of the loop, accessing address, address + step, address + 2 * step, ... (nodes) in consecutive iterations
+typedef struct {
+	int store;
+	int address, step;
+} jit_vector_stream;
+
+/* What one iteration does in every lane, in the order of the instructions:
+ * - IR_LOAD from stream, IR_STORE of op a to stream
+ * - IR_ADD, IR_SUB or IR_MUL of ops a and b, IR_SHL of op a by the constant b
+ * - IR_MOVE: node a, the same in all lanes
+ * - IR_ADD or IR_SUB with sum >= 0: adds op a to or subtracts it from register sum
+ */
+typedef struct {
+	int op;
+	int a, b;
+	int stream;
+	int sum;
+	// SIMD register of the result, or of the lanes of the sum
+	int xmm;
+} jit_vector_op;
+
+typedef struct {
+	// instruction numbers of the bge and of the jmp back to it
+	unsigned int header, back;
+	int induction, increment;
+	jit_operand bound;
+	jit_vector_node nodes[JIT_VECTOR_MAX_NODES];
+	int node_count;
+	jit_vector_stream streams[JIT_VECTOR_MAX_STREAMS];
+	int stream_count;
+	jit_vector_op ops[JIT_VECTOR_MAX_OPS];
+	int op_count;
+	// SIMD register of the offsets of the lanes of each load that is no contiguous one, for the gathers of AVX2
+	int offsets_xmm[JIT_VECTOR_MAX_STREAMS];
+	// where the vector code ends and the translation running one iteration at a time starts (see jit_write_vector_loop)
+	unsigned char *done, *scalar;
+} jit_vector_loop;
+
+// What a register holds during jit_vector_analyze
+typedef struct {
+	enum {
+		// start + k * step in the k-th iteration from now (nodes)
+		VECTOR_AFFINE,
+		// the result of op in every lane
+		VECTOR_LANES,
+		// what reg held at the start of the iteration
+		VECTOR_CARRIED,
+		// reg plus the lanes summed up by op
+		VECTOR_SUM
+	} kind;
+	int start, step;
+	int op;
+	int reg;
+} jit_vector_value;
+
+// Whether node is the constant value
+static int jit_vector_is_constant(const jit_vector_loop *loop, int node, int value)
+{
+	return loop->nodes[node].op == IR_MOVE && loop->nodes[node].operand.reg < 0 && loop->nodes[node].operand.value == value;
+}
+
+/* Adds the node for the operand to loop. Returns its index, -1 if there is no room. */
+static int jit_vector_leaf(jit_vector_loop *loop, jit_operand operand)
+{
+	jit_vector_node *x = &loop->nodes[loop->node_count];
+
+	if (loop->node_count == JIT_VECTOR_MAX_NODES) {
+		return -1;
+	}
+	x->op = IR_MOVE;
+	x->operand = operand;
+	x->left = x->right = -1;
+	return loop->node_count++;
+}
+
+/* Adds the node for left op right to loop, folding constants.
+ * Returns its index, -1 if there is no room or left or right is -1.
+ */
+static int jit_vector_combine(jit_vector_loop *loop, int op, int left, int right)
+{
+	jit_vector_node *x;
+
+	if (left < 0 || right < 0) {
+		return -1;
+	}
+
+	// computed in unsigned, so that overflows wrap around like in x86
+	if (loop->nodes[left].op == IR_MOVE && loop->nodes[left].operand.reg < 0 && loop->nodes[right].op == IR_MOVE && loop->nodes[right].operand.reg < 0) {
+		unsigned int a = loop->nodes[left].operand.value, b = loop->nodes[right].operand.value;
+
+		return jit_vector_leaf(loop, jit_constant_operand(op == IR_ADD ? a + b : op == IR_SUB ? a - b : op == IR_MUL ? a * b : a << (b & 31)));
+	}
+	if ((op == IR_ADD && jit_vector_is_constant(loop, left, 0)) || (op == IR_MUL && jit_vector_is_constant(loop, left, 1))) {
+		return right;
+	}
+	if ((op != IR_MUL && jit_vector_is_constant(loop, right, 0)) || (op == IR_MUL && jit_vector_is_constant(loop, right, 1))) {
+		return left;
+	}
+	if (op == IR_MUL && (jit_vector_is_constant(loop, left, 0) || jit_vector_is_constant(loop, right, 0))) {
+		return jit_vector_leaf(loop, jit_constant_operand(0));
+	}
+
+	if (loop->node_count == JIT_VECTOR_MAX_NODES) {
+		return -1;
+	}
+	x = &loop->nodes[loop->node_count];
+	x->op = op;
+	x->left = left;
+	x->right = right;
+	return loop->node_count++;
+}
+
+static jit_vector_value jit_vector_affine(int start, int step)
+{
+	jit_vector_value v = { VECTOR_AFFINE, start, step, -1, -1 };
+	return v;
+}
+
+/* Adds op to loop. Returns its index, -1 if there is no room or a or b is -1 (for ops that have them). */
+static int jit_vector_add_op(jit_vector_loop *loop, int op, int a, int b, int stream, int sum)
+{
+	jit_vector_op *x = &loop->ops[loop->op_count];
+
+	if (loop->op_count == JIT_VECTOR_MAX_OPS || a < 0 || (b < 0 && (op == IR_ADD || op == IR_SUB || op == IR_MUL) && sum < 0)) {
+		return -1;
+	}
+	x->op = op;
+	x->a = a;
+	x->b = b;
+	x->stream = stream;
+	x->sum = sum;
+	x->xmm = -1;
+	return loop->op_count++;
+}
+
+/* Returns the op computing v in every lane, adding one that sets all lanes to v
+ * if it is the same in every iteration. Returns -1 if it is neither.
+ */
+static int jit_vector_lanes(jit_vector_loop *loop, jit_vector_value v)
+{
+	if (v.kind == VECTOR_LANES) {
+		return v.op;
+	}
+	if (v.kind == VECTOR_AFFINE && jit_vector_is_constant(loop, v.step, 0)) {
+		return jit_vector_add_op(loop, IR_MOVE, v.start, -1, -1, -1);
+	}
+	return -1;
+}
+
+/* Adds a load or store of the address v to loop. Returns the stream, -1 if it is not affine or there is no room. */
+static int jit_vector_add_stream(jit_vector_loop *loop, int store, jit_vector_value v)
+{
+	jit_vector_stream *s = &loop->streams[loop->stream_count];
+
+	if (v.kind != VECTOR_AFFINE || v.start < 0 || v.step < 0 || loop->stream_count == JIT_VECTOR_MAX_STREAMS) {
+		return -1;
+	}
+	s->store = store;
+	s->address = v.start;
+	s->step = v.step;
+	return loop->stream_count++;
+}
+
+/* Sets *result to x op y (IR_ADD, IR_SUB or IR_MUL) as computed in an iteration.
+ * Returns 0 if it cannot be done in lanes.
+ */
+static int jit_vector_operation(jit_vector_loop *loop, int op, jit_vector_value x, jit_vector_value y, jit_vector_value *result)
+{
+	int a, b, k;
+
+	if (x.kind == VECTOR_AFFINE && y.kind == VECTOR_AFFINE) {
+		// (xs + k * xd) * (ys + k * yd) is only affine in k if xd or yd is 0
+		if (op != IR_MUL) {
+			*result = jit_vector_affine(jit_vector_combine(loop, op, x.start, y.start), jit_vector_combine(loop, op, x.step, y.step));
+		} else if (jit_vector_is_constant(loop, x.step, 0)) {
+			*result = jit_vector_affine(jit_vector_combine(loop, op, x.start, y.start), jit_vector_combine(loop, op, x.start, y.step));
+		} else if (jit_vector_is_constant(loop, y.step, 0)) {
+			*result = jit_vector_affine(jit_vector_combine(loop, op, x.start, y.start), jit_vector_combine(loop, op, x.step, y.start));
+		} else {
+			return 0;
+		}
+		return result->start >= 0 && result->step >= 0;
+	}
+
+	// sum = sum + x, sum = x + sum or sum = sum - x
+	if (x.kind == VECTOR_CARRIED && op != IR_MUL) {
+		a = jit_vector_lanes(loop, y);
+		result->kind = VECTOR_SUM;
+		result->reg = x.reg;
+		result->op = jit_vector_add_op(loop, op, a, -1, -1, x.reg);
+		return result->op >= 0;
+	}
+	if (y.kind == VECTOR_CARRIED && op == IR_ADD) {
+		return jit_vector_operation(loop, op, y, x, result);
+	}
+
+	// lanes * 2^k is lanes << k
+	if (op == IR_MUL && x.kind == VECTOR_AFFINE && y.kind == VECTOR_LANES) {
+		return jit_vector_operation(loop, op, y, x, result);
+	}
+	result->kind = VECTOR_LANES;
+	if (op == IR_MUL && y.kind == VECTOR_AFFINE && jit_vector_is_constant(loop, y.step, 0) && loop->nodes[y.start].op == IR_MOVE
+	 && loop->nodes[y.start].operand.reg < 0 && loop->nodes[y.start].operand.value > 0
+	 && ((unsigned int) loop->nodes[y.start].operand.value & (loop->nodes[y.start].operand.value - 1)) == 0) {
+		k = __builtin_ctz(loop->nodes[y.start].operand.value);
+		result->op = jit_vector_add_op(loop, IR_SHL, jit_vector_lanes(loop, x), k, -1, -1);
+	} else {
+		a = jit_vector_lanes(loop, x);
+		b = jit_vector_lanes(loop, y);
+		result->op = jit_vector_add_op(loop, op, a, b, -1, -1);
+	}
+	return result->op >= 0;
+}
+
+/* Describes the loop from the bge at instruction header to the jmp back to it in loop, from the IR
+ * of the count instructions from start as built (see VECTORIZATION). With zero_is_zero, $0 is 0.
+ * Returns 0 if it does not have that shape or does not fit into the SIMD registers, 1 otherwise.
+ */
+static int jit_vector_analyze(const jit_ir *ir, unsigned int start, unsigned int count, unsigned int header, int zero_is_zero, jit_vector_loop *loop)
+{
+	const jit_ir *h = &ir[header];
+	jit_vector_value value[32];
+	unsigned int written = 0, i, back;
+	int n, k, xmm = 0, updates = 0;
+
+	if (h->op != IR_BRANCH || h->opcode != BGE) {
+		return 0;
+	}
+	for (back = header + 1; back < count; back++) {
+		int op = ir[back].op;
+
+		if (op != IR_NOP && op != IR_MOVE && op != IR_ADD && op != IR_SUB && op != IR_MUL && op != IR_LOAD && op != IR_STORE) {
+			break;
+		}
+	}
+	// the bge has to leave the loop
+	if (back == count || ir[back].op != IR_JUMP || ir[back].target != start + 4 * header
+	 || (h->target >= start + 4 * header && h->target <= start + 4 * back)) {
+		return 0;
+	}
+
+	memset(loop, 0, sizeof(*loop));
+	loop->header = header;
+	loop->back = back;
+	loop->induction = h->a.reg;
+	loop->bound = h->b;
+	if (loop->bound.reg == 0 && zero_is_zero) {
+		loop->bound = jit_constant_operand(0);
+	}
+
+	for (i = header + 1; i < back; i++) {
+		if (ir[i].dest >= 0) {
+			written |= 1u << ir[i].dest;
+		}
+		if (ir[i].dest == loop->induction) {
+			if (updates++ || ir[i].op != IR_ADD || ir[i].a.reg != loop->induction || ir[i].b.reg >= 0 || ir[i].b.value <= 0) {
+				return 0;
+			}
+			loop->increment = ir[i].b.value;
+		}
+	}
+	if (!updates || (loop->bound.reg >= 0 && (written & (1u << loop->bound.reg)))) {
+		return 0;
+	}
+
+	for (n = 0; n < 32; n++) {
+		if (n == loop->induction) {
+			value[n] = jit_vector_affine(jit_vector_leaf(loop, jit_register_operand(n)), jit_vector_leaf(loop, jit_constant_operand(loop->increment)));
+		} else if (written & (1u << n)) {
+			value[n].kind = VECTOR_CARRIED;
+			value[n].reg = n;
+		} else {
+			value[n] = jit_vector_affine(jit_vector_leaf(loop, n == 0 && zero_is_zero ? jit_constant_operand(0) : jit_register_operand(n)),
+			                             jit_vector_leaf(loop, jit_constant_operand(0)));
+		}
+	}
+
+	for (i = header + 1; i < back; i++) {
+		const jit_ir *x = &ir[i];
+		jit_vector_value a, b, address;
+
+		a = x->a.reg >= 0 ? value[x->a.reg] : jit_vector_affine(jit_vector_leaf(loop, x->a), jit_vector_leaf(loop, jit_constant_operand(0)));
+		b = x->b.reg >= 0 ? value[x->b.reg] : jit_vector_affine(jit_vector_leaf(loop, x->b), jit_vector_leaf(loop, jit_constant_operand(0)));
+
+		switch (x->op) {
+			case IR_NOP:
+				break;
+			case IR_MOVE:
+				// sums are only ever added to
+				if (a.kind == VECTOR_CARRIED || a.kind == VECTOR_SUM) {
+					return 0;
+				}
+				value[x->dest] = a;
+				break;
+			case IR_ADD:
+			case IR_SUB:
+			case IR_MUL:
+				if (!jit_vector_operation(loop, x->op, a, b, &value[x->dest])) {
+					return 0;
+				}
+				break;
+			case IR_LOAD:
+				if (!jit_vector_operation(loop, IR_ADD, a, jit_vector_affine(jit_vector_leaf(loop, jit_constant_operand(x->offset)), jit_vector_leaf(loop, jit_constant_operand(0))), &address)) {
+					return 0;
+				}
+				k = jit_vector_add_stream(loop, 0, address);
+				value[x->dest].kind = VECTOR_LANES;
+				value[x->dest].op = jit_vector_add_op(loop, IR_LOAD, 0, -1, k, -1);
+				if (k < 0 || value[x->dest].op < 0) {
+					return 0;
+				}
+				break;
+			case IR_STORE:
+				if (!jit_vector_operation(loop, IR_ADD, b, jit_vector_affine(jit_vector_leaf(loop, jit_constant_operand(x->offset)), jit_vector_leaf(loop, jit_constant_operand(0))), &address)) {
+					return 0;
+				}
+				// stores write whole SIMD registers, so they have to be contiguous
+				if (address.kind != VECTOR_AFFINE || !jit_vector_is_constant(loop, address.step, 4)) {
+					return 0;
+				}
+				k = jit_vector_add_stream(loop, 1, address);
+				if (k < 0 || (a.kind != VECTOR_LANES && a.kind != VECTOR_AFFINE) || jit_vector_add_op(loop, IR_STORE, jit_vector_lanes(loop, a), -1, k, -1) < 0) {
+					return 0;
+				}
+				break;
+		}
+	}
+
+	// Temporaries are left to the last iteration; the registers read before they are written have to be sums
+	for (n = 0; n < 32; n++) {
+		if (n != loop->induction && (written & (1u << n)) && (value[n].kind == VECTOR_CARRIED || (value[n].kind == VECTOR_SUM && value[n].reg != n))) {
+			return 0;
+		}
+	}
+	for (k = 0; k < loop->op_count; k++) {
+		jit_vector_op *x = &loop->ops[k];
+
+		if (x->sum >= 0 && (value[x->sum].kind != VECTOR_SUM || value[x->sum].op != k)) {
+			return 0;
+		}
+		if (x->op != IR_STORE) {
+			x->xmm = xmm++;
+		}
+	}
+	for (k = 0; k < loop->stream_count; k++) {
+		loop->offsets_xmm[k] = -1;
+		if (!loop->streams[k].store && !jit_vector_is_constant(loop, loop->streams[k].step, 4)) {
+			loop->offsets_xmm[k] = xmm++;
+		}
+	}
+	if (loop->stream_count == 0 || loop->node_count == JIT_VECTOR_MAX_NODES || xmm > JIT_VECTOR_REGISTERS) {
+		return 0;
+	}
+
+	return 1;
+}
+
+// RELOCATIONS
+
+/* The i386 code contains absolute addresses: of the memory of the context,
+ * of its own instructions (the jump table of JR), and the call of jit_exit relative to itself.
+ * jit_translate records where they are, so that the persistent code cache can store the code
+ * without them and fill in the ones of another process (see PERSISTENT CODE CACHE).
+ * The x86-64 code only addresses registers and memory relative to rbx and r15, and itself relative to rip,
+ * but calls jit_exit at its 64-bit address, which is stored as two 32-bit halves.
+ */
+
+enum {
+	// memory + the value stored
+	JIT_RELOCATE_MEMORY,
+	// the start of the translation + the value stored
+	JIT_RELOCATE_CODE,
+	// jit_exit, relative to the end of the field
+	JIT_RELOCATE_EXIT,
+	// the lower and upper half of the address of jit_exit (x86-64)
+	JIT_RELOCATE_EXIT_LOW,
+	JIT_RELOCATE_EXIT_HIGH
+};
+
+typedef struct {
+	// of the 32-bit field from the start of the translation
+	unsigned int offset;
+	unsigned int kind;
+} jit_relocation;
+
+typedef struct {
+	jit_relocation *entries;
+	size_t count, capacity;
+	// set if there was no memory for one of them
+	int failed;
+} jit_relocations;
+
+void jit_relocations_add(jit_relocations *relocations, unsigned int offset, unsigned int kind)
+{
+	if (relocations->count == relocations->capacity) {
+		size_t capacity = relocations->capacity ? relocations->capacity * 2 : 64;
+		jit_relocation *entries = realloc(relocations->entries, capacity * sizeof(jit_relocation));
+
+		if (entries == NULL) {
+			relocations->failed = 1;
+			return;
+		}
+		relocations->entries = entries;
+		relocations->capacity = capacity;
+	}
+	relocations->entries[relocations->count].offset = offset;
+	relocations->entries[relocations->count].kind = kind;
+	relocations->count++;
+}
+
+/* Returns what the field of the relocation in the code at address code refers to,
+ * for the registers and memory of vm
+ */
+static unsigned int jit_relocation_base(const jit_relocation *relocation, unsigned char *code, imps_vm *vm)
+{
+	switch (relocation->kind) {
+		case JIT_RELOCATE_MEMORY:    return (unsigned int) (unsigned long) imps_vm_memory(vm);
+		case JIT_RELOCATE_CODE:      return (unsigned int) (unsigned long) code;
+		case JIT_RELOCATE_EXIT_LOW:  return (unsigned int) (unsigned long long) (unsigned long) jit_exit;
+		case JIT_RELOCATE_EXIT_HIGH: return (unsigned int) ((unsigned long long) (unsigned long) jit_exit >> 32);
+		default:                     return (unsigned int) ((unsigned long) jit_exit - (unsigned long) (code + relocation->offset + 4));
+	}
+}
+
+// FIXUPS
+
+/* jit_translate writes the code in one pass, so the targets of forward jumps
+ * (the translations of later instructions, the epilogue, the jump table, ...)
+ * are not known yet where they are written. Every label in the code is a pointer
+ * that is NULL until the code it stands for is written; a field that refers
+ * to a label still NULL is recorded here and filled in when the translation is done.
+ * All fields are 32 bits, so that the code does not depend on what is filled in.
+ */
+
+// More than the code of any IMPS instruction, including the vector code of a loop (see VECTORIZATION),
+// and than the code at the end of a translation: jit_translate stops when less than this is left
+#define JIT_MAX_INSTRUCTION_SIZE (16 * 1024)
+
+typedef struct {
+	// the 32-bit field in the generated code
+	unsigned char *field;
+	// where the address it refers to is stored once it is known
+	unsigned char **label;
+	// the address itself (i386 only) instead of its distance from the end of the field
+	int absolute;
+} jit_fixup;
+
+typedef struct {
+	jit_fixup *entries;
+	size_t count, capacity;
+	// set if there was no memory for one of them
+	int failed;
+} jit_fixups;
+
+void jit_fixups_add(jit_fixups *fixups, unsigned char *field, unsigned char **label, int absolute)
+{
+	if (fixups->count == fixups->capacity) {
+		size_t capacity = fixups->capacity ? fixups->capacity * 2 : 64;
+		jit_fixup *entries = realloc(fixups->entries, capacity * sizeof(jit_fixup));
+
+		if (entries == NULL) {
+			fixups->failed = 1;
+			return;
+		}
+		fixups->entries = entries;
+		fixups->capacity = capacity;
+	}
+	fixups->entries[fixups->count].field = field;
+	fixups->entries[fixups->count].label = label;
+	fixups->entries[fixups->count].absolute = absolute;
+	fixups->count++;
+}
+
+// Fills in the fields of all fixups, whose labels are all known now
+static void jit_fixups_apply(const jit_fixups *fixups)
+{
+	size_t k;
+
+	for (k = 0; k < fixups->count; k++) {
+		const jit_fixup *fixup = &fixups->entries[k];
+
+		if (fixup->absolute) {
+			W32(fixup->field, 0) = (int) (unsigned long) *fixup->label;
+		} else {
+			W32(fixup->field, 0) = (int) (*fixup->label - (fixup->field + 4));
+		}
+	}
+}
+
+// TODO start/end are bad names
+/* Translates the instructions from start to end, read from program (a copy of memory),
+ * into jit_area, which has room for jit_area_size bytes.
+ * Instructions that cannot be translated (JIT, unknown ones) leave the generated code,
+ * so that the interpreter executes them. HALT exits the emulator.
+ * With in_place, the translation stands for the instructions as the interpreter would run them
+ * (a hot loop): HALT leaves the generated code, too, so that the interpreter halts, and so do stores
+ * onto code pages (see imps_vm_code_map), so that the interpreter runs the changed instructions.
+ * Without it (a JIT region), the translation goes on running as translated, like the JIT always did.
+ * zero tells whether $0 was 0 when the translation was requested.
+ * Translations in place also get a chain entry that exits of other translations can be linked to
+ * (see DIRECT CHAINING), stored in chain_entry (NULL for the others and in i386 code).
+ * The absolute addresses in the code are added to relocations (see RELOCATIONS).
+ * The generated code is called by execute().
+ * Returns the number of bytes written, 0 if the translation does not fit into jit_area
+ * (or there is no memory for its fixups, see FIXUPS).
+ */
+size_t jit_translate(imps_vm *vm, const unsigned char *program, unsigned int start, unsigned int end, unsigned char *jit_area, size_t jit_area_size, int in_place, int zero, unsigned char **chain_entry, jit_relocations *relocations) {
+	// The generated code works directly on the registers and memory of the context, relative to the registers
+	// passed by execute() (and the memory, too, in x86-64 code; the i386 code has it at its absolute address)
+#if !JIT_X86_64
+	unsigned char *memory = imps_vm_memory(vm);
+#endif
+	// The code pages stores in place are checked against (see imps_vm_code_map), in the context as well
+	const imps_code_map *code_map = imps_vm_code_map(vm);
+	int code_map_offset = (unsigned char *) code_map - (unsigned char *) imps_vm_registers(vm);
+	// Hot loops are only translated from the program, so no code page comes after the one of its last byte
+	unsigned int last_code_page = (imps_vm_program_size(vm) - 1) / IMPS_CODE_PAGE_SIZE;
+
+	unsigned int start_instruction = W32(program, start);
+	LOG_DEBUG("first instruction to be JITed is at %d: ", start);
+	DEBUG(print_instruction_binary(start_instruction));
+	LOG_DEBUG("\n");
+	unsigned int end_instruction = W32(program, end);
+	LOG_DEBUG("last instruction to be JITed is at %d: ", end);
+	DEBUG(print_instruction_binary(end_instruction));
+	LOG_DEBUG("\n");
+
+	// jit instruction pointer, used to assemble the instructions part by part
+	unsigned char *jip;
+
+	unsigned int instruction_count = ((end - start) / 4) + 1;
+
+	// IMPS instruction byte address to JIT address mapping, NULL for the ones not translated yet (see FIXUPS)
+	unsigned char * mapping[instruction_count];
+	// The mapping as the translated code looks it up at JRs (see jit_write_dispatch), written at the end
+	unsigned char *jump_table = NULL;
+	// The jumps to code that comes after them
+	jit_fixups fixups = { NULL, 0, 0, 0 };
+	int has_jr = 0;
+
+	*chain_entry = NULL;
+
+	// The IR of the instructions as built and as optimized, which is what is translated (see INTERMEDIATE REPRESENTATION)
+	jit_ir built[instruction_count];
+	jit_ir ir[instruction_count];
+	// Whether the translation takes $0 to be 0
+	int zero_is_zero;
+	{
+		unsigned int i;
+
+		jit_ir_build(program, start, instruction_count, built);
+
+		/* $0 is an ordinary register in IMPS, but programs hardly ever write it.
+		 * So hot loops that do not write it are translated for $0 = 0 if it is now,
+		 * and leave to the interpreter when entered with another value (see below).
+		 */
+		zero_is_zero = in_place && zero;
+		for (i = 0; i < instruction_count; i++) {
+			if (built[i].dest == 0) {
+				zero_is_zero = 0;
+			}
+		}
+
+		memcpy(ir, built, sizeof(ir));
+		jit_ir_optimize(ir, start, instruction_count, zero_is_zero);
+
+		if (dump_ir) {
+			fprintf(stderr, "IR of %u to %u%s\n", start, end, zero_is_zero ? " ($0 = 0)" : "");
+			jit_ir_dump(stderr, program, start, instruction_count, built, ir);
+		}
+	}
+
+	// The counted loops that also run in SIMD registers (see VECTORIZATION), at their header and jmp back
+	jit_vector_loop vector_loops[JIT_VECTOR_MAX_LOOPS];
+	jit_vector_loop *vector_loop[instruction_count];
+	{
+		unsigned int i, loop_count = 0;
+
+		memset(vector_loop, 0, sizeof(vector_loop));
+		for (i = 0; i < instruction_count && simd != JIT_SIMD_NONE && loop_count < JIT_VECTOR_MAX_LOOPS; i++) {
+			jit_vector_loop *loop = &vector_loops[loop_count];
+
+			if (!jit_vector_analyze(built, start, instruction_count, i, zero_is_zero, loop)) {
+				continue;
+			}
+			vector_loop[loop->header] = vector_loop[loop->back] = loop;
+			// not written yet (see FIXUPS)
+			loop->done = loop->scalar = NULL;
+			loop_count++;
+
+			if (dump_ir) {
+				fprintf(stderr, "vectorized loop %u to %u: %d lanes (%s), %d loads and stores, %d SIMD operations\n",
+					start + 4 * loop->header, start + 4 * loop->back, simd == JIT_SIMD_AVX2 ? 8 : 4,
+					simd == JIT_SIMD_AVX2 ? "AVX2" : "SSE2", loop->stream_count, loop->op_count);
+			}
+		}
+	}
+
+#if JIT_X86_64
+	/* REGISTER ALLOCATION
+	 * The IMPS registers the translation uses most live in host registers while it runs:
+	 * the prologue loads them, and the epilogue, which every exit goes through,
+	 * stores back the ones the translation writes.
+	 * So inner loops work on host registers only, apart from loads and stores.
+	 */
+	static const int allocatable_registers[] = { ESI, EDI, R8, R9, R10, R11, R13, R14, EBP };
+	// Host register of each IMPS register, -1 for the ones that stay in memory
+	int host_register[32];
+	// Bit n set if the translation writes IMPS register n
+	unsigned int written = 0;
+	// Where every exit jumps to, written at the end
+	unsigned char *epilogue = NULL;
+	// The part of the epilogue after storing the registers back, and the part of the prologue loading them
+	unsigned char *epilogue_return = NULL;
+	unsigned char *load_registers = NULL;
+	{
+		unsigned int uses[32] = {0};
+		unsigned int i, k;
+		int n, best;
+
+		// Counted on the optimized IR, so constants and dropped instructions use no registers
+		for (i = 0; i < instruction_count; i++) {
+			jit_ir *x = &ir[i];
+
+			if (x->op == IR_NOP) {
+				continue;
+			}
+			if (x->dest >= 0) {
+				uses[x->dest]++;
+				written |= 1u << x->dest;
+			}
+			if (x->a.reg >= 0) {
+				uses[x->a.reg]++;
+			}
+			if (x->b.reg >= 0) {
+				uses[x->b.reg]++;
+			}
+			if (x->index >= 0) {
+				uses[x->index]++;
+			}
+			if (x->restore >= 0) {
+				uses[x->restore] += x->restore_always;
+				written |= 1u << x->restore;
+			}
+		}
+
+		for (n = 0; n < 32; n++) {
+			host_register[n] = -1;
+		}
+		// The most used ones first
+		for (k = 0; k < sizeof(allocatable_registers) / sizeof(allocatable_registers[0]); k++) {
+			best = -1;
+			for (n = 0; n < 32; n++) {
+				if (host_register[n] < 0 && uses[n] > 0 && (best < 0 || uses[n] > uses[best])) {
+					best = n;
+				}
+			}
+			if (best < 0) {
+				break;
+			}
+			host_register[best] = allocatable_registers[k];
+			LOG_DEBUG("IMPS register %d (used %d times) is host register %d\n", best, uses[best], allocatable_registers[k]);
+		}
+	}
+#else
+	// i386 has no host register to spare (see the i386 BACKEND), so all IMPS registers stay in memory
+	int host_register[32];
+
+	memset(host_register, -1, sizeof(host_register));
+#endif
+
+
+	/* One pass: every instruction is translated right where the one before it ends,
+	 * and jumps to code that is not written yet are filled in at the end (see FIXUPS).
+	 * jip never gets closer than JIT_MAX_INSTRUCTION_SIZE to the end of jit_area
+	 * before an instruction, so the translation stops as soon as it does not fit.
+	 */
+	{
+		// Print out what instruction is generated at what offset (byte) from jit_area.
+		// This is to be prepended to every translation into an Intel instruction so that it can be debugged with gdb's x/i jit_area+(offset).
+		// THIS DESCRIBES WHAT HAPPENS.
+		// TODO do this for all instructions
+		#define JIT_ASM(mnemonic, instruction_type) LOG_DEBUG("  +%d %s\n", (int) (jip - jit_area), (mnemonic" | "instruction_type));
+
+		// Records that the 32-bit field at jip holds an absolute address (see RELOCATIONS)
+		#define RELOCATE(kind) jit_relocations_add(relocations, jip - jit_area, kind);
+
+		// Whether the code of one more instruction (or the prologue, or the code at the end), plus extra bytes, surely fits into jit_area
+		int jit_fits(unsigned char * jip, size_t extra)
+		{
+			return (size_t) (jit_area + jit_area_size - jip) >= JIT_MAX_INSTRUCTION_SIZE + extra;
+		}
+
+		/* Writes the 32-bit field at jip referring to the code at *label: its distance from
+		 * the end of the field (rel32), or with absolute its address (only in i386 code).
+		 * If the label is not known yet, the field is filled in at the end (see FIXUPS).
+		 */
+		unsigned char * jit_write_label(unsigned char * jip, unsigned char ** label, int absolute)
+		{
+			if (*label == NULL) {
+				jit_fixups_add(&fixups, jip, label, absolute);
+				W32(jip, 0) = 0;
+			} else if (absolute) {
+				W32(jip, 0) = (int) (unsigned long) *label;
+			} else {
+				W32(jip, 0) = (int) (*label - (jip + 4));
+			}
+
+			return jip + 4;
+		}
+
+		/* X86 ENCODER (see above)
+		 * size is the operand size in bytes: 4, 8 (x86-64 only) or 1, with al, cl, dl and bl
+		 * as the only 8-bit registers. Host registers are numbered as above, -1 for none.
+		 * The writers are inline: they are mostly called with a constant operation and size,
+		 * so most of the choosing is folded away and translating is as fast as with hand-written bytes.
+		 */
+
+		// Writes the REX prefix that size and the host registers in the ModR/M spare (reg), the SIB index
+		// and the ModR/M r/m or SIB base (rm) need, if any (x86-64 only), and the opcode (two bytes for 0F xx)
+		inline unsigned char * jit_x86_opcode(unsigned char * jip, int size, int reg, int index, int rm, unsigned int opcode)
+		{
+#if JIT_X86_64
+			int rex = 0x40 | (size == 8 ? REX_W : 0) | (reg >= 8 ? REX_R : 0) | (index >= 8 ? REX_X : 0) | (rm >= 8 ? REX_B : 0);
+
+			if (rex != 0x40) {
+				*jip = rex;
+				jip++;
+			}
+#endif
+			if (opcode > 0xff) {
+				*jip = opcode >> 8;
+				jip++;
+			}
+			*jip = opcode & 0xff;
+			jip++;
+			return jip;
+		}
+
+		// Writes the ModR/M byte with spare (a host register or /n) and the memory operand m, and its SIB byte and displacement
+		inline unsigned char * jit_x86_modrm(unsigned char * jip, int spare, jit_x86_memory m)
+		{
+			// [esp] and [r12] need a SIB byte, and so does no base in x86-64, where mod 0 with r/m 5 is [rip + disp32]
+			int sib = m.index >= 0 || (m.base >= 0 ? (m.base & 7) == ESP : JIT_X86_64);
+			int mod;
+
+			if (m.base < 0) {
+				// r/m 5 or SIB base 5: disp32 only
+				mod = 0;
+			} else if (m.relocation < 0 && m.displacement == 0 && (m.base & 7) != EBP) {
+				// not for [ebp] and [r13], as mod 0 with them stands for no base
+				mod = 0;
+			} else if (m.relocation < 0 && m.displacement >= -128 && m.displacement <= 127) {
+				mod = 1;
+			} else {
+				mod = 2;
+			}
+
+			*jip = MODRM(mod, spare & 7, sib ? 4 : m.base < 0 ? 5 : m.base & 7);
+			jip++;
+			if (sib) {
+				*jip = SIB(m.scale, m.index < 0 ? 4 : m.index & 7, m.base < 0 ? 5 : m.base & 7);
+				jip++;
+			}
+			if (mod == 1) {
+				*jip = m.displacement;
+				jip++;
+			} else if (mod == 2 || m.base < 0) {
+				if (m.relocation >= 0) {
+					RELOCATE ( m.relocation )
+				}
+				W32(jip, 0) = m.displacement;
+				jip += 4;
+			}
+			return jip;
+		}
+
+		// Writes the immediate of an instruction: 8 bits for short forms (and 8-bit operations), else 32 bits
+		inline unsigned char * jit_x86_immediate(unsigned char * jip, int short_form, int imm)
+		{
+			if (short_form) {
+				*jip = imm;
+				jip++;
+			} else {
+				W32(jip, 0) = imm;
+				jip += 4;
+			}
+			return jip;
+		}
+
+		// Writes dst = dst op src of host registers (op r/m, reg if the operation has that form, else op reg, r/m)
+		inline unsigned char * jit_x86_rr(unsigned char * jip, int op, int size, int dst, int src)
+		{
+			const jit_x86_op *o = &jit_x86_ops[op];
+
+			LOG_DEBUG("  +%d %s | reg%d,reg%d\n", (int) (jip - jit_area), o->mnemonic, 8 * size, 8 * size);
+			if (o->rm_reg) {
+				jip = jit_x86_opcode (jip, size, src, -1, dst, o->rm_reg - (size == 1));
+				*jip = MODRM(3, src & 7, dst & 7);
+			} else {
+				jip = jit_x86_opcode (jip, size, dst, -1, src, o->reg_rm);
+				*jip = MODRM(3, dst & 7, src & 7);
+			}
+			jip++;
+			return jip;
+		}
+
+		// Writes reg = reg op [m] (op reg, r/m), or for X86_LEA reg = the address
+		inline unsigned char * jit_x86_rm(unsigned char * jip, int op, int size, int reg, jit_x86_memory m)
+		{
+			const jit_x86_op *o = &jit_x86_ops[op];
+
+			LOG_DEBUG("  +%d %s | reg%d,mem\n", (int) (jip - jit_area), o->mnemonic, 8 * size);
+			jip = jit_x86_opcode (jip, size, reg, m.index, m.base, o->reg_rm);
+			return jit_x86_modrm (jip, reg, m);
+		}
+
+		// Writes [m] = [m] op reg (op r/m, reg)
+		inline unsigned char * jit_x86_mr(unsigned char * jip, int op, int size, jit_x86_memory m, int reg)
+		{
+			const jit_x86_op *o = &jit_x86_ops[op];
+
+			LOG_DEBUG("  +%d %s | mem,reg%d\n", (int) (jip - jit_area), o->mnemonic, 8 * size);
+			jip = jit_x86_opcode (jip, size, reg, m.index, m.base, o->rm_reg - (size == 1));
+			return jit_x86_modrm (jip, reg, m);
+		}
+
+		// Writes op reg, for the operations without other operand (and shifts by 1)
+		inline unsigned char * jit_x86_r(unsigned char * jip, int op, int size, int reg)
+		{
+			const jit_x86_op *o = &jit_x86_ops[op];
+
+			LOG_DEBUG("  +%d %s | r/m%d\n", (int) (jip - jit_area), o->mnemonic, 8 * size);
+			jip = jit_x86_opcode (jip, size, -1, -1, reg, o->rm);
+			*jip = MODRM(3, o->digit, reg & 7);
+			jip++;
+			return jip;
+		}
+
+		// Writes reg = reg op imm (op r/m, imm)
+		inline unsigned char * jit_x86_ri(unsigned char * jip, int op, int size, int reg, int imm)
+		{
+			const jit_x86_op *o = &jit_x86_ops[op];
+			int imm8 = imm >= -128 && imm <= 127;
+			// imul reg, r/m, imm has the destination in the spare
+			int spare = op == X86_IMUL ? reg : o->digit;
+
+			if (op == X86_MOV && size == 4) {
+				LOG_DEBUG("  +%d mov | reg32,imm32\n", (int) (jip - jit_area));
+				jip = jit_x86_opcode (jip, size, -1, -1, reg, 0xb8 + (reg & 7));
+				return jit_x86_immediate (jip, 0, imm);
+			}
+			if (o->rm && imm == 1) {
+				return jit_x86_r (jip, op, size, reg);
+			}
+			if (size != 1 && imm8 && o->rm_imm8) {
+				LOG_DEBUG("  +%d %s | r/m%d,imm8\n", (int) (jip - jit_area), o->mnemonic, 8 * size);
+				jip = jit_x86_opcode (jip, size, spare, -1, reg, o->rm_imm8);
+			} else if (reg == EAX && (o->rm_imm32 == 0x81 || op == X86_TEST)) {
+				// without ModR/M byte: 04+8n ib / 05+8n id (ALU) and A8 ib / A9 id (TEST)
+				LOG_DEBUG("  +%d %s | EAX,imm%d\n", (int) (jip - jit_area), o->mnemonic, size == 1 ? 8 : 32);
+				jip = jit_x86_opcode (jip, size, -1, -1, -1, (op == X86_TEST ? 0xa9 : 8 * o->digit + 5) - (size == 1));
+				return jit_x86_immediate (jip, size == 1, imm);
+			} else {
+				LOG_DEBUG("  +%d %s | r/m%d,imm%d\n", (int) (jip - jit_area), o->mnemonic, 8 * size, size == 1 ? 8 : 32);
+				jip = jit_x86_opcode (jip, size, spare, -1, reg, o->rm_imm32 - (size == 1));
+				imm8 = size == 1;
+			}
+			*jip = MODRM(3, spare & 7, reg & 7);
+			jip++;
+			return jit_x86_immediate (jip, imm8, imm);
+		}
+
+		// Writes [m] = [m] op imm (op r/m, imm)
+		inline unsigned char * jit_x86_mi(unsigned char * jip, int op, int size, jit_x86_memory m, int imm)
+		{
+			const jit_x86_op *o = &jit_x86_ops[op];
+			int imm8 = size == 1 || (imm >= -128 && imm <= 127 && o->rm_imm8);
+
+			LOG_DEBUG("  +%d %s | mem,imm%d\n", (int) (jip - jit_area), o->mnemonic, imm8 ? 8 : 32);
+			jip = jit_x86_opcode (jip, size, -1, m.index, m.base, size == 1 ? o->rm_imm32 - 1 : imm8 ? o->rm_imm8 : o->rm_imm32);
+			jip = jit_x86_modrm (jip, o->digit, m);
+			return jit_x86_immediate (jip, imm8, imm);
+		}
+
+		// Writes push reg (in x86-64, push reg64)
+		unsigned char * jit_x86_push(unsigned char * jip, int reg)
+		{
+			LOG_DEBUG("  +%d push | reg\n", (int) (jip - jit_area));
+			return jit_x86_opcode (jip, 4, -1, -1, reg, 0x50 + (reg & 7));
+		}
+
+		// Writes pop reg (in x86-64, pop reg64)
+		unsigned char * jit_x86_pop(unsigned char * jip, int reg)
+		{
+			LOG_DEBUG("  +%d pop | reg\n", (int) (jip - jit_area));
+			return jit_x86_opcode (jip, 4, -1, -1, reg, 0x58 + (reg & 7));
+		}
+
+		/* Writes a jump to the code at *label, taken if the flags meet the condition code unless that is -1:
+		 * short (rel8) if the label is written already and close enough, else near (rel32, see jit_write_label).
+		 */
+		unsigned char * jit_x86_jump(unsigned char * jip, int condition_code, unsigned char ** label)
+		{
+			if (*label != NULL && *label - (jip + 2) >= -128 && *label - (jip + 2) <= 127) {
+				LOG_DEBUG("  +%d %s | rel8\n", (int) (jip - jit_area), condition_code < 0 ? "jmp" : "jcc");
+				*jip = condition_code < 0 ? 0xeb : 0x70 + condition_code;
+				jip++;
+				*jip = *label - (jip + 1);
+				jip++;
+				return jip;
+			}
+
+			LOG_DEBUG("  +%d %s | rel32\n", (int) (jip - jit_area), condition_code < 0 ? "jmp" : "jcc");
+			if (condition_code < 0) {
+				*jip = 0xe9;
+				jip++;
+			} else {
+				*jip = 0x0f;
+				jip++;
+				*jip = 0x80 + condition_code;
+				jip++;
+			}
+			return jit_write_label (jip, label, 0);
+		}
+
+		/* Writes a short jump (rel8) over the code written after it, taken if the flags meet the condition code
+		 * unless that is -1. Its displacement, at *displacement, is filled in once that code is written:
+		 *   **displacement = jip - (*displacement + 1)
+		 * which is less than 128 bytes for all code jumped over.
+		 */
+		unsigned char * jit_x86_short_jump(unsigned char * jip, int condition_code, unsigned char ** displacement)
+		{
+			LOG_DEBUG("  +%d %s | rel8\n", (int) (jip - jit_area), condition_code < 0 ? "jmp" : "jcc");
+			*jip = condition_code < 0 ? 0xeb : 0x70 + condition_code;
+			jip++;
+			*displacement = jip;
+			jip++;
+
+			return jip;
+		}
+
+		// IMPS register n in memory
+		jit_x86_memory jit_guest_register(unsigned int n)
+		{
+			return jit_x86_at (STATE, 4 * n);
+		}
+
+		// Writes reg = reg op IMPS register n, wherever it is
+		unsigned char * jit_write_guest_register_operation(unsigned char * jip, int op, int reg, unsigned int n)
+		{
+			if (host_register[n] >= 0) {
+				return jit_x86_rr (jip, op, 4, reg, host_register[n]);
+			}
+			return jit_x86_rm (jip, op, 4, reg, jit_guest_register(n));
+		}
+
+		// Writes mov reg, IMPS register n
+		unsigned char * jit_write_load_register(unsigned char * jip, int reg, unsigned int n)
+		{
+			return jit_write_guest_register_operation (jip, X86_MOV, reg, n);
+		}
+
+		// Writes mov IMPS register n, eax
+		unsigned char * jit_write_store_register(unsigned char * jip, unsigned int n)
+		{
+			if (host_register[n] >= 0) {
+				return jit_x86_rr (jip, X86_MOV, 4, host_register[n], EAX);
+			}
+			return jit_x86_mr (jip, X86_MOV, 4, jit_guest_register(n), EAX);
+		}
+
+		// Writes mov IMPS register n, value
+		unsigned char * jit_write_set_register(unsigned char * jip, unsigned int n, int value)
+		{
+			if (host_register[n] >= 0) {
+				// the flags are not used across IMPS instructions, so 0 is xor host, host
+				if (value == 0) {
+					return jit_x86_rr (jip, X86_XOR, 4, host_register[n], host_register[n]);
+				}
+				return jit_x86_ri (jip, X86_MOV, 4, host_register[n], value);
+			}
+			return jit_x86_mi (jip, X86_MOV, 4, jit_guest_register(n), value);
+		}
+
+		// Writes lea reg, [base + IMPS register index * 2^scale + displacement], base being an IMPS register or none (a constant)
+		unsigned char * jit_write_lea(unsigned char * jip, int reg, jit_operand base, int index, int scale, int displacement)
+		{
+			int index_host = host_register[index];
+			int base_host = base.reg >= 0 ? host_register[base.reg] : -1;
+
+			if (index_host < 0) {
+				jip = jit_write_load_register (jip, EDX, index);
+				index_host = EDX;
+			}
+			if (base.reg >= 0 && base_host < 0) {
+				jip = jit_write_load_register (jip, reg, base.reg);
+				base_host = reg;
+			}
+
+			return jit_x86_rm (jip, X86_LEA, 4, reg, jit_x86_indexed(base_host, index_host, scale, displacement));
+		}
+
+		// Writes eax = eax op IMPS register n, for op = ADD, SUB or MUL
+		unsigned char * jit_write_operation(unsigned char * jip, unsigned int op, unsigned int n)
+		{
+			return jit_write_guest_register_operation (jip, op == ADD ? X86_ADD : op == SUB ? X86_SUB : X86_IMUL, EAX, n);
+		}
+
+		// Writes the comparison of IMPS registers a and b for a conditional jump
+		unsigned char * jit_write_compare(unsigned char * jip, unsigned int a, unsigned int b)
+		{
+			if (host_register[a] >= 0) {
+				return jit_write_guest_register_operation (jip, X86_CMP, host_register[a], b);
+			}
+			if (host_register[b] >= 0) {
+				return jit_x86_mr (jip, X86_CMP, 4, jit_guest_register(a), host_register[b]);
+			}
+
+			jip = jit_write_load_register (jip, EAX, a);
+			return jit_write_guest_register_operation (jip, X86_CMP, EAX, b);
+		}
+
+		// Writes cmp byte [code pages + reg], 0 for the page in host register reg, or the constant page if reg < 0
+		unsigned char * jit_write_code_page_compare(unsigned char * jip, int reg, unsigned int page)
+		{
+			// the code pages are in the context, at a fixed offset from the registers (see imps_vm_code_map)
+			return jit_x86_mi (jip, X86_CMP, 1, jit_x86_indexed(STATE, reg, 0, code_map_offset + (reg >= 0 ? 0 : page)), 0);
+		}
+
+#if JIT_X86_64
+		/* x86-64 BACKEND
+		 * The generated code is called as (System V calling convention: edi, rsi, rdx)
+		 *   unsigned int code(unsigned int pc_to_return_to, int *registers, unsigned char *memory)
+		 * and keeps its arguments in callee-saved registers:
+		 *   r12d: pc_to_return_to, the PC the interpreter shall continue at
+		 *   rbx:  registers, so that IMPS register n is [rbx + 4*n] unless it is allocated
+		 *         to a host register (see REGISTER ALLOCATION)
+		 *   r15:  memory, so that the word at IMPS address eax is [r15 + rax]
+		 * eax, ecx and edx are scratch registers.
+		 * Every exit jumps to the epilogue at the end of the translation, which stores
+		 * the allocated registers back.
+		 */
+
+		// The registers the generated code uses and has to preserve for its caller
+		static const int saved_registers[] = { EBX, EBP, R12, R13, R14, R15 };
+
+		unsigned char * jit_write_prologue (unsigned char * jip)
+		{
+			unsigned int k, n;
+
+			for (k = 0; k < sizeof(saved_registers) / sizeof(saved_registers[0]); k++) {
+				jip = jit_x86_push (jip, saved_registers[k]);
+			}
+
+			// mov rbx, rsi; mov r15, rdx; mov r12d, edi
+			jip = jit_x86_rr (jip, X86_MOV, 8, STATE, ESI);
+			jip = jit_x86_rr (jip, X86_MOV, 8, R15, EDX);
+			jip = jit_x86_rr (jip, X86_MOV, 4, R12, EDI);
+
+			load_registers = jip;
+
+			for (n = 0; n < 32; n++) {
+				if (host_register[n] >= 0) {
+					// mov host, [rbx + 4*n]
+					jip = jit_x86_rm (jip, X86_MOV, 4, host_register[n], jit_guest_register(n));
+				}
+			}
+
+			return jip;
+		}
+
+		// Writes mov [rbx + 4*n], host for the allocated registers that may have changed
+		unsigned char * jit_write_store_registers (unsigned char * jip)
+		{
+			unsigned int n;
+
+			for (n = 0; n < 32; n++) {
+				if (host_register[n] >= 0 && (written & (1u << n))) {
+					jip = jit_x86_mr (jip, X86_MOV, 4, jit_guest_register(n), host_register[n]);
+				}
+			}
+
+			return jip;
+		}
+
+		// Writes the code every exit from the translation ends in: it stores the allocated
+		// registers that may have changed, and returns the PC in r12d to the interpreter
+		// (and in rdx the exit it left through, which only jit_write_exit_to() sets)
+		unsigned char * jit_write_epilogue (unsigned char * jip)
+		{
+			int k;
+
+			epilogue = jip;
+
+			// xor edx, edx
+			jip = jit_x86_rr (jip, X86_XOR, 4, EDX, EDX);
+
+			jip = jit_write_store_registers (jip);
+
+			epilogue_return = jip;
+
+			// mov eax, r12d
+			jip = jit_x86_rr (jip, X86_MOV, 4, EAX, R12);
+
+			for (k = sizeof(saved_registers) / sizeof(saved_registers[0]) - 1; k >= 0; k--) {
+				jip = jit_x86_pop (jip, saved_registers[k]);
+			}
+
+			JIT_ASM ( "ret", "RET" )  // c3
+			*jip = 0xc3;
+			jip++;
+
+			return jip;
+		}
+
+		// Writes code that returns the control from the JIT back to the interpreter.
+		// It shall return (set eax to) the interpreter PC to continue execution at, which is kept in r12d.
+		unsigned char * jit_write_leave (unsigned char * jip)
+		{
+			LOG_DEBUG("    writing a return-from-JIT instruction\n");
+
+			// jmp epilogue, which is written at the end (see FIXUPS)
+			return jit_x86_jump (jip, -1, &epilogue);
+		}
+
+		// Called from inside JIT code, changes the PC that jit_write_leave() returns.
+		unsigned char * jit_write_change_return_pc(unsigned char * jip, unsigned int new_return_pc)
+		{
+			LOG_DEBUG("    writing an instruction that would set the JIT return PC to %d\n", new_return_pc);
+
+			// mov r12d, new_return_pc
+			return jit_x86_ri (jip, X86_MOV, 4, R12, new_return_pc);
+		}
+
+		/* Writes code that leaves the JIT to continue at next_pc, known at translation time.
+		 * It stores the allocated registers itself and ends in a jump to the rest of the epilogue,
+		 * which returns its address in rdx, so that jit_link_exit() can redirect it
+		 * to the chain entry of the translation starting at next_pc.
+		 */
+		unsigned char * jit_write_exit_to(unsigned char * jip, unsigned int next_pc)
+		{
+			jip = jit_write_store_registers (jip);
+
+			jip = jit_write_change_return_pc (jip, next_pc);
+
+			JIT_ASM (
+				"lea rdx, [rip]",
+				"LEA reg64,mem"
+			)  // REX.W 8D /r
+			jip = jit_x86_opcode (jip, 8, EDX, -1, -1, 0x8d);
+			*jip = MODRM(0, EDX, 5);
+			jip++;
+			W32(jip, 0) = 0;
+			jip += 4;
+
+			// always rel32, as that is what jit_patch_jump() changes
+			JIT_ASM (
+				"jmp epilogue_return",
+				"JMP imm"
+			)  // E9 rw/rd
+			*jip = 0xe9;
+			jip++;
+			return jit_write_label (jip, &epilogue_return, 0);
+		}
+
+		/* Writes where linked exits of other translations jump to: as these stored their registers
+		 * and do not return to the interpreter before, it only sets the PC the translation returns
+		 * when falling through its end, which is what the interpreter passes for hot loops,
+		 * and continues with loading the registers in the prologue.
+		 */
+		unsigned char * jit_write_chain_entry(unsigned char * jip)
+		{
+			*chain_entry = jip;
+
+			jip = jit_write_change_return_pc (jip, end + 4);
+
+			// jmp load_registers
+			return jit_x86_jump (jip, -1, &load_registers);
+		}
+
+		/* Writes code that continues at the IMPS address in eax (the target of a JR):
+		 * if it is one of the translated instructions, at its translation, looked up
+		 * in the jump table, and otherwise in the interpreter.
+		 * The table holds the offset of every translated instruction from the table itself,
+		 * so the code does not depend on where it is loaded.
+		 */
+		unsigned char * jit_write_dispatch(unsigned char * jip)
+		{
+			unsigned char * outside;
+			unsigned char * unaligned;
+
+			// lea ecx, [rax - start]
+			jip = jit_x86_rm (jip, X86_LEA, 4, SCRATCH, jit_x86_at(EAX, -start));
+
+			// unsigned, so that targets before start are above, too
+			jip = jit_x86_ri (jip, X86_CMP, 4, SCRATCH, end - start);
+			// outside: jump over the lookup below to the exit
+			jip = jit_x86_short_jump (jip, 7, &outside);  // A
+
+			// not an instruction address (the interpreter reports it)
+			jip = jit_x86_ri (jip, X86_TEST, 1, SCRATCH, 3);
+			jip = jit_x86_short_jump (jip, 5, &unaligned);  // NZ
+
+			// ecx is now 4 * the instruction number, which is the offset of its entry in the table
+			JIT_ASM (
+				"lea rdx, [rip + jump_table]",
+				"LEA reg64,mem"
+			)  // REX.W 8D /r
+			jip = jit_x86_opcode (jip, 8, EDX, -1, -1, 0x8d);
+			*jip = MODRM(0, EDX, 5);
+			jip++;
+			jip = jit_write_label (jip, &jump_table, 0);
+
+			// movsxd rcx, [rdx + rcx]; add rcx, rdx; jmp rcx
+			jip = jit_x86_rm (jip, X86_MOVSXD, 8, SCRATCH, jit_x86_indexed(EDX, SCRATCH, 0, 0));
+			jip = jit_x86_rr (jip, X86_ADD, 8, SCRATCH, EDX);
+			jip = jit_x86_r (jip, X86_JMP, 4, SCRATCH);
+
+			*outside = jip - (outside + 1);
+			*unaligned = jip - (unaligned + 1);
+
+			// the interpreter continues at the target: mov r12d, eax
+			jip = jit_x86_rr (jip, X86_MOV, 4, R12, EAX);
+
+			return jit_write_leave (jip);
+		}
+
+		// Writes the table of jit_write_dispatch: for every translated instruction, the offset of its translation from the table
+		unsigned char * jit_write_jump_table(unsigned char * jip)
+		{
+			unsigned int i;
+
+			jump_table = jip;
+
+			for (i = 0; i < instruction_count; i++) {
+				W32(jip, 0) = (int) (mapping[i] - jump_table);
+				jip += 4;
+			}
+
+			return jip;
+		}
+
+		// Writes mov eax, [memory + eax]; the address in eax has been checked
+		unsigned char * jit_write_load_memory(unsigned char * jip)
+		{
+			// mov eax, [r15 + rax]
+			return jit_x86_rm (jip, X86_MOV, 4, EAX, jit_x86_indexed(R15, EAX, 0, 0));
+		}
+
+		// Writes mov [memory + reg], eax; the address in reg has been checked
+		unsigned char * jit_write_store_memory(unsigned char * jip, int reg)
+		{
+			// mov [r15 + reg], eax
+			return jit_x86_mr (jip, X86_MOV, 4, jit_x86_indexed(R15, reg, 0, 0), EAX);
+		}
+
+		// Writes code that exits the emulator like the interpreter does at HALT in JIT code
+		unsigned char * jit_write_exit(unsigned char * jip)
+		{
+			// jit_exit needs the stack aligned to 16 bytes at the call,
+			// which the pushes of the prologue do not keep: and rsp, -16
+			jip = jit_x86_ri (jip, X86_AND, 8, ESP, -16);
+
+			// jit_exit is too far away from the generated code for a 32-bit relative jump
+			JIT_ASM (
+				"mov rax, jit_exit",
+				"MOV reg64,imm64"
+			)  // REX.W B8+r io
+			*jip = REX_W;
+			jip++;
+			*jip = 0xb8 + EAX;
+			jip++;
+			// its address differs from process to process, so the persistent code cache relocates it (see RELOCATIONS)
+			W32(jip, 0) = (unsigned int) (unsigned long) jit_exit;
+			RELOCATE ( JIT_RELOCATE_EXIT_LOW )
+			jip += 4;
+			W32(jip, 0) = (unsigned int) ((unsigned long) jit_exit >> 32);
+			RELOCATE ( JIT_RELOCATE_EXIT_HIGH )
+			jip += 4;
+
+			// call rax
+			return jit_x86_r (jip, X86_CALL, 4, EAX);
+		}
+
+		/* Writes the SSE instruction [prefix] 0F [38 | 3A] opcode (map 1, 2 or 3) with the SIMD or general register reg
+		 * and rm: a register, or for rm < 0 the memory at [rax], or at [rax + the lanes of SIMD register index] for gathers.
+		 * With AVX2, it writes the VEX encoded instruction instead, on 256 bits with wide (else on the lower 128 bits)
+		 * and with the register vvvv as the first source (0 if the instruction has none),
+		 * which is also the destination as it is in SSE.
+		 */
+		unsigned char * jit_write_simd(unsigned char * jip, int wide, unsigned int prefix, int map, unsigned int opcode, int reg, int vvvv, int rm, int index)
+		{
+			if (simd == JIT_SIMD_AVX2) {
+				// 3-byte VEX prefix: C4 | ~R ~X ~B mmmmm | W ~vvvv L pp, pp being the prefix
+				*jip = 0xc4;
+				jip++;
+				*jip = (reg >= 8 ? 0 : 0x80) | (index >= 8 ? 0 : 0x40) | (rm >= 8 ? 0 : 0x20) | map;
+				jip++;
+				*jip = ((~vvvv & 15) << 3) | (wide ? 4 : 0) | (prefix == 0x66 ? 1 : prefix == 0xf3 ? 2 : prefix == 0xf2 ? 3 : 0);
+				jip++;
+			} else {
+				int rex = 0x40 | (reg >= 8 ? REX_R : 0) | (index >= 8 ? REX_X : 0) | (rm >= 8 ? REX_B : 0);
+
+				if (prefix) {
+					*jip = prefix;
+					jip++;
+				}
+				if (rex != 0x40) {
+					*jip = rex;
+					jip++;
+				}
+				*jip = 0x0f;
+				jip++;
+				if (map > 1) {
+					*jip = map == 2 ? 0x38 : 0x3a;
+					jip++;
+				}
+			}
+			*jip = opcode;
+			jip++;
+
+			if (rm >= 0) {
+				*jip = MODRM(3, reg & 7, rm & 7);
+				jip++;
+			} else if (index >= 0) {
+				*jip = MODRM(0, reg & 7, 4);
+				jip++;
+				*jip = SIB(0, index & 7, EAX);
+				jip++;
+			} else {
+				*jip = MODRM(0, reg & 7, EAX);
+				jip++;
+			}
+			return jip;
+		}
+
+		// [rsp + offset], a slot in the stack frame of vector loops
+		jit_x86_memory jit_frame(int offset)
+		{
+			return jit_x86_at (ESP, offset);
+		}
+#else
+		/* i386 BACKEND
+		 * The generated code is called as (cdecl, all arguments on the stack)
+		 *   unsigned int code(unsigned int pc_to_return_to, int *registers, unsigned char *memory)
+		 * and keeps registers in esi, so that IMPS register n is [esi + 4*n],
+		 * but accesses memory at its absolute address.
+		 * eax, ebx and edx are scratch registers.
+		 */
+
+		unsigned char * jit_write_prologue (unsigned char * jip)
+		{
+			JIT_ASM (
+				"push ebp; mov ebp, esp",
+				"ENTER imm,imm"
+			)  // C8 iw ib
+			*jip = 0xc8;
+			jip++;
+			*jip = 0;
+			jip++;
+			*jip = 0;
+			jip++;
+			*jip = 0;
+			jip++;
+
+			// ebx and esi are callee-saved, but the translation uses them; jit_write_leave pops them again
+			jip = jit_x86_push (jip, EBX);
+			jip = jit_x86_push (jip, STATE);
+
+			// mov esi, [ebp + 12], the registers argument
+			return jit_x86_rm (jip, X86_MOV, 4, STATE, jit_x86_at(EBP, 12));
+		}
+
+		// Writes code that returns the control from the JIT back to the interpreter.
+		// It shall return (set eax to) the interpreter PC to continue execution at.
+		unsigned char * jit_write_leave (unsigned char * jip)
+		{
+			LOG_DEBUG("    writing a return-from-JIT instruction\n");
+
+			// ebx and esi belong to the caller (see the prologue), which may be in the middle of an interpreter loop;
+			// nothing else is ever pushed, so they are right on top of the stack
+			jip = jit_x86_pop (jip, STATE);
+			jip = jit_x86_pop (jip, EBX);
+
+			// Put the return value (PC outside JIT, where to continue) into eax.
+			// If there is no jump out of JIT and we just want to continue where the JIT started, the we use the address pc_to_return_to provided by execute() as last parameter (which is ebp + 8).
+			// If there is such a jump, it will have overridden pc_to_return_to by calling jit_change_return_pc().
+			//          [... other execute parameters ...]
+			// ebp+8 -> pc_to_return_to
+			//          [return address to where execute() is called]
+			// ebp   -> [ebp from the scope where execute() is called]
+			//          [... our local variables ...]
+			jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_x86_at(EBP, 8));
+
+			JIT_ASM (
+				"mov esp, ebp; pop ebp",
+				"LEAVE"
+			)  // C9
+			*jip = 0xc9;
+			jip++;
+
+			JIT_ASM ( "ret", "RET" )  // c3
+			*jip = 0xc3;
+			jip++;
+
+			return jip;
+		}
+
+		// The code the translation ends in, which is just another exit
+		unsigned char * jit_write_epilogue (unsigned char * jip)
+		{
+			return jit_write_leave (jip);
+		}
+
+		// Called from inside JIT code, changes the pc_to_return_to argument to execute() that is later copied to eax by the code created by jit_write_leave() to form the return code of execute(). For a stack layout see jit_write_leave().
+		// If this function is not called, the original pc_to_return_to value set as execute parameter is left as is.
+		unsigned char * jit_write_change_return_pc(unsigned char * jip, unsigned int new_return_pc)
+		{
+			LOG_DEBUG("    writing an instruction that would set the JIT return PC to %d\n", new_return_pc);
+
+			// mov [ebp + 8], new_return_pc
+			return jit_x86_mi (jip, X86_MOV, 4, jit_x86_at(EBP, 8), new_return_pc);
+		}
+
+		// Writes code that leaves the JIT to continue at next_pc, known at translation time.
+		// i386 translations are never linked (see DIRECT CHAINING), so that is an ordinary exit.
+		unsigned char * jit_write_exit_to(unsigned char * jip, unsigned int next_pc)
+		{
+			jip = jit_write_change_return_pc (jip, next_pc);
+
+			return jit_write_leave (jip);
+		}
+
+		// Nothing to write, as i386 translations are never linked
+		unsigned char * jit_write_chain_entry(unsigned char * jip)
+		{
+			return jip;
+		}
+
+		/* Writes code that continues at the IMPS address in eax (the target of a JR):
+		 * if it is one of the translated instructions, at its translation, looked up
+		 * in the jump table, and otherwise in the interpreter.
+		 */
+		unsigned char * jit_write_dispatch(unsigned char * jip)
+		{
+			unsigned char * outside;
+			unsigned char * unaligned;
+
+			// lea ebx, [eax - start]
+			jip = jit_x86_rm (jip, X86_LEA, 4, SCRATCH, jit_x86_at(EAX, -start));
+
+			// unsigned, so that targets before start are above, too
+			jip = jit_x86_ri (jip, X86_CMP, 4, SCRATCH, end - start);
+			// outside: jump over the lookup below to the exit
+			jip = jit_x86_short_jump (jip, 7, &outside);  // A
+
+			// not an instruction address (the interpreter reports it)
+			jip = jit_x86_ri (jip, X86_TEST, 1, SCRATCH, 3);
+			jip = jit_x86_short_jump (jip, 5, &unaligned);  // NZ
+
+			// ebx is now 4 * the instruction number, which is the offset of its entry in the table
+			JIT_ASM (
+				"jmp [ebx + jump_table]",
+				"JMP r/m32"
+			)  // FF /4
+			*jip = 0xff;
+			jip++;
+			*jip = MODRM(2, 4, EBX);
+			jip++;
+			RELOCATE ( JIT_RELOCATE_CODE )
+			jip = jit_write_label (jip, &jump_table, 1);
+
+			*outside = jip - (outside + 1);
+			*unaligned = jip - (unaligned + 1);
+
+			// the interpreter continues at the target, see jit_write_change_return_pc(): mov [ebp + 8], eax
+			jip = jit_x86_mr (jip, X86_MOV, 4, jit_x86_at(EBP, 8), EAX);
+
+			return jit_write_leave (jip);
+		}
+
+		// Writes the table of jit_write_dispatch: for every translated instruction, the address of its translation
+		unsigned char * jit_write_jump_table(unsigned char * jip)
+		{
+			unsigned int i;
+
+			jump_table = jip;
+
+			for (i = 0; i < instruction_count; i++) {
+				W32(jip, 0) = (int) mapping[i];
+				RELOCATE ( JIT_RELOCATE_CODE )
+				jip += 4;
+			}
+
+			return jip;
+		}
+
+		// Writes mov eax, [memory + eax]; the address in eax has been checked
+		unsigned char * jit_write_load_memory(unsigned char * jip)
+		{
+			return jit_x86_rm (jip, X86_MOV, 4, EAX, jit_x86_relocated(EAX, -1, (int) memory, JIT_RELOCATE_MEMORY));
+		}
+
+		// Writes mov [memory + reg], eax; the address in reg has been checked
+		unsigned char * jit_write_store_memory(unsigned char * jip, int reg)
+		{
+			return jit_x86_mr (jip, X86_MOV, 4, jit_x86_relocated(reg, -1, (int) memory, JIT_RELOCATE_MEMORY), EAX);
+		}
+
+		// Writes code that exits the emulator like the interpreter does at HALT in JIT code
+		unsigned char * jit_write_exit(unsigned char * jip)
+		{
+			unsigned char * addr_after_instruction = jip + 5; // because this instruction has jip++, +=4
+
+			JIT_ASM (
+				"jmp jit_exit",
+				"JMP imm"
+			)  // E9 rw/rd
+			*jip = 0xe9;
+			jip++;
+			W32(jip, 0) = (int) ((int) jit_exit - (int) addr_after_instruction);
+			RELOCATE ( JIT_RELOCATE_EXIT )
+			jip += 4;
+
+			return jip;
+		}
+#endif
+
+		// Writes mov reg, operand
+		unsigned char * jit_write_load_operand(unsigned char * jip, int reg, jit_operand operand)
+		{
+			if (operand.reg >= 0) {
+				return jit_write_load_register (jip, reg, operand.reg);
+			}
+			// the flags are not used across it, so 0 is xor reg, reg
+			if (operand.value == 0) {
+				return jit_x86_rr (jip, X86_XOR, 4, reg, reg);
+			}
+			return jit_x86_ri (jip, X86_MOV, 4, reg, operand.value);
+		}
+
+		// Writes eax = eax op operand, for op = IR_ADD, IR_SUB, IR_MUL or IR_SHL (by a constant)
+		unsigned char * jit_write_operand_operation(unsigned char * jip, int op, jit_operand operand)
+		{
+			unsigned int imps_op = op == IR_ADD ? ADD : op == IR_SUB ? SUB : MUL;
+
+			if (op == IR_SHL) {
+				return jit_x86_ri (jip, X86_SHL, 4, EAX, operand.value);
+			}
+
+			if (operand.reg >= 0) {
+				return jit_write_operation (jip, imps_op, operand.reg);
+			}
+
+			return jit_x86_ri (jip, imps_op == ADD ? X86_ADD : imps_op == SUB ? X86_SUB : X86_IMUL, 4, EAX, operand.value);
+		}
+
+		// Writes the comparison of a register with operand b for a conditional jump
+		unsigned char * jit_write_operand_compare(unsigned char * jip, jit_operand a, jit_operand b)
+		{
+			int host = host_register[a.reg];
+
+			if (b.reg >= 0) {
+				return jit_write_compare (jip, a.reg, b.reg);
+			}
+
+			if (host < 0) {
+				return jit_x86_mi (jip, X86_CMP, 4, jit_guest_register(a.reg), b.value);
+			}
+			// test host, host sets the flags like cmp host, 0
+			if (b.value == 0) {
+				return jit_x86_rr (jip, X86_TEST, 4, host, host);
+			}
+			return jit_x86_ri (jip, X86_CMP, 4, host, b.value);
+		}
+
+		/* Writes code that leaves the JIT to let the interpreter execute the instruction at instruction_no. */
+		unsigned char * jit_write_leave_at(unsigned char * jip, unsigned int instruction_no)
+		{
+			jip = jit_write_change_return_pc (jip, instruction_no);
+
+			return jit_write_leave (jip);
+		}
+
+		/* Writes the register fused into the address of the load or store x from the address in reg
+		 * (see jit_ir_fuse_address). It uses eax.
+		 */
+		unsigned char * jit_write_restore(unsigned char * jip, int reg, const jit_ir *x)
+		{
+			if (reg != EAX) {
+				jip = jit_x86_rr (jip, X86_MOV, 4, EAX, reg);
+			}
+			if (x->restore_offset != 0) {
+				jip = jit_write_operand_operation (jip, IR_ADD, jit_constant_operand(-x->restore_offset));
+			}
+			return jit_write_store_register (jip, x->restore);
+		}
+
+		/* Writes code that leaves the JIT at the load or store x at instruction_no unless the flags
+		 * meet the condition code, setting the register fused into its address (see jit_ir_fuse_address)
+		 * from the address in reg first. x is NULL for other instructions.
+		 */
+		unsigned char * jit_write_leave_unless(unsigned char * jip, unsigned int condition_code, int reg, const jit_ir *x, unsigned int instruction_no)
+		{
+			unsigned char * jump_size;
+
+			// the size of the code leaving is filled in after writing it
+			jip = jit_x86_short_jump (jip, condition_code, &jump_size);
+
+			if (x != NULL && x->restore >= 0 && !x->restore_always) {
+				jip = jit_write_restore (jip, reg, x);
+			}
+
+			jip = jit_write_leave_at (jip, instruction_no);
+
+			*jump_size = jip - (jump_size + 1);
+
+			return jip;
+		}
+
+		/* Writes code that leaves the JIT at the load or store x at instruction_no
+		 * if the word at the guest address in reg is not in memory.
+		 * The interpreter then executes the access again and reports the error.
+		 * The range of a 32-bit address is all of the address space, so there
+		 * are no guard pages to catch it (see GUARD_PAGES_ENABLED in imps-vm.c).
+		 */
+		unsigned char * jit_write_bounds_check(unsigned char * jip, int reg, const jit_ir *x, unsigned int instruction_no)
+		{
+			// the word at address addr is in memory if addr <= MEM_SIZE - 4, i.e. addr < MEM_SIZE - 3 (unsigned)
+			jip = jit_x86_ri (jip, X86_CMP, 4, reg, MEM_SIZE - 3);
+
+			return jit_write_leave_unless (jip, 2, reg, x, instruction_no);  // B (below)
+		}
+
+		/* Writes code that leaves the JIT at the store x at instruction_no if the word at the address in reg
+		 * (or the constant address, if reg < 0) starts on a code page (see imps_vm_code_map),
+		 * as it may overwrite translated instructions, which would go on running as they were before.
+		 * The interpreter then executes the store and tells the code cache, which drops
+		 * the translations of the instructions it changed (see jit_code_written).
+		 */
+		unsigned char * jit_write_code_page_check(unsigned char * jip, int reg, unsigned int address, const jit_ir *x, unsigned int instruction_no)
+		{
+			if (reg >= 0) {
+				// mov edx, reg; shr edx, log2(IMPS_CODE_PAGE_SIZE)
+				jip = jit_x86_rr (jip, X86_MOV, 4, EDX, reg);
+				jip = jit_x86_ri (jip, X86_SHR, 4, EDX, __builtin_ctz(IMPS_CODE_PAGE_SIZE));
+
+				jip = jit_write_code_page_compare (jip, EDX, 0);
+			} else {
+				jip = jit_write_code_page_compare (jip, -1, address / IMPS_CODE_PAGE_SIZE);
+			}
+
+			return jit_write_leave_unless (jip, 4, reg, reg >= 0 ? x : NULL, instruction_no);  // E
+		}
+
+		/* Writes reg = the address of the load or store x at instruction_no (using eax and edx), with the checks
+		 * leaving the JIT if it is not in memory or, for stores with in_place, on a code page.
+		 * Constant addresses are checked here instead; if they fail, the code leaves right away
+		 * and the access written after it is never reached. Constant addresses after the pages
+		 * of the program cannot be on a code page (see jit_run_hot_loop), so their stores are not checked.
+		 */
+		unsigned char * jit_write_address(unsigned char * jip, int reg, const jit_ir *x, unsigned int instruction_no)
+		{
+			int store = x->op == IR_STORE;
+			jit_operand base = store ? x->b : x->a;
+
+			if (base.reg < 0 && x->index < 0) {
+				unsigned int address = base.value + x->offset;
+
+				// like the checks below
+				if (address > MEM_SIZE - 4) {
+					return jit_write_leave_at (jip, instruction_no);
+				}
+				if (store && in_place && address / IMPS_CODE_PAGE_SIZE <= last_code_page) {
+					jip = jit_write_code_page_check (jip, -1, address, x, instruction_no);
+				}
+				return jit_write_load_operand (jip, reg, jit_constant_operand(address));
+			}
+
+			if (x->index >= 0) {
+				jip = jit_write_lea (jip, reg, base, x->index, x->scale, x->offset + (base.reg < 0 ? base.value : 0));
+			} else if (host_register[base.reg] >= 0 && x->offset != 0) {
+				// lea reg, [host + offset]
+				jip = jit_x86_rm (jip, X86_LEA, 4, reg, jit_x86_at(host_register[base.reg], x->offset));
+			} else {
+				jip = jit_write_load_register (jip, reg, base.reg);
+				if (x->offset != 0) {
+					jip = jit_x86_ri (jip, X86_ADD, 4, reg, x->offset);
+				}
+			}
+
+			if (x->restore >= 0 && x->restore_always) {
+				jip = jit_write_restore (jip, reg, x);
+				if (reg == EAX && x->restore_offset != 0) {
+					jip = jit_write_operand_operation (jip, IR_ADD, jit_constant_operand(x->restore_offset));
+				}
+			}
+
+			jip = jit_write_bounds_check(jip, reg, x, instruction_no);
+			if (store && in_place) {
+				jip = jit_write_code_page_check(jip, reg, 0, x, instruction_no);
+			}
+
+			return jip;
+		}
+
+		// Writes a jump to the code at *label, which may come later (see jit_write_label)
+		unsigned char * jit_write_jump_to(unsigned char * jip, unsigned char ** label)
+		{
+			return jit_x86_jump (jip, -1, label);
+		}
+
+		// Writes a jump to the code at *label taken if the flags meet the condition code
+		// (cc is the condition code, see http://www.posix.nl/linuxassembly/nasmdochtml/nasmdoca.html#section-A.2.2)
+		unsigned char * jit_write_conditional_jump_to(unsigned char * jip, unsigned int condition_code, unsigned char ** label)
+		{
+			return jit_x86_jump (jip, condition_code, label);
+		}
+
+		unsigned char * jit_write_jump(unsigned char * jip, unsigned int target)
+		{
+			// If the target is in the JIT translation, jump around IN the translation
+			// otherwise, leave the JIT execution
+			// The target is known AT THE TIME OF TRANSLATION
+
+			// Note that target_instruction is the instruction number INSIDE JIT (the n-th jitted instruction)
+			int target_instruction = (target - start) / 4;  // (... - start) to get the address INSIDE JIT
+
+			// Only aligned addresses in the translation are still in jitted code,
+			// the interpreter takes care of everything else (e.g. an outer loop)
+			int in_jit = target % 4 == 0 && start <= target && target <= end;
+
+			if (in_jit)
+			{
+				LOG_DEBUG("unconditional in-jit-jump\n");
+
+				// later instructions are filled in at the end (see FIXUPS)
+				jip = jit_write_jump_to (jip, &mapping[target_instruction]);
+			}
+			else
+			{
+				LOG_DEBUG("    This is an unconditional out-of-jit-jump, assembling a JMP to PC=%d\n", target);
+
+				// set the right PC (target) into the return PC (where to jump outside in bytecode) and leave
+				jip = jit_write_exit_to (jip, target);
+			}
+			return jip;
+		}
+
+		/* Writes a jump to target taken if the flags of the comparison before it meet the condition code. */
+		unsigned char * jit_write_conditional_jump(unsigned char * jip, unsigned int target, unsigned int condition_code)
+		{
+			int target_instruction = (target - start) / 4;
+			// Like for jit_write_jump, branches before the translation leave it like the ones after it
+			int in_jit = target % 4 == 0 && start <= target && target <= end;
+
+			/* IDEA:
+			 * if in_jit:
+			 *   if branch?:
+			 *     jmp in_jit_addr
+			 * else:
+			 *   if branch?:
+			 *     PC = target
+			 */
+
+			if (in_jit)
+			{
+				// jump inside jit if the cmp condition is met
+
+				LOG_DEBUG("conditional in-jit-jump\n");
+
+				// later instructions are filled in at the end (see FIXUPS)
+				jip = jit_write_conditional_jump_to (jip, condition_code, &mapping[target_instruction]);
+			}
+			else
+			{
+				// jump out of jit if the cmp condition is met
+
+				LOG_DEBUG("    This is a conditional out-of-jit-jump, assembling a conditional out-of-JIT-return to PC=%d\n", target);
+
+				/* if the jump condition is NOT met (!condition_code), OMIT (jump over) the out-of-JIT jump written by jit_write_exit_to:
+				 *   its size depends on the registers it stores (see jit_write_exit_to),
+				 *   so the jump is filled in after writing it.
+				 */
+				unsigned char * jump_size;
+
+				jip = jit_x86_short_jump (jip, negate_condition_code(condition_code), &jump_size);
+
+				// set the right PC (target) into the return PC (where to jump outside in bytecode) and leave
+				jip = jit_write_exit_to (jip, target);
+
+				*jump_size = jip - (jump_size + 1);
+			}
+			return jip;
+		}
+
+#if JIT_X86_64
+		/* The stack frame of the vector code (see jit_write_vector_loop): the passes left, the iterations
+		 * they run, room for the offsets of the lanes of a gather, and for every load and store:
+		 * the pointer into memory, the step, the first address, and the lowest and highest byte accessed
+		 */
+		#define VECTOR_PASSES 0
+		#define VECTOR_ITERATIONS 8
+		#define VECTOR_OFFSETS 16
+		#define VECTOR_POINTER(s) (48 + 32 * (s))
+		#define VECTOR_STEP(s) (VECTOR_POINTER(s) + 8)
+		#define VECTOR_FIRST(s) (VECTOR_POINTER(s) + 16)
+		#define VECTOR_LOW(s) (VECTOR_POINTER(s) + 20)
+		#define VECTOR_HIGH(s) (VECTOR_POINTER(s) + 24)
+
+		// Writes eax = the node of loop, using ecx and the stack
+		unsigned char * jit_write_vector_node(unsigned char * jip, const jit_vector_loop *loop, int node)
+		{
+			const jit_vector_node *x = &loop->nodes[node];
+
+			if (x->op == IR_MOVE) {
+				return jit_write_load_operand (jip, EAX, x->operand);
+			}
+			if (loop->nodes[x->right].op == IR_MOVE) {
+				jip = jit_write_vector_node (jip, loop, x->left);
+				return jit_write_operand_operation (jip, x->op, loop->nodes[x->right].operand);
+			}
+
+			jip = jit_write_vector_node (jip, loop, x->right);
+
+			jip = jit_x86_push (jip, EAX);
+
+			jip = jit_write_vector_node (jip, loop, x->left);
+
+			jip = jit_x86_pop (jip, ECX);
+
+			return jit_x86_rr (jip, x->op == IR_ADD ? X86_ADD : x->op == IR_SUB ? X86_SUB : X86_IMUL, 4, EAX, ECX);
+		}
+
+		// Writes the op x of loop for one pass of the vector code, except for IR_MOVE, which is done before the passes
+		unsigned char * jit_write_vector_op(unsigned char * jip, const jit_vector_loop *loop, const jit_vector_op *x)
+		{
+			int lanes = simd == JIT_SIMD_AVX2 ? 8 : 4;
+			int s = x->stream;
+
+			switch (x->op) {
+				case IR_LOAD:
+				case IR_STORE:
+					// MOV rax, [rsp + pointer]
+					jip = jit_x86_rm (jip, X86_MOV, 8, EAX, jit_frame(VECTOR_POINTER(s)));
+
+					if (x->op == IR_STORE || loop->offsets_xmm[s] < 0) {
+						if (x->op == IR_STORE) {
+							JIT_ASM (
+								"MOVDQU [rax], xmm",
+								"MOVDQU xmm/m128,xmm"
+							)  // F3 0F 7F /r
+							jip = jit_write_simd (jip, 1, 0xf3, 1, 0x7f, loop->ops[x->a].xmm, 0, -1, -1);
+						} else {
+							JIT_ASM (
+								"MOVDQU xmm, [rax]",
+								"MOVDQU xmm,xmm/m128"
+							)  // F3 0F 6F /r
+							jip = jit_write_simd (jip, 1, 0xf3, 1, 0x6f, x->xmm, 0, -1, -1);
+						}
+
+						// ADD rax, 4 * lanes
+						jip = jit_x86_ri (jip, X86_ADD, 8, EAX, 4 * lanes);
+					} else if (simd == JIT_SIMD_AVX2) {
+						// all lanes at once; the gather clears the mask in xmm15 as it goes
+						JIT_ASM (
+							"VPCMPEQD ymm15, ymm15, ymm15",
+							"VPCMPEQD ymm,ymm,ymm/m256"
+						)  // VEX.256.66.0F 76 /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x76, 15, 15, 15, -1);
+
+						JIT_ASM (
+							"VPGATHERDD ymm, [rax + offsets], ymm15",
+							"VPGATHERDD ymm,vm32y,ymm"
+						)  // VEX.256.66.0F38.W0 90 /r
+						jip = jit_write_simd (jip, 1, 0x66, 2, 0x90, x->xmm, 15, -1, loop->offsets_xmm[s]);
+
+						// MOV rcx, [rsp + step]
+						jip = jit_x86_rm (jip, X86_MOV, 8, ECX, jit_frame(VECTOR_STEP(s)));
+
+						// LEA rax, [rax + rcx * 8]
+						jip = jit_x86_rm (jip, X86_LEA, 8, EAX, jit_x86_indexed(EAX, ECX, 3, 0));
+					} else {
+						// one lane after the other, 0 and 1 into xmm, 2 and 3 into xmm13, and interleaved
+						int k;
+
+						// MOV rcx, [rsp + step]
+						jip = jit_x86_rm (jip, X86_MOV, 8, ECX, jit_frame(VECTOR_STEP(s)));
+
+						for (k = 0; k < 4; k++) {
+							static const int lane_registers[] = { -1, 13, 13, 14 };
+
+							if (k > 0) {
+								// ADD rax, rcx
+								jip = jit_x86_rr (jip, X86_ADD, 8, EAX, ECX);
+							}
+
+							JIT_ASM (
+								"MOVD xmm, [rax]",
+								"MOVD xmm,r/m32"
+							)  // 66 0F 6E /r
+							jip = jit_write_simd (jip, 0, 0x66, 1, 0x6e, k == 0 ? x->xmm : lane_registers[k], 0, -1, -1);
+
+							if (k == 1 || k == 3) {
+								JIT_ASM (
+									"PUNPCKLDQ xmm, xmm",
+									"PUNPCKLDQ xmm,xmm/m128"
+								)  // 66 0F 62 /r
+								jip = jit_write_simd (jip, 1, 0x66, 1, 0x62, k == 1 ? x->xmm : 13, 0, k == 1 ? 13 : 14, -1);
+							}
+						}
+
+						JIT_ASM (
+							"PUNPCKLQDQ xmm, xmm13",
+							"PUNPCKLQDQ xmm,xmm/m128"
+						)  // 66 0F 6C /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x6c, x->xmm, x->xmm, 13, -1);
+
+						// ADD rax, rcx
+						jip = jit_x86_rr (jip, X86_ADD, 8, EAX, ECX);
+					}
+
+					// MOV [rsp + pointer], rax
+					jip = jit_x86_mr (jip, X86_MOV, 8, jit_frame(VECTOR_POINTER(s)), EAX);
+					break;
+
+				default:
+					if (x->sum >= 0) {
+						JIT_ASM (
+							"PADDD/PSUBD sum, xmm",
+							"PADDD/PSUBD xmm,xmm/m128"
+						)  // 66 0F FE /r, 66 0F FA /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, x->op == IR_ADD ? 0xfe : 0xfa, x->xmm, x->xmm, loop->ops[x->a].xmm, -1);
+						break;
+					}
+
+					JIT_ASM (
+						"MOVDQA xmm, a",
+						"MOVDQA xmm,xmm/m128"
+					)  // 66 0F 6F /r
+					jip = jit_write_simd (jip, 1, 0x66, 1, 0x6f, x->xmm, 0, loop->ops[x->a].xmm, -1);
+
+					if (x->op == IR_SHL) {
+						JIT_ASM (
+							"PSLLD xmm, b",
+							"PSLLD xmm,imm8"
+						)  // 66 0F 72 /6 ib
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x72, 6, x->xmm, x->xmm, -1);
+						*jip = x->b;
+						jip++;
+					} else if (x->op != IR_MUL) {
+						JIT_ASM (
+							"PADDD/PSUBD xmm, b",
+							"PADDD/PSUBD xmm,xmm/m128"
+						)  // 66 0F FE /r, 66 0F FA /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, x->op == IR_ADD ? 0xfe : 0xfa, x->xmm, x->xmm, loop->ops[x->b].xmm, -1);
+					} else if (simd == JIT_SIMD_AVX2) {
+						JIT_ASM (
+							"VPMULLD ymm, ymm, b",
+							"VPMULLD ymm,ymm,ymm/m256"
+						)  // VEX.256.66.0F38 40 /r
+						jip = jit_write_simd (jip, 1, 0x66, 2, 0x40, x->xmm, x->xmm, loop->ops[x->b].xmm, -1);
+					} else {
+						/* SSE2 only multiplies lanes 0 and 2 into 64 bits (PMULUDQ), whose lower halves are
+						 * the 32-bit products, signed or not: so it multiplies lanes 1 and 3 shifted down
+						 * in xmm13 and xmm14, and interleaves the lower halves of both
+						 */
+						int b = loop->ops[x->b].xmm;
+
+						JIT_ASM (
+							"PMULUDQ xmm, b",
+							"PMULUDQ xmm,xmm/m128"
+						)  // 66 0F F4 /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0xf4, x->xmm, x->xmm, b, -1);
+
+						JIT_ASM (
+							"MOVDQA xmm13, a",
+							"MOVDQA xmm,xmm/m128"
+						)  // 66 0F 6F /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x6f, 13, 0, loop->ops[x->a].xmm, -1);
+
+						JIT_ASM (
+							"MOVDQA xmm14, b",
+							"MOVDQA xmm,xmm/m128"
+						)  // 66 0F 6F /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x6f, 14, 0, b, -1);
+
+						JIT_ASM (
+							"PSRLQ xmm13, 32; PSRLQ xmm14, 32",
+							"PSRLQ xmm,imm8"
+						)  // 66 0F 73 /2 ib
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x73, 2, 13, 13, -1);
+						*jip = 32;
+						jip++;
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x73, 2, 14, 14, -1);
+						*jip = 32;
+						jip++;
+
+						JIT_ASM (
+							"PMULUDQ xmm13, xmm14",
+							"PMULUDQ xmm,xmm/m128"
+						)  // 66 0F F4 /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0xf4, 13, 13, 14, -1);
+
+						JIT_ASM (
+							"PSHUFD xmm, xmm, 0x08; PSHUFD xmm13, xmm13, 0x08",
+							"PSHUFD xmm,xmm/m128,imm8"
+						)  // 66 0F 70 /r ib
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x70, x->xmm, 0, x->xmm, -1);
+						*jip = 0x08;
+						jip++;
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x70, 13, 0, 13, -1);
+						*jip = 0x08;
+						jip++;
+
+						JIT_ASM (
+							"PUNPCKLDQ xmm, xmm13",
+							"PUNPCKLDQ xmm,xmm/m128"
+						)  // 66 0F 62 /r
+						jip = jit_write_simd (jip, 1, 0x66, 1, 0x62, x->xmm, x->xmm, 13, -1);
+					}
+					break;
+			}
+
+			return jip;
+		}
+
+		// Writes eax = the sum of the lanes of the SIMD register xmm, changing it
+		unsigned char * jit_write_vector_sum(unsigned char * jip, int xmm)
+		{
+			if (simd == JIT_SIMD_AVX2) {
+				JIT_ASM (
+					"VEXTRACTI128 xmm13, ymm, 1",
+					"VEXTRACTI128 xmm/m128,ymm,imm8"
+				)  // VEX.256.66.0F3A.W0 39 /r ib
+				jip = jit_write_simd (jip, 1, 0x66, 3, 0x39, xmm, 0, 13, -1);
+				*jip = 1;
+				jip++;
+
+				JIT_ASM (
+					"VPADDD xmm, xmm, xmm13",
+					"VPADDD xmm,xmm,xmm/m128"
+				)  // VEX.128.66.0F FE /r
+				jip = jit_write_simd (jip, 0, 0x66, 1, 0xfe, xmm, xmm, 13, -1);
+			}
+
+			// lanes 0 + 2 and 1 + 3, then both of those
+			JIT_ASM (
+				"PSHUFD xmm13, xmm, 0x4e; PADDD xmm, xmm13; PSHUFD xmm13, xmm, 0xb1; PADDD xmm, xmm13",
+				"PSHUFD xmm,xmm/m128,imm8; PADDD xmm,xmm/m128"
+			)  // 66 0F 70 /r ib, 66 0F FE /r
+			jip = jit_write_simd (jip, 0, 0x66, 1, 0x70, 13, 0, xmm, -1);
+			*jip = 0x4e;
+			jip++;
+			jip = jit_write_simd (jip, 0, 0x66, 1, 0xfe, xmm, xmm, 13, -1);
+			jip = jit_write_simd (jip, 0, 0x66, 1, 0x70, 13, 0, xmm, -1);
+			*jip = 0xb1;
+			jip++;
+			jip = jit_write_simd (jip, 0, 0x66, 1, 0xfe, xmm, xmm, 13, -1);
+
+			JIT_ASM (
+				"MOVD eax, xmm",
+				"MOVD r/m32,xmm"
+			)  // 66 0F 7E /r
+			return jit_write_simd (jip, 0, 0x66, 1, 0x7e, xmm, 0, EAX, -1);
+		}
+
+		/* Writes the vector code of loop (see VECTORIZATION), which runs at its header and always continues
+		 * with the translation running one iteration at a time (loop->scalar). If
+		 * - there are more iterations left than lanes: it runs as many passes as leave at least one iteration
+		 * - the addresses of all loads and stores in the first and in the last of those iterations are in memory,
+		 *   and so are the ones in between, as they grow by the same amount every iteration
+		 * - no store overlaps another access (unless both are contiguous from the same address,
+		 *   where every lane accesses the same words as one iteration after another would)
+		 *   or, in place, the code pages (see jit_write_code_page_check)
+		 * Then it adds the iterations to the induction register and the lanes of the sums to their registers.
+		 */
+		unsigned char * jit_write_vector_loop(unsigned char * jip, jit_vector_loop *loop)
+		{
+			int lanes = simd == JIT_SIMD_AVX2 ? 8 : 4;
+			int frame = VECTOR_POINTER(loop->stream_count);
+			unsigned char * pass;
+			unsigned char * jump_size[3];
+			int s, t, k, jumps;
+
+			// SUB rsp, frame
+			jip = jit_x86_ri (jip, X86_SUB, 8, ESP, frame);
+
+			// no iterations at all
+			jip = jit_write_operand_compare (jip, jit_register_operand(loop->induction), loop->bound);
+			jip = jit_write_conditional_jump_to (jip, 13, &loop->done);  // GE
+
+			// The iterations (n - i + c - 1) / c but the last one, in whole passes
+			jip = jit_write_load_operand (jip, EAX, loop->bound);
+			jip = jit_write_operation (jip, SUB, loop->induction);
+			if (loop->increment != 1) {
+				// in 64 bit, where n - i + c - 1 does not overflow
+				// ADD rax, c - 1
+				jip = jit_x86_ri (jip, X86_ADD, 8, EAX, loop->increment - 1);
+
+				// XOR edx, edx
+				jip = jit_x86_rr (jip, X86_XOR, 4, EDX, EDX);
+
+				jip = jit_write_load_operand (jip, ECX, jit_constant_operand(loop->increment));
+
+				// DIV rcx
+				jip = jit_x86_r (jip, X86_DIV, 8, ECX);
+			}
+			jip = jit_write_operand_operation (jip, IR_ADD, jit_constant_operand(-1));
+
+			// AND eax, -lanes
+			jip = jit_x86_ri (jip, X86_AND, 4, EAX, -lanes);
+			jip = jit_write_conditional_jump_to (jip, 4, &loop->done);  // Z
+
+			// MOV [rsp + iterations], rax
+			jip = jit_x86_mr (jip, X86_MOV, 8, jit_frame(VECTOR_ITERATIONS), EAX);
+
+			// SHR eax, log2(lanes)
+			jip = jit_x86_ri (jip, X86_SHR, 4, EAX, lanes == 8 ? 3 : 2);
+
+			// MOV [rsp + passes], rax
+			jip = jit_x86_mr (jip, X86_MOV, 8, jit_frame(VECTOR_PASSES), EAX);
+
+			for (s = 0; s < loop->stream_count; s++) {
+				jip = jit_write_vector_node (jip, loop, loop->streams[s].address);
+
+				// MOV [rsp + first], eax
+				jip = jit_x86_mr (jip, X86_MOV, 4, jit_frame(VECTOR_FIRST(s)), EAX);
+
+				// CMP eax, MEM_SIZE - 3
+				jip = jit_x86_ri (jip, X86_CMP, 4, EAX, MEM_SIZE - 3);
+				jip = jit_write_conditional_jump_to (jip, 3, &loop->done);  // AE
+
+				jip = jit_write_vector_node (jip, loop, loop->streams[s].step);
+
+				// MOVSXD rax, eax
+				jip = jit_x86_rr (jip, X86_MOVSXD, 8, EAX, EAX);
+
+				// MOV [rsp + step], rax
+				jip = jit_x86_mr (jip, X86_MOV, 8, jit_frame(VECTOR_STEP(s)), EAX);
+
+				// the last address, first + (iterations - 1) * step, which does not overflow in 64 bit
+				// MOV rcx, [rsp + iterations]
+				jip = jit_x86_rm (jip, X86_MOV, 8, ECX, jit_frame(VECTOR_ITERATIONS));
+
+				// DEC rcx
+				jip = jit_x86_r (jip, X86_DEC, 8, ECX);
+
+				// IMUL rcx, rax
+				jip = jit_x86_rr (jip, X86_IMUL, 8, ECX, EAX);
+
+				// MOV eax, [rsp + first]
+				jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_FIRST(s)));
+
+				// ADD rcx, rax
+				jip = jit_x86_rr (jip, X86_ADD, 8, ECX, EAX);
+
+				// unsigned, so that negative ones are above, too
+				// CMP rcx, MEM_SIZE - 3
+				jip = jit_x86_ri (jip, X86_CMP, 8, ECX, MEM_SIZE - 3);
+				jip = jit_write_conditional_jump_to (jip, 3, &loop->done);  // AE
 
-		for (count_only = 1; count_only >= 0; count_only--)
-		{
-			COUNT (LOG_DEBUG("pass 1/2: counting instructions to generate mapping\n");)
-			TRANSLATE (LOG_DEBUG("pass 2/2: translating\n");)
+				// the bytes accessed, from min(first, last) to max(first, last) + 3
+				// MOV edx, eax; CMP edx, ecx; CMOVA edx, ecx
+				jip = jit_x86_rr (jip, X86_MOV, 4, EDX, EAX);
+				jip = jit_x86_rr (jip, X86_CMP, 4, EDX, ECX);
+				jip = jit_x86_rr (jip, X86_CMOVA, 4, EDX, ECX);
 
-			// reset jip for each pass
-			jip = jit_area;
+				// CMP eax, ecx; CMOVB eax, ecx
+				jip = jit_x86_rr (jip, X86_CMP, 4, EAX, ECX);
+				jip = jit_x86_rr (jip, X86_CMOVB, 4, EAX, ECX);
 
-			JIT_ASM (
-				"push ebp; mov ebp, esp",
-				"ENTER imm,imm"
-			)  // C8 iw ib
-			TRANSLATE ( *jip = 0xc8; )
-			jip++;
-			TRANSLATE ( *jip = 0; )
-			jip++;
-			TRANSLATE ( *jip = 0; )
-			jip++;
-			TRANSLATE ( *jip = 0; )
-			jip++;
+				// MOV [rsp + low], edx
+				jip = jit_x86_mr (jip, X86_MOV, 4, jit_frame(VECTOR_LOW(s)), EDX);
 
-			unsigned int i;
-			for (i = 0; i < instruction_count; i++)
-			{
-				unsigned int instruction_no = start + i * 4;
-				unsigned int instruction = W32(memory, instruction_no);
+				jip = jit_write_operand_operation (jip, IR_ADD, jit_constant_operand(3));
 
-				TRANSLATE (
-					LOG_DEBUG("translating instruction no. %d at %d: %s ->\n", i, instruction_no, INSTRUCTION_NAMES[OPCODE]);
-				)
+				// MOV [rsp + high], eax
+				jip = jit_x86_mr (jip, X86_MOV, 4, jit_frame(VECTOR_HIGH(s)), EAX);
 
-				COUNT (
-					mapping[i] = jip;
-				)
+				// the pointer to the first address
+				// MOV eax, [rsp + first]
+				jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_FIRST(s)));
 
-				switch (OPCODE) {
-					case ADD:
-						// move R2 -> eax, R3 -> ebx, eax + ebx -> eax, eax -> R1
-						// TODO improve: R2 -> eax, eax + R3 -> eax, eax -> R1
-						// TODO improve: R2 -> eax, R3 + eax -> R3 (using ADD r/m32,reg32)
+				// ADD rax, r15
+				jip = jit_x86_rr (jip, X86_ADD, 8, EAX, R15);
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+				// MOV [rsp + pointer], rax
+				jip = jit_x86_mr (jip, X86_MOV, 8, jit_frame(VECTOR_POINTER(s)), EAX);
+			}
 
-						JIT_ASM (
-							"MOV ebx, r3",
-							"MOV reg32,r/m32"
-						)  // o32 8B /r
-						TRANSLATE ( *jip = 0x8b; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(0, EBX, 5); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R3]; )
-						jip += 4;
+			for (s = 0; s < loop->stream_count; s++) {
+				if (!loop->streams[s].store) {
+					continue;
+				}
 
-						JIT_ASM (
-							"ADD eax, ebx",
-							"ADD r/m32,reg32"
-						)  // o32 01 /r
-						TRANSLATE ( *jip = 0x01; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(3, EBX, EAX); )
-						jip++;
+				// every other access, the pairs of stores once
+				for (t = 0; t < loop->stream_count; t++) {
+					if (t == s || (loop->streams[t].store && t < s)) {
+						continue;
+					}
+					jumps = 0;
+
+					// the bytes of s above those of t, or below
+					// MOV eax, [rsp + low s]; CMP eax, [rsp + high t]
+					jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_LOW(s)));
+					jip = jit_x86_rm (jip, X86_CMP, 4, EAX, jit_frame(VECTOR_HIGH(t)));
+					jip = jit_x86_short_jump (jip, 7, &jump_size[jumps++]);  // A
+
+					// MOV eax, [rsp + low t]; CMP eax, [rsp + high s]
+					jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_LOW(t)));
+					jip = jit_x86_rm (jip, X86_CMP, 4, EAX, jit_frame(VECTOR_HIGH(s)));
+					jip = jit_x86_short_jump (jip, 7, &jump_size[jumps++]);  // A
+
+					if (jit_vector_is_constant(loop, loop->streams[t].step, 4)) {
+						// MOV eax, [rsp + first s]; CMP eax, [rsp + first t]
+						jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_FIRST(s)));
+						jip = jit_x86_rm (jip, X86_CMP, 4, EAX, jit_frame(VECTOR_FIRST(t)));
+						jip = jit_x86_short_jump (jip, 4, &jump_size[jumps++]);  // E
+					}
 
-						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+					jip = jit_write_jump_to (jip, &loop->done);
 
-					case ADDI:
-						// move R2 -> eax, eax + IMM -> eax, eax -> R1
+					for (k = 0; k < jumps; k++) {
+						*jump_size[k] = jip - (jump_size[k] + 1);
+					}
+				}
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+				if (in_place) {
+					// the bytes of s above the code pages or below them (see jit_write_code_page_check)
+					// MOV eax, [rsp + low s]; CMP eax, [rbx + code high]
+					jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_LOW(s)));
+					jip = jit_x86_rm (jip, X86_CMP, 4, EAX, jit_x86_at(STATE, code_map_offset + offsetof(imps_code_map, high)));
+					jip = jit_x86_short_jump (jip, 7, &jump_size[0]);  // A
 
-						JIT_ASM (
-							"ADD eax, IMM",
-							"ADD EAX,imm32"
-						)  // o32 05 id
-						TRANSLATE ( *jip = 0x05; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = SIGNEXT(SIGNED(IMM)); )
-						jip += 4;
+					// MOV eax, [rsp + high s]; CMP eax, [rbx + code low]
+					jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_HIGH(s)));
+					jip = jit_x86_rm (jip, X86_CMP, 4, EAX, jit_x86_at(STATE, code_map_offset + offsetof(imps_code_map, low)));
+					jip = jit_x86_short_jump (jip, 2, &jump_size[1]);  // B
 
-						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+					jip = jit_write_jump_to (jip, &loop->done);
 
-					case SUB:
-						// move R2 -> eax, R3 -> ebx, eax - ebx -> eax, eax -> R1
-						// TODO improve: R2 -> eax, eax - R3 -> eax, eax -> R1
-						// TODO improve: R2 -> eax, R3 - eax -> R3 (using SUB r/m32,reg32)
+					*jump_size[0] = jip - (jump_size[0] + 1);
+					*jump_size[1] = jip - (jump_size[1] + 1);
+				}
+			}
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+			// The values the same in all lanes, the sums starting at 0 and the offsets of the lanes of gathers
+			for (k = 0; k < loop->op_count; k++) {
+				const jit_vector_op *x = &loop->ops[k];
 
-						JIT_ASM (
-							"MOV ebx, r3",
-							"MOV reg32,r/m32"
-						)  // o32 8B /r
-						TRANSLATE ( *jip = 0x8b; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(0, EBX, 5); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R3]; )
-						jip += 4;
+				if (x->op == IR_MOVE) {
+					jip = jit_write_vector_node (jip, loop, x->a);
 
-						JIT_ASM (
-							"SUB eax, ebx",
-							"SUB r/m32,reg32"
-						)  // o32 29 /r
-						TRANSLATE ( *jip = 0x29; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(3, EBX, EAX); )
-						jip++;
+					JIT_ASM (
+						"MOVD xmm, eax",
+						"MOVD xmm,r/m32"
+					)  // 66 0F 6E /r
+					jip = jit_write_simd (jip, 0, 0x66, 1, 0x6e, x->xmm, 0, EAX, -1);
 
+					if (simd == JIT_SIMD_AVX2) {
 						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
+							"VPBROADCASTD ymm, xmm",
+							"VPBROADCASTD ymm,xmm/m32"
+						)  // VEX.256.66.0F38.W0 58 /r
+						jip = jit_write_simd (jip, 1, 0x66, 2, 0x58, x->xmm, 0, x->xmm, -1);
+					} else {
+						JIT_ASM (
+							"PSHUFD xmm, xmm, 0",
+							"PSHUFD xmm,xmm/m128,imm8"
+						)  // 66 0F 70 /r ib
+						jip = jit_write_simd (jip, 0, 0x66, 1, 0x70, x->xmm, 0, x->xmm, -1);
+						*jip = 0;
 						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+					}
+				} else if (x->sum >= 0) {
+					JIT_ASM (
+						"PXOR xmm, xmm",
+						"PXOR xmm,xmm/m128"
+					)  // 66 0F EF /r
+					jip = jit_write_simd (jip, 1, 0x66, 1, 0xef, x->xmm, x->xmm, x->xmm, -1);
+				}
+			}
+			for (s = 0; s < loop->stream_count && simd == JIT_SIMD_AVX2; s++) {
+				if (loop->offsets_xmm[s] < 0) {
+					continue;
+				}
 
-					case SUBI:
-						// move R2 -> eax, eax - IMM -> eax, eax -> R1
+				// 0, step, 2 * step, ... written to the frame and loaded from there
+				// MOV eax, [rsp + step]; XOR ecx, ecx
+				jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_STEP(s)));
+				jip = jit_x86_rr (jip, X86_XOR, 4, ECX, ECX);
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+				for (k = 0; k < 8; k++) {
+					// MOV [rsp + offsets + 4 * k], ecx; ADD ecx, eax
+					jip = jit_x86_mr (jip, X86_MOV, 4, jit_frame(VECTOR_OFFSETS + 4 * k), ECX);
+					jip = jit_x86_rr (jip, X86_ADD, 4, ECX, EAX);
+				}
 
-						JIT_ASM (
-							"SUB eax, IMM",
-							"SUB EAX,imm32"
-						)  // o32 2D id
-						TRANSLATE ( *jip = 0x2d; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = SIGNEXT(SIGNED(IMM)); )
-						jip += 4;
+				// LEA rax, [rsp + offsets]
+				jip = jit_x86_rm (jip, X86_LEA, 8, EAX, jit_frame(VECTOR_OFFSETS));
 
-						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+				JIT_ASM (
+					"VMOVDQU ymm, [rax]",
+					"VMOVDQU ymm,ymm/m256"
+				)  // VEX.256.F3.0F 6F /r
+				jip = jit_write_simd (jip, 1, 0xf3, 1, 0x6f, loop->offsets_xmm[s], 0, -1, -1);
+			}
+
+			pass = jip;
+			for (k = 0; k < loop->op_count; k++) {
+				if (loop->ops[k].op != IR_MOVE) {
+					jip = jit_write_vector_op (jip, loop, &loop->ops[k]);
+				}
+			}
 
-					case MUL:
-						// move R2 -> eax, eax * R3 -> eax, eax -> R1
+			// SUB qword [rsp + passes], 1
+			jip = jit_x86_mi (jip, X86_SUB, 8, jit_frame(VECTOR_PASSES), 1);
+			jip = jit_write_conditional_jump_to (jip, 5, &pass);  // NZ
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+			// i = i + iterations * c
+			// MOV eax, [rsp + iterations]
+			jip = jit_x86_rm (jip, X86_MOV, 4, EAX, jit_frame(VECTOR_ITERATIONS));
+			if (loop->increment != 1) {
+				jip = jit_write_operand_operation (jip, IR_MUL, jit_constant_operand(loop->increment));
+			}
+			jip = jit_write_operation (jip, ADD, loop->induction);
+			jip = jit_write_store_register (jip, loop->induction);
 
-						JIT_ASM (
-							"IMUL eax, operand",
-							"IMUL r/m32"
-						)  // o32 F7 /5  - EDX:EAX = EAX * operand
-						TRANSLATE ( *jip = 0xf7; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(0, 5, 5); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R3]; )
-						jip += 4;
+			for (k = 0; k < loop->op_count; k++) {
+				const jit_vector_op *x = &loop->ops[k];
 
-						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+				if (x->sum < 0) {
+					continue;
+				}
+				// the lanes of sum = sum - x already hold minus the x
+				jip = jit_write_vector_sum (jip, x->xmm);
+				jip = jit_write_operation (jip, ADD, x->sum);
+				jip = jit_write_store_register (jip, x->sum);
+			}
 
-					case MULI:
-						// move R2 -> eax, eax * IMM -> eax, eax -> R1
+			loop->done = jip;
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+			if (simd == JIT_SIMD_AVX2) {
+				// so that SSE code after it does not pay for the upper halves
+				JIT_ASM (
+					"VZEROUPPER",
+					"VZEROUPPER"
+				)  // VEX.128.0F.WIG 77
+				*jip = 0xc5;
+				jip++;
+				*jip = 0xf8;
+				jip++;
+				*jip = 0x77;
+				jip++;
+			}
 
-						JIT_ASM (
-							"IMUL eax, IMM",
-							"IMUL reg32,imm32"
-						)  // o32 69 /r id
-						TRANSLATE ( *jip = 0x69; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(3, SPARE, 0); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = SIGNEXT(SIGNED(IMM)); )
-						jip += 4;
+			// ADD rsp, frame
+			jip = jit_x86_ri (jip, X86_ADD, 8, ESP, frame);
 
-						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+			loop->scalar = jip;
+
+			return jip;
+		}
+#else
+		// i386 translations are not vectorized (see VECTORIZATION)
+		unsigned char * jit_write_vector_loop(unsigned char * jip, jit_vector_loop *loop)
+		{
+			return jip;
+		}
+#endif
+
+		memset(mapping, 0, sizeof(mapping));
+		jip = jit_area;
+
+		if (!jit_fits (jip, 0)) {
+			goto too_big;
+		}
+
+		jip = jit_write_prologue (jip);
+
+		if (zero_is_zero) {
+			// $0 != 0: leave at the start, so that the interpreter runs the loop
+			jip = jit_write_operand_compare (jip, jit_register_operand(0), jit_constant_operand(0));
+			jip = jit_write_leave_unless (jip, 4, EAX, NULL, start);  // Z (zero)
+		}
+
+		unsigned int i;
+		for (i = 0; i < instruction_count; i++)
+		{
+			unsigned int instruction_no = start + i * 4;
+			unsigned int instruction = W32(program, instruction_no);
+			jit_ir *x = &ir[i];
+
+			LOG_DEBUG("translating instruction no. %d at %d: %s ->\n", i, instruction_no, imps_opcode_name(OPCODE));
+
+			if (!jit_fits (jip, 0)) {
+				goto too_big;
+			}
+
+			mapping[i] = jip;
+
+			if (vector_loop[i] && vector_loop[i]->header == i) {
+				jip = jit_write_vector_loop (jip, vector_loop[i]);
+			}
+
+			switch (x->op) {
+				case IR_NOP:
+					// optimized away (see jit_ir_optimize)
+					break;
+
+				case IR_MOVE:
+					if (x->a.reg < 0) {
+						jip = jit_write_set_register (jip, x->dest, x->a.value);
+					} else {
+						jip = jit_write_load_register (jip, EAX, x->a.reg);
+						jip = jit_write_store_register (jip, x->dest);
+					}
+					break;
+
+				case IR_ADD:
+				case IR_SUB:
+				case IR_MUL:
+				case IR_SHL:
+					// move a -> eax, eax op b -> eax, eax -> dest
+					jip = jit_write_load_operand (jip, EAX, x->a);
+					jip = jit_write_operand_operation (jip, x->op, x->b);
+					jip = jit_write_store_register (jip, x->dest);
+					break;
+
+				case IR_LOAD:
+					// a + (index << scale) + offset -> eax, mem[eax] -> eax, eax -> dest
+					jip = jit_write_address (jip, EAX, x, instruction_no);
+					jip = jit_write_load_memory (jip);
+					jip = jit_write_store_register (jip, x->dest);
+					break;
+
+				case IR_STORE:
+					// b + (index << scale) + offset -> scratch, move a -> eax, eax -> mem[scratch]
+					jip = jit_write_address (jip, SCRATCH, x, instruction_no);
+					jip = jit_write_load_operand (jip, EAX, x->a);
+					jip = jit_write_store_memory (jip, SCRATCH);
+					break;
+
+				case IR_BRANCH:
+					{
+						// Intel condition codes of BEQ to BGE: E (equals), NE, L (lower), G (greater), LE, GE
+						static const unsigned int condition_codes[] = { 4, 5, 12, 15, 14, 13 };
+
+						jip = jit_write_operand_compare (jip, x->a, x->b);
+						jip = jit_write_conditional_jump (jip, x->target, condition_codes[x->opcode - BEQ]);
+					}
+					break;
+
+				case IR_JUMP:
+					if (vector_loop[i] && vector_loop[i]->back == i) {
+						// the next iteration, past the vector code, which left fewer than there are lanes
+						jip = jit_write_jump_to (jip, &vector_loop[i]->scalar);
+					} else {
+						jip = jit_write_jump (jip, x->target);
+					}
+					break;
+
+				case IR_JR:
+					/* We cannot determine statically whether the jumping destination (in the register) is inside the JITed instructions or not.
+					 * We need a runtime JIT bounds check for that.
+					 * So we assemble the following:
+					 *   if start <= [destination in register] <= end and it is an instruction address
+					 *     jump to mapping([destination in register])
+					 *   else:
+					 *     jump out of JIT to [destination in register]
+					 */
+					jip = jit_write_load_register (jip, EAX, x->a.reg);
+					jip = jit_write_dispatch (jip);
+					has_jr = 1;
+					break;
+
+				case IR_JAL:
+					/* What we have to do:
+					 *   registers[31] = current_PC + 4;
+					 *   PC = ADDR;
+					 * The rest is just a normal jump.
+					 */
+					jip = jit_write_set_register (jip, 31, x->a.value);
+					jip = jit_write_jump (jip, x->target);
+					break;
+
+				case IR_HALT:
+					if (in_place) {
+						jip = jit_write_leave_at (jip, instruction_no);
+					} else {
+						jip = jit_write_exit (jip);
+					}
+					break;
+
+				default:
+					// JIT: If you say "JIT" one more time, I dare you, I double dare you, the interpreter will run it
+					// Unknown instructions do nothing, but the interpreter may know them (e.g. JIT without a handler)
+					LOG_DEBUG("    instruction %d is left to the interpreter\n", OPCODE);
+					jip = jit_write_leave_at (jip, instruction_no);
+					break;
+			}
+		}
+
+		// the jump table (and the int3 before it) comes on top of the rest
+		if (!jit_fits (jip, has_jr ? 4 * instruction_count + 3 : 0)) {
+			goto too_big;
+		}
+
+		// Falling through the end of a hot loop continues after it, maybe in another one
+		if (in_place) {
+			jip = jit_write_exit_to (jip, end + 4);
+		}
+
+		jip = jit_write_epilogue (jip);
+
+		if (in_place) {
+			jip = jit_write_chain_entry (jip);
+		}
+
+		if (has_jr) {
+			// Aligned for the loads of the entries (jit_area is, see jit_compiler_thread)
+			while ((jip - jit_area) % 4 != 0) {
+				JIT_ASM ( "int3", "INT3" )  // CC
+				*jip = 0xcc;
+				jip++;
+			}
+			jip = jit_write_jump_table (jip);
+		}
+
+		if (fixups.failed) {
+			goto too_big;
+		}
+		jit_fixups_apply(&fixups);
+	}
+
+	free(fixups.entries);
+	return jip - jit_area;
+
+too_big:
+	LOG_DEBUG("translation needs more than the %zu bytes of jit_area\n", jit_area_size);
+	free(fixups.entries);
+	return 0;
+}
+
+// for easier debugging
+static jit_result execute (pc_returning_fn_ptr ptr, unsigned int pc_to_return_to, imps_vm *vm)
+{
+#if JIT_X86_64
+	return ptr(pc_to_return_to, imps_vm_registers(vm), imps_vm_memory(vm));
+#else
+	jit_result result = { ptr(pc_to_return_to, imps_vm_registers(vm), imps_vm_memory(vm)), NULL };
+
+	return result;
+#endif
+}
+
+// CODE CACHE
+
+/* Translations are kept in mmap'd chunks of memory whose pages are writable
+ * only while code is written into them and executable only afterwards (W^X),
+ * so neither the stack nor any other memory is writable and executable at once.
+ * The translated regions are looked up by their start and end address, so entering
+ * a region again (e.g. a hot loop reached from an outer loop) reuses its code,
+ * until a store changes its instructions (see jit_code_written).
+ * The i386 code contains the addresses of the registers and memory of the context,
+ * which is fine as imps-emulator-jit only has one.
+ */
+
+// Size of the first chunk; every further one is twice as big as the one before
+#define JIT_CACHE_CHUNK_SIZE (64 * 1024)
+// No translation of a region in 64 KiB of memory comes close to that
+#define JIT_CACHE_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define JIT_CACHE_BUCKETS 256
+
+typedef struct jit_chunk {
+	unsigned char *base;
+	size_t size;
+	// bytes taken by translations
+	size_t used;
+	struct jit_chunk *previous;
+} jit_chunk;
+
+typedef struct jit_region {
+	unsigned int start, end;
+	int in_place;
+	// The instruction words it was translated from, to notice which stores changed them (see jit_code_written)
+	unsigned int *instructions;
+	// Whether it contains SW, so that running it can change the program
+	int stores;
+	unsigned char *code;
+	// Where linked exits jump to (see jit_write_chain_entry), NULL if it cannot be linked to
+	unsigned char *chain_entry;
+	// Whether $0 was 0 when it was requested (see zero_is_zero in jit_translate)
+	int zero;
+	// The translation requested from the compiler thread and not installed yet, if any (see BACKGROUND COMPILATION)
+	struct jit_request *pending;
+	struct jit_region *next;
+} jit_region;
+
+// An exit (see jit_write_exit_to) that jumps directly to the translation of its target
+typedef struct {
+	// the jump at its end
+	unsigned char *exit;
+	// what it jumped to before
+	int displacement;
+	jit_region *target;
+} jit_link;
+
+typedef struct {
+	// the chunk translations are written to, with the full ones behind it
+	jit_chunk *chunk;
+	jit_region *buckets[JIT_CACHE_BUCKETS];
+	// The hot loop translated last for each loop header, where exits to it continue (see DIRECT CHAINING)
+	jit_region *entries[MEM_SIZE / 4];
+	jit_link *links;
+	size_t link_count, link_capacity;
+	// Where translations are stored for later runs, NULL for none, and the files mapped from there (see PERSISTENT CODE CACHE)
+	char *directory;
+	jit_chunk *files;
+} jit_cache;
+
+static jit_cache cache;
+
+/* Sets the protection of the pages containing bytes from to to of the chunk.
+ * Returns 0 on error.
+ */
+static int jit_cache_protect(jit_chunk *chunk, size_t from, size_t to, int prot)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	from -= from % page_size;
+	return mprotect(chunk->base + from, to - from, prot) == 0;
+}
+
+static jit_chunk * jit_cache_add_chunk(size_t size)
+{
+	jit_chunk *chunk = malloc(sizeof(jit_chunk));
+
+	if (chunk == NULL) {
+		return NULL;
+	}
+	// Not even readable before something is translated into it
+	chunk->base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk->base == MAP_FAILED) {
+		free(chunk);
+		return NULL;
+	}
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->previous = cache.chunk;
+	cache.chunk = chunk;
+	return chunk;
+}
+
+// BACKGROUND COMPILATION
+
+/* Regions are translated by a compiler thread, so that the interpreter does not stop
+ * for the two passes of jit_translate over a big region. Looking up a region that is not
+ * translated yet queues a request with a copy of its instruction words and goes on:
+ * a hot loop is interpreted meanwhile, and the next time it is entered after the compiler
+ * thread is done, the code is installed into the code cache and run (see jit_cache_finish).
+ * So the compiler thread never touches the code cache, and no code is made writable
+ * while the interpreter may be running it.
+ * A JIT instruction waits for its translation instead, as a JIT region has semantics
+ * of its own (e.g. HALT ends the emulator); its requests go to the front of the queue.
+ * With --jit-stats, it prints how long the requests waited in the queue and were translated.
+ */
+
+typedef struct jit_request {
+	// What to translate (see jit_translate)
+	unsigned int start, end;
+	int in_place, zero;
+	unsigned int *instructions;
+	// The translation, for jit_cache_install to copy into the code cache, NULL if it failed
+	unsigned char *code;
+	size_t code_size;
+	// from the start of the code, -1 for none
+	long chain_entry;
+	jit_relocations relocations;
+	// Set by the compiler thread, the fields above are only read after it
+	int done;
+	// Set when the region no longer needs it (e.g. it changed) while it is translated, so that the compiler thread frees it
+	int abandoned;
+	// When it was queued, taken out of the queue and done, in seconds
+	double queued, started, finished;
+	struct jit_request *next;
+} jit_request;
+
+typedef struct {
+	pthread_t thread;
+	int running;
+	// Protects everything below and the requests in the queue
+	pthread_mutex_t lock;
+	// Signalled when a request is queued or the thread shall stop, and when a request is done
+	pthread_cond_t queued, done;
+	jit_request *first, *last;
+	// Stop once the queue is empty
+	int stop;
+	// Statistics (--jit-stats): requests, the ones JIT instructions waited for,
+	// and how often a hot loop was interpreted as its translation was not done yet
+	unsigned long long requests, waited_for, interpreted;
+	double wait_total, wait_max, compile_total, compile_max;
+	// Only used by the compiler thread: the instruction words of the request it translates, at their addresses
+	unsigned char memory[MEM_SIZE];
+} jit_compiler;
+
+static jit_compiler compiler = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+
+static double jit_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void jit_request_free(jit_request *request)
+{
+	free(request->instructions);
+	free(request->code);
+	free(request->relocations.entries);
+	free(request);
+}
+
+/* Takes requests out of the queue and translates them into buffers of their own,
+ * as big as the chunks of the code cache would be, until stopped.
+ */
+static void * jit_compiler_thread(void *arg)
+{
+	imps_vm *vm = arg;
+	jit_request *request;
+
+	pthread_mutex_lock(&compiler.lock);
+	for (;;) {
+		size_t size;
+		double wait, compile;
+
+		while (compiler.first == NULL && !compiler.stop) {
+			pthread_cond_wait(&compiler.queued, &compiler.lock);
+		}
+		if (compiler.first == NULL) {
+			break;
+		}
+		request = compiler.first;
+		compiler.first = request->next;
+		if (compiler.first == NULL) {
+			compiler.last = NULL;
+		}
+		request->started = jit_now();
+		pthread_mutex_unlock(&compiler.lock);
+
+		// Nobody else reads or writes the request until it is done
+		memcpy(&compiler.memory[request->start], request->instructions, request->end - request->start + 4);
+		for (size = JIT_CACHE_CHUNK_SIZE; size <= JIT_CACHE_MAX_CHUNK_SIZE; size *= 2) {
+			unsigned char *chain_entry;
+
+			// Aligned like the functions of the compiler (malloc is)
+			request->code = malloc(size);
+			if (request->code == NULL) {
+				break;
+			}
+			request->relocations.count = 0;
+			request->relocations.failed = 0;
+			request->code_size = jit_translate(vm, compiler.memory, request->start, request->end, request->code, size,
+			                                   request->in_place, request->zero, &chain_entry, &request->relocations);
+			if (request->code_size) {
+				request->chain_entry = chain_entry ? chain_entry - request->code : -1;
+				break;
+			}
+			free(request->code);
+			request->code = NULL;
+		}
+
+		pthread_mutex_lock(&compiler.lock);
+		request->finished = jit_now();
+		wait = request->started - request->queued;
+		compile = request->finished - request->started;
+		compiler.wait_total += wait;
+		compiler.compile_total += compile;
+		if (wait > compiler.wait_max) {
+			compiler.wait_max = wait;
+		}
+		if (compile > compiler.compile_max) {
+			compiler.compile_max = compile;
+		}
+		if (request->abandoned) {
+			jit_request_free(request);
+		} else {
+			request->done = 1;
+			pthread_cond_broadcast(&compiler.done);
+		}
+	}
+	pthread_mutex_unlock(&compiler.lock);
+	return NULL;
+}
+
+/* Queues the translation of region with its instruction words as they are now,
+ * at the front of the queue if urgent. Starts the compiler thread for vm if it is not running.
+ * Returns the request, or NULL on error.
+ */
+static jit_request * jit_compiler_request(imps_vm *vm, const jit_region *region, int urgent)
+{
+	size_t length = region->end - region->start + 4;
+	jit_request *request = calloc(1, sizeof(jit_request));
+
+	if (request == NULL || (request->instructions = malloc(length)) == NULL) {
+		free(request);
+		return NULL;
+	}
+	request->start = region->start;
+	request->end = region->end;
+	request->in_place = region->in_place;
+	request->zero = region->zero;
+	memcpy(request->instructions, region->instructions, length);
+
+	pthread_mutex_lock(&compiler.lock);
+	if (!compiler.running) {
+		if (pthread_create(&compiler.thread, NULL, jit_compiler_thread, vm) != 0) {
+			pthread_mutex_unlock(&compiler.lock);
+			jit_request_free(request);
+			return NULL;
+		}
+		compiler.running = 1;
+	}
+	request->queued = jit_now();
+	if (urgent) {
+		request->next = compiler.first;
+		compiler.first = request;
+		if (compiler.last == NULL) {
+			compiler.last = request;
+		}
+	} else {
+		if (compiler.last != NULL) {
+			compiler.last->next = request;
+		} else {
+			compiler.first = request;
+		}
+		compiler.last = request;
+	}
+	compiler.requests++;
+	pthread_cond_signal(&compiler.queued);
+	pthread_mutex_unlock(&compiler.lock);
+
+	LOG_DEBUG("compiler: requested the translation of %d to %d\n", region->start, region->end);
+	return request;
+}
+
+/* Lets go of a request: frees it, unless the compiler thread is translating it
+ * and frees it when it is done.
+ */
+static void jit_compiler_abandon(jit_request *request)
+{
+	jit_request **p, *previous = NULL;
+
+	pthread_mutex_lock(&compiler.lock);
+	for (p = &compiler.first; *p != NULL; previous = *p, p = &(*p)->next) {
+		if (*p == request) {
+			break;
+		}
+	}
+	if (*p != NULL) {
+		// Still queued
+		*p = request->next;
+		if (compiler.last == request) {
+			compiler.last = previous;
+		}
+		jit_request_free(request);
+	} else if (request->done) {
+		jit_request_free(request);
+	} else {
+		request->abandoned = 1;
+	}
+	pthread_mutex_unlock(&compiler.lock);
+}
+
+/* Returns whether the request is done, waiting for that with wait. */
+static int jit_compiler_done(jit_request *request, int wait)
+{
+	int done;
+
+	pthread_mutex_lock(&compiler.lock);
+	if (!request->done) {
+		if (wait) {
+			compiler.waited_for++;
+			while (!request->done) {
+				pthread_cond_wait(&compiler.done, &compiler.lock);
+			}
+		} else {
+			compiler.interpreted++;
+		}
+	}
+	done = request->done;
+	pthread_mutex_unlock(&compiler.lock);
+	return done;
+}
+
+/* Stops the compiler thread. With drain, it translates the requests still queued first,
+ * otherwise they are left for jit_cache_destroy to free.
+ */
+static void jit_compiler_stop(int drain)
+{
+	if (!compiler.running) {
+		return;
+	}
+	pthread_mutex_lock(&compiler.lock);
+	if (!drain) {
+		compiler.first = compiler.last = NULL;
+	}
+	compiler.stop = 1;
+	pthread_cond_signal(&compiler.queued);
+	pthread_mutex_unlock(&compiler.lock);
+	pthread_join(compiler.thread, NULL);
+	compiler.running = 0;
+}
+
+static void jit_compiler_print_stats(FILE *out)
+{
+	unsigned long long requests = compiler.requests ? compiler.requests : 1;
+
+	fprintf(out, "compiler: %llu requests, %llu waited for by JIT instructions, %llu hot loop entries interpreted while translating\n",
+		compiler.requests, compiler.waited_for, compiler.interpreted);
+	fprintf(out, "queue wait:   %10.3f ms mean, %10.3f ms max\n", compiler.wait_total * 1000 / requests, compiler.wait_max * 1000);
+	fprintf(out, "compile time: %10.3f ms mean, %10.3f ms max\n", compiler.compile_total * 1000 / requests, compiler.compile_max * 1000);
+}
+
+/* Copies the translation of the request into the current chunk, or into a new, bigger one
+ * if it does not fit, putting in the absolute addresses for its new place (see RELOCATIONS).
+ * Returns the code, with its chain entry in chain_entry, or NULL if there is no memory for it.
+ */
+static unsigned char * jit_cache_install(imps_vm *vm, const jit_request *request, unsigned char **chain_entry)
+{
+	jit_chunk *chunk = cache.chunk;
+	size_t offset = 0, size, i;
+	unsigned char *code;
+
+	if (request->relocations.failed) {
+		return NULL;
+	}
+
+	// Aligned like the functions of the compiler
+	while (chunk == NULL || (offset = (chunk->used + 15) & ~15) + request->code_size > chunk->size) {
+		size = chunk ? chunk->size * 2 : JIT_CACHE_CHUNK_SIZE;
+		if (size > JIT_CACHE_MAX_CHUNK_SIZE) {
+			return NULL;
+		}
+		LOG_DEBUG("code cache: adding a chunk of %zu bytes\n", size);
+		chunk = jit_cache_add_chunk(size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+	}
+
+	code = chunk->base + offset;
+	if (!jit_cache_protect(chunk, offset, offset + request->code_size, PROT_READ | PROT_WRITE)) {
+		return NULL;
+	}
+	memcpy(code, request->code, request->code_size);
+	for (i = 0; i < request->relocations.count; i++) {
+		const jit_relocation *relocation = &request->relocations.entries[i];
+
+		W32(code, relocation->offset) += jit_relocation_base(relocation, code, vm) - jit_relocation_base(relocation, request->code, vm);
+	}
+	if (!jit_cache_protect(chunk, offset, offset + request->code_size, PROT_READ | PROT_EXEC)) {
+		return NULL;
+	}
+	chunk->used = offset + request->code_size;
+
+	*chain_entry = request->chain_entry >= 0 ? code + request->chain_entry : NULL;
+	return code;
+}
+
+// PERSISTENT CODE CACHE
+
+/* With a cache directory (--jit-cache), every translation is also written to a file there,
+ * named after a hash of what it is a translation of: the instruction words, start and end,
+ * in_place, whether $0 was 0, the pages of the program (whose stores are checked, see jit_write_address),
+ * the SIMD instructions used and the version of the backend.
+ * Later runs map the file instead of translating the region again. The code is stored
+ * without its absolute addresses (see RELOCATIONS), which are put back in while the mapping
+ * is writable, before it is made executable (W^X as for the chunks). Files also hold
+ * the instruction words, so that regions whose hashes collide are translated anyway.
+ * They are written under a temporary name and renamed, so that processes running at the
+ * same time (e.g. batch jobs of the same program) never map a half-written one.
+ */
+
+#define JIT_DISK_CACHE_MAGIC "IMPSJITC"
+// Changes whenever the generated code does, so that files of other emulator versions are never used
+#define JIT_DISK_CACHE_VERSION 4
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	// What the code is a translation of (see above)
+	unsigned int start, end;
+	int in_place, zero, simd, x86_64;
+	unsigned int program_pages;
+	// Followed by the instruction words, the relocations and, at code_offset (page aligned), the code
+	unsigned int relocation_count;
+	unsigned int code_offset, code_size;
+	// from the start of the code, -1 for none
+	int chain_entry;
+} jit_disk_cache_header;
+
+/* Fills in the fields of header up to relocation_count for the translation of region in vm,
+ * and writes the name of its file into path, which has room for strlen(cache.directory) + 32 bytes
+ */
+static void jit_disk_cache_key(imps_vm *vm, const jit_region *region, jit_disk_cache_header *header, char *path)
+{
+	const unsigned char *bytes = (const unsigned char *) header;
+	// FNV-1a
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t i;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, JIT_DISK_CACHE_MAGIC, sizeof(header->magic));
+	header->version = JIT_DISK_CACHE_VERSION;
+	header->start = region->start;
+	header->end = region->end;
+	header->in_place = region->in_place;
+	header->zero = region->zero;
+	header->simd = simd;
+	header->x86_64 = JIT_X86_64;
+	header->program_pages = (imps_vm_program_size(vm) + IMPS_CODE_PAGE_SIZE - 1) / IMPS_CODE_PAGE_SIZE;
+
+	for (i = 0; i < offsetof(jit_disk_cache_header, relocation_count); i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	bytes = (const unsigned char *) region->instructions;
+	for (i = 0; i < region->end - region->start + 4; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	sprintf(path, "%s/%016llx.jit", cache.directory, hash);
+}
+
+/* Maps the stored translation of region, if there is one, setting its chain entry.
+ * Returns its code, or NULL if there is none.
+ */
+static unsigned char * jit_disk_cache_load(imps_vm *vm, jit_region *region)
+{
+	char path[strlen(cache.directory) + 32];
+	size_t length = region->end - region->start + 4;
+	jit_disk_cache_header key;
+	const jit_disk_cache_header *header;
+	const jit_relocation *relocations;
+	unsigned char *base, *code;
+	jit_chunk *chunk;
+	struct stat file_stat;
+	size_t size, i;
+	int fd;
+
+	jit_disk_cache_key(vm, region, &key, path);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(key) + length) {
+		close(fd);
+		return NULL;
+	}
+	size = file_stat.st_size;
+	// Private, so that relocating and linking its code does not change the file
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = (const jit_disk_cache_header *) base;
+	relocations = (const jit_relocation *) (base + sizeof(key) + length);
+	code = base + header->code_offset;
+	if (memcmp(header, &key, offsetof(jit_disk_cache_header, relocation_count)) != 0
+	 || memcmp(base + sizeof(key), region->instructions, length) != 0
+	 || sizeof(key) + length + (size_t) header->relocation_count * sizeof(jit_relocation) > header->code_offset
+	 || (size_t) header->code_offset + header->code_size > size
+	 || header->chain_entry >= (int) header->code_size) {
+		LOG_DEBUG("code cache: %s is no translation of %d to %d\n", path, region->start, region->end);
+		munmap(base, size);
+		return NULL;
+	}
 
-					case LW:
-						// move R2 -> eax, eax + IMM -> eax, mem[eax] -> eax, eax -> R1
-						// TODO improve: find shorter sequence
+	for (i = 0; i < header->relocation_count; i++) {
+		if ((size_t) relocations[i].offset + 4 > header->code_size || relocations[i].kind > JIT_RELOCATE_EXIT_HIGH) {
+			munmap(base, size);
+			return NULL;
+		}
+		W32(code, relocations[i].offset) += jit_relocation_base(&relocations[i], code, vm);
+	}
+	region->chain_entry = header->chain_entry >= 0 ? code + header->chain_entry : NULL;
 
-						JIT_ASM (
-							"MOV eax, r2",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+	chunk = malloc(sizeof(jit_chunk));
+	if (chunk == NULL || mprotect(base, size, PROT_READ | PROT_EXEC) != 0) {
+		free(chunk);
+		munmap(base, size);
+		return NULL;
+	}
+	chunk->base = base;
+	chunk->size = chunk->used = size;
+	chunk->previous = cache.files;
+	cache.files = chunk;
 
-						JIT_ASM (
-							"ADD eax, IMM",
-							"ADD EAX,imm32"
-						)  // o32 05 id
-						TRANSLATE ( *jip = 0x05; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = SIGNEXT(SIGNED(IMM)); )
-						jip += 4;
+	LOG_DEBUG("code cache: mapped the translation of %d to %d from %s\n", region->start, region->end, path);
+	return code;
+}
 
-						JIT_ASM (
-							"MOV eax, [eax]",
-							"MOV reg32,r/m32"
-						)  // o32 8B /r
-						TRANSLATE ( *jip = 0x8b; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = MODRM(2, EAX, EAX); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) memory; )
-						jip += 4;
+/* Writes the translation of region done for request to the cache directory. */
+static void jit_disk_cache_store(imps_vm *vm, const jit_region *region, const jit_request *request)
+{
+	size_t code_size = request->code_size;
+	char path[strlen(cache.directory) + 32];
+	char temporary_path[sizeof(path) + 32];
+	size_t length = region->end - region->start + 4;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t header_size, i;
+	jit_disk_cache_header header;
+	unsigned char *code;
+	FILE *file;
+	int written;
+
+	if (request->relocations.failed || (code = malloc(code_size)) == NULL) {
+		return;
+	}
 
-						JIT_ASM (
-							"MOV R1, eax",
-							"MOV memoffs32,EAX"
-						)  // o32 A3 ow/od
-						TRANSLATE ( *jip = 0xa3; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
-						break;
+	jit_disk_cache_key(vm, region, &header, path);
+	header_size = sizeof(header) + length + request->relocations.count * sizeof(jit_relocation);
+	header.relocation_count = request->relocations.count;
+	header.code_offset = (header_size + page_size - 1) / page_size * page_size;
+	header.code_size = code_size;
+	header.chain_entry = request->chain_entry;
+
+	// Without the addresses of this process
+	memcpy(code, request->code, code_size);
+	for (i = 0; i < request->relocations.count; i++) {
+		W32(code, request->relocations.entries[i].offset) -= jit_relocation_base(&request->relocations.entries[i], request->code, vm);
+	}
 
-					case SW:
-						// move R1 -> eax, R2 -> ebx, eax -> mem[ebx + C]
+	sprintf(temporary_path, "%s.%d.tmp", path, (int) getpid());
+	file = fopen(temporary_path, "wb");
+	if (!file) {
+		LOG_DEBUG("code cache: cannot write %s\n", temporary_path);
+		free(code);
+		return;
+	}
+	written = fwrite(&header, sizeof(header), 1, file) == 1
+	       && fwrite(region->instructions, length, 1, file) == 1
+	       && fwrite(request->relocations.entries, sizeof(jit_relocation), request->relocations.count, file) == request->relocations.count
+	       && fseek(file, header.code_offset, SEEK_SET) == 0
+	       && fwrite(code, code_size, 1, file) == 1;
+	written = fclose(file) == 0 && written;
+	free(code);
+
+	if (!written || rename(temporary_path, path) != 0) {
+		LOG_DEBUG("code cache: cannot write %s\n", path);
+		unlink(temporary_path);
+	}
+}
 
-						JIT_ASM (
-							"MOV eax, r1",
-							"MOV EAX,memoffs32"
-						)  // o32 A1 ow/od
-						TRANSLATE ( *jip = 0xa1; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R1]; )
-						jip += 4;
+// DIRECT CHAINING
+
+/* Exits to a PC known at translation time (branches and jumps out of the translation and
+ * falling through the end of a hot loop, see jit_write_exit_to) return their address
+ * to jit_run_region(). It works as the stub shared by all of them: if a hot loop starts
+ * at the PC, it runs that one right away instead of going back to the interpreter,
+ * and links the exit to it by patching its jump to the chain entry of the hot loop,
+ * so that the next time it is taken, it stays in native code.
+ * Only x86-64 translations are linked.
+ *
+ * A linked exit does not come back to the interpreter anymore, which is where stores
+ * into translated instructions are noticed (see jit_code_written), so links are only made
+ * between translations without SW, and the ones to a translation are undone when it is dropped.
+ */
 
-						JIT_ASM (
-							"MOV ebx, r2",
-							"MOV reg32,r/m32"
-						)  // o32 8B /r
-						TRANSLATE ( *jip = 0x8b; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(0, EBX, 5); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[R2]; )
-						jip += 4;
+/* Points the jump ending at jump + 5 (see jit_write_exit_to) to jump + 5 + displacement.
+ * Returns 0 if the pages cannot be made writable, or if jump is not in the code cache.
+ */
+static int jit_patch_jump(unsigned char *jump, int displacement)
+{
+	jit_chunk *chunk;
+	size_t offset;
 
-						JIT_ASM (
-							"MOV mem[R2 + IMM], eax",
-							"MOV r/m32,reg32"
-						)  //  o32 89 /r
-						// where mem[R2 + IMM] = memory + IMM + R2 and memory + IMM is a constant
-						TRANSLATE ( *jip = 0x89; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = MODRM(2, EAX, EBX); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = ((int) memory) + SIGNEXT(SIGNED(IMM)) ; )
-						jip += 4;
-						break;
+	for (chunk = cache.chunk; chunk != NULL; chunk = chunk->previous) {
+		if (chunk->base <= jump && jump < chunk->base + chunk->size) {
+			break;
+		}
+	}
+	// or mapped from a file
+	if (chunk == NULL) {
+		for (chunk = cache.files; chunk != NULL; chunk = chunk->previous) {
+			if (chunk->base <= jump && jump < chunk->base + chunk->size) {
+				break;
+			}
+		}
+	}
+	if (chunk == NULL) {
+		return 0;
+	}
+	offset = jump - chunk->base;
 
-					case BEQ:
-						jip = jit_write_conditional_jump(jip, count_only, i, instruction, 4);  // E (equals)
-						break;
+	if (!jit_cache_protect(chunk, offset, offset + 5, PROT_READ | PROT_WRITE)) {
+		return 0;
+	}
+	W32(jump, 1) = displacement;
+	return jit_cache_protect(chunk, offset, offset + 5, PROT_READ | PROT_EXEC);
+}
 
-					case BNE:
-						jip = jit_write_conditional_jump(jip, count_only, i, instruction, 5);  // NE (not equals)
-						break;
+/* Links the exit to the translation, if its chain entry is in reach of the jump. */
+static void jit_link_exit(unsigned char *exit, jit_region *target)
+{
+	long displacement = target->chain_entry - (exit + 5);
 
-					case BLT:
-						jip = jit_write_conditional_jump(jip, count_only, i, instruction, 12);  // L (lower)
-						break;
+	if (displacement != (int) displacement) {
+		return;
+	}
+	if (cache.link_count == cache.link_capacity) {
+		size_t capacity = cache.link_capacity ? cache.link_capacity * 2 : 64;
+		jit_link *links = realloc(cache.links, capacity * sizeof(jit_link));
 
-					case BGT:
-						jip = jit_write_conditional_jump(jip, count_only, i, instruction, 15);  // G (greater)
-						break;
+		if (links == NULL) {
+			return;
+		}
+		cache.links = links;
+		cache.link_capacity = capacity;
+	}
 
-					case BLE:
-						jip = jit_write_conditional_jump(jip, count_only, i, instruction, 14);  // LE (lower equal)
-						break;
+	cache.links[cache.link_count].exit = exit;
+	cache.links[cache.link_count].displacement = W32(exit, 1);
+	cache.links[cache.link_count].target = target;
+	if (jit_patch_jump(exit, displacement)) {
+		LOG_DEBUG("code cache: linking exit %p to the translation of %d to %d\n", exit, target->start, target->end);
+		cache.link_count++;
+	}
+}
 
-					case BGE:
-						jip = jit_write_conditional_jump(jip, count_only, i, instruction, 13);  // GE (greater equals)
-						break;
+/* Lets the exits linked to the translation return to the interpreter again. */
+static void jit_unlink(jit_region *target)
+{
+	size_t i = 0;
+
+	while (i < cache.link_count) {
+		if (cache.links[i].target == target) {
+			LOG_DEBUG("code cache: unlinking exit %p from the translation of %d to %d\n", cache.links[i].exit, target->start, target->end);
+			jit_patch_jump(cache.links[i].exit, cache.links[i].displacement);
+			cache.links[i] = cache.links[--cache.link_count];
+		} else {
+			i++;
+		}
+	}
+}
 
-					case JMP:
-						jip = jit_write_jump(jip, count_only, i, instruction);
-						break;
+/* Drops the code of region (which stays in the cache until jit_cache_destroy) and its request,
+ * if any, so that it is translated again the next time it is looked up, and gives up its code pages.
+ */
+static void jit_cache_drop(imps_vm *vm, jit_region *region)
+{
+	// Exits linked to the old code must not jump there anymore
+	jit_unlink(region);
+	region->code = NULL;
+	if (region->pending != NULL) {
+		jit_compiler_abandon(region->pending);
+		region->pending = NULL;
+	}
+	imps_vm_remove_code(vm, region->start, region->end - region->start + 4);
+}
 
-					case JR:
-						/* We cannot determine statically whether the jumping destination (in the register) is inside the JITed instructions or not.
-						 * We need a runtime JIT bounds check for that.
-						 * So we assemble the following:
-						 *   if running_jit_start_instruction_no <= [destination in register] <= running_jit_end_instruction_no
-						 *     jump to mapping([destination in register])
-						 *   else:
-						 *     jump out of JIT to [destination in register]
-						 */
+/* Drops the translations of the instructions that changed among the bytes from addr
+ * to addr + length - 1 (see jit_cache_drop). This is the imps_code_write_handler of imps-emulator-jit:
+ * the code pages of a region are the ones of its instructions from when it was looked up
+ * until it is dropped, so that no store can change them unnoticed.
+ */
+void jit_code_written(imps_vm *vm, unsigned int addr, size_t length)
+{
+	unsigned char *memory = imps_vm_memory(vm);
+	jit_region *region;
+	int i;
 
-						// SOTA
+	for (i = 0; i < JIT_CACHE_BUCKETS; i++) {
+		for (region = cache.buckets[i]; region != NULL; region = region->next) {
+			if ((region->code != NULL || region->pending != NULL) && region->start < addr + length && addr <= region->end + 3
+			 && memcmp(region->instructions, &memory[region->start], region->end - region->start + 4) != 0) {
+				LOG_DEBUG("code cache: region %d to %d was changed, dropping its translation\n", region->start, region->end);
+				jit_cache_drop(vm, region);
+			}
+		}
+	}
+}
 
-						LOG_ERROR("TRANSLATING JAR INSTRUCTION NEEDS RUNTIME JIT CHECK, NOT IMPLEMENTED YET.\n");
-						return 1;
-						break;
+/* Installs the translation requested for region once the compiler thread is done with it,
+ * waiting for that with wait (see BACKGROUND COMPILATION), and stores it in the cache directory.
+ * Returns the region, without code if the compiler thread is not done yet,
+ * or NULL if it cannot be translated.
+ */
+static jit_region * jit_cache_finish(imps_vm *vm, jit_region *region, int wait)
+{
+	jit_request *request = region->pending;
 
-					case JAL:
-						/* What we have to do:
-						 *   registers[31] = current_PC + 4;
-						 *   PC = ADDR;
-						 * and current_PC = instruction_no (= start + i * 4).
-						 */
+	if (!jit_compiler_done(request, wait)) {
+		return region;
+	}
 
-						JIT_ASM (
-							"mov instruction_no+4, r31",
-							"MOV r/m32,imm32"
-						)  // o32 C7 /0 id
-						TRANSLATE ( *jip = 0xc7; )
-						jip++;
-						TRANSLATE ( *jip = MODRM(0, 0, 5); )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) &registers[31]; )
-						jip += 4;
-						TRANSLATE ( W32(jip, 0) = (int) instruction_no + 4; )
-						jip += 4;
+	region->pending = NULL;
+	if (request->code != NULL) {
+		region->code = jit_cache_install(vm, request, &region->chain_entry);
+		if (region->code != NULL && cache.directory) {
+			jit_disk_cache_store(vm, region, request);
+		}
+	}
+	jit_request_free(request);
 
-						// The rest is just a normal jump, and although this instruction is not of type JMP, we can just pass in instruction, because the imm part of JMP and JAL look exactly alike and jit_write_jump only uses the imm part.
-						jip = jit_write_jump(jip, count_only, i, instruction);
-						break;
+	// Without code, it is requested again next time
+	if (region->code == NULL) {
+		jit_cache_drop(vm, region);
+		return NULL;
+	}
+	if (region->in_place) {
+		cache.entries[region->start / 4] = region;
+	}
+	return region;
+}
 
-					case HALT:
-						;
-						unsigned char * addr_after_instruction = jip + 5; // because this instruction has jip++, +=4
+/* Returns the translation of the instructions from start to end, requesting it
+ * only if they were not translated before or changed since (see jit_code_written), or NULL if that fails.
+ * With wait, it waits for the compiler thread; otherwise the code of the region
+ * is NULL until a later lookup finds the compiler thread done and installs it.
+ */
+jit_region * jit_cache_lookup(imps_vm *vm, unsigned int start, unsigned int end, int in_place, int wait)
+{
+	unsigned char *memory = imps_vm_memory(vm);
+	size_t length = end - start + 4;
+	jit_region **bucket = &cache.buckets[(start / 4 * 31 + end / 4) % JIT_CACHE_BUCKETS];
+	jit_region *region;
+	unsigned int pc;
+
+	for (region = *bucket; region != NULL; region = region->next) {
+		if (region->start == start && region->end == end && region->in_place == in_place) {
+			break;
+		}
+	}
 
-						JIT_ASM (
-							"jmp jit_exit",
-							"JMP imm"
-						)  // E9 rw/rd
-						TRANSLATE ( *jip = 0xe9; )
-						jip++;
-						TRANSLATE ( W32(jip, 0) = (int) ((int) jit_exit - (int) addr_after_instruction); )
-						jip += 4;
-						break;
+	if (region != NULL && region->code != NULL) {
+		return region;
+	}
+	if (region != NULL && region->pending != NULL) {
+		return jit_cache_finish(vm, region, wait);
+	}
 
-					case JIT:
-						LOG_ERROR("ATTEMPT TO TRANSLATE JIT INSTRUCTION. If you say \"JIT\" one more time, I dare you, I double dare you, I will not implement this one!");
-						return 1;
+	if (region == NULL) {
+		region = calloc(1, sizeof(jit_region));
+		if (region == NULL) {
+			return NULL;
+		}
+		region->instructions = malloc(length);
+		if (region->instructions == NULL) {
+			free(region);
+			return NULL;
+		}
+		region->start = start;
+		region->end = end;
+		region->in_place = in_place;
+		region->next = *bucket;
+		*bucket = region;
+	}
 
-					default:
-						LOG_ERROR("ATTEMPT TO TRANSLATE UNKNOWN INSTRUCTION %d", OPCODE);
-						print_instruction_binary(instruction);
-						LOG_ERROR("\n");
-						return 1;
-				}
-			}
+	memcpy(region->instructions, &memory[start], length);
+	imps_vm_add_code(vm, start, length);
+	region->stores = 0;
+	for (pc = start; pc <= end; pc += 4) {
+		if (W32(memory, pc) >> 26 == SW) {
+			region->stores = 1;
+		}
+	}
+	region->zero = in_place && imps_vm_register(vm, 0) == 0;
 
-			jip = jit_write_leave (jip, count_only);
+	region->code = cache.directory ? jit_disk_cache_load(vm, region) : NULL;
+	if (region->code != NULL) {
+		if (in_place) {
+			cache.entries[start / 4] = region;
 		}
+		return region;
 	}
 
-	// RET
-	*jip = 0xc3;
-	
-	return 1;
+	region->pending = jit_compiler_request(vm, region, wait);
+	if (region->pending == NULL) {
+		jit_cache_drop(vm, region);
+		return NULL;
+	}
+	return jit_cache_finish(vm, region, wait);
 }
 
-// for easier debugging
-static unsigned int execute (pc_returning_fn_ptr ptr, unsigned int pc_to_return_to)
+/* Returns the hot loop translation starting at pc (translated again if it changed),
+ * or NULL if there is none or it is not done yet.
+ */
+static jit_region * jit_cache_entry(imps_vm *vm, unsigned int pc)
 {
-	return ptr(pc_to_return_to);
-}
+	jit_region *region;
 
-static void check_assertions() {
-	// Check if there are as many elements in the instruction enum as in the instruction names array.
-	assert(sizeof(INSTRUCTION_NAMES) / sizeof(char*) == LAST_OPCODE);
+	if (pc % 4 != 0 || pc >= MEM_SIZE || (region = cache.entries[pc / 4]) == NULL) {
+		return NULL;
+	}
+	region = jit_cache_lookup(vm, region->start, region->end, 1, 0);
+	return region != NULL && region->code != NULL ? region : NULL;
 }
 
-int main (int argc, char *argv[])
+/* Stops the compiler thread. With a cache directory, it finishes the translations
+ * still requested first and stores them, so that the next run finds them.
+ */
+void jit_cache_flush(imps_vm *vm)
 {
-	check_assertions();
+	jit_region *region;
+	int i;
 
-	if (argc != 2) {
-		LOG_ERROR("imps-emulator takes exactly one argument\n");
-		return 1;
+	jit_compiler_stop(cache.directory != NULL);
+	if (cache.directory == NULL) {
+		return;
+	}
+	for (i = 0; i < JIT_CACHE_BUCKETS; i++) {
+		for (region = cache.buckets[i]; region != NULL; region = region->next) {
+			if (region->pending != NULL && region->pending->done && region->pending->code != NULL) {
+				jit_disk_cache_store(vm, region, region->pending);
+			}
+		}
 	}
+}
 
-	// The memory of the emulator, fixed to 16 bit byte-addressable space
-	unsigned char memory[MEM_SIZE] = {0};
-	// program size in bytes
-	unsigned int program_size = 0;
+void jit_cache_destroy()
+{
+	int i;
+
+	// The requests it did not take yet are freed with their regions
+	jit_compiler_stop(0);
+
+	for (i = 0; i < JIT_CACHE_BUCKETS; i++) {
+		while (cache.buckets[i] != NULL) {
+			jit_region *next = cache.buckets[i]->next;
+
+			if (cache.buckets[i]->pending != NULL) {
+				jit_request_free(cache.buckets[i]->pending);
+			}
+			free(cache.buckets[i]->instructions);
+			free(cache.buckets[i]);
+			cache.buckets[i] = next;
+		}
+	}
+	memset(cache.entries, 0, sizeof(cache.entries));
+	free(cache.links);
+	cache.links = NULL;
+	cache.link_count = cache.link_capacity = 0;
+	while (cache.chunk != NULL) {
+		jit_chunk *previous = cache.chunk->previous;
+
+		munmap(cache.chunk->base, cache.chunk->size);
+		free(cache.chunk);
+		cache.chunk = previous;
+	}
+	while (cache.files != NULL) {
+		jit_chunk *previous = cache.files->previous;
 
-	// The 32 general-purpose registers of the emulator, each 32 bit
-	int registers[32] = {0};
+		munmap(cache.files->base, cache.files->size);
+		free(cache.files);
+		cache.files = previous;
+	}
+}
 
-	// Special registers
-	unsigned int PC = 0;
+/* Marks the decode cache entries stale that stores of generated code may have changed,
+ * as they do not go through it. Hot loops translated in place leave their stores onto code pages
+ * to the interpreter (see jit_write_code_page_check), which invalidates those words itself,
+ * so after them only the words off the code pages are invalidated.
+ */
+static void jit_invalidate_decoded(imps_vm *vm, int in_place)
+{
+	const imps_code_map *code_map = imps_vm_code_map(vm);
+	unsigned int page, from = 0;
 
-	// Runtime information for code in the JIT about which instruction range has been JITed.
-	// While code is interpreted instead of JITed, these are set to -1.
-	int running_jit_start_instruction_no = -1;
-	int running_jit_end_instruction_no = -1;
+	if (!in_place || code_map->low > code_map->high) {
+		imps_vm_invalidate_decoded(vm, 0, MEM_SIZE);
+		return;
+	}
+	// from is the start of the pages since the last code page
+	for (page = code_map->low / IMPS_CODE_PAGE_SIZE; page <= code_map->high / IMPS_CODE_PAGE_SIZE; page++) {
+		if (code_map->pages[page]) {
+			imps_vm_invalidate_decoded(vm, from, page * IMPS_CODE_PAGE_SIZE - from);
+			from = (page + 1) * IMPS_CODE_PAGE_SIZE;
+		}
+	}
+	imps_vm_invalidate_decoded(vm, from, MEM_SIZE - from);
+}
 
-	char *program_filename = argv[1];
+/* Runs the translation of a region from its start, with the interpreter
+ * continuing at pc_to_return_to unless the code leaves at another PC.
+ * Exits to hot loops continue there and are linked to them (see DIRECT CHAINING).
+ */
+void jit_run_region(imps_vm *vm, jit_region *region, unsigned int pc_to_return_to)
+{
+	jit_result result;
+	jit_region *target;
+	int stores = 0;
+	// whether all regions that stored were translated in place
+	int in_place = 1;
+
+	for (;;) {
+		// Jump into the generated native instructions
+		// The generated code will return here
+		// The return value (which is in eax, set by jit_write_leave) tells us where to continue.
+		LOG_DEBUG("Jumping into generated code for %d to %d ...\n", region->start, region->end);
+		result = execute((pc_returning_fn_ptr) region->code, pc_to_return_to, vm);
+		LOG_DEBUG("... generated code returned, setting PC to %lu\n", result.pc);
+		stores |= region->stores;
+		if (region->stores && !region->in_place) {
+			// JIT regions store without checking the code pages (see jit_translate)
+			jit_code_written(vm, 0, MEM_SIZE);
+			in_place = 0;
+		}
 
-	program_size = read_binary_file_into_buffer(program_filename, memory, MEM_SIZE);
+		if (result.exit == NULL || (target = jit_cache_entry(vm, result.pc)) == NULL) {
+			break;
+		}
+		if (!region->stores && !target->stores && target->chain_entry != NULL) {
+			jit_link_exit(result.exit, target);
+		}
+		region = target;
+		pc_to_return_to = target->end + 4;
+	}
+	imps_vm_set_pc(vm, result.pc);
 
-	LOG_DEBUG("read %d bytes from program file\n", program_size);
+	if (stores) {
+		jit_invalidate_decoded(vm, in_place);
+	}
+}
 
-	while (1) {
-		LOG_DEBUG("PC: %d\t- ", PC);
+/* Executes the JIT instruction at the PC of vm: translates the instruction range following it
+ * (unless it is in the code cache already) and runs the generated code, which sets the PC
+ * to where the interpreter shall continue.
+ * Returns 1 on success, 0 on error. This is the imps_jit_handler of imps-emulator-jit.
+ */
+int jit_run(imps_vm *vm)
+{
+	unsigned char *memory = imps_vm_memory(vm);
+	unsigned int program_size = imps_vm_program_size(vm);
+	unsigned int PC = imps_vm_pc(vm);
+	jit_region *region;
+
+	/* Layout:
+	 *
+	 *       [... some code ...]
+	 * PC -> JIT init instruction
+	 *       jit_instructions_start
+	 *       jit_instructions_end
+	 *       [... some code ...] ("place a")
+	 */
+	LOG_DEBUG("JIT: checking for instruction start and end addresses\n");
+	if (PC + 8 + 4 > program_size) {
+		LOG_ERROR("JIT instruction lacks following start and end addresses\n");	
+		return 0;
+	}
+	
+	// TODO add relative start address + length
+	
+	/* Treat all bytes b code jit_instruction_start <= b <= jit_instruction_end
+	 * as 32-bit IMPS instructions and JIT-compile them.
+	 */
+	unsigned int jit_instructions_start = W32(memory, PC + 4);
+	unsigned int jit_instructions_end = W32(memory, PC + 8);
+	
+	// Check that start and end address are in memory range
+	if (!jit_check_translation_range(jit_instructions_start, jit_instructions_end, program_size)) {
+		LOG_ERROR(" - JIT start/end (%d/%d) instructions are illegal\n", jit_instructions_start, jit_instructions_end);
+		return 0;
+	}
+	
+	// Translate all those instructions into machine instructions
+	// The interpreter cannot run a JIT region for us meanwhile (see BACKGROUND COMPILATION)
+	region = jit_cache_lookup(vm, jit_instructions_start, jit_instructions_end, 0, 1);
+	
+	if (region == NULL) {
+		LOG_ERROR(" JIT TRANLATION UNSUCCESSFUL\n");
+		return 0;
+	}
 
-		// fetch
+	jit_run_region(vm, region, PC + 12);  // 12 = offset of "place a"
 
-		unsigned int instruction = W32(memory, PC);
-		
-		// execute
+	return 1;
+}
 
-		DEBUG(print_instruction_binary(instruction));
-		LOG_DEBUG(" ");
+/* Requests the translation of the loop from header_pc to its closing branch at branch_pc
+ * (unless it is in the code cache already) and, once it is there, runs it from header_pc
+ * until it jumps out or falls through the closing branch.
+ * This is the imps_hot_loop_handler of imps-emulator-jit.
+ */
+int jit_run_hot_loop(imps_vm *vm, unsigned int header_pc, unsigned int branch_pc)
+{
+	jit_region *region;
 
-		switch (OPCODE) {
-		
-			case HALT:
-				LOG_DEBUG("HALT\n");
-				// The spec does not say this, but the provied result files increment the PC after HALT
-				PC += 4;
-				print_state(PC, registers);
-				return 0;
-			
-			// Arithmetics
-			
-			case ADD:
-				LOG_DEBUG("ADD R%d = R%d + R%d\n", R1, R2, R3);
-				registers[R1] = registers[R2] + registers[R3];
-				break;
+	// Only loops in the program are compiled; a loop written at runtime stays interpreted
+	if (header_pc % 4 != 0 || branch_pc + 4 > imps_vm_program_size(vm)) {
+		return IMPS_HOT_LOOP_INTERPRETED;
+	}
 
-			case ADDI:
-				LOG_DEBUG("ADDI R%d = R%d + %d\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				registers[R1] = registers[R2] + SIGNEXT(SIGNED(IMM));
-				break;
+	// HALT in a hot loop must not exit before the interpreter printed the registers,
+	// and the loop must not go on running instructions it overwrote
+	region = jit_cache_lookup(vm, header_pc, branch_pc, 1, 0);
+	if (region == NULL) {
+		LOG_DEBUG("hot loop %d to %d cannot be translated, interpreting it\n", header_pc, branch_pc);
+		return IMPS_HOT_LOOP_INTERPRETED;
+	}
+	if (region->code == NULL) {
+		// The interpreter goes on with it while the compiler thread translates it
+		return IMPS_HOT_LOOP_PENDING;
+	}
 
-			case SUB:
-				LOG_DEBUG("SUB R%d = R%d - R%d\n", R1, R2, R3);
-				registers[R1] = registers[R2] - SIGNED(registers[R3]);
-				break;
+	// Falling through the closing branch continues after it
+	jit_run_region(vm, region, branch_pc + 4);
 
-			case SUBI:
-				LOG_DEBUG("SUBI R%d = R%d - %d\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				registers[R1] = registers[R2] - SIGNEXT(SIGNED(IMM));
-				break;
+	return IMPS_HOT_LOOP_RAN;
+}
 
-			case MUL:
-				LOG_DEBUG("MUL R%d = R%d - R%d\n", R1, R2, R3);
-				registers[R1] = registers[R2] * SIGNED(registers[R3]);
-				break;
+// COMPILE BENCHMARK
 
-			case MULI:
-				LOG_DEBUG("MULI R%d = R%d + %d\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				registers[R1] = registers[R2] * SIGNEXT(SIGNED(IMM));
-				break;
+/* --compile-bench=N translates every loop of the program (from the target of each backward
+ * branch or jump to it, as the hot loop handler would) N times over without running anything,
+ * and prints how many guest instructions it translated per second and how many bytes of code
+ * each of them became, so that changes making the JIT slower or its code bigger show up
+ * (see bench/bench.py). Returns 0 on success, 1 if a loop cannot be translated.
+ */
+static int jit_compile_bench(imps_vm *vm, unsigned int rounds)
+{
+	unsigned char *memory = imps_vm_memory(vm);
+	unsigned int program_size = imps_vm_program_size(vm);
+	// The header and the backward branch or jump of every loop, found before the time is taken
+	unsigned int *loops = malloc(program_size / 4 * 2 * sizeof(unsigned int) + 1);
+	jit_relocations relocations = { NULL, 0, 0, 0 };
+	size_t size = JIT_CACHE_CHUNK_SIZE;
+	unsigned char *code = malloc(size);
+	unsigned long long instructions = 0, bytes = 0;
+	unsigned int round, pc, k, loop_count = 0;
+	double started, seconds;
+
+	if (loops == NULL || code == NULL) {
+		LOG_ERROR("out of memory\n");
+		free(loops);
+		free(code);
+		return 1;
+	}
 
-			// Load and store
+	for (pc = 0; pc + 4 <= program_size; pc += 4) {
+		unsigned int instruction = W32(memory, pc);
+		unsigned int header;
 
-			case LW:
-				LOG_DEBUG("LW R%d = MEMORY[R%d + %d]\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				//LOG_DEBUG("- MEMORY[R%d + %d] = MEMORY[%d + %d] = %d\n", R2, SIGNEXT(SIGNED(IMM)), registers[R2], IMM, SIGNED(W32(memory, registers[R2] + SIGNEXT(SIGNED(IMM)))));
-				//LOG_DEBUG("-- and this is MEMORY[%d]", registers[R2] + SIGNEXT(SIGNED(IMM)))
-				{
-					unsigned int addr = registers[R2] + SIGNEXT(SIGNED(IMM));
-					if (!in_memory_bounds(addr)) {
-						LOG_ERROR("Access to address %d: out of allowed range\n", addr);
-						DEBUG(print_instruction_binary(instruction));
-						LOG_ERROR("\n");
-						return 1;
-					}
-					registers[R1] = W32(memory, addr);
-				}
-				break;
+		if (OPCODE >= BEQ && OPCODE <= BGE && (int) SIGNEXT(IMM) < 0) {
+			header = pc + (int) SIGNEXT(IMM) * 4;
+		} else if (OPCODE == JMP && ADDR <= pc && ADDR % 4 == 0) {
+			header = ADDR;
+		} else {
+			continue;
+		}
+		// branching back before address 0
+		if (header > pc) {
+			continue;
+		}
+		loops[2 * loop_count] = header;
+		loops[2 * loop_count + 1] = pc;
+		loop_count++;
+	}
 
-			case SW:
-				LOG_DEBUG("SW MEMORY[R%d + %d] = %d\n", R1, R2, registers[R1]);
-				{
-					unsigned int addr = registers[R2] + SIGNEXT(SIGNED(IMM));
-					if (!in_memory_bounds(addr)) {
-						LOG_ERROR("Access to address %d: out of allowed range\n", addr);
-						DEBUG(print_instruction_binary(instruction));
-						LOG_ERROR("\n");
-						return 1;
-					}
-					W32(memory, addr) = registers[R1];
+	started = jit_now();
+	for (round = 0; round < rounds; round++) {
+		for (k = 0; k < loop_count; k++) {
+			unsigned int header = loops[2 * k], end = loops[2 * k + 1];
+			unsigned char *chain_entry;
+			size_t code_size;
+
+			relocations.count = 0;
+			while ((code_size = jit_translate(vm, memory, header, end, code, size, 1, 1, &chain_entry, &relocations)) == 0) {
+				free(code);
+				size *= 2;
+				code = size <= JIT_CACHE_MAX_CHUNK_SIZE ? malloc(size) : NULL;
+				if (code == NULL) {
+					LOG_ERROR("cannot translate the loop from %u to %u\n", header, end);
+					free(relocations.entries);
+					free(loops);
+					return 1;
 				}
-				break;
+			}
+			instructions += (end - header) / 4 + 1;
+			bytes += code_size;
+		}
+	}
+	seconds = jit_now() - started;
+	free(code);
+	free(relocations.entries);
+	free(loops);
+
+	printf("translated %u loops %u times: %llu instructions, %llu bytes in %.6f s\n", loop_count, rounds, instructions, bytes, seconds);
+	printf("%.0f instructions/s, %.2f bytes/instruction\n",
+		seconds > 0 ? instructions / seconds : 0.0, instructions ? (double) bytes / instructions : 0.0);
+	return 0;
+}
 
-			// Branching
+int main (int argc, char *argv[])
+{
+	char *program_filename = NULL;
+	int engine = IMPS_ENGINE_SWITCH;
+	// Backward jumps to a loop header before it is compiled, 0 to never compile loops
+	unsigned int hot_loop_threshold = 1000;
+	// Print the statistics of the compiler thread at the end
+	int jit_stats = 0;
+	// Translate the loops this many times instead of running the program, see jit_compile_bench
+	unsigned int compile_bench = 0;
+	int arg;
+	int result;
+
+#if JIT_X86_64
+	simd = __builtin_cpu_supports("avx2") ? JIT_SIMD_AVX2 : JIT_SIMD_SSE2;
+#endif
 
-			case BEQ:
-				LOG_DEBUG("BEQ if R%d == R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] == registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	for (arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--engine=switch") == 0) {
+			engine = IMPS_ENGINE_SWITCH;
+		} else if (strcmp(argv[arg], "--engine=threaded") == 0) {
+			engine = IMPS_ENGINE_THREADED;
+		} else if (strncmp(argv[arg], "--hot-loop-threshold=", 21) == 0) {
+			hot_loop_threshold = strtoul(argv[arg] + 21, NULL, 10);
+		} else if (strcmp(argv[arg], "--dump-ir") == 0) {
+			dump_ir = 1;
+		} else if (strcmp(argv[arg], "--jit-stats") == 0) {
+			jit_stats = 1;
+		} else if (strncmp(argv[arg], "--compile-bench=", 16) == 0) {
+			compile_bench = strtoul(argv[arg] + 16, NULL, 10);
+		} else if (strncmp(argv[arg], "--jit-cache=", 12) == 0) {
+			cache.directory = argv[arg] + 12;
+		} else if (strcmp(argv[arg], "--simd=none") == 0) {
+			simd = JIT_SIMD_NONE;
+		} else if (JIT_X86_64 && strcmp(argv[arg], "--simd=sse2") == 0) {
+			simd = JIT_SIMD_SSE2;
+		} else if (JIT_X86_64 && strcmp(argv[arg], "--simd=avx2") == 0) {
+			if (!__builtin_cpu_supports("avx2")) {
+				LOG_ERROR("this CPU has no AVX2\n");
+				return 1;
+			}
+			simd = JIT_SIMD_AVX2;
+		} else if (argv[arg][0] == '-') {
+			LOG_ERROR("unknown option %s\n", argv[arg]);
+			return 1;
+		} else if (program_filename == NULL) {
+			program_filename = argv[arg];
+		} else {
+			LOG_ERROR("imps-emulator takes exactly one program\n");
+			return 1;
+		}
+	}
 
-			case BNE:
-				LOG_DEBUG("BNE if R%d != R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] != registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	if (program_filename == NULL) {
+		LOG_ERROR("usage: imps-emulator-jit [--engine=switch|threaded] [--hot-loop-threshold=N] [--simd=none|sse2|avx2] [--jit-cache=DIR] [--jit-stats] [--dump-ir] [--compile-bench=N] program.oout\n");
+		return 1;
+	}
 
-			case BLT:
-				LOG_DEBUG("BLT if R%d < R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] < registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	// Made by the first run using it
+	if (cache.directory && mkdir(cache.directory, 0777) != 0 && errno != EEXIST) {
+		LOG_ERROR("Error creating directory %s: %s\n", cache.directory, strerror(errno));
+		return 1;
+	}
 
-			case BGT:
-				LOG_DEBUG("BGT if R%d > R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] > registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	// The state of the virtual machine, interpreted by libimps (see imps-vm.h)
+	// and executed natively by jit_run
+	imps_vm *vm = imps_vm_create();
 
-			case BLE:
-				LOG_DEBUG("BLE if R%d <= R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] <= registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	if (vm == NULL) {
+		LOG_ERROR("out of memory\n");
+		return 1;
+	}
 
-			case BGE:
-				LOG_DEBUG("BGE if R%d >= R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				//LOG_DEBUG("- R%d is %d, R%d is %d\n", R1, registers[R1], R2, registers[R2]);
-				if (registers[R1] >= registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	imps_vm_set_engine(vm, engine);
+	imps_vm_set_jit_handler(vm, jit_run);
+	imps_vm_set_code_write_handler(vm, jit_code_written);
+	if (hot_loop_threshold) {
+		imps_vm_set_hot_loop_handler(vm, jit_run_hot_loop, hot_loop_threshold);
+	}
 
-			// Jumping
+	unsigned char program[MEM_SIZE] = {0};
+	// program size in bytes
+	unsigned int program_size = read_binary_file_into_buffer(program_filename, program, MEM_SIZE);
 
-			case JMP:
-				LOG_DEBUG("JMP PC = %d\n", ADDR);
-				PC = ADDR;
-				continue;
+	imps_vm_load(vm, program, program_size);
 
-			case JR:
-				LOG_DEBUG("JR PC = R%d\n", R1);
-				PC = registers[R1];
-				continue;
+	if (compile_bench) {
+		result = jit_compile_bench(vm, compile_bench);
+		imps_vm_destroy(vm);
+		return result;
+	}
 
-			case JAL:
-				LOG_DEBUG("JAL R31 = PC + 4; PC = %d\n", ADDR);
-				registers[31] = PC + 4;
-				PC = ADDR;
-				continue;
+	result = imps_vm_run(vm);
 
-			case JIT:
-				/* Layout:
-				 *
-				 *       [... some code ...]
-				 * PC -> JIT init instruction
-				 *       jit_instructions_start
-				 *       jit_instructions_end
-				 *       [... some code ...] ("place a")
-				 */
-				LOG_DEBUG("JIT: checking for instruction start and end addresses\n");
-				if (PC + 8 + 4 > program_size) {
-						LOG_ERROR("JIT instruction lacks following start and end addresses\n");	
-						return 1;
-				}
-				
-				// TODO add relative start address + length
-				
-				/* Treat all bytes b code jit_instruction_start <= b <= jit_instruction_end
-				 * as 32-bit IMPS instructions and JIT-compile them.
-				 */
-				unsigned int jit_instructions_start = W32(memory, PC + 4);
-				unsigned int jit_instructions_end = W32(memory, PC + 8);
-				
-				// Check that start and end address are in memory range
-				if (!jit_check_translation_range(jit_instructions_start, jit_instructions_end, program_size)) {
-					LOG_ERROR(" - JIT start/end (%d/%d) instructions are illegal\n", jit_instructions_start, jit_instructions_end);
-					return 1;
-				}
-				
-				#define jit_area_size 100
-				unsigned char jit_area[jit_area_size] = {0};
-				
-				// Translate all those instructions into machine instructions
-				int translation_successful = jit_translate(registers, memory, jit_instructions_start, jit_instructions_end, jit_area, &running_jit_start_instruction_no, &running_jit_end_instruction_no);
-				
-				if (!translation_successful) {
-					LOG_ERROR(" JIT TRANLATION UNSUCCESSFUL\n");
-					return 1;
-				}
-				
-				running_jit_start_instruction_no = jit_instructions_start;
-				running_jit_end_instruction_no = jit_instructions_end;
-
-				// Jump into the generated native instructions
-				// The generated code will return here
-				// The return value (which is in eax, set by jit_write_leave) tells us where to continue.
-				LOG_DEBUG("Jumping into generated code ...\n");
-				PC = execute((pc_returning_fn_ptr) jit_area, PC + 12);  // 12 = offset of "place a"
-				LOG_DEBUG("... generated code returned, setting PC to %d\n", PC);
-
-				running_jit_start_instruction_no = -1;
-				running_jit_end_instruction_no = -1;
-				
-				continue;
+	if (result == IMPS_HALTED) {
+		imps_vm_print_state(vm, stdout);
+	} else {
+		LOG_ERROR("%s\n", imps_vm_error(vm));
+	}
 
-			default:
-				LOG_DEBUG("UNKNOWN INSTRUCTION ");
-				DEBUG(print_instruction_binary(instruction));
-				LOG_DEBUG("\n");
-				return 1;
-		}
-				
-		// increment PC
-		// for BRANCHES and JUMPS, this MUST NOT BE EXECUTED (use continue),
-		// because otherwise we skip an instruction
-		PC += 4;
+	jit_cache_flush(vm);
+	if (jit_stats) {
+		jit_compiler_print_stats(stderr);
 	}
-}
 
+	imps_vm_destroy(vm);
+	jit_cache_destroy();
+
+	return result;
+}
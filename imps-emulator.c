@@ -7,12 +7,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include "imps-vm.h"
 
 // Size of memory, fixed by spec
-#define MEM_SIZE 65536
+#define MEM_SIZE IMPS_MEM_SIZE
+
+#ifndef DEBUG_ENABLED
+	#define DEBUG_ENABLED 1
+#endif
 
 // Debug chosen to be constant instead of macro so that it is changable on gdb debugging.
-const int DEBUG = 1;
+const int DEBUG = DEBUG_ENABLED;
 
 // SEMANTIC PRINTFS
 
@@ -20,45 +28,6 @@ const int DEBUG = 1;
 #define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
 #define LOG_DEBUG(...) DEBUG( printf(__VA_ARGS__); )
 
-// Opcodes
-
-enum {
-	HALT,
-	ADD,
-	ADDI,
-	SUB,
-	SUBI,
-	MUL,
-	MULI,
-	LW,
-	SW,
-	BEQ,
-	BNE,
-	BLT,
-	BGT,
-	BLE,
-	BGE,
-	JMP,
-	JR,
-	JAL
-};
-
-// Allows to get 32-bit word from any byte address
-#define W32(arr, pos) (*((unsigned int *) &(arr)[pos]))
-
-// signed for arithmethic operations
-#define SIGNED(i) ((signed int) i)
-
-// sign extension for immediate parts
-#define SIGNEXT(i) ( ((i) & 0b00000000000000001000000000000000 ) ? ((i) | 0b11111111111111110000000000000000) : (i) )
-
-/* Prints the 32-bit instruction bit by bit */
-void print_instruction (unsigned int instruction)
-{
-	unsigned int mask = 1 << 30;
-	while (mask) { putchar(instruction & mask ? '1' : '0'); mask >>= 1; }
-}
-
 /* Read the file at filename into the buffer, limiting the read to limit bytes.
  * Returns the number of bytes read.
  */
@@ -79,260 +48,168 @@ size_t read_binary_file_into_buffer(char *filename, unsigned char *buf, size_t l
 	return bytes_read;
 }
 
-/* Returns 1 if the given address is in memory range, 0 otherwise. */
-int in_memory_bounds (unsigned int addr) {
-	return addr < MEM_SIZE;
-}
-
-/* We chose to not encapsulate the state of the "virtual machine"
- * in a struct as it makes the program easier to read, has (at least)
- * the same performance and is not necessary for this task.
- */
-
-/* Prints the state of of the virtual machine, namely PC and all register contents */
-void print_state(unsigned int PC, int *registers) {
-	int i;
-	
-	printf("\n");
-	printf("Registers:\n");
-	printf("PC : %10d (0x%.8x)\n", PC, PC);
-		for (i = 0; i < 32; i++) {
-			printf("$%-2d: %10d (0x%.8x)\n", i, registers[i], registers[i]);
-		}
-}
-
 int main (int argc, char *argv[])
 {
-	if (argc != 2) {
-		LOG_ERROR("imps-emulator takes exactly one argument\n");
-		return 1;
+	char *program_filename = NULL;
+	int engine = IMPS_ENGINE_SWITCH;
+	// Which superinstructions to use (see imps_vm_set_fusion)
+	char *fusion = "all";
+	int pair_stats = 0;
+	int profile = 0;
+	// Where --profile writes the machine-readable profile, program.oout.prof by default
+	char *profile_filename = NULL;
+	// Stop after that many instructions, 0 for no limit
+	unsigned long long max_steps = 0;
+	// Where to write a snapshot of the state the program halted or stopped in
+	char *snapshot_filename = NULL;
+	// Snapshot to continue from instead of a program to start
+	char *restore_filename = NULL;
+	// Where to write the binary trace of the executed instructions, see imps-trace
+	char *trace_filename = NULL;
+	int arg;
+	int result;
+
+	for (arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--engine=switch") == 0) {
+			engine = IMPS_ENGINE_SWITCH;
+		} else if (strcmp(argv[arg], "--engine=threaded") == 0) {
+			engine = IMPS_ENGINE_THREADED;
+		} else if (strncmp(argv[arg], "--fuse=", 7) == 0) {
+			fusion = argv[arg] + 7;
+		} else if (strcmp(argv[arg], "--pair-stats") == 0) {
+			pair_stats = 1;
+		} else if (strcmp(argv[arg], "--profile") == 0) {
+			profile = 1;
+		} else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+			profile = 1;
+			profile_filename = argv[arg] + 10;
+		} else if (strncmp(argv[arg], "--max-steps=", 12) == 0) {
+			max_steps = strtoull(argv[arg] + 12, NULL, 10);
+		} else if (strncmp(argv[arg], "--save-snapshot=", 16) == 0) {
+			snapshot_filename = argv[arg] + 16;
+		} else if (strncmp(argv[arg], "--restore=", 10) == 0) {
+			restore_filename = argv[arg] + 10;
+		} else if (strncmp(argv[arg], "--trace=", 8) == 0) {
+			trace_filename = argv[arg] + 8;
+		} else if (argv[arg][0] == '-') {
+			LOG_ERROR("unknown option %s\n", argv[arg]);
+			return 1;
+		} else if (program_filename == NULL) {
+			program_filename = argv[arg];
+		} else {
+			LOG_ERROR("imps-emulator takes exactly one program\n");
+			return 1;
+		}
 	}
 
-	// The memory of the emulator, fixed to 16 bit byte-addressable space
-	unsigned char memory[MEM_SIZE] = {0};
-	// program size in bytes
-	unsigned int program_size = 0;
-
-	// The 32 general-purpose registers of the emulator, each 32 bit
-	// signed int such that arithmetic expressions are simple to implement
-	int registers[32] = {0};
-
-	/* NOTE: Register count 32 is not macro'd because it determines
-	 * all instructions.
-	 */
-
-	// program counter
-	unsigned int PC = 0;
-
-	// Read in program
-
-	char *program_filename = argv[1];
-
-	program_size = read_binary_file_into_buffer(program_filename, memory, MEM_SIZE);
-
-	LOG_DEBUG("read %d bytes from program file\n", program_size);
-
-	/* Main computation loop.
-	 * Runs a fetch-execute-cycle until HALT is encountered or an error is encountered,
-	 * e.g. an unknown instruction is to be executed or memory borders are exceeded.
-	 */
-
-	while (1) {
-		LOG_DEBUG("PC: %d\t- ", PC);
-
-		// fetch
-
-		unsigned int instruction = W32(memory, PC);
-
-		// Instruction part access
-		
-		/* These macros are fixed to the instruction being called "instruction"
-		 * (therefore we declared them locally) so that we can write OPCODE
-		 * instead of OPCODE(instruction), which makes the program a lot cleaner.
-		 */
-
-		#define OPCODE ( (instruction & 0b11111100000000000000000000000000) >> 26 )
-		#define R1     ( (instruction & 0b00000011111000000000000000000000) >> 21 )
-		#define R2     ( (instruction & 0b00000000000111110000000000000000) >> 16 )
-		#define R3     ( (instruction & 0b00000000000000001111100000000000) >> 11 )
-		#define IMM    ( (instruction & 0b00000000000000001111111111111111) >>  0 )
-		#define ADDR   ( (instruction & 0b00000011111111111111111111111111) >>  0 )
-
-		/* REMEMBER that R1 is not register 1, but the R1 part of the instruction
-		 * as in the spec. The actual registers are accessed with register[i].
-		 */
-
-		// execute
-
-		DEBUG(print_instruction(instruction));
-		LOG_DEBUG(" ");
-
-		/* We chose a simple switch instead of a virtual function table as this is
-		 * an easy-to-understand, easily debuggable and clean solution and also
-		 * allows control over the outer while loop (e.g. for when PC incrementation)
-		 * shall be skipped.
-		 * We have enough faith in gcc to believe that it optimises it to be at least
-		 * as fast as a vtable.
-		 */
-
-		/* REMEMBER that for immediate instructions, the IMM part has to be
-		 * treated as signed and also sign-extended.
-		 */
-
-		switch (OPCODE) {
-		
-			case HALT:
-				LOG_DEBUG("HALT\n");
-				// The spec do not say this, but the provied result files increment the PC after HALT
-				PC += 4;
-				print_state(PC, registers);
-				return 0;
-			
-			// Arithmetics
-			
-			case ADD:
-				LOG_DEBUG("ADD R%d = R%d + R%d\n", R1, R2, R3);
-				registers[R1] = registers[R2] + registers[R3];
-				break;
-
-			case ADDI:
-				LOG_DEBUG("ADDI R%d = R%d + %d\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				registers[R1] = registers[R2] + SIGNEXT(SIGNED(IMM));
-				break;
-
-			case SUB:
-				LOG_DEBUG("SUB R%d = R%d - R%d\n", R1, R2, R3);
-				registers[R1] = registers[R2] - SIGNED(registers[R3]);
-				break;
-
-			case SUBI:
-				LOG_DEBUG("SUBI R%d = R%d - %d\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				registers[R1] = registers[R2] - SIGNEXT(SIGNED(IMM));
-				break;
-
-			case MUL:
-				LOG_DEBUG("MUL R%d = R%d - R%d\n", R1, R2, R3);
-				registers[R1] = registers[R2] * SIGNED(registers[R3]);
-				break;
+	if ((program_filename == NULL) == (restore_filename == NULL)) {
+		LOG_ERROR("usage: imps-emulator [--engine=switch|threaded] [--fuse=all|none|SUPERINSTRUCTION,...] [--pair-stats] [--profile[=FILE]]\n"
+		          "                     [--trace=FILE] [--max-steps=N] [--save-snapshot=FILE] (program.oout | --restore=FILE)\n");
+		return 1;
+	}
+	// Named after the snapshot when continuing from one
+	if (program_filename == NULL) {
+		program_filename = restore_filename;
+	}
 
-			case MULI:
-				LOG_DEBUG("MULI R%d = R%d + %d\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				registers[R1] = registers[R2] * SIGNEXT(SIGNED(IMM));
-				break;
+	// The state of the virtual machine (memory, registers, PC, ...), see imps-vm.h
+	imps_vm *vm = imps_vm_create();
 
-			// Load and store
+	if (vm == NULL) {
+		LOG_ERROR("out of memory\n");
+		return 1;
+	}
 
-			case LW:
-				LOG_DEBUG("LW R%d = MEMORY[R%d + %d]\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				// Scope this because switch allows re-use of variables in different cases.
-				{
-					unsigned int addr = registers[R2] + SIGNEXT(SIGNED(IMM));
-					// Check memory violation according to the spec
-					if (!in_memory_bounds(addr)) {
-						LOG_DEBUG("Load access from address %d out of allowed range\n", addr);
-						DEBUG(print_instruction(instruction));
-						LOG_ERROR("\n");
-						return 1;
-					}
-					registers[R1] = W32(memory, addr);
-				}
-				break;
+	imps_vm_set_engine(vm, engine);
+	if (!imps_vm_set_fusion(vm, fusion)) {
+		LOG_ERROR("%s\n", imps_vm_error(vm));
+		imps_vm_destroy(vm);
+		return 1;
+	}
+	if (pair_stats) {
+		imps_vm_enable_stats(vm);
+	}
+	if (profile) {
+		imps_vm_enable_profile(vm);
+	}
+	if (trace_filename && !imps_vm_start_trace(vm, trace_filename)) {
+		LOG_ERROR("%s\n", imps_vm_error(vm));
+		imps_vm_destroy(vm);
+		return 1;
+	}
 
-			case SW:
-				LOG_DEBUG("SW MEMORY[R%d + %d] = %d\n", R1, R2, registers[R1]);
-				{
-					unsigned int addr = registers[R2] + SIGNEXT(SIGNED(IMM));
-					if (!in_memory_bounds(addr)) {
-						LOG_DEBUG("Store access to address %d out of allowed range\n", addr);
-						DEBUG(print_instruction(instruction));
-						LOG_ERROR("\n");
-						return 1;
-					}
-					W32(memory, addr) = registers[R1];
-				}
-				break;
+	if (restore_filename) {
+		imps_snapshot *snapshot = imps_snapshot_open(restore_filename);
 
-			// Branching
+		if (snapshot == NULL) {
+			LOG_ERROR("Error opening snapshot %s: %s\n", restore_filename,
+				errno == EINVAL ? "not a snapshot of this emulator version" : strerror(errno));
+			imps_vm_destroy(vm);
+			return 1;
+		}
+		if (!imps_vm_restore(vm, snapshot)) {
+			LOG_ERROR("%s\n", imps_vm_error(vm));
+			imps_snapshot_close(snapshot);
+			imps_vm_destroy(vm);
+			return 1;
+		}
+		// The mapping stays valid without it
+		imps_snapshot_close(snapshot);
+	} else {
+		// Read in program
 
-			case BEQ:
-				LOG_DEBUG("BEQ if R%d == R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] == registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+		unsigned char program[MEM_SIZE] = {0};
+		// program size in bytes
+		unsigned int program_size = read_binary_file_into_buffer(program_filename, program, MEM_SIZE);
 
-			case BNE:
-				LOG_DEBUG("BNE if R%d != R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] != registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+		imps_vm_load(vm, program, program_size);
+	}
 
-			case BLT:
-				LOG_DEBUG("BLT if R%d < R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				// NOTE: This relies on the fact that registers[] is signed int.
-				if (registers[R1] < registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	if (max_steps) {
+		result = imps_vm_step(vm, max_steps);
+	} else {
+		result = imps_vm_run(vm);
+	}
 
-			case BGT:
-				LOG_DEBUG("BGT if R%d > R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] > registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	if (result == IMPS_HALTED) {
+		imps_vm_print_state(vm, stdout);
+	} else if (result == IMPS_RUNNING) {
+		LOG_ERROR("stopped after %llu instructions at PC %u\n", max_steps, imps_vm_pc(vm));
+	} else {
+		LOG_ERROR("%s\n", imps_vm_error(vm));
+	}
 
-			case BLE:
-				LOG_DEBUG("BLE if R%d <= R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] <= registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	if (snapshot_filename && !imps_vm_save_snapshot(vm, snapshot_filename)) {
+		LOG_ERROR("%s\n", imps_vm_error(vm));
+	}
 
-			case BGE:
-				LOG_DEBUG("BGE if R%d >= R%d then PC = PC + (%d * 4)\n", R1, R2, SIGNEXT(SIGNED(IMM)));
-				if (registers[R1] >= registers[R2]) {
-					PC += SIGNEXT(SIGNED(IMM)) * 4;
-					continue;
-				}
-				break;
+	if (trace_filename && !imps_vm_stop_trace(vm)) {
+		LOG_ERROR("%s\n", imps_vm_error(vm));
+	}
 
-			// Jumping
+	imps_vm_print_stats(vm, stderr);
 
-			case JMP:
-				LOG_DEBUG("JMP PC = %d\n", ADDR);
-				PC = ADDR;
-				continue;
+	if (profile) {
+		char default_filename[strlen(program_filename) + 6];
+		FILE *file;
 
-			case JR:
-				LOG_DEBUG("JR PC = R%d\n", R1);
-				PC = registers[R1];
-				continue;
+		if (profile_filename == NULL) {
+			sprintf(default_filename, "%s.prof", program_filename);
+			profile_filename = default_filename;
+		}
 
-			case JAL:
-				LOG_DEBUG("JAL R31 = PC + 4; PC = %d\n", ADDR);
-				registers[31] = PC + 4;
-				PC = ADDR;
-				continue;
+		imps_vm_print_profile(vm, stderr);
 
-			default:
-				LOG_DEBUG("UNKNOWN INSTRUCTION ");
-				DEBUG(print_instruction(instruction));
-				LOG_DEBUG("\n");
+		file = fopen(profile_filename, "w");
+		if (!file) {
+			LOG_ERROR("Error opening file %s\n", profile_filename);
+		} else {
+			imps_vm_write_profile(vm, file);
+			fclose(file);
 		}
-				
-		/* for BRANCHES and JUMPS, this MUST NOT BE EXECUTED
-		 * (therefore, continue is used),
-		 * because otherwise we skip an instruction
-		 */
-		// increment PC
-		PC += 4;
 	}
-}
 
+	imps_vm_destroy(vm);
+
+	return result;
+}
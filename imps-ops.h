@@ -0,0 +1,192 @@
+/* The IMPS instruction set: opcodes, the parts of an instruction word
+ * and what each instruction does.
+ *
+ * Shared by the engines in imps-vm.c and the C programs imps-aot translates
+ * IMPS programs into, so that interpreted and ahead-of-time compiled programs
+ * execute exactly the same semantics and print exactly the same state.
+ *
+ * The semantics are macros working on the int registers[32] in scope;
+ * register operands are register numbers and immediates are sign-extended.
+ * Arithmetics is done unsigned, which wraps around like the 32-bit registers
+ * of the spec: signed overflow is undefined in C, so gcc -O2 would be
+ * allowed to assume it never happens (e.g. when it optimises a loop).
+ */
+
+#ifndef IMPS_OPS_H
+#define IMPS_OPS_H
+
+#include "imps-vm.h"
+
+// Opcodes
+
+enum {
+	HALT,
+	ADD,
+	ADDI,
+	SUB,
+	SUBI,
+	MUL,
+	MULI,
+	LW,
+	SW,
+	BEQ,
+	BNE,
+	BLT,
+	BGT,
+	BLE,
+	BGE,
+	JMP,
+	JR,
+	JAL,
+	// Only known to imps-emulator-jit, see imps_vm_set_jit_handler
+	JIT,
+	LAST_OPCODE
+};
+
+// Allows to get 32-bit word from any byte address
+#define W32(arr, pos) (*((unsigned int *) &(arr)[pos]))
+
+// signed for arithmethic operations
+#define SIGNED(i) ((signed int) i)
+
+// sign extension for immediate parts
+#define SIGNEXT(i) ( ((i) & 0b00000000000000001000000000000000 ) ? ((i) | 0b11111111111111110000000000000000) : (i) )
+
+// Instruction parts
+
+#define IMPS_OPCODE(instruction) ( ((instruction) & 0b11111100000000000000000000000000) >> 26 )
+#define IMPS_R1(instruction)     ( ((instruction) & 0b00000011111000000000000000000000) >> 21 )
+#define IMPS_R2(instruction)     ( ((instruction) & 0b00000000000111110000000000000000) >> 16 )
+#define IMPS_R3(instruction)     ( ((instruction) & 0b00000000000000001111100000000000) >> 11 )
+#define IMPS_IMM(instruction)    ( ((instruction) & 0b00000000000000001111111111111111) >>  0 )
+#define IMPS_ADDR(instruction)   ( ((instruction) & 0b00000011111111111111111111111111) >>  0 )
+
+// Arithmetics
+
+#define IMPS_ADD(r1, r2, r3)   registers[r1] = (unsigned int) registers[r2] + (unsigned int) registers[r3]
+#define IMPS_ADDI(r1, r2, imm) registers[r1] = (unsigned int) registers[r2] + (unsigned int) (imm)
+#define IMPS_SUB(r1, r2, r3)   registers[r1] = (unsigned int) registers[r2] - (unsigned int) registers[r3]
+#define IMPS_SUBI(r1, r2, imm) registers[r1] = (unsigned int) registers[r2] - (unsigned int) (imm)
+#define IMPS_MUL(r1, r2, r3)   registers[r1] = (unsigned int) registers[r2] * (unsigned int) registers[r3]
+#define IMPS_MULI(r1, r2, imm) registers[r1] = (unsigned int) registers[r2] * (unsigned int) (imm)
+
+// Load and store
+
+// The byte address LW and SW access
+#define IMPS_ADDRESS(r2, imm) ((unsigned int) registers[r2] + (unsigned int) (imm))
+
+// Whether the word at addr can be loaded, stored or fetched according to the spec
+#define IMPS_IN_MEMORY(addr) ((addr) <= IMPS_MEM_SIZE - 4)
+
+// What is reported when that is not the case, with the address as argument
+#define IMPS_LOAD_ERROR  "Load access from address %d out of allowed range"
+#define IMPS_STORE_ERROR "Store access to address %d out of allowed range"
+#define IMPS_FETCH_ERROR "Instruction fetch from address %u out of allowed range"
+
+// Branch conditions
+
+#define IMPS_BEQ(r1, r2) (registers[r1] == registers[r2])
+#define IMPS_BNE(r1, r2) (registers[r1] != registers[r2])
+#define IMPS_BLT(r1, r2) (registers[r1] <  registers[r2])
+#define IMPS_BGT(r1, r2) (registers[r1] >  registers[r2])
+#define IMPS_BLE(r1, r2) (registers[r1] <= registers[r2])
+#define IMPS_BGE(r1, r2) (registers[r1] >= registers[r2])
+
+/* Prints PC and all register contents in the format of the provided result files.
+ * The spec does not say this, but they show the PC incremented after HALT.
+ */
+static inline void imps_print_state(FILE *out, unsigned int pc, const int *registers)
+{
+	int i;
+
+	fprintf(out, "\n");
+	fprintf(out, "Registers:\n");
+	fprintf(out, "PC : %10d (0x%.8x)\n", pc, pc);
+	for (i = 0; i < 32; i++) {
+		fprintf(out, "$%-2d: %10d (0x%.8x)\n", i, registers[i], registers[i]);
+	}
+}
+
+/* A plain fetch-execute loop on the macros above, running the program in memory
+ * from *pc until HALT (returns 1, with *pc after the HALT like the engines)
+ * or an access outside of memory (returns 0, with *error set to one of the
+ * formats above and *addr to the address it takes).
+ * Unknown instructions (JIT too) do nothing, as in imps-emulator.
+ * This is what programs translated by imps-aot fall back to for the code
+ * they could not translate ahead of time; the engines are a lot faster.
+ */
+static inline int imps_interpret(int *registers, unsigned char *memory, unsigned int *pc, const char **error, unsigned int *addr)
+{
+	unsigned int PC = *pc;
+
+	while (1) {
+		unsigned int instruction;
+		unsigned int r1, r2, r3;
+		int imm;
+
+		if (!IMPS_IN_MEMORY(PC)) {
+			*error = IMPS_FETCH_ERROR;
+			*addr = PC;
+			*pc = PC;
+			return 0;
+		}
+
+		instruction = W32(memory, PC);
+		r1 = IMPS_R1(instruction);
+		r2 = IMPS_R2(instruction);
+		r3 = IMPS_R3(instruction);
+		imm = SIGNEXT(SIGNED(IMPS_IMM(instruction)));
+
+		switch (IMPS_OPCODE(instruction)) {
+			case HALT:
+				*pc = PC + 4;
+				return 1;
+
+			case ADD:  IMPS_ADD(r1, r2, r3);   break;
+			case ADDI: IMPS_ADDI(r1, r2, imm); break;
+			case SUB:  IMPS_SUB(r1, r2, r3);   break;
+			case SUBI: IMPS_SUBI(r1, r2, imm); break;
+			case MUL:  IMPS_MUL(r1, r2, r3);   break;
+			case MULI: IMPS_MULI(r1, r2, imm); break;
+
+			case LW:
+			case SW:
+				*addr = IMPS_ADDRESS(r2, imm);
+				if (!IMPS_IN_MEMORY(*addr)) {
+					*error = IMPS_OPCODE(instruction) == LW ? IMPS_LOAD_ERROR : IMPS_STORE_ERROR;
+					*pc = PC;
+					return 0;
+				}
+				if (IMPS_OPCODE(instruction) == LW) {
+					registers[r1] = W32(memory, *addr);
+				} else {
+					W32(memory, *addr) = registers[r1];
+				}
+				break;
+
+			case BEQ: if (IMPS_BEQ(r1, r2)) { PC += imm * 4; continue; } break;
+			case BNE: if (IMPS_BNE(r1, r2)) { PC += imm * 4; continue; } break;
+			case BLT: if (IMPS_BLT(r1, r2)) { PC += imm * 4; continue; } break;
+			case BGT: if (IMPS_BGT(r1, r2)) { PC += imm * 4; continue; } break;
+			case BLE: if (IMPS_BLE(r1, r2)) { PC += imm * 4; continue; } break;
+			case BGE: if (IMPS_BGE(r1, r2)) { PC += imm * 4; continue; } break;
+
+			case JMP:
+				PC = IMPS_ADDR(instruction);
+				continue;
+
+			case JR:
+				PC = registers[r1];
+				continue;
+
+			case JAL:
+				registers[31] = PC + 4;
+				PC = IMPS_ADDR(instruction);
+				continue;
+		}
+
+		PC += 4;
+	}
+}
+
+#endif
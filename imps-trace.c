@@ -0,0 +1,266 @@
+/* Decodes, filters and summarizes the binary traces written by imps-emulator --trace
+ * (see imps_vm_start_trace).
+ *
+ * usage: imps-trace [--summary] [--from=N] [--count=N] [--pc=A[-B]] [--reg=N] [--mem=A[-B]] trace-file
+ *
+ * Without --summary, it prints one line per executed instruction: its number in the trace,
+ * PC, the disassembled instruction and what it changed, e.g.
+ *
+ *          17     40  lw $3 $1 4          $3 = 12  <- [104]
+ *
+ * The filters select which instructions are printed or summarized:
+ * --from skips the first N instructions of the trace, --count stops after N matching ones,
+ * --pc keeps the ones at addresses A to B, --reg the ones writing register N
+ * and --mem the loads and stores of addresses A to B.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imps-vm.h"
+
+// SEMANTIC PRINTFS
+
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+
+// How many of the most executed instructions --summary lists
+#define HOTTEST_COUNT 10
+
+// Which records to print or summarize
+typedef struct {
+	unsigned long long from;
+	// 0 for no limit
+	unsigned long long count;
+	unsigned int pc_low, pc_high;
+	// -1 for any
+	int reg;
+	unsigned int mem_low, mem_high;
+	int mem_given;
+} filter;
+
+typedef struct {
+	unsigned long long instructions;
+	unsigned long long opcodes[64];
+	unsigned long long loads, stores;
+	unsigned long long register_writes[32];
+	// executions of the instruction at each aligned address
+	unsigned long long pc_counts[IMPS_MEM_SIZE / 4];
+	// accessed words of memory, and the lowest and highest address accessed
+	unsigned char touched[IMPS_MEM_SIZE / 4];
+	unsigned int touched_count;
+	unsigned int mem_low, mem_high;
+} summary;
+
+/* Parses "A" or "A-B" into low and high. Returns 0 if it is neither. */
+int parse_range(const char *s, unsigned int *low, unsigned int *high)
+{
+	char *end;
+
+	*low = *high = strtoul(s, &end, 0);
+	if (*end == '-') {
+		*high = strtoul(end + 1, &end, 0);
+	}
+	return end != s && *end == '\0' && *low <= *high;
+}
+
+int matches(const filter *f, const imps_trace_record *r)
+{
+	if (r->pc < f->pc_low || r->pc > f->pc_high) {
+		return 0;
+	}
+	if (f->reg >= 0 && r->reg != f->reg) {
+		return 0;
+	}
+	if (f->mem_given && (!(r->flags & (IMPS_TRACE_LOAD | IMPS_TRACE_STORE)) || r->addr < f->mem_low || r->addr > f->mem_high)) {
+		return 0;
+	}
+	return 1;
+}
+
+void print_record(unsigned long long n, const imps_trace_record *r)
+{
+	char disassembled[64];
+
+	imps_disassemble(r->instruction, r->pc, disassembled, sizeof(disassembled));
+	printf("%12llu %6u  %-24s", n, r->pc, disassembled);
+	if (r->reg != IMPS_TRACE_NO_REGISTER) {
+		printf("  $%d = %d", r->reg, r->value);
+	}
+	if (r->flags & IMPS_TRACE_LOAD) {
+		printf("  <- [%u]", r->addr);
+	}
+	if (r->flags & IMPS_TRACE_STORE) {
+		printf("  [%u] = %d", r->addr, r->value);
+	}
+	printf("\n");
+}
+
+void add_to_summary(summary *s, const imps_trace_record *r)
+{
+	s->instructions++;
+	s->opcodes[r->instruction >> 26]++;
+	if (r->reg != IMPS_TRACE_NO_REGISTER) {
+		s->register_writes[r->reg & 31]++;
+	}
+	if (r->pc < IMPS_MEM_SIZE && r->pc % 4 == 0) {
+		s->pc_counts[r->pc / 4]++;
+	}
+	if (r->flags & (IMPS_TRACE_LOAD | IMPS_TRACE_STORE)) {
+		if (r->flags & IMPS_TRACE_LOAD) {
+			s->loads++;
+		} else {
+			s->stores++;
+		}
+		if (s->loads + s->stores == 1 || r->addr < s->mem_low) {
+			s->mem_low = r->addr;
+		}
+		if (s->loads + s->stores == 1 || r->addr > s->mem_high) {
+			s->mem_high = r->addr;
+		}
+		if (r->addr < IMPS_MEM_SIZE && !s->touched[r->addr / 4]) {
+			s->touched[r->addr / 4] = 1;
+			s->touched_count++;
+		}
+	}
+}
+
+void print_summary(summary *s)
+{
+	unsigned int opcode, reg, i, pc;
+
+	printf("instructions %llu\n", s->instructions);
+	if (s->instructions == 0) {
+		return;
+	}
+
+	printf("\nopcodes:\n");
+	for (opcode = 0; opcode < 64; opcode++) {
+		if (s->opcodes[opcode]) {
+			printf("  %-6s %12llu %6.2f%%\n", imps_opcode_name(opcode), s->opcodes[opcode], 100.0 * s->opcodes[opcode] / s->instructions);
+		}
+	}
+
+	printf("\nmemory: %llu loads, %llu stores", s->loads, s->stores);
+	if (s->loads + s->stores) {
+		printf(" of %u different words, addresses %u to %u", s->touched_count, s->mem_low, s->mem_high);
+	}
+	printf("\n");
+
+	printf("\nregister writes:\n");
+	for (reg = 0; reg < 32; reg++) {
+		if (s->register_writes[reg]) {
+			printf("  $%-2u %12llu\n", reg, s->register_writes[reg]);
+		}
+	}
+
+	printf("\nmost executed instructions:\n");
+	for (i = 0; i < HOTTEST_COUNT; i++) {
+		unsigned int hottest = 0;
+
+		for (pc = 0; pc < IMPS_MEM_SIZE / 4; pc++) {
+			if (s->pc_counts[pc] > s->pc_counts[hottest]) {
+				hottest = pc;
+			}
+		}
+		if (s->pc_counts[hottest] == 0) {
+			break;
+		}
+		printf("  %6u %12llu %6.2f%%\n", hottest * 4, s->pc_counts[hottest], 100.0 * s->pc_counts[hottest] / s->instructions);
+		// Taken out for the next round
+		s->pc_counts[hottest] = 0;
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	filter f = { 0, 0, 0, 0xffffffff, -1, 0, 0, 0 };
+	int show_summary = 0;
+	char *trace_filename = NULL;
+	summary *s = NULL;
+	imps_trace_header header;
+	imps_trace_record records[4096];
+	unsigned long long n = 0, matched = 0;
+	size_t count, i;
+	FILE *file;
+	int arg;
+
+	for (arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--summary") == 0) {
+			show_summary = 1;
+		} else if (strncmp(argv[arg], "--from=", 7) == 0) {
+			f.from = strtoull(argv[arg] + 7, NULL, 10);
+		} else if (strncmp(argv[arg], "--count=", 8) == 0) {
+			f.count = strtoull(argv[arg] + 8, NULL, 10);
+		} else if (strncmp(argv[arg], "--pc=", 5) == 0) {
+			if (!parse_range(argv[arg] + 5, &f.pc_low, &f.pc_high)) {
+				LOG_ERROR("invalid address range %s\n", argv[arg] + 5);
+				return 1;
+			}
+		} else if (strncmp(argv[arg], "--reg=", 6) == 0) {
+			f.reg = atoi(argv[arg] + 6);
+		} else if (strncmp(argv[arg], "--mem=", 6) == 0) {
+			if (!parse_range(argv[arg] + 6, &f.mem_low, &f.mem_high)) {
+				LOG_ERROR("invalid address range %s\n", argv[arg] + 6);
+				return 1;
+			}
+			f.mem_given = 1;
+		} else if (argv[arg][0] == '-') {
+			LOG_ERROR("unknown option %s\n", argv[arg]);
+			return 1;
+		} else if (trace_filename == NULL) {
+			trace_filename = argv[arg];
+		} else {
+			LOG_ERROR("imps-trace takes exactly one trace\n");
+			return 1;
+		}
+	}
+
+	if (trace_filename == NULL) {
+		LOG_ERROR("usage: imps-trace [--summary] [--from=N] [--count=N] [--pc=A[-B]] [--reg=N] [--mem=A[-B]] trace-file\n");
+		return 1;
+	}
+
+	file = fopen(trace_filename, "rb");
+	if (!file) {
+		LOG_ERROR("Error opening file %s\n", trace_filename);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1
+	 || memcmp(header.magic, IMPS_TRACE_MAGIC, sizeof(header.magic)) != 0
+	 || header.version != IMPS_TRACE_VERSION
+	 || header.record_size != sizeof(imps_trace_record)) {
+		LOG_ERROR("%s is not a trace of this emulator version\n", trace_filename);
+		fclose(file);
+		return 1;
+	}
+
+	if (show_summary) {
+		s = calloc(1, sizeof(summary));
+	}
+
+	while ((count = fread(records, sizeof(imps_trace_record), 4096, file)) > 0) {
+		for (i = 0; i < count; i++, n++) {
+			if (n < f.from || !matches(&f, &records[i])) {
+				continue;
+			}
+			if (s) {
+				add_to_summary(s, &records[i]);
+			} else {
+				print_record(n, &records[i]);
+			}
+			matched++;
+			if (f.count && matched == f.count) {
+				goto done;
+			}
+		}
+	}
+
+done:
+	fclose(file);
+	if (s) {
+		print_summary(s);
+		free(s);
+	}
+	return 0;
+}
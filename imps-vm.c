@@ -0,0 +1,2591 @@
+/* The IMPS virtual machine: decoding, superinstructions and the interpreter engines,
+ * working on an imps_vm context (see imps-vm.h).
+ * This is what imps-emulator and imps-emulator-jit run programs with,
+ * and what libimps is made of.
+ */
+
+// For memfd_create
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "imps-vm.h"
+#include "imps-ops.h"
+
+// Size of memory, fixed by spec
+#define MEM_SIZE IMPS_MEM_SIZE
+
+#ifndef DEBUG_ENABLED
+	#define DEBUG_ENABLED 1
+#endif
+
+// Debug chosen to be constant instead of macro so that it is changable on gdb debugging.
+static const int DEBUG = DEBUG_ENABLED;
+
+/* With guard pages, memory is followed by address space that is never mapped,
+ * covering everything a 32-bit register plus a 16-bit offset can reach.
+ * Loads and stores are then not checked at all; the ones outside of memory
+ * fault and are turned into errors by a SIGSEGV handler (see guard_fault).
+ */
+#ifndef GUARD_PAGES_ENABLED
+	#define GUARD_PAGES_ENABLED 0
+#endif
+
+// The SIGSEGV handler needs to read the registers of the faulting code, see LOAD_WORD
+#if GUARD_PAGES_ENABLED && !(defined(__x86_64__) && defined(__linux__))
+	#error "guard pages are only implemented for x86-64 Linux"
+#endif
+
+static const int GUARD_PAGES = GUARD_PAGES_ENABLED;
+
+// SEMANTIC PRINTFS
+
+#define DEBUG(x) if (DEBUG) { x; }
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#define LOG_DEBUG(...) DEBUG( printf(__VA_ARGS__); )
+
+// Opcodes, continuing the IMPS ones (see imps-ops.h)
+
+enum {
+	// Not an IMPS opcode: marks a decode cache entry that has to be (re-)decoded first
+	NOT_DECODED = 64,
+	// Not an IMPS opcode: a backward branch or jump, whose taken jumps are counted
+	// to find hot loops (see imps_vm_set_hot_loop_handler)
+	LOOP_BRANCH,
+	// Not IMPS opcodes either: superinstructions, see fuse_instruction()
+	FIRST_SUPERINSTRUCTION,
+	ADD_ADD = FIRST_SUPERINSTRUCTION,
+	ADD_LW,
+	MUL_MULI,
+	MULI_ADD,
+	MUL_ADD,
+	ADDI_JMP,
+	SUBI_JMP,
+	ADD_ADD_LW,
+	MUL_MULI_MULI,
+	MULI_ADD_ADD,
+	MUL_MULI_ADD,
+	LAST_SUPERINSTRUCTION
+};
+
+static char * INSTRUCTION_NAMES[] = {
+	"HALT",
+	"ADD",
+	"ADDI",
+	"SUB",
+	"SUBI",
+	"MUL",
+	"MULI",
+	"LW",
+	"SW",
+	"BEQ",
+	"BNE",
+	"BLT",
+	"BGT",
+	"BLE",
+	"BGE",
+	"JMP",
+	"JR",
+	"JAL",
+	"JIT"
+};
+
+/* An instruction as it is executed by the main loop.
+ * Decoding (extracting the instruction parts, sign-extending the immediate and
+ * calculating branch targets) is done once per instruction word instead of
+ * every time the instruction is executed.
+ */
+typedef struct {
+	unsigned char opcode;
+	unsigned char r1;
+	unsigned char r2;
+	unsigned char r3;
+	// sign-extended immediate
+	int imm;
+	// absolute address to continue at for taken branches and jumps
+	unsigned int target;
+	// the original instruction word, kept for debug output
+	unsigned int instruction;
+} decoded_instruction;
+
+/* Only aligned instructions inside memory have an entry in the decode cache,
+ * everything else is decoded on the fly (the spec does not forbid jumping there).
+ */
+#define DECODE_CACHEABLE(pc) ( ((pc) & ~(MEM_SIZE - 4)) == 0 )
+
+/* Decodes the instruction word found at address pc into d. */
+static void decode_instruction(unsigned int instruction, unsigned int pc, decoded_instruction *d)
+{
+	// Instruction part access
+
+	/* These macros are fixed to the instruction being called "instruction"
+	 * so that we can write OPCODE instead of OPCODE(instruction), which
+	 * makes the program a lot cleaner.
+	 */
+
+	#define OPCODE IMPS_OPCODE(instruction)
+	#define R1     IMPS_R1(instruction)
+	#define R2     IMPS_R2(instruction)
+	#define R3     IMPS_R3(instruction)
+	#define IMM    IMPS_IMM(instruction)
+	#define ADDR   IMPS_ADDR(instruction)
+
+	d->opcode = OPCODE;
+	d->r1 = R1;
+	d->r2 = R2;
+	d->r3 = R3;
+	/* REMEMBER that for immediate instructions, the IMM part has to be
+	 * treated as signed and also sign-extended.
+	 */
+	d->imm = SIGNEXT(SIGNED(IMM));
+	d->instruction = instruction;
+
+	switch (d->opcode) {
+		case BEQ: case BNE: case BLT: case BGT: case BLE: case BGE:
+			d->target = pc + d->imm * 4;
+			break;
+		case JMP: case JAL:
+			d->target = ADDR;
+			break;
+		default:
+			d->target = 0;
+	}
+
+	#undef OPCODE
+	#undef R1
+	#undef R2
+	#undef R3
+	#undef IMM
+	#undef ADDR
+}
+
+/* Turns the decoded instruction at pc into a LOOP_BRANCH if it is a branch
+ * or jump that goes backwards (to a loop header), and the engines shall count it.
+ * Calls (JAL) do not close loops.
+ */
+static void mark_loop_branch(decoded_instruction *d, unsigned int pc)
+{
+	switch (d->opcode) {
+		case BEQ: case BNE: case BLT: case BGT: case BLE: case BGE: case JMP:
+			if (d->target <= pc) {
+				d->opcode = LOOP_BRANCH;
+			}
+			break;
+	}
+}
+
+/* Whether the branch or jump d, whose original opcode is in d->instruction
+ * (e.g. a LOOP_BRANCH), jumps to its target.
+ */
+static inline int branch_taken(const decoded_instruction *d, const int *registers)
+{
+	switch (d->instruction >> 26) {
+		case BEQ: return IMPS_BEQ(d->r1, d->r2);
+		case BNE: return IMPS_BNE(d->r1, d->r2);
+		case BLT: return IMPS_BLT(d->r1, d->r2);
+		case BGT: return IMPS_BGT(d->r1, d->r2);
+		case BLE: return IMPS_BLE(d->r1, d->r2);
+		case BGE: return IMPS_BGE(d->r1, d->r2);
+		// JMP
+		default: return 1;
+	}
+}
+
+/* A superinstruction executes a fixed sequence of instructions with a single dispatch.
+ * The sequences are the ones that are executed most in compiled IMPS code,
+ * as found with --pair-stats (e.g. address arithmetic and loop back-edges in matmult).
+ * Only the last instruction of a sequence may change the control flow;
+ * SW is not allowed at all as it may change the following instructions.
+ */
+typedef struct {
+	// the opcodes joined with "+", as accepted by --fuse
+	char *name;
+	// number of instructions executed
+	int length;
+	unsigned char opcodes[3];
+} superinstruction;
+
+#define SUPERINSTRUCTION_COUNT (LAST_SUPERINSTRUCTION - FIRST_SUPERINSTRUCTION)
+
+static superinstruction SUPERINSTRUCTIONS[SUPERINSTRUCTION_COUNT] = {
+	[ADD_ADD - FIRST_SUPERINSTRUCTION]       = { "ADD+ADD",       2, { ADD, ADD } },
+	[ADD_LW - FIRST_SUPERINSTRUCTION]        = { "ADD+LW",        2, { ADD, LW } },
+	[MUL_MULI - FIRST_SUPERINSTRUCTION]      = { "MUL+MULI",      2, { MUL, MULI } },
+	[MULI_ADD - FIRST_SUPERINSTRUCTION]      = { "MULI+ADD",      2, { MULI, ADD } },
+	[MUL_ADD - FIRST_SUPERINSTRUCTION]       = { "MUL+ADD",       2, { MUL, ADD } },
+	[ADDI_JMP - FIRST_SUPERINSTRUCTION]      = { "ADDI+JMP",      2, { ADDI, JMP } },
+	[SUBI_JMP - FIRST_SUPERINSTRUCTION]      = { "SUBI+JMP",      2, { SUBI, JMP } },
+	[ADD_ADD_LW - FIRST_SUPERINSTRUCTION]    = { "ADD+ADD+LW",    3, { ADD, ADD, LW } },
+	[MUL_MULI_MULI - FIRST_SUPERINSTRUCTION] = { "MUL+MULI+MULI", 3, { MUL, MULI, MULI } },
+	[MULI_ADD_ADD - FIRST_SUPERINSTRUCTION]  = { "MULI+ADD+ADD",  3, { MULI, ADD, ADD } },
+	[MUL_MULI_ADD - FIRST_SUPERINSTRUCTION]  = { "MUL+MULI+ADD",  3, { MUL, MULI, ADD } }
+};
+
+/* Returns the name of an opcode, including superinstructions. */
+const char * imps_opcode_name(unsigned int opcode)
+{
+	if (opcode < LAST_OPCODE) {
+		return INSTRUCTION_NAMES[opcode];
+	}
+	if (opcode == LOOP_BRANCH) {
+		return "LOOP_BRANCH";
+	}
+	if (opcode >= FIRST_SUPERINSTRUCTION && opcode < LAST_SUPERINSTRUCTION) {
+		return SUPERINSTRUCTIONS[opcode - FIRST_SUPERINSTRUCTION].name;
+	}
+	return "UNKNOWN";
+}
+
+/* Turns decode_cache[i] into the longest superinstruction that starts there, if any.
+ * fusion[s] says whether superinstruction FIRST_SUPERINSTRUCTION + s may be used.
+ * Only the opcode of entry i is changed: the superinstruction takes the operands
+ * of its instructions from the entries following it, and jumping into the middle
+ * of a superinstruction still executes the original instructions.
+ */
+static void fuse_instruction(decoded_instruction *decode_cache, unsigned int i, const unsigned char *fusion)
+{
+	int s, j;
+	int best = -1;
+
+	for (s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+		superinstruction *super = &SUPERINSTRUCTIONS[s];
+
+		if (!fusion[s] || i + super->length > MEM_SIZE / 4) {
+			continue;
+		}
+
+		for (j = 0; j < super->length; j++) {
+			decoded_instruction *part = &decode_cache[i + j];
+			/* Compare the original opcodes; the entries may be superinstructions themselves.
+			 * Loop branches stay on their own so that they are counted.
+			 */
+			if (part->opcode == NOT_DECODED || part->opcode == LOOP_BRANCH || (part->instruction >> 26) != super->opcodes[j]) {
+				break;
+			}
+		}
+
+		if (j == super->length && (best < 0 || super->length > SUPERINSTRUCTIONS[best].length)) {
+			best = s;
+		}
+	}
+
+	if (best >= 0) {
+		decode_cache[i].opcode = FIRST_SUPERINSTRUCTION + best;
+	}
+}
+
+/* Marks the decode cache entries overlapping the 32-bit word at addr as stale.
+ * Needs to be called on every store so that self-modifying programs
+ * execute what is in memory and not what was there when it was decoded.
+ * This includes the two entries before, which may be superinstructions
+ * that execute the stored word as well.
+ * addr must be in memory bounds; the cache has one spare entry at the end
+ * for words that start in the last cached word.
+ */
+static void invalidate_decoded(decoded_instruction *decode_cache, unsigned int addr)
+{
+	unsigned int i = addr / 4;
+
+	decode_cache[i].opcode = NOT_DECODED;
+	decode_cache[(addr + 3) / 4].opcode = NOT_DECODED;
+	if (i >= 1) decode_cache[i - 1].opcode = NOT_DECODED;
+	if (i >= 2) decode_cache[i - 2].opcode = NOT_DECODED;
+}
+
+/* Decodes the stale entry for the aligned, in-memory pc and fuses it
+ * with the following instructions where possible.
+ * With loop_branches, backward branches and jumps become LOOP_BRANCHes.
+ */
+static void redecode_instruction(unsigned char *memory, decoded_instruction *decode_cache, unsigned int pc, const unsigned char *fusion, int loop_branches)
+{
+	decode_instruction(W32(memory, pc), pc, &decode_cache[pc / 4]);
+	if (loop_branches) {
+		mark_loop_branch(&decode_cache[pc / 4], pc);
+	}
+	fuse_instruction(decode_cache, pc / 4, fusion);
+}
+
+/* Counts of executed opcode pairs and triples, see imps_vm_enable_stats.
+ * Superinstructions count as one opcode.
+ */
+typedef struct {
+	// the last two executed opcodes, the most recent one last; -1 if none
+	int last[2];
+	unsigned long long pairs[LAST_SUPERINSTRUCTION][LAST_SUPERINSTRUCTION];
+	unsigned long long triples[LAST_SUPERINSTRUCTION][LAST_SUPERINSTRUCTION][LAST_SUPERINSTRUCTION];
+} opcode_stats;
+
+static void record_opcode(opcode_stats *stats, unsigned int opcode)
+{
+	if (stats->last[1] >= 0) {
+		stats->pairs[stats->last[1]][opcode]++;
+		if (stats->last[0] >= 0) {
+			stats->triples[stats->last[0]][stats->last[1]][opcode]++;
+		}
+	}
+	stats->last[0] = stats->last[1];
+	stats->last[1] = opcode;
+}
+
+// One line of the histogram printed by imps_vm_print_stats
+typedef struct {
+	unsigned long long count;
+	int opcodes[3];
+} opcode_sequence_count;
+
+static int compare_opcode_sequence_counts(const void *a, const void *b)
+{
+	unsigned long long count_a = ((const opcode_sequence_count *) a)->count;
+	unsigned long long count_b = ((const opcode_sequence_count *) b)->count;
+	// descending
+	return (count_a < count_b) - (count_a > count_b);
+}
+
+/* Prints the histogram of sequences of length 2 or 3, most frequent first. */
+static void print_opcode_sequence_counts(opcode_stats *stats, int length, FILE *out)
+{
+	const int n = LAST_SUPERINSTRUCTION;
+	opcode_sequence_count *lines = malloc(sizeof(opcode_sequence_count) * n * n * n);
+	unsigned long long total = 0;
+	int line_count = 0;
+	int a, b, c, i, j;
+
+	for (a = 0; a < n; a++) {
+		for (b = 0; b < n; b++) {
+			for (c = 0; c < (length == 3 ? n : 1); c++) {
+				unsigned long long count = length == 3 ? stats->triples[a][b][c] : stats->pairs[a][b];
+				if (count) {
+					lines[line_count].count = count;
+					lines[line_count].opcodes[0] = a;
+					lines[line_count].opcodes[1] = b;
+					lines[line_count].opcodes[2] = c;
+					line_count++;
+					total += count;
+				}
+			}
+		}
+	}
+
+	qsort(lines, line_count, sizeof(opcode_sequence_count), compare_opcode_sequence_counts);
+
+	fprintf(out, "Executed opcode %s:\n", length == 3 ? "triples" : "pairs");
+	for (i = 0; i < line_count; i++) {
+		fprintf(out, "%12llu %6.2f%% ", lines[i].count, 100.0 * lines[i].count / total);
+		for (j = 0; j < length; j++) {
+			fprintf(out, " %s", imps_opcode_name(lines[i].opcodes[j]));
+		}
+		fprintf(out, "\n");
+	}
+
+	free(lines);
+}
+
+/* A control transfer other than to the next instruction (taken branch, jump),
+ * and how often it happened.
+ */
+typedef struct {
+	unsigned int from;
+	unsigned int to;
+	unsigned long long count;
+} profile_edge;
+
+/* Execution counts per instruction and per taken edge, see imps_vm_enable_profile. */
+typedef struct {
+	// executions of the instruction at each aligned address
+	unsigned long long counts[MEM_SIZE / 4];
+	// executions at unaligned or out-of-memory addresses
+	unsigned long long other_count;
+	unsigned long long total;
+
+	// open addressing hash table of edges, edge_capacity is a power of 2
+	profile_edge *edges;
+	unsigned int edge_capacity;
+	unsigned int edge_count;
+
+	// the previously executed instruction, to find out if it jumped
+	unsigned int last_pc;
+	int has_last_pc;
+} profile;
+
+static profile_edge * find_edge(profile_edge *edges, unsigned int capacity, unsigned int from, unsigned int to)
+{
+	unsigned int i = (from * 31 + to * 17) & (capacity - 1);
+
+	while (edges[i].count && (edges[i].from != from || edges[i].to != to)) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &edges[i];
+}
+
+static void record_edge(profile *prof, unsigned int from, unsigned int to)
+{
+	profile_edge *edge;
+	unsigned int i;
+
+	// Keep the table at most half full
+	if (2 * (prof->edge_count + 1) > prof->edge_capacity) {
+		unsigned int capacity = prof->edge_capacity ? 2 * prof->edge_capacity : 256;
+		profile_edge *edges = calloc(capacity, sizeof(profile_edge));
+
+		for (i = 0; i < prof->edge_capacity; i++) {
+			if (prof->edges[i].count) {
+				*find_edge(edges, capacity, prof->edges[i].from, prof->edges[i].to) = prof->edges[i];
+			}
+		}
+		free(prof->edges);
+		prof->edges = edges;
+		prof->edge_capacity = capacity;
+	}
+
+	edge = find_edge(prof->edges, prof->edge_capacity, from, to);
+	if (edge->count == 0) {
+		edge->from = from;
+		edge->to = to;
+		prof->edge_count++;
+	}
+	edge->count++;
+}
+
+/* Counts the execution of the instruction at pc, and the edge to it
+ * if it does not follow the previous one.
+ */
+static void profile_instruction(profile *prof, unsigned int pc)
+{
+	if (prof->has_last_pc && pc != prof->last_pc + 4) {
+		record_edge(prof, prof->last_pc, pc);
+	}
+	if (DECODE_CACHEABLE(pc)) {
+		prof->counts[pc / 4]++;
+	} else {
+		prof->other_count++;
+	}
+	prof->total++;
+	prof->last_pc = pc;
+	prof->has_last_pc = 1;
+}
+
+/* The trace of every executed instruction, see imps_vm_start_trace.
+ * The engine fills the chunks of a ring buffer one after another and hands
+ * each full one to a writer thread, so it only takes the lock once per chunk
+ * and only waits when all chunks are still being written out.
+ */
+#define TRACE_CHUNK_RECORDS 4096
+#define TRACE_CHUNKS 16
+
+typedef struct {
+	imps_trace_record records[TRACE_CHUNKS][TRACE_CHUNK_RECORDS];
+	// index of the next record to fill in the chunk head % TRACE_CHUNKS
+	unsigned int position;
+	// chunks handed to the writer thread and chunks written out by it, since the start
+	unsigned long long head;
+	unsigned long long tail;
+	// the last record, as the register it writes is only known after its instruction
+	imps_trace_record *pending;
+
+	int fd;
+	// set when the writer thread shall exit after writing out all full chunks
+	int stopping;
+	// errno of the first failed write, see imps_vm_stop_trace
+	int write_error;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	// signalled when head or tail changed, or on stopping
+	pthread_cond_t changed;
+} trace;
+
+/* Writes all of buf to fd. Returns 0 on error (with errno set), 1 otherwise. */
+static int write_all(int fd, const void *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = write(fd, buf, size);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		buf = (const char *) buf + written;
+		size -= written;
+	}
+	return 1;
+}
+
+/* The writer thread: writes out the chunks the engine handed over. */
+static void * trace_writer(void *arg)
+{
+	trace *tr = arg;
+
+	pthread_mutex_lock(&tr->lock);
+	while (1) {
+		while (tr->tail == tr->head && !tr->stopping) {
+			pthread_cond_wait(&tr->changed, &tr->lock);
+		}
+		if (tr->tail == tr->head) {
+			break;
+		}
+		// The engine does not touch the chunk until tail moves past it
+		pthread_mutex_unlock(&tr->lock);
+		if (!tr->write_error && !write_all(tr->fd, tr->records[tr->tail % TRACE_CHUNKS], sizeof(tr->records[0]))) {
+			tr->write_error = errno;
+		}
+		pthread_mutex_lock(&tr->lock);
+		tr->tail++;
+		pthread_cond_signal(&tr->changed);
+	}
+	pthread_mutex_unlock(&tr->lock);
+	return NULL;
+}
+
+/* Hands the full chunk to the writer thread and waits until the next one is free. */
+static void trace_next_chunk(trace *tr)
+{
+	pthread_mutex_lock(&tr->lock);
+	tr->head++;
+	pthread_cond_signal(&tr->changed);
+	while (tr->head - tr->tail == TRACE_CHUNKS) {
+		pthread_cond_wait(&tr->changed, &tr->lock);
+	}
+	pthread_mutex_unlock(&tr->lock);
+	tr->position = 0;
+}
+
+/* Completes the last record with the value of the register its instruction wrote. */
+static void trace_finish(trace *tr, const int *registers)
+{
+	if (tr->pending) {
+		if (tr->pending->reg != IMPS_TRACE_NO_REGISTER) {
+			tr->pending->value = registers[tr->pending->reg];
+		}
+		tr->pending = NULL;
+	}
+}
+
+/* Records the instruction d at pc, which is about to be executed as opcode
+ * (superinstructions are traced one instruction at a time).
+ */
+static void trace_instruction(trace *tr, unsigned int pc, const decoded_instruction *d, unsigned int opcode, const int *registers)
+{
+	imps_trace_record *r;
+
+	trace_finish(tr, registers);
+	if (tr->position == TRACE_CHUNK_RECORDS) {
+		trace_next_chunk(tr);
+	}
+	r = &tr->records[tr->head % TRACE_CHUNKS][tr->position++];
+
+	r->pc = pc;
+	r->instruction = d->instruction;
+	r->addr = 0;
+	r->value = 0;
+	r->reg = IMPS_TRACE_NO_REGISTER;
+	r->flags = 0;
+	r->reserved = 0;
+
+	switch (opcode) {
+		case ADD:
+		case ADDI:
+		case SUB:
+		case SUBI:
+		case MUL:
+		case MULI:
+			r->reg = d->r1;
+			break;
+		case LW:
+			r->reg = d->r1;
+			r->flags = IMPS_TRACE_LOAD;
+			r->addr = IMPS_ADDRESS(d->r2, d->imm);
+			break;
+		case SW:
+			r->flags = IMPS_TRACE_STORE;
+			r->addr = IMPS_ADDRESS(d->r2, d->imm);
+			r->value = registers[d->r1];
+			break;
+		case JAL:
+			r->reg = 31;
+			break;
+	}
+	tr->pending = r;
+}
+
+/* Prints the 32-bit instruction bit by bit */
+static void print_instruction (unsigned int instruction)
+{
+	unsigned int mask = 1 << 30;
+	while (mask) { putchar(instruction & mask ? '1' : '0'); mask >>= 1; }
+}
+
+/* Returns 1 if the 32-bit word at the given address is in memory range, 0 otherwise.
+ * Words reaching over the end of memory are not, as they cannot be with guard pages.
+ */
+static int in_memory_bounds (unsigned int addr) {
+	return IMPS_IN_MEMORY(addr);
+}
+
+/* A snapshot is the state of a context in a file (see imps_vm_snapshot),
+ * laid out so that it can be mapped instead of read: a header,
+ * then the decode cache and then the memory, which start at multiples
+ * of IMAGE_ALIGN so that they can be mmap'd with any page size.
+ * Taking the decode cache along means a restored context does not
+ * have to decode the program again.
+ */
+#define IMAGE_ALIGN 65536
+#define DECODE_CACHE_SIZE (sizeof(decoded_instruction) * (MEM_SIZE / 4 + 1))
+// The space for the decode cache, in a context and in a snapshot
+#define MAPPED_DECODE_CACHE_SIZE ((DECODE_CACHE_SIZE + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN)
+#define IMAGE_DECODE_CACHE_OFFSET IMAGE_ALIGN
+#define IMAGE_MEMORY_OFFSET (IMAGE_DECODE_CACHE_OFFSET + MAPPED_DECODE_CACHE_SIZE)
+#define IMAGE_SIZE (IMAGE_MEMORY_OFFSET + MEM_SIZE)
+
+/* The unmapped space after memory with guard pages: addresses are unsigned 32-bit,
+ * so no word accessed starts further than 4 GiB from the start of memory.
+ */
+#define GUARD_SIZE (1ULL << 32)
+
+/* The state of the virtual machine.
+ * Everything a program can change lives here, so that any number
+ * of programs can be run in the same process.
+ * Contexts are mmap'd and laid out like snapshots: decode cache and memory
+ * start at page boundaries, so they can be replaced by copy-on-write mappings
+ * of a snapshot (see imps_vm_restore), and memory comes last,
+ * so that the guard pages follow it.
+ */
+struct imps_vm {
+	union {
+		struct {
+			// The 32 general-purpose registers of the emulator, each 32 bit
+			// signed int such that arithmetic expressions are simple to implement
+			int registers[32];
+
+			/* NOTE: Register count 32 is not macro'd because it determines
+			 * all instructions.
+			 */
+
+			// program counter
+			unsigned int pc;
+
+			// program size in bytes
+			unsigned int program_size;
+			/* The first and the last address whose decode cache entry may be decoded,
+			 * low > high if there are none: the program, and what was executed outside of it
+			 * (see imps_vm_invalidate_decoded)
+			 */
+			unsigned int decoded_low, decoded_high;
+
+			// Options
+			int engine;
+			// Which superinstructions to use (see fuse_instruction)
+			unsigned char fusion[SUPERINSTRUCTION_COUNT];
+			// NULL unless imps_vm_enable_stats was called
+			opcode_stats *stats;
+			// NULL unless imps_vm_enable_profile was called
+			profile *prof;
+			// NULL unless imps_vm_start_trace was called
+			trace *trace;
+			// NULL if there is no JIT
+			imps_jit_handler jit;
+			// NULL unless imps_vm_set_hot_loop_handler was called, with its options
+			imps_hot_loop_handler hot_loop;
+			unsigned int hot_loop_threshold;
+			// How often the loop at each aligned address was jumped back to, saturating at hot_loop_threshold
+			unsigned int *loop_counts;
+
+			// The code pages (see imps_vm_add_code), how often each was added, and the handler of stores to them
+			imps_code_map code;
+			unsigned int code_users[IMPS_CODE_PAGES];
+			imps_code_write_handler code_write;
+
+			// Where the SIGSEGV handler continues after a fault on the guard pages
+			sigjmp_buf guard_fault_jump;
+			// The instruction that faulted there, NULL if it was not a LOAD_WORD or STORE_WORD
+			const decoded_instruction *guard_fault_instruction;
+
+			// What went wrong, see imps_vm_error
+			char error[128];
+		};
+		// Like the header of a snapshot
+		unsigned char header_space[IMAGE_ALIGN];
+	};
+
+	// Pre-decoded instructions, indexed by PC / 4
+	decoded_instruction decode_cache[MAPPED_DECODE_CACHE_SIZE / sizeof(decoded_instruction)];
+
+	// The memory of the emulator, fixed to 16 bit byte-addressable space
+	unsigned char memory[MEM_SIZE];
+};
+
+#define SNAPSHOT_MAGIC "IMPSSNAP"
+#define SNAPSHOT_VERSION 4
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	/* The decode cache is only usable by a build that decodes the same way,
+	 * these catch the obvious differences.
+	 */
+	unsigned int decoded_instruction_size;
+	unsigned int superinstruction_count;
+	unsigned int pc;
+	unsigned int program_size;
+	int registers[32];
+	// The superinstructions in the decode cache
+	unsigned char fusion[SUPERINSTRUCTION_COUNT];
+	// Whether the decode cache has LOOP_BRANCHes
+	unsigned char loop_branches;
+	// The bounds of its decoded entries
+	unsigned int decoded_low, decoded_high;
+} snapshot_header;
+
+struct imps_snapshot {
+	// A memfd or an opened snapshot file, never written after creation
+	int fd;
+	snapshot_header header;
+};
+
+/* Sets the message returned by imps_vm_error. */
+static void set_error(imps_vm *vm, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vsnprintf(vm->error, sizeof(vm->error), format, args);
+	va_end(args);
+}
+
+/* The semantics of the instructions superinstructions are made of,
+ * for the decoded instruction d. For use inside the engines.
+ */
+#define EXEC_ADD(d)  IMPS_ADD((d)->r1, (d)->r2, (d)->r3)
+#define EXEC_ADDI(d) IMPS_ADDI((d)->r1, (d)->r2, (d)->imm)
+#define EXEC_SUBI(d) IMPS_SUBI((d)->r1, (d)->r2, (d)->imm)
+#define EXEC_MUL(d)  IMPS_MUL((d)->r1, (d)->r2, (d)->r3)
+#define EXEC_MULI(d) IMPS_MULI((d)->r1, (d)->r2, (d)->imm)
+#define EXEC_LW(part) \
+	{ \
+		unsigned int addr = IMPS_ADDRESS((part)->r2, (part)->imm); \
+		CHECK_ACCESS(addr, part, IMPS_LOAD_ERROR); \
+		registers[(part)->r1] = LOAD_WORD(addr, part); \
+	}
+
+/* Checks that the word at addr, accessed by the decoded instruction part
+ * (d or one of the instructions of superinstruction d following it), is in memory.
+ * With guard pages there is nothing to check.
+ */
+#define CHECK_ACCESS(addr, part, format) \
+	if (!GUARD_PAGES && !in_memory_bounds(addr)) { \
+		set_error(vm, format, addr); \
+		PC += 4 * ((part) - d); \
+		LEAVE(IMPS_ERROR); \
+	}
+
+/* Checks that an instruction that is not in the decode cache can be fetched from PC.
+ * With guard pages, the PC is stored instead for guard_fault, which cannot
+ * tell it from the decode cache. This is the slow path anyway.
+ */
+#define CHECK_FETCH() \
+	if (GUARD_PAGES) { \
+		*(volatile unsigned int *) &vm->pc = PC; \
+	} else if (!in_memory_bounds(PC)) { \
+		set_error(vm, IMPS_FETCH_ERROR, PC); \
+		LEAVE(IMPS_ERROR); \
+	}
+
+#if GUARD_PAGES_ENABLED
+	/* The loads and stores of guest memory. With guard pages, each is a single
+	 * instruction whose address is listed in the section imps_guard_sites,
+	 * done with the decoded instruction part it belongs to in rbx.
+	 * When one of them faults, the SIGSEGV handler finds the instruction
+	 * that faulted in rbx (see guard_fault_handler), so the engines do not
+	 * have to store anything before each access.
+	 */
+	#define GUARD_SITE(instruction) \
+		"1: " instruction "\n" \
+		".pushsection imps_guard_sites, \"aw\"\n" \
+		".quad 1b\n" \
+		".popsection\n"
+
+	#define LOAD_WORD(addr, part) \
+		({ \
+			unsigned int value; \
+			asm volatile (GUARD_SITE("movl %1, %0") : "=r" (value) : "m" (W32(memory, addr)), "b" (part)); \
+			value; \
+		})
+	#define STORE_WORD(addr, value, part) \
+		asm volatile (GUARD_SITE("movl %1, %0") : "=m" (W32(memory, addr)) : "r" (value), "b" (part))
+#else
+	#define LOAD_WORD(addr, part) W32(memory, addr)
+	#define STORE_WORD(addr, value, part) W32(memory, addr) = (value)
+#endif
+
+#define LOG_SUPERINSTRUCTION() LOG_DEBUG("%s (superinstruction)\n", imps_opcode_name(d->opcode))
+
+// Leaves the engine, keeping the PC in the context
+#define LEAVE(result) \
+	do { \
+		vm->pc = PC; \
+		return (result); \
+	} while (0)
+
+/* Calls the code write handler if the bytes from addr to addr + length - 1
+ * are on a code page (see imps_vm_add_code).
+ */
+static void report_code_write(imps_vm *vm, unsigned int addr, size_t length)
+{
+	unsigned int page;
+
+	if (vm->code_write == NULL || length == 0) {
+		return;
+	}
+	for (page = addr / IMPS_CODE_PAGE_SIZE; page <= (addr + length - 1) / IMPS_CODE_PAGE_SIZE; page++) {
+		if (vm->code.pages[page]) {
+			vm->code_write(vm, addr, length);
+			return;
+		}
+	}
+}
+
+/* After a store of the word at addr: tells the code write handler if it was written on a code page.
+ * As code pages include the 3 bytes before the code, the page of addr is all there is to look up.
+ */
+#define CHECK_CODE_WRITE(addr) \
+	if (vm->code.pages[(addr) / IMPS_CODE_PAGE_SIZE]) { \
+		report_code_write(vm, addr, 4); \
+	}
+
+/* Decodes the stale entry for the aligned, in-memory pc (see redecode_instruction)
+ * and widens the bounds of the decoded entries to it.
+ */
+static void redecode(imps_vm *vm, unsigned int pc)
+{
+	redecode_instruction(vm->memory, vm->decode_cache, pc, vm->fusion, vm->hot_loop != NULL);
+	if (pc < vm->decoded_low) {
+		vm->decoded_low = pc;
+	}
+	if (pc > vm->decoded_high || vm->decoded_low > vm->decoded_high) {
+		vm->decoded_high = pc;
+	}
+}
+
+/* Runs the hot loop at vm->pc, closed by the loop branch at branch_pc, with vm->hot_loop.
+ * Returns 1 if it ran, with vm->pc where the interpreter continues.
+ * A loop that cannot be compiled is interpreted from then on, its loop branch
+ * becoming a plain branch again; one whose code is pending only this time.
+ */
+static int run_hot_loop(imps_vm *vm, unsigned int branch_pc)
+{
+	switch (vm->hot_loop(vm, vm->pc, branch_pc)) {
+		case IMPS_HOT_LOOP_RAN:
+			return 1;
+		case IMPS_HOT_LOOP_PENDING:
+			return 0;
+	}
+	vm->decode_cache[branch_pc / 4].opcode = vm->decode_cache[branch_pc / 4].instruction >> 26;
+	return 0;
+}
+
+/* Executes the LOOP_BRANCH d at PC: counts the jump back to the loop header,
+ * and once the loop is hot, runs it natively every time it is reached
+ * until it exits (see imps_vm_set_hot_loop_handler).
+ */
+#define EXEC_LOOP_BRANCH() \
+	if (branch_taken(d, registers)) { \
+		unsigned int branch_pc = PC; \
+		PC = TARGET; \
+		if (vm->loop_counts[PC / 4] < vm->hot_loop_threshold) { \
+			vm->loop_counts[PC / 4]++; \
+		} else { \
+			vm->pc = PC; \
+			if (run_hot_loop(vm, branch_pc)) { \
+				PC = vm->pc; \
+			} \
+		} \
+	} else { \
+		PC += 4; \
+	}
+
+/* Runs the program from vm->pc until HALT (returns IMPS_HALTED)
+ * or an error (returns IMPS_ERROR), dispatching each instruction with a switch.
+ * This is the reference engine.
+ * If limited, it returns IMPS_RUNNING after count instructions.
+ * If profiled, every executed instruction is counted in vm->prof.
+ * If traced, every executed instruction is recorded in vm->trace.
+ * In all these cases, superinstructions are executed one instruction at a time
+ * so that the counts are exact.
+ * This is inlined into imps_vm_run and imps_vm_step with limited, profiled and traced
+ * being constant, so running without them does not pay for the checks.
+ */
+static inline __attribute__((always_inline)) int run_switch_engine(imps_vm *vm, const int limited, unsigned long long count, const int profiled, const int traced)
+{
+	// Copied out of the context so that gcc can keep them in registers
+	unsigned char *memory = vm->memory;
+	int *registers = vm->registers;
+	decoded_instruction *decode_cache = vm->decode_cache;
+	opcode_stats *stats = vm->stats;
+
+	// program counter
+	unsigned int PC = vm->pc;
+
+	// Used for instructions that cannot be cached (see DECODE_CACHEABLE)
+	decoded_instruction uncached;
+
+	/* Main computation loop.
+	 * Runs a fetch-execute-cycle until HALT is encountered or an error is encountered,
+	 * e.g. an unknown instruction is to be executed or memory borders are exceeded.
+	 */
+
+	while (1) {
+		if (limited) {
+			if (count == 0) {
+				LEAVE(IMPS_RUNNING);
+			}
+			count--;
+		}
+
+		if (profiled) {
+			profile_instruction(vm->prof, PC);
+		}
+
+		LOG_DEBUG("PC: %d\t- ", PC);
+
+		// fetch
+
+		decoded_instruction *d;
+
+		if (DECODE_CACHEABLE(PC)) {
+			d = &decode_cache[PC / 4];
+			// Stale or never executed cache entry
+			if (d->opcode == NOT_DECODED) {
+				redecode(vm, PC);
+			}
+		} else {
+			CHECK_FETCH();
+			d = &uncached;
+			decode_instruction(W32(memory, PC), PC, d);
+		}
+
+		unsigned int opcode = d->opcode;
+
+		/* Only the first instruction of a superinstruction, and loop branches
+		 * as plain branches, as native code would not be counted
+		 */
+		if ((limited || profiled || traced) && opcode > NOT_DECODED) {
+			opcode = d->instruction >> 26;
+		}
+
+		if (stats) {
+			record_opcode(stats, opcode);
+		}
+
+		if (traced) {
+			trace_instruction(vm->trace, PC, d, opcode, registers);
+		}
+
+		// Instruction part access
+
+		/* These macros are fixed to the decoded instruction being called "d"
+		 * (therefore we declared them locally) so that we can write R1
+		 * instead of d->r1, which makes the program a lot cleaner.
+		 * IMM is already sign-extended, TARGET is the absolute address
+		 * a branch or jump continues at.
+		 */
+
+		#define R1     (d->r1)
+		#define R2     (d->r2)
+		#define R3     (d->r3)
+		#define IMM    (d->imm)
+		#define TARGET (d->target)
+
+		/* REMEMBER that R1 is not register 1, but the R1 part of the instruction
+		 * as in the spec. The actual registers are accessed with register[i].
+		 */
+
+		// execute
+
+		DEBUG(print_instruction(d->instruction));
+		LOG_DEBUG(" ");
+
+		/* We chose a simple switch instead of a virtual function table as this is
+		 * an easy-to-understand, easily debuggable and clean solution and also
+		 * allows control over the outer while loop (e.g. for when PC incrementation)
+		 * shall be skipped.
+		 * We have enough faith in gcc to believe that it optimises it to be at least
+		 * as fast as a vtable.
+		 */
+
+		switch (opcode) {
+
+			case HALT:
+				LOG_DEBUG("HALT\n");
+				// The spec do not say this, but the provied result files increment the PC after HALT
+				PC += 4;
+				LEAVE(IMPS_HALTED);
+			
+			// Arithmetics
+			
+			case ADD:
+				LOG_DEBUG("ADD R%d = R%d + R%d\n", R1, R2, R3);
+				IMPS_ADD(R1, R2, R3);
+				break;
+
+			case ADDI:
+				LOG_DEBUG("ADDI R%d = R%d + %d\n", R1, R2, IMM);
+				IMPS_ADDI(R1, R2, IMM);
+				break;
+
+			case SUB:
+				LOG_DEBUG("SUB R%d = R%d - R%d\n", R1, R2, R3);
+				IMPS_SUB(R1, R2, R3);
+				break;
+
+			case SUBI:
+				LOG_DEBUG("SUBI R%d = R%d - %d\n", R1, R2, IMM);
+				IMPS_SUBI(R1, R2, IMM);
+				break;
+
+			case MUL:
+				LOG_DEBUG("MUL R%d = R%d - R%d\n", R1, R2, R3);
+				IMPS_MUL(R1, R2, R3);
+				break;
+
+			case MULI:
+				LOG_DEBUG("MULI R%d = R%d + %d\n", R1, R2, IMM);
+				IMPS_MULI(R1, R2, IMM);
+				break;
+
+			// Load and store
+
+			case LW:
+				LOG_DEBUG("LW R%d = MEMORY[R%d + %d]\n", R1, R2, IMM);
+				// Scope this because switch allows re-use of variables in different cases.
+				{
+					unsigned int addr = IMPS_ADDRESS(R2, IMM);
+					// Check memory violation according to the spec
+					CHECK_ACCESS(addr, d, IMPS_LOAD_ERROR);
+					registers[R1] = LOAD_WORD(addr, d);
+				}
+				break;
+
+			case SW:
+				LOG_DEBUG("SW MEMORY[R%d + %d] = %d\n", R1, R2, registers[R1]);
+				{
+					unsigned int addr = IMPS_ADDRESS(R2, IMM);
+					CHECK_ACCESS(addr, d, IMPS_STORE_ERROR);
+					STORE_WORD(addr, registers[R1], d);
+					invalidate_decoded(decode_cache, addr);
+					CHECK_CODE_WRITE(addr);
+				}
+				break;
+
+			// Branching
+
+			case BEQ:
+				LOG_DEBUG("BEQ if R%d == R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+				if (IMPS_BEQ(R1, R2)) {
+					PC = TARGET;
+					continue;
+				}
+				break;
+
+			case BNE:
+				LOG_DEBUG("BNE if R%d != R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+				if (IMPS_BNE(R1, R2)) {
+					PC = TARGET;
+					continue;
+				}
+				break;
+
+			case BLT:
+				LOG_DEBUG("BLT if R%d < R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+				// NOTE: This relies on the fact that registers[] is signed int.
+				if (IMPS_BLT(R1, R2)) {
+					PC = TARGET;
+					continue;
+				}
+				break;
+
+			case BGT:
+				LOG_DEBUG("BGT if R%d > R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+				if (IMPS_BGT(R1, R2)) {
+					PC = TARGET;
+					continue;
+				}
+				break;
+
+			case BLE:
+				LOG_DEBUG("BLE if R%d <= R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+				if (IMPS_BLE(R1, R2)) {
+					PC = TARGET;
+					continue;
+				}
+				break;
+
+			case BGE:
+				LOG_DEBUG("BGE if R%d >= R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+				if (IMPS_BGE(R1, R2)) {
+					PC = TARGET;
+					continue;
+				}
+				break;
+
+			// Jumping
+
+			case JMP:
+				LOG_DEBUG("JMP PC = %d\n", TARGET);
+				PC = TARGET;
+				continue;
+
+			case JR:
+				LOG_DEBUG("JR PC = R%d\n", R1);
+				PC = registers[R1];
+				continue;
+
+			case JAL:
+				LOG_DEBUG("JAL R31 = PC + 4; PC = %d\n", TARGET);
+				registers[31] = PC + 4;
+				PC = TARGET;
+				continue;
+
+			case LOOP_BRANCH:
+				LOG_DEBUG("%s (loop branch) to %d\n", imps_opcode_name(d->instruction >> 26), TARGET);
+				EXEC_LOOP_BRANCH();
+				continue;
+
+			// Superinstructions (see fuse_instruction)
+
+			case ADD_ADD:
+				LOG_SUPERINSTRUCTION();
+				EXEC_ADD(d);
+				EXEC_ADD(d + 1);
+				PC += 8;
+				continue;
+
+			case ADD_LW:
+				LOG_SUPERINSTRUCTION();
+				EXEC_ADD(d);
+				EXEC_LW(d + 1);
+				PC += 8;
+				continue;
+
+			case MUL_MULI:
+				LOG_SUPERINSTRUCTION();
+				EXEC_MUL(d);
+				EXEC_MULI(d + 1);
+				PC += 8;
+				continue;
+
+			case MULI_ADD:
+				LOG_SUPERINSTRUCTION();
+				EXEC_MULI(d);
+				EXEC_ADD(d + 1);
+				PC += 8;
+				continue;
+
+			case MUL_ADD:
+				LOG_SUPERINSTRUCTION();
+				EXEC_MUL(d);
+				EXEC_ADD(d + 1);
+				PC += 8;
+				continue;
+
+			case ADDI_JMP:
+				LOG_SUPERINSTRUCTION();
+				EXEC_ADDI(d);
+				PC = d[1].target;
+				continue;
+
+			case SUBI_JMP:
+				LOG_SUPERINSTRUCTION();
+				EXEC_SUBI(d);
+				PC = d[1].target;
+				continue;
+
+			case ADD_ADD_LW:
+				LOG_SUPERINSTRUCTION();
+				EXEC_ADD(d);
+				EXEC_ADD(d + 1);
+				EXEC_LW(d + 2);
+				PC += 12;
+				continue;
+
+			case MUL_MULI_MULI:
+				LOG_SUPERINSTRUCTION();
+				EXEC_MUL(d);
+				EXEC_MULI(d + 1);
+				EXEC_MULI(d + 2);
+				PC += 12;
+				continue;
+
+			case MULI_ADD_ADD:
+				LOG_SUPERINSTRUCTION();
+				EXEC_MULI(d);
+				EXEC_ADD(d + 1);
+				EXEC_ADD(d + 2);
+				PC += 12;
+				continue;
+
+			case MUL_MULI_ADD:
+				LOG_SUPERINSTRUCTION();
+				EXEC_MUL(d);
+				EXEC_MULI(d + 1);
+				EXEC_ADD(d + 2);
+				PC += 12;
+				continue;
+
+			case JIT:
+				if (vm->jit) {
+					LOG_DEBUG("JIT\n");
+					vm->pc = PC;
+					if (!vm->jit(vm)) {
+						set_error(vm, "JIT instruction at %d failed", PC);
+						return IMPS_ERROR;
+					}
+					PC = vm->pc;
+					continue;
+				}
+				// Without a JIT, this is just an unknown instruction
+				// fall through
+			default:
+				LOG_DEBUG("UNKNOWN INSTRUCTION ");
+				DEBUG(print_instruction(d->instruction));
+				LOG_DEBUG("\n");
+		}
+				
+		/* for BRANCHES and JUMPS, this MUST NOT BE EXECUTED
+		 * (therefore, continue is used),
+		 * because otherwise we skip an instruction
+		 */
+		// increment PC
+		PC += 4;
+	}
+
+	#undef R1
+	#undef R2
+	#undef R3
+	#undef IMM
+	#undef TARGET
+}
+
+/* Same as run_switch_engine, but uses gcc's labels as values ("computed goto")
+ * to jump from the end of each instruction directly to the code of the next one.
+ * Compared to the single switch, every instruction has its own indirect jump,
+ * which the CPU can predict a lot better (e.g. an ADD is often followed by a LW).
+ */
+static int run_threaded_engine(imps_vm *vm)
+{
+	unsigned char *memory = vm->memory;
+	int *registers = vm->registers;
+	decoded_instruction *decode_cache = vm->decode_cache;
+	opcode_stats *stats = vm->stats;
+
+	// program counter
+	unsigned int PC = vm->pc;
+
+	// Used for instructions that cannot be cached (see DECODE_CACHEABLE)
+	decoded_instruction uncached;
+
+	decoded_instruction *d;
+
+	// Where the code for each opcode is, unknown opcodes by default
+	static void *dispatch_table[LAST_SUPERINSTRUCTION] = {
+		[0 ... LAST_SUPERINSTRUCTION - 1] = &&do_unknown,
+		[HALT] = &&do_halt,
+		[ADD]  = &&do_add,
+		[ADDI] = &&do_addi,
+		[SUB]  = &&do_sub,
+		[SUBI] = &&do_subi,
+		[MUL]  = &&do_mul,
+		[MULI] = &&do_muli,
+		[LW]   = &&do_lw,
+		[SW]   = &&do_sw,
+		[BEQ]  = &&do_beq,
+		[BNE]  = &&do_bne,
+		[BLT]  = &&do_blt,
+		[BGT]  = &&do_bgt,
+		[BLE]  = &&do_ble,
+		[BGE]  = &&do_bge,
+		[JMP]  = &&do_jmp,
+		[JR]   = &&do_jr,
+		[JAL]  = &&do_jal,
+		[JIT]  = &&do_jit,
+		[NOT_DECODED] = &&do_not_decoded,
+		[LOOP_BRANCH] = &&do_loop_branch,
+		[ADD_ADD]       = &&do_add_add,
+		[ADD_LW]        = &&do_add_lw,
+		[MUL_MULI]      = &&do_mul_muli,
+		[MULI_ADD]      = &&do_muli_add,
+		[MUL_ADD]       = &&do_mul_add,
+		[ADDI_JMP]      = &&do_addi_jmp,
+		[SUBI_JMP]      = &&do_subi_jmp,
+		[ADD_ADD_LW]    = &&do_add_add_lw,
+		[MUL_MULI_MULI] = &&do_mul_muli_muli,
+		[MULI_ADD_ADD]  = &&do_muli_add_add,
+		[MUL_MULI_ADD]  = &&do_mul_muli_add
+	};
+
+	// Fetches the instruction at PC and jumps to its code.
+	#define DISPATCH() \
+		do { \
+			LOG_DEBUG("PC: %d\t- ", PC); \
+			if (DECODE_CACHEABLE(PC)) { \
+				d = &decode_cache[PC / 4]; \
+			} else { \
+				CHECK_FETCH(); \
+				d = &uncached; \
+				decode_instruction(W32(memory, PC), PC, d); \
+			} \
+			DEBUG(print_instruction(d->instruction)); \
+			LOG_DEBUG(" "); \
+			if (stats && d->opcode != NOT_DECODED) { \
+				record_opcode(stats, d->opcode); \
+			} \
+			goto *dispatch_table[d->opcode]; \
+		} while (0)
+
+	// Continues with the instruction after the current one.
+	#define NEXT() \
+		do { \
+			PC += 4; \
+			DISPATCH(); \
+		} while (0)
+
+	// See run_switch_engine for these
+	#define R1     (d->r1)
+	#define R2     (d->r2)
+	#define R3     (d->r3)
+	#define IMM    (d->imm)
+	#define TARGET (d->target)
+
+	DISPATCH();
+
+	do_not_decoded:
+		// Stale or never executed cache entry: decode and jump to the real code
+		redecode(vm, PC);
+		if (stats) {
+			record_opcode(stats, d->opcode);
+		}
+		goto *dispatch_table[d->opcode];
+
+	do_halt:
+		LOG_DEBUG("HALT\n");
+		// The spec do not say this, but the provied result files increment the PC after HALT
+		PC += 4;
+		LEAVE(IMPS_HALTED);
+
+	// Arithmetics
+
+	do_add:
+		LOG_DEBUG("ADD R%d = R%d + R%d\n", R1, R2, R3);
+		IMPS_ADD(R1, R2, R3);
+		NEXT();
+
+	do_addi:
+		LOG_DEBUG("ADDI R%d = R%d + %d\n", R1, R2, IMM);
+		IMPS_ADDI(R1, R2, IMM);
+		NEXT();
+
+	do_sub:
+		LOG_DEBUG("SUB R%d = R%d - R%d\n", R1, R2, R3);
+		IMPS_SUB(R1, R2, R3);
+		NEXT();
+
+	do_subi:
+		LOG_DEBUG("SUBI R%d = R%d - %d\n", R1, R2, IMM);
+		IMPS_SUBI(R1, R2, IMM);
+		NEXT();
+
+	do_mul:
+		LOG_DEBUG("MUL R%d = R%d - R%d\n", R1, R2, R3);
+		IMPS_MUL(R1, R2, R3);
+		NEXT();
+
+	do_muli:
+		LOG_DEBUG("MULI R%d = R%d + %d\n", R1, R2, IMM);
+		IMPS_MULI(R1, R2, IMM);
+		NEXT();
+
+	// Load and store
+
+	do_lw:
+		LOG_DEBUG("LW R%d = MEMORY[R%d + %d]\n", R1, R2, IMM);
+		{
+			unsigned int addr = IMPS_ADDRESS(R2, IMM);
+			// Check memory violation according to the spec
+			CHECK_ACCESS(addr, d, IMPS_LOAD_ERROR);
+			registers[R1] = LOAD_WORD(addr, d);
+		}
+		NEXT();
+
+	do_sw:
+		LOG_DEBUG("SW MEMORY[R%d + %d] = %d\n", R1, R2, registers[R1]);
+		{
+			unsigned int addr = IMPS_ADDRESS(R2, IMM);
+			CHECK_ACCESS(addr, d, IMPS_STORE_ERROR);
+			STORE_WORD(addr, registers[R1], d);
+			invalidate_decoded(decode_cache, addr);
+			CHECK_CODE_WRITE(addr);
+		}
+		NEXT();
+
+	// Branching
+
+	do_beq:
+		LOG_DEBUG("BEQ if R%d == R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+		PC = IMPS_BEQ(R1, R2) ? TARGET : PC + 4;
+		DISPATCH();
+
+	do_bne:
+		LOG_DEBUG("BNE if R%d != R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+		PC = IMPS_BNE(R1, R2) ? TARGET : PC + 4;
+		DISPATCH();
+
+	do_blt:
+		LOG_DEBUG("BLT if R%d < R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+		// NOTE: This relies on the fact that registers[] is signed int.
+		PC = IMPS_BLT(R1, R2) ? TARGET : PC + 4;
+		DISPATCH();
+
+	do_bgt:
+		LOG_DEBUG("BGT if R%d > R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+		PC = IMPS_BGT(R1, R2) ? TARGET : PC + 4;
+		DISPATCH();
+
+	do_ble:
+		LOG_DEBUG("BLE if R%d <= R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+		PC = IMPS_BLE(R1, R2) ? TARGET : PC + 4;
+		DISPATCH();
+
+	do_bge:
+		LOG_DEBUG("BGE if R%d >= R%d then PC = PC + (%d * 4)\n", R1, R2, IMM);
+		PC = IMPS_BGE(R1, R2) ? TARGET : PC + 4;
+		DISPATCH();
+
+	// Jumping
+
+	do_jmp:
+		LOG_DEBUG("JMP PC = %d\n", TARGET);
+		PC = TARGET;
+		DISPATCH();
+
+	do_jr:
+		LOG_DEBUG("JR PC = R%d\n", R1);
+		PC = registers[R1];
+		DISPATCH();
+
+	do_jal:
+		LOG_DEBUG("JAL R31 = PC + 4; PC = %d\n", TARGET);
+		registers[31] = PC + 4;
+		PC = TARGET;
+		DISPATCH();
+
+	do_loop_branch:
+		LOG_DEBUG("%s (loop branch) to %d\n", imps_opcode_name(d->instruction >> 26), TARGET);
+		EXEC_LOOP_BRANCH();
+		DISPATCH();
+
+	do_jit:
+		if (vm->jit == NULL) {
+			goto do_unknown;
+		}
+		LOG_DEBUG("JIT\n");
+		vm->pc = PC;
+		if (!vm->jit(vm)) {
+			set_error(vm, "JIT instruction at %d failed", PC);
+			return IMPS_ERROR;
+		}
+		PC = vm->pc;
+		DISPATCH();
+
+	// Superinstructions (see fuse_instruction)
+
+	do_add_add:
+		LOG_SUPERINSTRUCTION();
+		EXEC_ADD(d);
+		EXEC_ADD(d + 1);
+		PC += 8;
+		DISPATCH();
+
+	do_add_lw:
+		LOG_SUPERINSTRUCTION();
+		EXEC_ADD(d);
+		EXEC_LW(d + 1);
+		PC += 8;
+		DISPATCH();
+
+	do_mul_muli:
+		LOG_SUPERINSTRUCTION();
+		EXEC_MUL(d);
+		EXEC_MULI(d + 1);
+		PC += 8;
+		DISPATCH();
+
+	do_muli_add:
+		LOG_SUPERINSTRUCTION();
+		EXEC_MULI(d);
+		EXEC_ADD(d + 1);
+		PC += 8;
+		DISPATCH();
+
+	do_mul_add:
+		LOG_SUPERINSTRUCTION();
+		EXEC_MUL(d);
+		EXEC_ADD(d + 1);
+		PC += 8;
+		DISPATCH();
+
+	do_addi_jmp:
+		LOG_SUPERINSTRUCTION();
+		EXEC_ADDI(d);
+		PC = d[1].target;
+		DISPATCH();
+
+	do_subi_jmp:
+		LOG_SUPERINSTRUCTION();
+		EXEC_SUBI(d);
+		PC = d[1].target;
+		DISPATCH();
+
+	do_add_add_lw:
+		LOG_SUPERINSTRUCTION();
+		EXEC_ADD(d);
+		EXEC_ADD(d + 1);
+		EXEC_LW(d + 2);
+		PC += 12;
+		DISPATCH();
+
+	do_mul_muli_muli:
+		LOG_SUPERINSTRUCTION();
+		EXEC_MUL(d);
+		EXEC_MULI(d + 1);
+		EXEC_MULI(d + 2);
+		PC += 12;
+		DISPATCH();
+
+	do_muli_add_add:
+		LOG_SUPERINSTRUCTION();
+		EXEC_MULI(d);
+		EXEC_ADD(d + 1);
+		EXEC_ADD(d + 2);
+		PC += 12;
+		DISPATCH();
+
+	do_mul_muli_add:
+		LOG_SUPERINSTRUCTION();
+		EXEC_MUL(d);
+		EXEC_MULI(d + 1);
+		EXEC_ADD(d + 2);
+		PC += 12;
+		DISPATCH();
+
+	do_unknown:
+		LOG_DEBUG("UNKNOWN INSTRUCTION ");
+		DEBUG(print_instruction(d->instruction));
+		LOG_DEBUG("\n");
+		NEXT();
+
+	#undef DISPATCH
+	#undef NEXT
+	#undef R1
+	#undef R2
+	#undef R3
+	#undef IMM
+	#undef TARGET
+}
+
+/* Parses a list of superinstructions into fusion (see imps_vm_set_fusion).
+ * Returns 0 on error.
+ */
+static int parse_fusion(imps_vm *vm, const char *list, unsigned char *fusion)
+{
+	char names[strlen(list) + 1];
+	char *name;
+	// strtok_r instead of strtok as other threads may be using other contexts
+	char *rest;
+	int s;
+
+	if (strcmp(list, "all") == 0) {
+		memset(fusion, 1, SUPERINSTRUCTION_COUNT);
+		return 1;
+	}
+
+	memset(fusion, 0, SUPERINSTRUCTION_COUNT);
+
+	if (strcmp(list, "none") == 0) {
+		return 1;
+	}
+
+	strcpy(names, list);
+	for (name = strtok_r(names, ",", &rest); name != NULL; name = strtok_r(NULL, ",", &rest)) {
+		for (s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+			if (strcasecmp(name, SUPERINSTRUCTIONS[s].name) == 0) {
+				fusion[s] = 1;
+				break;
+			}
+		}
+		if (s == SUPERINSTRUCTION_COUNT) {
+			set_error(vm, "unknown superinstruction %s", name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Decodes the program once up front; the rest of memory is decoded
+ * on first execution in case the program jumps there.
+ */
+static void predecode(imps_vm *vm)
+{
+	unsigned int i;
+
+	for (i = 0; i < MEM_SIZE / 4 + 1; i++) {
+		if (i * 4 < vm->program_size) {
+			decode_instruction(W32(vm->memory, i * 4), i * 4, &vm->decode_cache[i]);
+			if (vm->hot_loop) {
+				mark_loop_branch(&vm->decode_cache[i], i * 4);
+			}
+		} else {
+			vm->decode_cache[i].opcode = NOT_DECODED;
+		}
+	}
+	// Fusing needs the following instructions to be decoded already
+	for (i = 0; i * 4 < vm->program_size; i++) {
+		fuse_instruction(vm->decode_cache, i, vm->fusion);
+	}
+	vm->decoded_low = vm->program_size ? 0 : MEM_SIZE;
+	vm->decoded_high = vm->program_size ? (vm->program_size - 1) & ~3u : 0;
+}
+
+// GUARD PAGES
+
+// What is mapped for a context, including the guard pages
+#define MAPPED_VM_SIZE (sizeof(imps_vm) + (GUARD_PAGES ? GUARD_SIZE : 0))
+
+// The context whose program this thread runs with guard pages, see run_guarded
+static __thread imps_vm *guarded_vm;
+
+// What was installed for SIGSEGV before guard_fault_handler, for faults that are not ours
+static struct sigaction previous_sigsegv_action;
+
+#if GUARD_PAGES_ENABLED
+	// Made by the linker for the section GUARD_SITE puts the addresses of the loads and stores in
+	extern const unsigned long __start_imps_guard_sites[] __attribute__((visibility("hidden")));
+	extern const unsigned long __stop_imps_guard_sites[] __attribute__((visibility("hidden")));
+#endif
+
+/* Returns the decoded instruction that made the faulting access, from rbx
+ * if the faulting code is one of the loads and stores of the engines, or NULL.
+ */
+static const decoded_instruction * faulting_instruction(ucontext_t *context)
+{
+#if GUARD_PAGES_ENABLED
+	unsigned long rip = context->uc_mcontext.gregs[REG_RIP];
+	const unsigned long *site;
+
+	for (site = __start_imps_guard_sites; site < __stop_imps_guard_sites; site++) {
+		if (*site == rip) {
+			return (const decoded_instruction *) context->uc_mcontext.gregs[REG_RBX];
+		}
+	}
+#endif
+	return NULL;
+}
+
+/* Jumps back to run_guarded if the fault is on the guard pages of the running context. */
+static void guard_fault_handler(int signal, siginfo_t *info, void *ucontext)
+{
+	imps_vm *vm = guarded_vm;
+	unsigned char *addr = info->si_addr;
+
+	if (vm && addr >= vm->memory + MEM_SIZE && addr < vm->memory + MEM_SIZE + GUARD_SIZE) {
+		vm->guard_fault_instruction = faulting_instruction(ucontext);
+		siglongjmp(vm->guard_fault_jump, 1);
+	}
+
+	// A real crash
+	if (previous_sigsegv_action.sa_flags & SA_SIGINFO) {
+		previous_sigsegv_action.sa_sigaction(signal, info, ucontext);
+	} else if (previous_sigsegv_action.sa_handler == SIG_DFL || previous_sigsegv_action.sa_handler == SIG_IGN) {
+		// Returning executes the faulting instruction again, which then gets the default action
+		sigaction(SIGSEGV, &previous_sigsegv_action, NULL);
+	} else {
+		previous_sigsegv_action.sa_handler(signal);
+	}
+}
+
+static void install_guard_fault_handler(void)
+{
+	static int installed = 0;
+	struct sigaction action;
+
+	if (!__sync_bool_compare_and_swap(&installed, 0, 1)) {
+		return;
+	}
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = guard_fault_handler;
+	sigemptyset(&action.sa_mask);
+	// SIGSEGV must not stay blocked, as the handler does not return but jumps back into run_guarded
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigaction(SIGSEGV, &action, &previous_sigsegv_action);
+}
+
+/* Makes the error for the instruction that faulted on the guard pages
+ * and leaves the PC at it, the same as the software checks (see CHECK_ACCESS).
+ * A fault can only come from fetching an instruction outside of memory, a LW or a SW.
+ */
+static int guard_fault(imps_vm *vm)
+{
+	const decoded_instruction *faulting = vm->guard_fault_instruction;
+	unsigned int instruction;
+	unsigned int addr;
+
+	// Otherwise it is not in the decode cache (or a fetch), and its PC was stored by CHECK_FETCH
+	if (faulting >= vm->decode_cache && faulting < vm->decode_cache + MEM_SIZE / 4) {
+		vm->pc = (faulting - vm->decode_cache) * 4;
+	}
+
+	if (!in_memory_bounds(vm->pc)) {
+		set_error(vm, IMPS_FETCH_ERROR, vm->pc);
+		return IMPS_ERROR;
+	}
+
+	// The faulting access did not change any register, so the address can be calculated again
+	instruction = W32(vm->memory, vm->pc);
+	addr = vm->registers[(instruction >> 16) & 0x1f] + SIGNEXT(instruction & 0xffff);
+	if ((instruction >> 26) == SW) {
+		set_error(vm, IMPS_STORE_ERROR, addr);
+	} else {
+		set_error(vm, IMPS_LOAD_ERROR, addr);
+	}
+	return IMPS_ERROR;
+}
+
+// The API, see imps-vm.h
+
+/* Allocates a zeroed context with the default options but does not decode anything yet. */
+static imps_vm * new_vm(void)
+{
+	// The guard pages are only reserved address space, they never use memory
+	imps_vm *vm = mmap(NULL, MAPPED_VM_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (vm == MAP_FAILED) {
+		return NULL;
+	}
+	if (mprotect(vm, sizeof(imps_vm), PROT_READ | PROT_WRITE) != 0) {
+		munmap(vm, MAPPED_VM_SIZE);
+		return NULL;
+	}
+	vm->engine = IMPS_ENGINE_SWITCH;
+	memset(vm->fusion, 1, sizeof(vm->fusion));
+	// No code pages
+	vm->code.low = MEM_SIZE;
+	return vm;
+}
+
+imps_vm * imps_vm_create(void)
+{
+	imps_vm *vm = new_vm();
+
+	// Check if there are as many elements in the instruction enum as in the instruction names array.
+	assert(sizeof(INSTRUCTION_NAMES) / sizeof(char*) == LAST_OPCODE);
+	// Check that the small parts of the context fit in front of the decode cache.
+	assert(offsetof(imps_vm, decode_cache) == IMAGE_ALIGN);
+
+	if (vm == NULL) {
+		return NULL;
+	}
+	if (GUARD_PAGES) {
+		install_guard_fault_handler();
+	}
+	predecode(vm);
+	return vm;
+}
+
+void imps_vm_destroy(imps_vm *vm)
+{
+	if (vm == NULL) {
+		return;
+	}
+	imps_vm_stop_trace(vm);
+	free(vm->loop_counts);
+	free(vm->stats);
+	if (vm->prof) {
+		free(vm->prof->edges);
+		free(vm->prof);
+	}
+	// Including the mappings of a snapshot and the guard pages
+	munmap(vm, MAPPED_VM_SIZE);
+}
+
+int imps_vm_load(imps_vm *vm, const unsigned char *program, size_t program_size)
+{
+	if (program_size > MEM_SIZE) {
+		set_error(vm, "program of %zu bytes does not fit into memory", program_size);
+		return 0;
+	}
+
+	memset(vm->memory, 0, MEM_SIZE);
+	memcpy(vm->memory, program, program_size);
+	report_code_write(vm, 0, MEM_SIZE);
+	memset(vm->registers, 0, sizeof(vm->registers));
+	vm->pc = 0;
+	vm->program_size = program_size;
+	vm->error[0] = '\0';
+	// Nothing was executed before the new program
+	if (vm->stats) {
+		vm->stats->last[0] = vm->stats->last[1] = -1;
+	}
+	if (vm->prof) {
+		vm->prof->has_last_pc = 0;
+	}
+	if (vm->loop_counts) {
+		memset(vm->loop_counts, 0, sizeof(unsigned int) * (MEM_SIZE / 4));
+	}
+
+	LOG_DEBUG("read %d bytes from program file\n", vm->program_size);
+
+	predecode(vm);
+	return 1;
+}
+
+/* Runs the program with the engine selected in vm.
+ * Not inlined into run_guarded, see there.
+ */
+static __attribute__((noinline)) int run(imps_vm *vm)
+{
+	int result;
+
+	// Profiling and tracing are only done by the switch engine
+	if (vm->prof || vm->trace) {
+		result = run_switch_engine(vm, 0, 0, vm->prof != NULL, vm->trace != NULL);
+	} else if (vm->engine == IMPS_ENGINE_THREADED) {
+		return run_threaded_engine(vm);
+	} else {
+		return run_switch_engine(vm, 0, 0, 0, 0);
+	}
+
+	// The registers may be changed through the API before running again
+	if (vm->trace) {
+		trace_finish(vm->trace, vm->registers);
+	}
+	return result;
+}
+
+static __attribute__((noinline)) int step(imps_vm *vm, unsigned long long count)
+{
+	int result = run_switch_engine(vm, 1, count, vm->prof != NULL, vm->trace != NULL);
+
+	if (vm->trace) {
+		trace_finish(vm->trace, vm->registers);
+	}
+	return result;
+}
+
+/* Runs run(vm), or step(vm, count) if limited, with faults on the guard pages
+ * of vm leading back here instead of crashing.
+ * This is a function of its own because the compiler cannot keep anything
+ * in registers across sigsetjmp.
+ */
+static int run_guarded(imps_vm *vm, int limited, unsigned long long count)
+{
+	int result;
+
+	guarded_vm = vm;
+	if (sigsetjmp(vm->guard_fault_jump, 0) == 0) {
+		result = limited ? step(vm, count) : run(vm);
+	} else {
+		result = guard_fault(vm);
+	}
+	guarded_vm = NULL;
+	return result;
+}
+
+int imps_vm_run(imps_vm *vm)
+{
+	if (GUARD_PAGES) {
+		return run_guarded(vm, 0, 0);
+	}
+	return run(vm);
+}
+
+int imps_vm_step(imps_vm *vm, unsigned long long count)
+{
+	if (GUARD_PAGES) {
+		return run_guarded(vm, 1, count);
+	}
+	return step(vm, count);
+}
+
+void imps_vm_set_engine(imps_vm *vm, int engine)
+{
+	vm->engine = engine;
+}
+
+int imps_vm_set_fusion(imps_vm *vm, const char *list)
+{
+	if (!parse_fusion(vm, list, vm->fusion)) {
+		return 0;
+	}
+	// Superinstructions are made when decoding
+	predecode(vm);
+	return 1;
+}
+
+void imps_vm_enable_stats(imps_vm *vm)
+{
+	if (vm->stats == NULL) {
+		vm->stats = calloc(1, sizeof(opcode_stats));
+		vm->stats->last[0] = vm->stats->last[1] = -1;
+	}
+}
+
+void imps_vm_enable_profile(imps_vm *vm)
+{
+	if (vm->prof == NULL) {
+		vm->prof = calloc(1, sizeof(profile));
+	}
+}
+
+int imps_vm_start_trace(imps_vm *vm, const char *filename)
+{
+	imps_trace_header header = { IMPS_TRACE_MAGIC, IMPS_TRACE_VERSION, sizeof(imps_trace_record) };
+	trace *tr;
+
+	if (vm->trace) {
+		set_error(vm, "already tracing");
+		return 0;
+	}
+	tr = calloc(1, sizeof(trace));
+	if (tr == NULL) {
+		set_error(vm, "out of memory");
+		return 0;
+	}
+	tr->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tr->fd < 0) {
+		set_error(vm, "cannot open %s: %s", filename, strerror(errno));
+		free(tr);
+		return 0;
+	}
+	if (!write_all(tr->fd, &header, sizeof(header))) {
+		set_error(vm, "cannot write trace: %s", strerror(errno));
+		close(tr->fd);
+		free(tr);
+		return 0;
+	}
+	pthread_mutex_init(&tr->lock, NULL);
+	pthread_cond_init(&tr->changed, NULL);
+	if (pthread_create(&tr->writer, NULL, trace_writer, tr) != 0) {
+		set_error(vm, "cannot start the trace writer thread");
+		close(tr->fd);
+		free(tr);
+		return 0;
+	}
+	vm->trace = tr;
+	return 1;
+}
+
+int imps_vm_stop_trace(imps_vm *vm)
+{
+	trace *tr = vm->trace;
+	int write_error;
+
+	if (tr == NULL) {
+		return 1;
+	}
+	pthread_mutex_lock(&tr->lock);
+	tr->stopping = 1;
+	pthread_cond_signal(&tr->changed);
+	pthread_mutex_unlock(&tr->lock);
+	pthread_join(tr->writer, NULL);
+
+	// The writer wrote all full chunks, the one being filled is left
+	write_error = tr->write_error;
+	if (!write_error && !write_all(tr->fd, tr->records[tr->head % TRACE_CHUNKS], tr->position * sizeof(imps_trace_record))) {
+		write_error = errno;
+	}
+	if (close(tr->fd) != 0 && !write_error) {
+		write_error = errno;
+	}
+	pthread_mutex_destroy(&tr->lock);
+	pthread_cond_destroy(&tr->changed);
+	free(tr);
+	vm->trace = NULL;
+
+	if (write_error) {
+		set_error(vm, "cannot write trace: %s", strerror(write_error));
+		return 0;
+	}
+	return 1;
+}
+
+void imps_vm_set_jit_handler(imps_vm *vm, imps_jit_handler jit)
+{
+	vm->jit = jit;
+}
+
+/* Sets the hot loop handler without decoding again, for contexts about to be restored. */
+static void set_hot_loop_handler(imps_vm *vm, imps_hot_loop_handler handler, unsigned int threshold)
+{
+	if (handler && vm->loop_counts == NULL) {
+		vm->loop_counts = calloc(MEM_SIZE / 4, sizeof(unsigned int));
+		// Without counts, loops are only interpreted
+		if (vm->loop_counts == NULL) {
+			handler = NULL;
+		}
+	}
+	vm->hot_loop = handler;
+	vm->hot_loop_threshold = threshold;
+	if (vm->loop_counts) {
+		memset(vm->loop_counts, 0, sizeof(unsigned int) * (MEM_SIZE / 4));
+	}
+}
+
+void imps_vm_set_hot_loop_handler(imps_vm *vm, imps_hot_loop_handler handler, unsigned int threshold)
+{
+	set_hot_loop_handler(vm, handler, threshold);
+	// Loop branches are made when decoding
+	predecode(vm);
+}
+
+unsigned int imps_vm_pc(imps_vm *vm)
+{
+	return vm->pc;
+}
+
+void imps_vm_set_pc(imps_vm *vm, unsigned int pc)
+{
+	vm->pc = pc;
+}
+
+int imps_vm_register(imps_vm *vm, int i)
+{
+	return vm->registers[i];
+}
+
+void imps_vm_set_register(imps_vm *vm, int i, int value)
+{
+	vm->registers[i] = value;
+}
+
+int imps_vm_read_memory(imps_vm *vm, unsigned int addr, void *buf, size_t length)
+{
+	if (addr > MEM_SIZE || length > MEM_SIZE - addr) {
+		return 0;
+	}
+	memcpy(buf, &vm->memory[addr], length);
+	return 1;
+}
+
+int imps_vm_write_memory(imps_vm *vm, unsigned int addr, const void *buf, size_t length)
+{
+	if (addr > MEM_SIZE || length > MEM_SIZE - addr) {
+		return 0;
+	}
+	memcpy(&vm->memory[addr], buf, length);
+	imps_vm_invalidate_decoded(vm, addr, length);
+	report_code_write(vm, addr, length);
+	return 1;
+}
+
+int * imps_vm_registers(imps_vm *vm)
+{
+	return vm->registers;
+}
+
+unsigned char * imps_vm_memory(imps_vm *vm)
+{
+	return vm->memory;
+}
+
+void imps_vm_invalidate_decoded(imps_vm *vm, unsigned int addr, size_t length)
+{
+	unsigned int a, end;
+
+	if (length == 0 || vm->decoded_low > vm->decoded_high || addr >= MEM_SIZE) {
+		return;
+	}
+	/* Every word written to also invalidates the entries that may execute it (see invalidate_decoded),
+	 * the ones of the word and the two before: only the words from decoded_low to decoded_high + 8 have any.
+	 * So a JIT writing anywhere in memory does not make the whole decode cache stale.
+	 */
+	a = addr & ~3u;
+	if (a < vm->decoded_low) {
+		a = vm->decoded_low;
+	}
+	end = length < MEM_SIZE - addr ? addr + length : MEM_SIZE;
+	if (end > vm->decoded_high + 12) {
+		end = vm->decoded_high + 12;
+	}
+	for (; a < end; a += 4) {
+		invalidate_decoded(vm->decode_cache, a);
+	}
+}
+
+unsigned int imps_vm_program_size(imps_vm *vm)
+{
+	return vm->program_size;
+}
+
+void imps_vm_set_code_write_handler(imps_vm *vm, imps_code_write_handler handler)
+{
+	vm->code_write = handler;
+}
+
+/* Counts the code at addr once more (by 1) or once less (by -1) on its pages
+ * and marks the pages used by any code, which the bounds are recomputed from.
+ */
+static void count_code(imps_vm *vm, unsigned int addr, size_t length, int by)
+{
+	unsigned int first = (addr < 3 ? 0 : addr - 3) / IMPS_CODE_PAGE_SIZE;
+	unsigned int last = (addr + length - 1) / IMPS_CODE_PAGE_SIZE;
+	unsigned int page;
+
+	if (length == 0 || addr >= MEM_SIZE || length > MEM_SIZE - addr) {
+		return;
+	}
+	for (page = first; page <= last; page++) {
+		vm->code_users[page] += by;
+		vm->code.pages[page] = vm->code_users[page] != 0;
+	}
+
+	vm->code.low = MEM_SIZE;
+	vm->code.high = 0;
+	for (page = 0; page < IMPS_CODE_PAGES; page++) {
+		if (vm->code.pages[page]) {
+			if (vm->code.low == MEM_SIZE) {
+				vm->code.low = page * IMPS_CODE_PAGE_SIZE;
+			}
+			vm->code.high = page * IMPS_CODE_PAGE_SIZE + IMPS_CODE_PAGE_SIZE - 1;
+		}
+	}
+}
+
+void imps_vm_add_code(imps_vm *vm, unsigned int addr, size_t length)
+{
+	count_code(vm, addr, length, 1);
+}
+
+void imps_vm_remove_code(imps_vm *vm, unsigned int addr, size_t length)
+{
+	count_code(vm, addr, length, -1);
+}
+
+const imps_code_map * imps_vm_code_map(imps_vm *vm)
+{
+	return &vm->code;
+}
+
+const char * imps_vm_error(imps_vm *vm)
+{
+	return vm->error;
+}
+
+/* Writes the state of vm to fd as described at snapshot_header.
+ * Returns 0 on error, 1 otherwise.
+ */
+static int write_image(imps_vm *vm, int fd, snapshot_header *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+	header->version = SNAPSHOT_VERSION;
+	header->decoded_instruction_size = sizeof(decoded_instruction);
+	header->superinstruction_count = SUPERINSTRUCTION_COUNT;
+	header->pc = vm->pc;
+	header->program_size = vm->program_size;
+	memcpy(header->registers, vm->registers, sizeof(header->registers));
+	memcpy(header->fusion, vm->fusion, sizeof(header->fusion));
+	header->loop_branches = vm->hot_loop != NULL;
+	header->decoded_low = vm->decoded_low;
+	header->decoded_high = vm->decoded_high;
+
+	// The gaps between the parts stay holes in the file
+	if (ftruncate(fd, IMAGE_SIZE) != 0
+	 || pwrite(fd, header, sizeof(*header), 0) != sizeof(*header)
+	 || pwrite(fd, vm->decode_cache, DECODE_CACHE_SIZE, IMAGE_DECODE_CACHE_OFFSET) != DECODE_CACHE_SIZE
+	 || pwrite(fd, vm->memory, MEM_SIZE, IMAGE_MEMORY_OFFSET) != MEM_SIZE) {
+		set_error(vm, "cannot write snapshot: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+imps_snapshot * imps_vm_snapshot(imps_vm *vm)
+{
+	imps_snapshot *snapshot = malloc(sizeof(imps_snapshot));
+
+	if (snapshot == NULL) {
+		set_error(vm, "out of memory");
+		return NULL;
+	}
+	// Lives in memory only and goes away with the last mapping of it
+	snapshot->fd = memfd_create("imps-snapshot", MFD_CLOEXEC);
+	if (snapshot->fd < 0) {
+		set_error(vm, "cannot create snapshot: %s", strerror(errno));
+		free(snapshot);
+		return NULL;
+	}
+	if (!write_image(vm, snapshot->fd, &snapshot->header)) {
+		imps_snapshot_close(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+int imps_vm_save_snapshot(imps_vm *vm, const char *filename)
+{
+	snapshot_header header;
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int ok;
+
+	if (fd < 0) {
+		set_error(vm, "cannot open %s: %s", filename, strerror(errno));
+		return 0;
+	}
+	ok = write_image(vm, fd, &header);
+	if (close(fd) != 0 && ok) {
+		set_error(vm, "cannot write snapshot: %s", strerror(errno));
+		ok = 0;
+	}
+	return ok;
+}
+
+imps_snapshot * imps_snapshot_open(const char *filename)
+{
+	imps_snapshot *snapshot = malloc(sizeof(imps_snapshot));
+	snapshot_header *header;
+	struct stat st;
+
+	if (snapshot == NULL) {
+		return NULL;
+	}
+	header = &snapshot->header;
+	snapshot->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (snapshot->fd < 0) {
+		free(snapshot);
+		return NULL;
+	}
+	// Mapping beyond the end of the file would only fail when accessed, with SIGBUS
+	if (fstat(snapshot->fd, &st) != 0
+	 || st.st_size < IMAGE_SIZE
+	 || pread(snapshot->fd, header, sizeof(*header), 0) != sizeof(*header)
+	 || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+	 || header->version != SNAPSHOT_VERSION
+	 || header->decoded_instruction_size != sizeof(decoded_instruction)
+	 || header->superinstruction_count != SUPERINSTRUCTION_COUNT
+	 || header->program_size > MEM_SIZE
+	 || header->decoded_high > MEM_SIZE - 4) {
+		imps_snapshot_close(snapshot);
+		errno = EINVAL;
+		return NULL;
+	}
+	return snapshot;
+}
+
+void imps_snapshot_close(imps_snapshot *snapshot)
+{
+	if (snapshot == NULL) {
+		return;
+	}
+	// Contexts restored from it keep their mappings
+	close(snapshot->fd);
+	free(snapshot);
+}
+
+int imps_vm_restore(imps_vm *vm, const imps_snapshot *snapshot)
+{
+	const snapshot_header *header = &snapshot->header;
+
+	/* A private mapping replacing the old decode cache and memory:
+	 * the pages are shared with the snapshot (and everything else restored from it)
+	 * until they are written to, so restoring copies nothing.
+	 */
+	if (mmap(vm->decode_cache, MAPPED_DECODE_CACHE_SIZE + MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			snapshot->fd, IMAGE_DECODE_CACHE_OFFSET) == MAP_FAILED) {
+		set_error(vm, "cannot map snapshot: %s", strerror(errno));
+		return 0;
+	}
+
+	report_code_write(vm, 0, MEM_SIZE);
+	memcpy(vm->registers, header->registers, sizeof(vm->registers));
+	vm->pc = header->pc;
+	vm->program_size = header->program_size;
+	vm->decoded_low = header->decoded_low;
+	vm->decoded_high = header->decoded_high;
+	vm->error[0] = '\0';
+	// Nothing was executed before the restored state
+	if (vm->stats) {
+		vm->stats->last[0] = vm->stats->last[1] = -1;
+	}
+	if (vm->prof) {
+		vm->prof->has_last_pc = 0;
+	}
+
+	// Loops are counted from the restored state on
+	if (vm->loop_counts) {
+		memset(vm->loop_counts, 0, sizeof(unsigned int) * (MEM_SIZE / 4));
+	}
+
+	// The decode cache was made with other superinstructions or loop branches
+	if (memcmp(header->fusion, vm->fusion, sizeof(vm->fusion)) != 0 || header->loop_branches != (vm->hot_loop != NULL)) {
+		predecode(vm);
+	}
+	return 1;
+}
+
+imps_vm * imps_vm_fork(imps_vm *vm, const imps_snapshot *snapshot)
+{
+	// Not decoded, the decode cache comes with the snapshot
+	imps_vm *child = new_vm();
+
+	if (child == NULL) {
+		set_error(vm, "out of memory");
+		return NULL;
+	}
+	child->engine = vm->engine;
+	memcpy(child->fusion, vm->fusion, sizeof(child->fusion));
+	child->jit = vm->jit;
+	child->code_write = vm->code_write;
+	if (vm->hot_loop) {
+		set_hot_loop_handler(child, vm->hot_loop, vm->hot_loop_threshold);
+	}
+
+	if (!imps_vm_restore(child, snapshot)) {
+		set_error(vm, "%s", child->error);
+		imps_vm_destroy(child);
+		return NULL;
+	}
+	return child;
+}
+
+void imps_vm_print_state(imps_vm *vm, FILE *out)
+{
+	imps_print_state(out, vm->pc, vm->registers);
+}
+
+void imps_vm_print_stats(imps_vm *vm, FILE *out)
+{
+	if (vm->stats == NULL) {
+		return;
+	}
+	fprintf(out, "\n");
+	print_opcode_sequence_counts(vm->stats, 2, out);
+	fprintf(out, "\n");
+	print_opcode_sequence_counts(vm->stats, 3, out);
+}
+
+void imps_disassemble(unsigned int instruction, unsigned int pc, char *buf, size_t size)
+{
+	decoded_instruction d;
+	char name[8];
+	int i;
+
+	decode_instruction(instruction, pc, &d);
+
+	if (d.opcode >= LAST_OPCODE) {
+		// Not an instruction, probably data
+		snprintf(buf, size, ".fill %d", SIGNED(instruction));
+		return;
+	}
+
+	// Lower case, as in the assembler source
+	for (i = 0; INSTRUCTION_NAMES[d.opcode][i]; i++) {
+		name[i] = INSTRUCTION_NAMES[d.opcode][i] - 'A' + 'a';
+	}
+	name[i] = '\0';
+
+	switch (d.opcode) {
+		case ADD: case SUB: case MUL:
+			snprintf(buf, size, "%s $%d $%d $%d", name, d.r1, d.r2, d.r3);
+			break;
+		case ADDI: case SUBI: case MULI: case LW: case SW:
+			snprintf(buf, size, "%s $%d $%d %d", name, d.r1, d.r2, d.imm);
+			break;
+		case BEQ: case BNE: case BLT: case BGT: case BLE: case BGE:
+			snprintf(buf, size, "%s $%d $%d L%u", name, d.r1, d.r2, d.target);
+			break;
+		case JMP: case JAL:
+			snprintf(buf, size, "%s L%u", name, d.target);
+			break;
+		case JR:
+			snprintf(buf, size, "%s $%d", name, d.r1);
+			break;
+		default:
+			snprintf(buf, size, "%s", name);
+	}
+}
+
+static int compare_edge_counts(const void *a, const void *b)
+{
+	unsigned long long count_a = ((const profile_edge *) a)->count;
+	unsigned long long count_b = ((const profile_edge *) b)->count;
+	// descending
+	return (count_a < count_b) - (count_a > count_b);
+}
+
+/* Copies the edges of the profile into a malloc'd array, most frequent first. */
+static profile_edge * sorted_edges(profile *prof)
+{
+	profile_edge *edges = malloc(sizeof(profile_edge) * (prof->edge_count + 1));
+	unsigned int i, n = 0;
+
+	for (i = 0; i < prof->edge_capacity; i++) {
+		if (prof->edges[i].count) {
+			edges[n++] = prof->edges[i];
+		}
+	}
+	qsort(edges, n, sizeof(profile_edge), compare_edge_counts);
+	return edges;
+}
+
+/* A loop header is the target of a backward branch or JMP (to the same or a lower address);
+ * JR and JAL are returns and calls rather than loops.
+ * Sets backward_jumps[header / 4] to the number of backward jumps to it
+ * and loop_end[header / 4] to the highest address jumping back to it.
+ */
+static void find_loops(imps_vm *vm, unsigned long long *backward_jumps, unsigned int *loop_end)
+{
+	profile *prof = vm->prof;
+	unsigned int i;
+
+	for (i = 0; i < prof->edge_capacity; i++) {
+		profile_edge *edge = &prof->edges[i];
+		unsigned int opcode;
+
+		if (!edge->count || edge->to > edge->from || !DECODE_CACHEABLE(edge->to) || !DECODE_CACHEABLE(edge->from)) {
+			continue;
+		}
+		opcode = W32(vm->memory, edge->from) >> 26;
+		if ((opcode >= BEQ && opcode <= BGE) || opcode == JMP) {
+			backward_jumps[edge->to / 4] += edge->count;
+			if (edge->from > loop_end[edge->to / 4]) {
+				loop_end[edge->to / 4] = edge->from;
+			}
+		}
+	}
+}
+
+void imps_vm_print_profile(imps_vm *vm, FILE *out)
+{
+	profile *prof = vm->prof;
+	unsigned long long *backward_jumps;
+	unsigned int *loop_end;
+	unsigned char *is_target;
+	profile_edge *edges;
+	unsigned int end, pc, i;
+
+	if (prof == NULL) {
+		return;
+	}
+
+	backward_jumps = calloc(MEM_SIZE / 4, sizeof(unsigned long long));
+	loop_end = calloc(MEM_SIZE / 4, sizeof(unsigned int));
+	is_target = calloc(MEM_SIZE / 4, 1);
+	find_loops(vm, backward_jumps, loop_end);
+	for (i = 0; i < prof->edge_capacity; i++) {
+		if (prof->edges[i].count && DECODE_CACHEABLE(prof->edges[i].to)) {
+			is_target[prof->edges[i].to / 4] = 1;
+		}
+	}
+
+	// The program, and everything executed after it
+	end = (vm->program_size + 3) & ~3u;
+	for (pc = end; pc < MEM_SIZE; pc += 4) {
+		if (prof->counts[pc / 4]) {
+			end = pc + 4;
+		}
+	}
+
+	fprintf(out, "\nProfile: %llu instructions executed\n\n", prof->total);
+	fprintf(out, "       count       %%  label   instruction\n");
+	for (pc = 0; pc < end; pc += 4) {
+		unsigned long long count = prof->counts[pc / 4];
+		char label[16] = "";
+		char instruction[48];
+
+		if (is_target[pc / 4]) {
+			snprintf(label, sizeof(label), "L%u:", pc);
+		}
+		imps_disassemble(W32(vm->memory, pc), pc, instruction, sizeof(instruction));
+
+		if (count) {
+			fprintf(out, "%12llu %6.2f%%  %-7s ", count, 100.0 * count / prof->total, label);
+		} else {
+			fprintf(out, "%12s %7s  %-7s ", "-", "", label);
+		}
+		if (backward_jumps[pc / 4]) {
+			fprintf(out, "%-24s <- loop header: %llu backward jumps, loop ends at L%u",
+				instruction, backward_jumps[pc / 4], loop_end[pc / 4]);
+		} else {
+			fprintf(out, "%s", instruction);
+		}
+		fprintf(out, "\n");
+	}
+	if (prof->other_count) {
+		fprintf(out, "%12llu instructions at unaligned or out-of-memory addresses\n", prof->other_count);
+	}
+
+	edges = sorted_edges(prof);
+	fprintf(out, "\nTaken branches and jumps:\n");
+	for (i = 0; i < prof->edge_count; i++) {
+		fprintf(out, "%12llu  %u -> %u%s\n", edges[i].count, edges[i].from, edges[i].to,
+			edges[i].to <= edges[i].from ? " (backward)" : "");
+	}
+
+	free(edges);
+	free(backward_jumps);
+	free(loop_end);
+	free(is_target);
+}
+
+void imps_vm_write_profile(imps_vm *vm, FILE *out)
+{
+	profile *prof = vm->prof;
+	unsigned long long *backward_jumps;
+	unsigned int *loop_end;
+	profile_edge *edges;
+	unsigned int pc, i;
+
+	if (prof == NULL) {
+		return;
+	}
+
+	backward_jumps = calloc(MEM_SIZE / 4, sizeof(unsigned long long));
+	loop_end = calloc(MEM_SIZE / 4, sizeof(unsigned int));
+	find_loops(vm, backward_jumps, loop_end);
+
+	fprintf(out, "# imps profile\n");
+	fprintf(out, "# total <instructions executed>\n");
+	fprintf(out, "# instruction <address> <count> <opcode>\n");
+	fprintf(out, "# edge <from address> <to address> <count>\n");
+	fprintf(out, "# loop <header address> <address of last backward jump> <backward jumps>\n");
+	fprintf(out, "total %llu\n", prof->total);
+	for (pc = 0; pc < MEM_SIZE; pc += 4) {
+		if (prof->counts[pc / 4]) {
+			fprintf(out, "instruction %u %llu %s\n", pc, prof->counts[pc / 4], imps_opcode_name(W32(vm->memory, pc) >> 26));
+		}
+	}
+	edges = sorted_edges(prof);
+	for (i = 0; i < prof->edge_count; i++) {
+		fprintf(out, "edge %u %u %llu\n", edges[i].from, edges[i].to, edges[i].count);
+	}
+	for (pc = 0; pc < MEM_SIZE; pc += 4) {
+		if (backward_jumps[pc / 4]) {
+			fprintf(out, "loop %u %u %llu\n", pc, loop_end[pc / 4], backward_jumps[pc / 4]);
+		}
+	}
+
+	free(edges);
+	free(backward_jumps);
+	free(loop_end);
+}
@@ -0,0 +1,294 @@
+/* The IMPS virtual machine as a library (libimps).
+ *
+ * All state of a running program (memory, registers, PC, decoded instructions)
+ * lives in an imps_vm context, so a host process can run any number of
+ * programs, one after another or side by side, without forking an emulator
+ * for each of them.
+ *
+ * Typical use:
+ *
+ *     imps_vm *vm = imps_vm_create();
+ *     imps_vm_load(vm, program, program_size);
+ *     if (imps_vm_run(vm) == IMPS_HALTED) {
+ *         imps_vm_print_state(vm, stdout);
+ *     }
+ *     imps_vm_destroy(vm);
+ *
+ * A context must only be used by one thread at a time.
+ */
+
+#ifndef IMPS_VM_H
+#define IMPS_VM_H
+
+#include <stdio.h>
+
+// Size of guest memory in bytes, fixed by spec
+#define IMPS_MEM_SIZE 65536
+
+// Results of imps_vm_run and imps_vm_step
+enum {
+	// HALT was executed
+	IMPS_HALTED = 0,
+	// the program did something illegal, see imps_vm_error
+	IMPS_ERROR = 1,
+	// imps_vm_step executed all its instructions without halting
+	IMPS_RUNNING = 2
+};
+
+// Engines, i.e. ways of dispatching the instructions, see imps_vm_set_engine
+enum {
+	IMPS_ENGINE_SWITCH,
+	IMPS_ENGINE_THREADED
+};
+
+typedef struct imps_vm imps_vm;
+typedef struct imps_snapshot imps_snapshot;
+
+/* Executes the JIT instruction at imps_vm_pc(vm) (see imps-emulator-jit.c)
+ * and sets the PC to where the interpreter shall continue.
+ * Returns 1 on success, 0 on error.
+ */
+typedef int (*imps_jit_handler)(imps_vm *vm);
+
+/* Compiles the loop from header_pc to branch_pc, the backward branch or jump closing it,
+ * and runs it natively from header_pc until it exits, setting the PC to where
+ * the interpreter shall continue. Returns one of the results below.
+ */
+typedef int (*imps_hot_loop_handler)(imps_vm *vm, unsigned int header_pc, unsigned int branch_pc);
+
+// Results of an imps_hot_loop_handler
+enum {
+	// it cannot compile the loop, which is interpreted from now on
+	IMPS_HOT_LOOP_INTERPRETED = 0,
+	// it ran the loop
+	IMPS_HOT_LOOP_RAN = 1,
+	// the code of the loop is not there yet (e.g. it is compiled in the background),
+	// so it is interpreted this time and handed to the handler again the next time
+	IMPS_HOT_LOOP_PENDING = 2
+};
+
+/* Returns a new context with zeroed memory and registers, or NULL if out of memory.
+ * It uses the switch engine and all superinstructions.
+ */
+imps_vm * imps_vm_create(void);
+void imps_vm_destroy(imps_vm *vm);
+
+/* Resets memory, registers and PC, and loads the program of the given size
+ * to address 0. Returns 0 if it does not fit into memory, 1 otherwise.
+ */
+int imps_vm_load(imps_vm *vm, const unsigned char *program, size_t program_size);
+
+/* Runs from the current PC until HALT or an error. */
+int imps_vm_run(imps_vm *vm);
+/* Like imps_vm_run, but stops after count instructions (returning IMPS_RUNNING).
+ * Always uses the switch engine and single instructions, no superinstructions.
+ */
+int imps_vm_step(imps_vm *vm, unsigned long long count);
+
+// Options
+
+void imps_vm_set_engine(imps_vm *vm, int engine);
+/* Selects the superinstructions to use: "all", "none" or a comma-separated list
+ * of names, e.g. "ADD+ADD,ADDI+JMP". Returns 0 on unknown names, 1 otherwise.
+ */
+int imps_vm_set_fusion(imps_vm *vm, const char *list);
+/* Starts counting executed opcode pairs and triples, see imps_vm_print_stats. */
+void imps_vm_enable_stats(imps_vm *vm);
+/* Starts counting how often each instruction is executed and each branch or jump is taken,
+ * see imps_vm_print_profile. Programs are then run with the switch engine,
+ * one instruction at a time.
+ */
+void imps_vm_enable_profile(imps_vm *vm);
+/* Installs the code that executes the JIT opcode; without one it is an unknown instruction. */
+void imps_vm_set_jit_handler(imps_vm *vm, imps_jit_handler jit);
+/* Makes the engines count how often each backward branch or jump is taken.
+ * Once a loop header was jumped back to threshold times, the loop is handed
+ * to the handler every time it is reached, so that it runs natively;
+ * loops the handler cannot compile stay interpreted, and loops it has no code for yet
+ * are interpreted until it has. NULL stops counting.
+ * imps_vm_step, profiling and tracing never use it, as they count single instructions.
+ */
+void imps_vm_set_hot_loop_handler(imps_vm *vm, imps_hot_loop_handler handler, unsigned int threshold);
+
+// State access
+
+unsigned int imps_vm_pc(imps_vm *vm);
+void imps_vm_set_pc(imps_vm *vm, unsigned int pc);
+int imps_vm_register(imps_vm *vm, int i);
+void imps_vm_set_register(imps_vm *vm, int i, int value);
+/* Copy length bytes from/to guest memory at addr.
+ * Return 0 if the range is not in memory, 1 otherwise.
+ */
+int imps_vm_read_memory(imps_vm *vm, unsigned int addr, void *buf, size_t length);
+int imps_vm_write_memory(imps_vm *vm, unsigned int addr, const void *buf, size_t length);
+
+/* Direct access to the 32 registers and the IMPS_MEM_SIZE bytes of memory,
+ * e.g. for generated code. After writing to memory this way,
+ * imps_vm_invalidate_decoded has to be called for the written range.
+ * That only costs for the part of it that was decoded: the program and what was executed elsewhere.
+ */
+int * imps_vm_registers(imps_vm *vm);
+unsigned char * imps_vm_memory(imps_vm *vm);
+void imps_vm_invalidate_decoded(imps_vm *vm, unsigned int addr, size_t length);
+/* Size of the loaded program in bytes */
+unsigned int imps_vm_program_size(imps_vm *vm);
+
+// Code pages
+
+/* A JIT copies the instructions it translates, so it has to learn when the program
+ * overwrites them. It registers their addresses with imps_vm_add_code, which marks the
+ * IMPS_CODE_PAGE_SIZE byte pages they are on as code pages; every store of the engines
+ * (and imps_vm_write_memory, imps_vm_load and imps_vm_restore) whose word starts on a code page
+ * then calls the code write handler after writing. Stores anywhere else only cost
+ * the lookup in the map. Code generated by the JIT checks its own stores in the map
+ * (see imps_vm_code_map), so that it leaves them to the interpreter.
+ */
+#define IMPS_CODE_PAGE_SIZE 64
+#define IMPS_CODE_PAGES (IMPS_MEM_SIZE / IMPS_CODE_PAGE_SIZE)
+
+typedef struct {
+	// nonzero for code pages, indexed by address / IMPS_CODE_PAGE_SIZE
+	unsigned char pages[IMPS_CODE_PAGES];
+	// the first and the last byte of all code pages, low > high if there are none
+	unsigned int low, high;
+} imps_code_map;
+
+/* Called after the bytes from addr to addr + length - 1 were written, some of them on a code page.
+ * The bytes may be unchanged, and may only be data sharing a page with code.
+ */
+typedef void (*imps_code_write_handler)(imps_vm *vm, unsigned int addr, size_t length);
+
+void imps_vm_set_code_write_handler(imps_vm *vm, imps_code_write_handler handler);
+/* Marks the pages of the length bytes at addr as code, including the one of addr - 3,
+ * so that every word overlapping them starts on a code page.
+ * Code can be added several times; its pages stay marked until it was removed as often.
+ */
+void imps_vm_add_code(imps_vm *vm, unsigned int addr, size_t length);
+void imps_vm_remove_code(imps_vm *vm, unsigned int addr, size_t length);
+/* The map lives in the context, at a fixed offset from imps_vm_registers,
+ * so that generated code can address it relative to the registers.
+ */
+const imps_code_map * imps_vm_code_map(imps_vm *vm);
+
+/* Describes the error after IMPS_ERROR was returned */
+const char * imps_vm_error(imps_vm *vm);
+
+// Snapshots
+
+/* A snapshot is a frozen copy of memory, registers and PC that contexts can be
+ * restored from any number of times. Restoring maps the memory of the snapshot
+ * copy-on-write instead of copying it, so the contexts restored from it
+ * share all the pages they do not write to, e.g. to run many different
+ * continuations of a program after its setup was executed only once:
+ *
+ *     imps_vm_step(vm, setup_instructions);
+ *     imps_snapshot *snapshot = imps_vm_snapshot(vm);
+ *     for (...) {
+ *         imps_vm *child = imps_vm_fork(vm, snapshot);
+ *         imps_vm_set_register(child, 4, ...);
+ *         imps_vm_run(child);
+ *         imps_vm_destroy(child);
+ *     }
+ *     imps_snapshot_close(snapshot);
+ *
+ * Snapshot files have the same layout, so restoring from a file maps it
+ * without parsing. Such a file must not be changed while contexts use it.
+ * Options, stats and profiles are not part of a snapshot.
+ */
+
+/* Takes an in-memory snapshot of the state of vm.
+ * Returns NULL on error (see imps_vm_error).
+ */
+imps_snapshot * imps_vm_snapshot(imps_vm *vm);
+/* Writes the state of vm to a snapshot file. Returns 0 on error, 1 otherwise. */
+int imps_vm_save_snapshot(imps_vm *vm, const char *filename);
+/* Opens a snapshot file written by imps_vm_save_snapshot.
+ * Returns NULL with errno set on error (EINVAL if it is no snapshot of this version).
+ */
+imps_snapshot * imps_snapshot_open(const char *filename);
+/* Closing does not affect the contexts restored from the snapshot. */
+void imps_snapshot_close(imps_snapshot *snapshot);
+
+/* Sets memory, registers and PC of vm to the ones of the snapshot.
+ * Returns 0 on error, 1 otherwise.
+ */
+int imps_vm_restore(imps_vm *vm, const imps_snapshot *snapshot);
+/* Returns a new context with the options of vm (engine, superinstructions, JIT handler)
+ * restored from the snapshot, or NULL on error (see imps_vm_error of vm).
+ */
+imps_vm * imps_vm_fork(imps_vm *vm, const imps_snapshot *snapshot);
+
+// Tracing
+
+/* A trace file starts with an imps_trace_header, followed by one imps_trace_record
+ * for every executed instruction, in the byte order of the machine that wrote it.
+ * imps-trace decodes, filters and summarizes them.
+ */
+#define IMPS_TRACE_MAGIC "IMPSTRCE"
+#define IMPS_TRACE_VERSION 1
+
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	// sizeof(imps_trace_record)
+	unsigned int record_size;
+} imps_trace_header;
+
+// imps_trace_record.reg of instructions that do not write a register
+#define IMPS_TRACE_NO_REGISTER 0xff
+
+// imps_trace_record.flags
+enum {
+	IMPS_TRACE_LOAD = 1,
+	IMPS_TRACE_STORE = 2
+};
+
+typedef struct {
+	unsigned int pc;
+	// the instruction word executed (the first one of a superinstruction is traced on its own)
+	unsigned int instruction;
+	// the address accessed by a load or store
+	unsigned int addr;
+	// the new value of reg, or the word written by a store
+	int value;
+	// the register written, or IMPS_TRACE_NO_REGISTER
+	unsigned char reg;
+	unsigned char flags;
+	unsigned short reserved;
+} imps_trace_record;
+
+/* Starts writing an imps_trace_record for every instruction executed by vm
+ * to the file, until imps_vm_stop_trace. Records are collected in a ring buffer
+ * that a background thread writes out, so the program only waits for the file
+ * when the ring is full. Like profiling, tracing runs the switch engine
+ * one instruction at a time, and code generated by a JIT is not traced.
+ * Returns 0 on error (see imps_vm_error), 1 otherwise.
+ */
+int imps_vm_start_trace(imps_vm *vm, const char *filename);
+/* Writes out the rest of the trace and closes the file. imps_vm_destroy does this, too.
+ * Returns 0 if writing the trace failed (see imps_vm_error), 1 otherwise.
+ */
+int imps_vm_stop_trace(imps_vm *vm);
+
+// Output
+
+/* Prints PC and all register contents, as the emulators do after HALT */
+void imps_vm_print_state(imps_vm *vm, FILE *out);
+/* Prints the histograms of opcode pairs and triples (needs imps_vm_enable_stats) */
+void imps_vm_print_stats(imps_vm *vm, FILE *out);
+
+/* Prints the program annotated with the execution counts, with loop headers marked,
+ * and the taken branches (needs imps_vm_enable_profile)
+ */
+void imps_vm_print_profile(imps_vm *vm, FILE *out);
+/* Writes the profile in a line based format for other tools, see the header it writes */
+void imps_vm_write_profile(imps_vm *vm, FILE *out);
+
+/* Returns the name of an opcode, e.g. "ADD" */
+const char * imps_opcode_name(unsigned int opcode);
+/* Writes the instruction found at address pc in assembler syntax into buf,
+ * with branch and jump targets as labels of the form L<address>, e.g. "bge $5 $1 L140"
+ */
+void imps_disassemble(unsigned int instruction, unsigned int pc, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,35 @@
+
+Registers:
+PC :        120 (0x00000078)
+$0 :          0 (0x00000000)
+$1 :      22000 (0x000055f0)
+$2 :       2000 (0x000007d0)
+$3 :       2000 (0x000007d0)
+$4 :      18000 (0x00004650)
+$5 :  136380421 (0x08210005)
+$6 :  149356547 (0x08e70003)
+$7 :      12000 (0x00002ee0)
+$8 :          0 (0x00000000)
+$9 :          0 (0x00000000)
+$10:          0 (0x00000000)
+$11:          0 (0x00000000)
+$12:          0 (0x00000000)
+$13:          0 (0x00000000)
+$14:          0 (0x00000000)
+$15:          0 (0x00000000)
+$16:          0 (0x00000000)
+$17:          0 (0x00000000)
+$18:          0 (0x00000000)
+$19:          0 (0x00000000)
+$20:          3 (0x00000003)
+$21:          3 (0x00000003)
+$22:          0 (0x00000000)
+$23:          0 (0x00000000)
+$24:          0 (0x00000000)
+$25:          0 (0x00000000)
+$26:          0 (0x00000000)
+$27:          0 (0x00000000)
+$28:          0 (0x00000000)
+$29:          0 (0x00000000)
+$30:          0 (0x00000000)
+$31:          0 (0x00000000)
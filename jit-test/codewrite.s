@@ -0,0 +1,32 @@
+main:       addi $3 $0 2000         ; iterations of every loop
+round:      addi $21 $0 3
+            bge $20 $21 done
+            add $2 $0 $0
+loop_a:     bge $2 $3 a_done        ; $1 += 1 in the first round, += 5 after
+inc_a:      addi $1 $1 1
+            addi $2 $2 1
+            jmp loop_a
+a_done:     add $2 $0 $0
+loop_b:     bge $2 $3 b_done        ; $4 += 3, never changed
+            addi $4 $4 3
+            addi $2 $2 1
+            jmp loop_b
+b_done:     lw $6 $0 d_word
+            add $6 $6 $20
+            add $2 $0 $0
+loop_c:     bge $2 $3 c_done        ; stores addi $7 $7 round + 1 into loop d
+            sw $6 $0 inc_d
+            addi $2 $2 1
+            jmp loop_c
+c_done:     add $2 $0 $0
+loop_d:     bge $2 $3 d_done        ; $7 += round + 1
+inc_d:      addi $7 $7 1
+            addi $2 $2 1
+            jmp loop_d
+d_done:     lw $5 $0 a_word
+            sw $5 $0 inc_a          ; addi $1 $1 5 into the translated loop a
+            addi $20 $20 1
+            jmp round
+done:       halt
+a_word:     .fill 0x08210005        ; addi $1 $1 5
+d_word:     .fill 0x08e70001        ; addi $7 $7 1
@@ -0,0 +1,35 @@
+
+Registers:
+PC :         84 (0x00000054)
+$0 :          0 (0x00000000)
+$1 :      30000 (0x00007530)
+$2 :      30000 (0x00007530)
+$3 : -1906139975 (0x8e629cb9)
+$4 : -1930945168 (0x8ce81d70)
+$5 :          0 (0x00000000)
+$6 :          0 (0x00000000)
+$7 : -2124562821 (0x815dbe7b)
+$8 :         64 (0x00000040)
+$9 :         60 (0x0000003c)
+$10: -365467152 (0xea3769f0)
+$11: -1600333765 (0xa09cd83b)
+$12: -2124562821 (0x815dbe7b)
+$13:          0 (0x00000000)
+$14:          0 (0x00000000)
+$15:          0 (0x00000000)
+$16:          0 (0x00000000)
+$17:          0 (0x00000000)
+$18:          0 (0x00000000)
+$19:          0 (0x00000000)
+$20:          0 (0x00000000)
+$21:          0 (0x00000000)
+$22:          0 (0x00000000)
+$23:          0 (0x00000000)
+$24:          0 (0x00000000)
+$25:          0 (0x00000000)
+$26:          0 (0x00000000)
+$27:          0 (0x00000000)
+$28:          0 (0x00000000)
+$29:          0 (0x00000000)
+$30:          0 (0x00000000)
+$31:          0 (0x00000000)
@@ -0,0 +1,22 @@
+main:       addi $2 $0 30000        ; iterations, most of them after the loop got hot
+            addi $3 $0 12345
+            addi $8 $0 64           ; bytes of the table
+loop:       bge $1 $2 done
+            muli $3 $3 1103         ; x = x * 1103 + 12345
+            addi $3 $3 12345
+            lw $7 $6 table          ; table[j] += x, $4 = sum of them
+            add $7 $7 $3
+            sw $7 $6 table
+            add $4 $4 $7
+            addi $6 $6 4
+            blt $6 $8 next
+            add $6 $0 $0
+next:       addi $1 $1 1
+            jmp loop
+done:       lw $10 $0 table
+            addi $9 $0 28
+            lw $11 $9 table
+            addi $9 $0 60
+            lw $12 $9 table
+            halt
+table:      .skip 16
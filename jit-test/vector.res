@@ -0,0 +1,35 @@
+
+Registers:
+PC :        204 (0x000000cc)
+$0 :          0 (0x00000000)
+$1 :       1003 (0x000003eb)
+$2 :       1003 (0x000003eb)
+$3 :       4008 (0x00000fa8)
+$4 :    3009508 (0x002debe4)
+$5 :       6507 (0x0000196b)
+$6 : -1870901368 (0x907c4f88)
+$7 : -1298149210 (0xb29fd0a6)
+$8 : -1125296771 (0xbced557d)
+$9 :       1002 (0x000003ea)
+$10: -1125296771 (0xbced557d)
+$11:  922429010 (0x36fb2652)
+$12:    3009508 (0x002debe4)
+$13: -1298149210 (0xb29fd0a6)
+$14:          0 (0x00000000)
+$15:          0 (0x00000000)
+$16:          0 (0x00000000)
+$17:          0 (0x00000000)
+$18:          0 (0x00000000)
+$19:          0 (0x00000000)
+$20:          4 (0x00000004)
+$21:          4 (0x00000004)
+$22:          0 (0x00000000)
+$23:          0 (0x00000000)
+$24:          0 (0x00000000)
+$25:          0 (0x00000000)
+$26:          0 (0x00000000)
+$27:          0 (0x00000000)
+$28:          0 (0x00000000)
+$29:          0 (0x00000000)
+$30:          0 (0x00000000)
+$31:          0 (0x00000000)
@@ -0,0 +1,57 @@
+main:       addi $2 $0 1003         ; n, not a multiple of the lanes
+            add $1 $0 $0
+init:       bge $1 $2 init_done     ; a[i] = 3i + 1, b[i] = 7i - 500
+            muli $3 $1 4
+            muli $4 $1 3
+            addi $4 $4 1
+            sw $4 $3 a
+            muli $4 $1 7
+            subi $4 $4 500
+            sw $4 $3 b
+            addi $1 $1 1
+            jmp init
+init_done:  add $20 $0 $0
+            addi $21 $0 4
+outer:      bge $20 $21 outer_done  ; the passes after the first run vectorized
+            add $1 $0 $0
+vec:        bge $1 $2 vec_done      ; c[i] = c[i] + a[i] * b[i], $8 = sum of the products
+            muli $3 $1 4
+            lw $4 $3 a
+            lw $5 $3 b
+            mul $6 $4 $5
+            lw $7 $3 c
+            add $7 $7 $6
+            sw $7 $3 c
+            add $8 $8 $6
+            addi $1 $1 1
+            jmp vec
+vec_done:   add $1 $0 $0
+            subi $9 $2 1
+overlap:    bge $1 $9 overlap_done  ; a[i + 1] = a[i] + b[i] stores what the next iteration loads
+            muli $3 $1 4
+            lw $4 $3 a
+            lw $5 $3 b
+            add $4 $4 $5
+            sw $4 $3 a1
+            addi $1 $1 1
+            jmp overlap
+overlap_done: addi $20 $20 1
+            jmp outer
+outer_done: add $1 $0 $0
+sum:        bge $1 $2 sum_done      ; $10 = sum of c, $11 = sum of a
+            muli $3 $1 4
+            lw $4 $3 c
+            add $10 $10 $4
+            lw $4 $3 a
+            add $11 $11 $4
+            addi $1 $1 1
+            jmp sum
+sum_done:   lw $12 $0 a_last
+            lw $13 $0 c_last
+            halt
+a:          .skip 1
+a1:         .skip 1001
+a_last:     .skip 1
+b:          .skip 1003
+c:          .skip 1002
+c_last:     .skip 1